@@ -60,6 +60,7 @@ int Cli::run()
         {"cloudinit-userdata", "Add cloud-init user-data file to image", "cloudinit-userdata", ""},
         {"cloudinit-networkconfig", "Add cloud-init network-config file to image", "cloudinit-networkconfig", ""},
         {"disable-eject", "Disable automatic ejection of storage media after verification"},
+        {"differential", "Only write the parts of the image that differ from what is on the storage media"},
         {"debug", "Output debug messages to console"},
         {"quiet", "Only write to console on error"},
     });
@@ -71,7 +72,7 @@ int Cli::run()
     const QStringList args = parser.positionalArguments();
     if (args.count() != 2)
     {
-        std::cerr << "Usage: --cli [--disable-verify] [--disable-eject] [--sha256 <expected hash> [--cache-file <cache file>]] [--first-run-script <script>] [--debug] [--quiet] <image file to write> <destination drive device>" << std::endl;
+        std::cerr << "Usage: --cli [--disable-verify] [--disable-eject] [--differential] [--sha256 <expected hash> [--cache-file <cache file>]] [--first-run-script <script>] [--debug] [--quiet] <image file to write> <destination drive device>" << std::endl;
         return 1;
     }
 
@@ -215,6 +216,7 @@ int Cli::run()
     _imageWriter->setDst(args[1]);
     _imageWriter->setVerifyEnabled(!parser.isSet("disable-verify"));
     _imageWriter->setSetting("eject", !parser.isSet("disable-eject"));
+    _imageWriter->setSetting("differentialWrite", parser.isSet("differential"));
 
     /* Run startWrite() in event loop (otherwise calling _app->exit() on error does not work) */
     QTimer::singleShot(1, _imageWriter, &ImageWriter::startWrite);
@@ -227,6 +229,8 @@ void Cli::onSuccess()
     {
         _clearLine();
         std::cerr << "Write successful." << std::endl;
+        if (_imageWriter->bytesSkipped())
+            std::cerr << "Skipped " << _imageWriter->bytesSkipped() / 1048576 << " MB already on the device." << std::endl;
     }
     _app->exit(0);
 }
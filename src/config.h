@@ -32,6 +32,15 @@
 /* Block size used with uncompressed images */
 #define IMAGEWRITER_UNCOMPRESSED_BLOCKSIZE 128*1024
 
+/* Uncompressed local images are written straight from a mapping of the file, in writes of this size */
+#define IMAGEWRITER_MAPPED_WRITE_SIZE     4*1024*1024
+
+/* Part of an uncompressed local image that is mapped at a time */
+#define IMAGEWRITER_MAPPED_WINDOW_SIZE    64*1024*1024
+
+/* Most readers extracting the entries of a local multi-file zip side by side */
+#define IMAGEWRITER_EXTRACT_WORKERS       4
+
 /* Block size used when reading during verify stage */
 #define IMAGEWRITER_VERIFY_BLOCKSIZE      128*1024
 
@@ -41,7 +50,72 @@
 /* Do not cache if it would bring free disk space under 5 GB */
 #define IMAGEWRITER_MINIMAL_SPACE_FOR_CACHING   5*1024*1024*1024ll
 
+/* Largest decompressed image (in MB) kept in the second cache tier, 0 disables it */
+#define IMAGEWRITER_RAW_CACHE_BUDGET_DEFAULT    0
+
+/* The decompressed image cache stores a SHA256 for every chunk of this size */
+#define IMAGEWRITER_RAW_CACHE_CHUNK_SIZE        4*1024*1024
+
+/* All-zero blocks of this size are left as holes in the decompressed image cache */
+#define IMAGEWRITER_RAW_CACHE_SPARSE_BLOCKSIZE  4096
+
+/* Start downloading the selected image into the cache once the device is chosen, while the write is still being set up */
+#define IMAGEWRITER_PREFETCH_DEFAULT            true
+
+/* Largest download (in MB) that is prefetched */
+#define IMAGEWRITER_PREFETCH_BUDGET_DEFAULT     8192
+
+/* Bandwidth (in KB/s) a prefetch may use until the write starts, 0 for no limit */
+#define IMAGEWRITER_PREFETCH_MAX_SPEED_DEFAULT  8192
+
+/* Chunk sizes accepted in a download chunk manifest, a chunk is held back in memory until its digest is checked */
+#define IMAGEWRITER_DOWNLOAD_CHUNK_MIN_SIZE     64*1024
+#define IMAGEWRITER_DOWNLOAD_CHUNK_MAX_SIZE     64*1024*1024
+
+/* Range requests made for a download chunk that does not match its digest, before giving up */
+#define IMAGEWRITER_DOWNLOAD_CHUNK_REFETCHES    3
+
+/* A write journal records a SHA256 per chunk of this size, a resumed write always rewrites the first chunk */
+#define IMAGEWRITER_JOURNAL_CHUNK_SIZE          16*1024*1024
+
+/* Data written before the device is synced and the chunks are added to the journal */
+#define IMAGEWRITER_JOURNAL_SYNC_INTERVAL       256*1024*1024
+
+/* Granularity at which a differential write compares the image with the device and leaves identical data alone */
+#define IMAGEWRITER_DIFFERENTIAL_BLOCKSIZE      128*1024
+
 /* Uniflash serial baud rate */
 #define UNIFLASH_BAUD_RATE                     921600
 
+/* A uniflash write fails when neither the image download nor the transfer to the board moved for this long */
+#define UNIFLASH_IMAGE_STALL_TIMEOUT_MSEC      120000
+
+/* How long to wait for the network boot helper to be authorized and listening */
+#define SIMPBOOTP_START_TIMEOUT_MSEC           60000
+
+/* Decoded image data buffered between the extract pipeline and a slower DFU device */
+#define DFU_STREAM_BUFFER_SIZE                 64*1024*1024ll
+
+/* The boot partition is kept in memory for the bootloader stages, images with a larger one are refused */
+#define DFU_BOOT_PREFIX_MAX_SIZE               512*1024*1024ll
+
+/* How long to wait for a DFU device to (re)enumerate with the expected alt setting */
+#define DFU_ENUMERATION_TIMEOUT_MSEC           15000
+
+/* Re-probe interval while waiting for a DFU device, in case a hotplug event is missed or unsupported */
+#define DFU_PROBE_INTERVAL_MSEC                250
+
+/* How long U-Boot may take to leave DFU mode after the detach request */
+#define DFU_DETACH_TIMEOUT_MSEC                5000
+
+/* Time U-Boot needs to write the boot binaries to the eMMC boot partition after leaving DFU mode */
+#define DFU_BOOT_WRITE_MSEC                    15000
+
+/* Largest control transfer the libusb Linux and Windows backends accept, caps the DFU transfer size */
+#define DFU_MAX_CONTROL_TRANSFER               4096
+
+/* Image data read ahead of the DFU transfer, in blocks of DFU_READAHEAD_BLOCKSIZE */
+#define DFU_READAHEAD_BLOCKSIZE                1024*1024
+#define DFU_READAHEAD_BLOCKS                   4
+
 #endif // CONFIG_H
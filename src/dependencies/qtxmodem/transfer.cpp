@@ -10,17 +10,27 @@
 #include <QIODevice>
 #include <QFile>
 #include <QByteArray>
+#include <QFileInfo>
 
 #define XMODEM_ACK  ((char)0x06)
 #define XMODEM_NACK ((char)0x15)
 #define XMODEM_CRC  'C'
+#define YMODEM_G    'G'
 #define XMODEM_SOH  ((char)0x01)
+#define XMODEM_STX  ((char)0x02)
 #define XMODEM_EOT  ((char)0x04)
+#define XMODEM_CAN  ((char)0x18)
+#define XMODEM_SUB  ((char)0x1A)
 
-static char xmodem_sum(const QByteArray &ba){
+#define XMODEM_BLOCK_SIZE    128
+#define XMODEM_1K_BLOCK_SIZE 1024
+//Packets queued ahead in streaming mode before waiting for the port to drain
+#define YMODEM_G_WRITE_AHEAD 8
+
+static char xmodem_sum(const char *data, int len){
     char rv = 0;
-    for(char b : ba){
-        rv = rv + b;
+    for(int i = 0; i < len; i++){
+        rv = rv + data[i];
     }
     return rv;
 }
@@ -48,6 +58,14 @@ bool Transfer::setSerialPortAndConfigure(QString serialPortName, uint32_t baudra
         }
     }
 
+    //Device paths not enumerated as serial ports, pseudo terminals for instance
+    if(this->serialPortInfo == nullptr && serialPortName.startsWith('/') && QFileInfo::exists(serialPortName))
+    {
+        this->serialPortPath = serialPortName;
+        this->_baudrate = baudrate;
+        return true;
+    }
+
     if(this->serialPortInfo == nullptr)
     {
         return false;
@@ -81,6 +99,202 @@ void Transfer::setDataBits(QSerialPort::DataBits bits){
     this->serialPort->setDataBits(bits);
 }
 
+void Transfer::setUse1KPackets(bool enabled){
+    this->use1KPackets = enabled;
+}
+
+void Transfer::setStreamingEnabled(bool enabled){
+    this->streamingEnabled = enabled;
+}
+
+quint32 Transfer::retransmissions() const{
+    return this->retransmitted;
+}
+
+void Transfer::setReplyTimeout(quint32 msecs){
+    this->replyTimeout = msecs;
+}
+
+QByteArray Transfer::buildPacket(quint8 seq, const char *data, int len, int block_size, char pad_byte, bool use_crc){
+    QByteArray packet;
+    packet.reserve(3 + block_size + 2);
+
+    //Packet header
+    packet.append(block_size == XMODEM_1K_BLOCK_SIZE ? XMODEM_STX : XMODEM_SOH);
+    packet.append(seq);
+    packet.append(255U - seq);
+
+    //Payload
+    packet.append(data, len);
+    packet.append(block_size - len, pad_byte);
+
+    //Checksum, over the payload only
+    const char *payload = packet.constData() + 3;
+    if(use_crc){
+        uint16_t packet_crc = crc_init();
+        packet_crc = crc_update(packet_crc, payload, block_size);
+        packet_crc = crc_finalize(packet_crc);
+
+        //Add CRC, big endian.
+        packet.append((packet_crc >> 8) & 0xFF);
+        packet.append(packet_crc & 0xFF);
+    }
+    else{
+        packet.append(xmodem_sum(payload, block_size));
+    }
+    return packet;
+}
+
+QByteArray Transfer::buildYmodemHeader(const QString &fileName, qint64 size){
+    //Block 0: file name and decimal size, NUL separated
+    QByteArray info = fileName.toUtf8();
+    info.append('\0');
+    if(!fileName.isEmpty()){
+        info.append(QByteArray::number(size));
+    }
+    info.truncate(XMODEM_BLOCK_SIZE);
+    return buildPacket(0, info.constData(), info.size(), XMODEM_BLOCK_SIZE, 0, true);
+}
+
+QList<QByteArray> Transfer::buildPackets(const QByteArray &content, bool use_crc, bool ymodem) const{
+    QList<QByteArray> packets;
+    const bool use_1k = use_crc && (this->use1KPackets || ymodem);
+    const qint64 size = content.size();
+    quint8 seq = 1;
+    qint64 pos = 0;
+
+    //Full 1K packets first, the tail keeps the 128 byte padding rules
+    if(use_1k){
+        for(; size - pos >= XMODEM_1K_BLOCK_SIZE; pos += XMODEM_1K_BLOCK_SIZE){
+            packets.append(buildPacket(seq++, content.constData() + pos, XMODEM_1K_BLOCK_SIZE, XMODEM_1K_BLOCK_SIZE, 0, use_crc));
+        }
+    }
+
+    if(ymodem){
+        //Receiver knows the size from block 0 and cuts the padding itself
+        int block_size = use_1k && size - pos > XMODEM_BLOCK_SIZE ? XMODEM_1K_BLOCK_SIZE : XMODEM_BLOCK_SIZE;
+        for(; pos < size; pos += block_size){
+            int len = qMin<qint64>(block_size, size - pos);
+            packets.append(buildPacket(seq++, content.constData() + pos, len, block_size, XMODEM_SUB, use_crc));
+        }
+        return packets;
+    }
+
+    for(; pos < size; pos += XMODEM_BLOCK_SIZE){
+        int len = qMin<qint64>(XMODEM_BLOCK_SIZE, size - pos);
+
+        //Padding of half-full packets will be performed using the PKCS#7
+        //method of filling the pachet with the value fo the gap size.
+        //If the file to be transfered is an even split of 128 bytes *and*
+        //PKCS#7 flag is enabled (this->usePkcsPadding) an aditional 128 byte packet
+        //of the number 128 repeated all over it *must* be sent as to guarantee
+        //padding is always present.
+        char pad_byte = (XMODEM_BLOCK_SIZE - len) & 0xFF;
+        packets.append(buildPacket(seq++, content.constData() + pos, len, XMODEM_BLOCK_SIZE, pad_byte, use_crc));
+    }
+
+    if((size % XMODEM_BLOCK_SIZE) == 0 && this->usePkcsPadding){
+        packets.append(buildPacket(seq++, nullptr, 0, XMODEM_BLOCK_SIZE, (char)128U, use_crc));
+    }
+
+    return packets;
+}
+
+bool Transfer::readStatus(char &status_char, quint32 timeout){
+    //waitForReadyRead() only reports new data, replies may already be buffered
+    if(this->serialPort->bytesAvailable() == 0 && !this->serialPort->waitForReadyRead(timeout)){
+        return false;
+    }
+    return this->serialPort->read(&status_char, 1) == 1;
+}
+
+void Transfer::purgeInput(){
+    //Whatever the receiver still has to say about the failed attempt must not be taken as the reply to the next one
+    do{
+        this->serialPort->clear(QSerialPort::Input);
+        this->serialPort->readAll();
+    }while(this->serialPort->waitForReadyRead(purgeQuietTime));
+}
+
+bool Transfer::sendAcked(const QList<QByteArray> &packets, qint64 total_size){
+    qint64 sent_size = 0;
+    quint32 retries = 0;
+
+    for(int i = 0; i < packets.size() && !cancelRequested; ){
+        this->serialPort->write(packets.at(i));
+        this->serialPort->waitForBytesWritten();
+
+        //Read receiver response, a lost reply is handled like a NAK
+        char status_char = '\0';
+        bool replied = readStatus(status_char, this->replyTimeout);
+
+        if(replied && status_char == XMODEM_ACK){
+            sent_size += packets.at(i).at(0) == XMODEM_STX ? XMODEM_1K_BLOCK_SIZE : XMODEM_BLOCK_SIZE;
+            retries = 0;
+            i++;
+
+            //Update with transfer progress
+            emit updateProgress(qMin(1.0f, sent_size / (float) qMax<qint64>(total_size, 1)));
+        }
+        else if(replied && status_char == XMODEM_CAN){
+            emit transferFailed(tr("Transfer cancelled by receiver"));
+            return false;
+        }
+        else if(++retries > maxRetries){
+            emit transferFailed(replied ? tr("Too many retransmissions") : tr("Status timeout"));
+            return false;
+        }
+        else{
+            //NAK, line noise or a lost reply, the same packet goes again once the line is quiet
+            this->retransmitted++;
+            purgeInput();
+        }
+    }
+
+    return !cancelRequested;
+}
+
+bool Transfer::sendStreaming(const QList<QByteArray> &packets, qint64 total_size){
+    qint64 sent_size = 0;
+
+    //YMODEM-G has no retransmission, the receiver cancels the whole transfer on any error
+    for(int i = 0; i < packets.size() && !cancelRequested; i++){
+        this->serialPort->write(packets.at(i));
+        sent_size += packets.at(i).at(0) == XMODEM_STX ? XMODEM_1K_BLOCK_SIZE : XMODEM_BLOCK_SIZE;
+
+        if((i + 1) % YMODEM_G_WRITE_AHEAD != 0 && i + 1 != packets.size()){
+            continue;
+        }
+
+        if(!this->serialPort->waitForBytesWritten(timeoutRead)){
+            abortStreaming(tr("Write timeout"));
+            return false;
+        }
+
+        //Nothing is expected while streaming, anything the receiver sends means the transfer is lost
+        if(this->serialPort->bytesAvailable() > 0){
+            char status_char = '\0';
+            this->serialPort->read(&status_char, 1);
+            abortStreaming(status_char == XMODEM_CAN ? tr("Transfer cancelled by receiver")
+                                                     : tr("Receiver reported an error (0x") + QString::number((quint8) status_char, 16) + ")");
+            return false;
+        }
+
+        //Update with transfer progress
+        emit updateProgress(qMin(1.0f, sent_size / (float) qMax<qint64>(total_size, 1)));
+    }
+
+    return !cancelRequested;
+}
+
+void Transfer::abortStreaming(const QString &reason){
+    //YMODEM-G has no way to repeat a packet, the sender cancels and the whole file has to go again
+    this->serialPort->write(QByteArray(2, XMODEM_CAN));
+    this->serialPort->waitForBytesWritten(timeoutRead);
+    purgeInput();
+    emit transferFailed(reason);
+}
+
 Transfer::~Transfer(){
 }
 
@@ -113,14 +327,19 @@ void Transfer::run(){
         }
     });
 
-    if(this->serialPortInfo == nullptr)
+    if(this->serialPortInfo == nullptr && this->serialPortPath.isEmpty())
     {
         emit transferFailed(tr("Cannot find serial port!"));
         this->cancelRequested = true;
         return;
     }
 
-    this->serialPort = new QSerialPort(*this->serialPortInfo, nullptr);
+    if(this->serialPortInfo != nullptr){
+        this->serialPort = new QSerialPort(*this->serialPortInfo, nullptr);
+    }
+    else{
+        this->serialPort = new QSerialPort(this->serialPortPath, nullptr);
+    }
 
     if(this->serialPort == nullptr)
     {
@@ -177,26 +396,29 @@ void Transfer::run(){
     }
 
     //Initialize transfer status
-    quint32 current_packet = 1;
+    //Boot files are a few MB at most, frames are built from memory
+    QByteArray content = in_file->readAll();
     bool use_crc = true;
+    bool use_ymodem_g = false;
+    this->retransmitted = 0;
 
     //Transfer loop
     bool transferComplete = false;
-    bool sendPkcsPacket = ((in_file->size() % 128) == 0) && this->usePkcsPadding;
-    bool pkcsPacketSent = false;
     do{
         //Wait for the first character from recipient
         char status_char = '\0';
-        if(this->serialPort->waitForReadyRead(this->timeoutFirstRead)){
-            this->serialPort->read(&status_char, 1);
+        if(readStatus(status_char, this->timeoutFirstRead)){
             //Received a byte
             if(status_char == XMODEM_CRC){
                 use_crc = true;
-                status_char = XMODEM_NACK;
             }
             else if(status_char == XMODEM_NACK){
                 use_crc = false;
             }
+            else if(status_char == YMODEM_G && this->streamingEnabled){
+                use_crc = true;
+                use_ymodem_g = true;
+            }
             else{
                 emit transferFailed(tr("Incorrect start of XMODEM transmission (0x") + QString::number(status_char,16) + ")");
                 this->cancelRequested = true;
@@ -210,119 +432,67 @@ void Transfer::run(){
             continue; //<-- Will cleanup and return
         }
 
-        //The proper, real, main XMODEM loop
-        while(!cancelRequested && !transferComplete){
-            QByteArray packet;
-
-            if(!in_file->atEnd())
-            {
-                //Packet header
-                packet.append(XMODEM_SOH);
-                packet.append(current_packet & 0xFF);
-                packet.append(255U - (current_packet & 0xFF));
-
-                //Payload
-                QByteArray payload = in_file->read(128);
-                if (payload.length() < 128){
-                    int padding = 128 - payload.length();
-                    char pad_byte = padding & 0xFF;
-
-                    //Padding of half-full packets will be performed using the PKCS#7
-                    //method of filling the pachet with the value fo the gap size.
-                    //If the file to be transfered is an even split of 128 bytes *and*
-                    //PKCS#7 flag is enabled (this->usePkcsPadding) an aditional 128 byte packet
-                    //of the number 128 repeated all over it *must* be sent as to guarantee
-                    //padding is always present.
-                    while(padding){
-                        payload.append((char)pad_byte);
-                        padding--;
-                    }
-                }
-                packet.append(payload);
-
-                //Checksum
-                if(use_crc){
-                    uint16_t packet_crc = crc_init();
-                    packet_crc = crc_update(packet_crc, payload.data(), payload.size());
-                    packet_crc = crc_finalize(packet_crc);
-
-                    //Add CRC, big endian.
-                    packet.append((packet_crc >> 8) & 0xFF);
-                    packet.append(packet_crc & 0xFF);
-                }
-                else{
-                    packet.append(xmodem_sum(packet));
-                }
-            }
-            else if (sendPkcsPacket){
-                //Packet header
-                packet.append(XMODEM_SOH);
-                packet.append(current_packet & 0xFF);
-                packet.append(255U - (current_packet & 0xFF));
-                //Payload
-                const uint8_t pad_byte = 128U;
-                uint16_t cksum = 0; //Same for CRC and checksum
-                for(int i = 0; i<128; i++){
-                    packet.append(pad_byte);
-                    if(use_crc){
-                        cksum = crc_update(cksum, &pad_byte, 1);
-                    }
-                    else{
-                        cksum += pad_byte;
-                    }
-                }
-                //Checksum
-                if(use_crc){
-                    packet.append((cksum >> 8) & 0xFF);
-                    packet.append(cksum & 0xFF);
-                }
-                else{
-                    packet.append(cksum & 0xFF);
-                }
-
-                //Signal we sent the packet
-                pkcsPacketSent = true;
+        //Receivers repeat the start character until the first packet arrives
+        this->serialPort->clear(QSerialPort::Input);
+        QList<QByteArray> packets = buildPackets(content, use_crc, use_ymodem_g);
+
+        if(use_ymodem_g){
+            //Block 0 is answered by another 'G' once the receiver opened the file
+            this->serialPort->write(buildYmodemHeader(QFileInfo(this->filePath).fileName(), content.size()));
+            this->serialPort->waitForBytesWritten();
+            if(!readStatus(status_char, timeoutRead) || status_char != YMODEM_G){
+                abortStreaming(status_char == XMODEM_CAN ? tr("Transfer cancelled by receiver") : tr("Status timeout"));
+                this->cancelRequested = true;
             }
-            else{
-                //Transfer complete!
-                packet.append(XMODEM_EOT);
-                packet.append(XMODEM_EOT);
-                packet.append(XMODEM_EOT);
-                transferComplete = true;
+
+            if(cancelRequested || !sendStreaming(packets, content.size())){
+                this->cancelRequested = true;
+                continue; //<-- Will cleanup and return
             }
-            this->serialPort->write(packet);
-            this->serialPort->waitForBytesWritten();
+        }
+        else if(!sendAcked(packets, content.size())){
+            this->cancelRequested = true;
+            continue; //<-- Will cleanup and return
+        }
 
-            //Read receiver response
-            if(this->serialPort->waitForReadyRead(timeoutRead)){
-                this->serialPort->read(&status_char, 1);
-                if(status_char == XMODEM_ACK){
-                    current_packet++;
-
-                    //If we just sent the PKCS packet, set the sendPkcsPacket
-                    //flag to false so next "packet" is the end of transfer.
-                    if(pkcsPacketSent){
-                        sendPkcsPacket = false;
-                    }
-                }
-                else{
-                    //Seek only needed within file packets. PKCS padding needs
-                    //no call to seek()
-                    if(!pkcsPacketSent){
-                        in_file->seek((current_packet - 1) * 128);
-                    }
-                }
+        //End of transmission, YMODEM receivers may NAK the first EOT to make sure
+        this->serialPort->write(QByteArray(use_ymodem_g ? 1 : 3, XMODEM_EOT));
+        this->serialPort->waitForBytesWritten();
+        quint32 retries = 0;
+        if(use_ymodem_g){
+            //Streaming receivers ACK the EOT right away, there is nothing to retry
+            if(!readStatus(status_char, this->replyTimeout) || status_char != XMODEM_ACK){
+                abortStreaming(tr("End of transmission not acknowledged"));
+                this->cancelRequested = true;
+            }
+        }
+        else do{
+            bool replied = readStatus(status_char, this->replyTimeout);
+            if(replied && status_char == XMODEM_ACK){
+                break;
             }
-            else
-            {
+            if(retries++ >= maxRetries){
                 emit transferFailed(tr("Status timeout"));
-                cancelRequested = true;
+                this->cancelRequested = true;
+                break;
             }
+            if(!replied || status_char == XMODEM_NACK){
+                this->retransmitted++;
+                purgeInput();
+                this->serialPort->write(QByteArray(1, XMODEM_EOT));
+                this->serialPort->waitForBytesWritten();
+            }
+        }while(true);
 
-            //Update with transfer progress
-            emit updateProgress( ((current_packet - 1) * 128.0f) / ((float) in_file->size()) );
-
+        if(use_ymodem_g && !cancelRequested){
+            //An empty block 0 closes the batch, receiver asks for it with 'G'
+            if(readStatus(status_char, timeoutRead) && status_char == YMODEM_G){
+                this->serialPort->write(buildYmodemHeader(QString(), 0));
+                this->serialPort->waitForBytesWritten();
+            }
         }
+
+        transferComplete = !cancelRequested;
     }while(0); //Shameless goto bait
 
     //Transfer completed, do cleanup
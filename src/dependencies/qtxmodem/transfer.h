@@ -29,6 +29,15 @@ public:
     void setPkcsPadding(bool enabled);
     void setDataBits(QSerialPort::DataBits bits);
 
+    //1024 byte (STX) packets for CRC receivers, the tail still goes in 128 byte packets
+    void setUse1KPackets(bool enabled);
+    //Stream with YMODEM-G if the receiver starts with 'G', no waiting for ACKs
+    void setStreamingEnabled(bool enabled);
+    //Packets sent again after a NAK, a garbled or a missing reply during the last transfer
+    quint32 retransmissions() const;
+    //How long to wait for the ACK of a packet before sending it again
+    void setReplyTimeout(quint32 msecs);
+
     virtual ~Transfer();
     void launch();
     void cancel();
@@ -42,12 +51,32 @@ protected:
 
     static const quint32 timeoutRead      =  5000;
     static const quint32 timeoutFirstRead = 60000;
+    static const quint32 maxRetries       =    10;
+    static const quint32 purgeQuietTime   =   100;
+
+    //Pre-frames the whole file, so no file access or CRC math sits between packets
+    QList<QByteArray> buildPackets(const QByteArray &content, bool use_crc, bool ymodem) const;
+    static QByteArray buildPacket(quint8 seq, const char *data, int len, int block_size, char pad_byte, bool use_crc);
+    static QByteArray buildYmodemHeader(const QString &fileName, qint64 size);
+
+    bool sendAcked(const QList<QByteArray> &packets, qint64 total_size);
+    bool sendStreaming(const QList<QByteArray> &packets, qint64 total_size);
+    //Cancels a streaming transfer on its first error, as YMODEM-G has no retransmission
+    void abortStreaming(const QString &reason);
+    bool readStatus(char &status_char, quint32 timeout);
+    //Drops pending input until the line stayed quiet for purgeQuietTime
+    void purgeInput();
 
 private:
     QSerialPort *serialPort{};
     QSerialPortInfo *serialPortInfo{};
+    QString serialPortPath{};
+    quint32 replyTimeout{timeoutRead};
     QString filePath{};
     bool usePkcsPadding{};
+    bool use1KPackets{true};
+    bool streamingEnabled{true};
+    quint32 retransmitted{};
     bool cancelRequested{};
     uint32_t _baudrate{};
 
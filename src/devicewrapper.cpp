@@ -15,6 +15,12 @@ DeviceWrapper::DeviceWrapper(DeviceWrapperFile *file, QObject *parent)
 
 }
 
+DeviceWrapper::DeviceWrapper(const BlockReader &read, QObject *parent)
+    : QObject(parent), _dirty(false), _file(nullptr), _read(read)
+{
+
+}
+
 DeviceWrapper::~DeviceWrapper()
 {
     sync();
@@ -30,7 +36,7 @@ void DeviceWrapper::_seekToBlock(quint64 blockNr)
 
 void DeviceWrapper::sync()
 {
-    if (!_dirty)
+    if (!_dirty || !_file)
         return;
 
     const auto blockNrs = _blockcache.keys();
@@ -85,6 +91,14 @@ void DeviceWrapper::_readIntoBlockCacheIfNeeded(quint64 offset, quint64 size)
     {
         if (!_blockcache.contains(i))
         {
+            if (!_file)
+            {
+                auto cacheEntry = new DeviceWrapperBlockCacheEntry(this);
+                _read(cacheEntry->block, 4096, i*4096);
+                _blockcache.insert(i, cacheEntry);
+                continue;
+            }
+
             _seekToBlock(i);
 
             auto cacheEntry = new DeviceWrapperBlockCacheEntry(this);
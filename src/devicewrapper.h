@@ -9,6 +9,7 @@
 #include <QObject>
 #include <QMap>
 #include <QFile>
+#include <functional>
 
 class DeviceWrapperBlockCacheEntry;
 class DeviceWrapperFatPartition;
@@ -29,6 +30,12 @@ class DeviceWrapper : public QObject
     Q_OBJECT
 public:
     explicit DeviceWrapper(DeviceWrapperFile *file, QObject *parent = nullptr);
+    /*
+     * Read-only device whose blocks come from a callback, e.g. an image that is still being decoded.
+     * read() fills size bytes at offset, blocking until they are available, or throws.
+     */
+    typedef std::function<void(char *buf, quint64 size, quint64 offset)> BlockReader;
+    explicit DeviceWrapper(const BlockReader &read, QObject *parent = nullptr);
     virtual ~DeviceWrapper();
     void sync();
     void pwrite(const char *buf, quint64 size, quint64 offset);
@@ -39,6 +46,7 @@ protected:
     bool _dirty;
     QMap<quint64,DeviceWrapperBlockCacheEntry *> _blockcache;
     DeviceWrapperFile *_file;
+    BlockReader _read;
 
     void _readIntoBlockCacheIfNeeded(quint64 offset, quint64 size);
     void _seekToBlock(quint64 blockNr);
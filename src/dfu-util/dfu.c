@@ -33,7 +33,8 @@
 #include "dfu.h"
 #include "quirks.h"
 
-static int dfu_timeout = 5000;  /* 5 seconds - default */
+/* Per thread, so concurrent transfers to different devices keep their own timeout */
+static DFU_THREAD_LOCAL int dfu_timeout = 5000;  /* 5 seconds - default */
 
 void dfu_set_timeout(int ms)
 {
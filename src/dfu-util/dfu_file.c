@@ -121,9 +121,9 @@ static int probe_prefix(struct dfu_file *file)
 void dfu_progress_bar(const char *desc, unsigned long long curr,
 		unsigned long long max)
 {
-	static char buf[PROGRESS_BAR_WIDTH + 1];
-	static unsigned long long last_progress = -1;
-	static time_t last_time;
+	static DFU_THREAD_LOCAL char buf[PROGRESS_BAR_WIDTH + 1];
+	static DFU_THREAD_LOCAL unsigned long long last_progress = -1;
+	static DFU_THREAD_LOCAL time_t last_time;
 	time_t curr_time = time(NULL);
 	unsigned long long progress;
 	unsigned long long x;
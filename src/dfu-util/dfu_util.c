@@ -155,7 +155,7 @@ static int get_string_descriptor_ascii(libusb_device_handle *devh,
 	return di;
 }
 
-static void probe_configuration(libusb_device *dev, struct libusb_device_descriptor *desc)
+static void probe_configuration(struct dfu_ctx *ctx, libusb_device *dev, struct libusb_device_descriptor *desc)
 {
 	struct usb_dfu_func_descriptor func_dfu;
 	libusb_device_handle *devh;
@@ -178,7 +178,7 @@ static void probe_configuration(libusb_device *dev, struct libusb_device_descrip
 		ret = libusb_get_config_descriptor(dev, cfg_idx, &cfg);
 		if (ret != 0)
 			return;
-		if (match_config_index > -1 && match_config_index != cfg->bConfigurationValue) {
+		if (ctx->match_config_index > -1 && ctx->match_config_index != cfg->bConfigurationValue) {
 			libusb_free_config_descriptor(cfg);
 			continue;
 		}
@@ -259,7 +259,7 @@ found_dfu:
 		     intf_idx++) {
 			int multiple_alt;
 
-			if (match_iface_index > -1 && match_iface_index != intf_idx)
+			if (ctx->match_iface_index > -1 && ctx->match_iface_index != intf_idx)
 				continue;
 
 			uif = &cfg->interface[intf_idx];
@@ -302,22 +302,22 @@ found_dfu:
 					dfu_mode = 1;
 
 				if (dfu_mode &&
-				    match_iface_alt_index > -1 && match_iface_alt_index != intf->bAlternateSetting)
+				    ctx->match_iface_alt_index > -1 && ctx->match_iface_alt_index != intf->bAlternateSetting)
 					continue;
 
 				if (dfu_mode) {
-					if ((match_vendor_dfu >= 0 && match_vendor_dfu != desc->idVendor) ||
-					    (match_product_dfu >= 0 && match_product_dfu != desc->idProduct)) {
+					if ((ctx->match_vendor_dfu >= 0 && ctx->match_vendor_dfu != desc->idVendor) ||
+					    (ctx->match_product_dfu >= 0 && ctx->match_product_dfu != desc->idProduct)) {
 						continue;
 					}
 				} else {
-					if ((match_vendor >= 0 && match_vendor != desc->idVendor) ||
-					    (match_product >= 0 && match_product != desc->idProduct)) {
+					if ((ctx->match_vendor >= 0 && ctx->match_vendor != desc->idVendor) ||
+					    (ctx->match_product >= 0 && ctx->match_product != desc->idProduct)) {
 						continue;
 					}
 				}
 
-				if (match_devnum >= 0 && match_devnum != libusb_get_device_address(dev))
+				if (ctx->match_devnum >= 0 && ctx->match_devnum != libusb_get_device_address(dev))
 					continue;
 
 				ret = libusb_open(dev, &devh);
@@ -352,14 +352,14 @@ found_dfu:
 				libusb_close(devh);
 
 				if (dfu_mode &&
-				    match_iface_alt_name != NULL && strcmp(alt_name, match_iface_alt_name))
+				    ctx->match_iface_alt_name != NULL && strcmp(alt_name, ctx->match_iface_alt_name))
 					continue;
 
 				if (dfu_mode) {
-					if (match_serial_dfu != NULL && strcmp(match_serial_dfu, serial_name))
+					if (ctx->match_serial_dfu != NULL && strcmp(ctx->match_serial_dfu, serial_name))
 						continue;
 				} else {
-					if (match_serial != NULL && strcmp(match_serial, serial_name))
+					if (ctx->match_serial != NULL && strcmp(ctx->match_serial, serial_name))
 						continue;
 				}
 
@@ -395,10 +395,10 @@ found_dfu:
 				pdfu->bMaxPacketSize0 = desc->bMaxPacketSize0;
 
 				/* append to list */
-				if (!dfu_root) {
-					dfu_root = pdfu;
+				if (!ctx->dfu_root) {
+					ctx->dfu_root = pdfu;
 				} else {
-					struct dfu_if *last = dfu_root;
+					struct dfu_if *last = ctx->dfu_root;
 					while (last->next)
 						last = last->next;
 					last->next = pdfu;
@@ -409,55 +409,70 @@ found_dfu:
 	}
 }
 
-#define MAX_PATH_LEN 20
-char path_buf[MAX_PATH_LEN];
-
-char *get_path(libusb_device *dev)
+const char *get_path(libusb_device *dev, char *path_buf, size_t len)
 {
 #if (defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102) || (defined(LIBUSBX_API_VERSION) && LIBUSBX_API_VERSION >= 0x01000102)
 	uint8_t path[8];
 	int r,j;
 	r = libusb_get_port_numbers(dev, path, sizeof(path));
 	if (r > 0) {
-		sprintf(path_buf,"%d-%d",libusb_get_bus_number(dev),path[0]);
+		snprintf(path_buf,len,"%d-%d",libusb_get_bus_number(dev),path[0]);
 		for (j = 1; j < r; j++){
-			sprintf(path_buf+strlen(path_buf),".%d",path[j]);
+			snprintf(path_buf+strlen(path_buf),len-strlen(path_buf),".%d",path[j]);
 		};
+	} else if (len) {
+		path_buf[0] = '\0';
 	}
 	return path_buf;
 #else
 # warning "libusb too old - building without USB path support!"
 	(void)dev;
+	(void)path_buf;
+	(void)len;
 	return NULL;
 #endif
 }
 
-void probe_devices(libusb_context *ctx)
+void dfu_ctx_init(struct dfu_ctx *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->match_vendor = -1;
+	ctx->match_product = -1;
+	ctx->match_vendor_dfu = -1;
+	ctx->match_product_dfu = -1;
+	ctx->match_config_index = -1;
+	ctx->match_iface_index = -1;
+	ctx->match_iface_alt_index = -1;
+	ctx->match_devnum = -1;
+}
+
+void probe_devices(struct dfu_ctx *ctx, libusb_context *usb_ctx)
 {
 	libusb_device **list;
 	ssize_t num_devs;
 	ssize_t i;
+	char path_buf[MAX_PATH_LEN];
 
-	num_devs = libusb_get_device_list(ctx, &list);
+	num_devs = libusb_get_device_list(usb_ctx, &list);
 	for (i = 0; i < num_devs; ++i) {
 		struct libusb_device_descriptor desc;
 		struct libusb_device *dev = list[i];
 
-		if (match_path != NULL && strcmp(get_path(dev),match_path) != 0)
+		if (ctx->match_path != NULL && strcmp(get_path(dev, path_buf, sizeof(path_buf)),ctx->match_path) != 0)
 			continue;
 		if (libusb_get_device_descriptor(dev, &desc))
 			continue;
-		probe_configuration(dev, &desc);
+		probe_configuration(ctx, dev, &desc);
 	}
 	libusb_free_device_list(list, 1);
 }
 
-void disconnect_devices(void)
+void disconnect_devices(struct dfu_ctx *ctx)
 {
 	struct dfu_if *pdfu;
 	struct dfu_if *prev = NULL;
 
-	for (pdfu = dfu_root; pdfu != NULL; pdfu = pdfu->next) {
+	for (pdfu = ctx->dfu_root; pdfu != NULL; pdfu = pdfu->next) {
 		free(prev);
 		libusb_unref_device(pdfu->dev);
 		free(pdfu->alt_name);
@@ -465,27 +480,29 @@ void disconnect_devices(void)
 		prev = pdfu;
 	}
 	free(prev);
-	dfu_root = NULL;
+	ctx->dfu_root = NULL;
 }
 
 void print_dfu_if(struct dfu_if *dfu_if)
 {
+	char path_buf[MAX_PATH_LEN];
+
 	printf("Found %s: [%04x:%04x] ver=%04x, devnum=%u, cfg=%u, intf=%u, "
 	       "path=\"%s\", alt=%u, name=\"%s\", serial=\"%s\"\n",
 	       dfu_if->flags & DFU_IFF_DFU ? "DFU" : "Runtime",
 	       dfu_if->vendor, dfu_if->product,
 	       dfu_if->bcdDevice, dfu_if->devnum,
 	       dfu_if->configuration, dfu_if->interface,
-	       get_path(dfu_if->dev),
+	       get_path(dfu_if->dev, path_buf, sizeof(path_buf)),
 	       dfu_if->altsetting, dfu_if->alt_name,
 	       dfu_if->serial_name);
 }
 
 /* Walk the device tree and print out DFU devices */
-void list_dfu_interfaces(void)
+void list_dfu_interfaces(struct dfu_ctx *ctx)
 {
 	struct dfu_if *pdfu;
 
-	for (pdfu = dfu_root; pdfu != NULL; pdfu = pdfu->next)
+	for (pdfu = ctx->dfu_root; pdfu != NULL; pdfu = pdfu->next)
 		print_dfu_if(pdfu);
 }
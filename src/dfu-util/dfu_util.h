@@ -5,6 +5,9 @@
  * but 254 would even accommodate a UTF-8 encoding + NUL terminator */
 #define MAX_DESC_STR_LEN 254
 
+/* "bus-port.port..." for up to 7 hub levels */
+#define MAX_PATH_LEN 20
+
 enum mode {
 	MODE_NONE,
 	MODE_VERSION,
@@ -14,23 +17,32 @@ enum mode {
 	MODE_DOWNLOAD
 };
 
-extern struct dfu_if *dfu_root;
-extern char *match_path;
-extern int match_vendor;
-extern int match_product;
-extern int match_vendor_dfu;
-extern int match_product_dfu;
-extern int match_config_index;
-extern int match_iface_index;
-extern int match_iface_alt_index;
-extern int match_devnum;
-extern const char *match_iface_alt_name;
-extern const char *match_serial;
-extern const char *match_serial_dfu;
+/*
+ * Device match criteria and the DFU interfaces found by probe_devices().
+ * Kept per caller instead of in globals, so several devices can be probed
+ * and flashed concurrently from different threads.
+ */
+struct dfu_ctx {
+	struct dfu_if *dfu_root;
+	const char *match_path;
+	int match_vendor;
+	int match_product;
+	int match_vendor_dfu;
+	int match_product_dfu;
+	int match_config_index;
+	int match_iface_index;
+	int match_iface_alt_index;
+	int match_devnum;
+	const char *match_iface_alt_name;
+	const char *match_serial;
+	const char *match_serial_dfu;
+};
 
-void probe_devices(libusb_context *);
-void disconnect_devices(void);
+void dfu_ctx_init(struct dfu_ctx *ctx);
+void probe_devices(struct dfu_ctx *ctx, libusb_context *);
+void disconnect_devices(struct dfu_ctx *ctx);
 void print_dfu_if(struct dfu_if *);
-void list_dfu_interfaces(void);
+void list_dfu_interfaces(struct dfu_ctx *ctx);
+const char *get_path(libusb_device *dev, char *buf, size_t len);
 
 #endif /* DFU_UTIL_H */
@@ -42,23 +42,37 @@
 #define DFU_TIMEOUT 5000
 
 extern int verbose;
-static unsigned int last_erased_page = 1; /* non-aligned value, won't match */
-static unsigned int dfuse_address = 0;
-static unsigned int dfuse_address_present = 0;
-static unsigned int dfuse_length = 0;
-static int dfuse_force = 0;
-static int dfuse_leave = 0;
-static int dfuse_unprotect = 0;
-static int dfuse_mass_erase = 0;
-static int dfuse_will_reset = 0;
-static int dfuse_fast = 0;
+
+/*
+ * Options and progress of one dfuse_do_upload() or dfuse_do_dnload() call.
+ * Kept on the caller's stack instead of in globals, so transfers to
+ * several devices can run concurrently from different threads.
+ */
+struct dfuse_state {
+	unsigned int last_erased_page;
+	unsigned int dfuse_address;
+	unsigned int dfuse_address_present;
+	unsigned int dfuse_length;
+	int dfuse_force;
+	int dfuse_leave;
+	int dfuse_unprotect;
+	int dfuse_mass_erase;
+	int dfuse_will_reset;
+	int dfuse_fast;
+};
+
+static void dfuse_state_init(struct dfuse_state *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->last_erased_page = 1; /* non-aligned value, won't match */
+}
 
 static unsigned int quad2uint(unsigned char *p)
 {
 	return (*p + (*(p + 1) << 8) + (*(p + 2) << 16) + (*(p + 3) << 24));
 }
 
-static void dfuse_parse_options(const char *options)
+static void dfuse_parse_options(struct dfuse_state *st, const char *options)
 {
 	char *end;
 	const char *endword;
@@ -72,8 +86,8 @@ static void dfuse_parse_options(const char *options)
 
 		number = strtoul(options, &end, 0);
 		if (end == endword) {
-			dfuse_address = number;
-			dfuse_address_present = 1;
+			st->dfuse_address = number;
+			st->dfuse_address_present = 1;
 		} else {
 			errx(EX_USAGE, "Invalid dfuse address: %s", options);
 		}
@@ -90,32 +104,32 @@ static void dfuse_parse_options(const char *options)
 			endword = options + strlen(options);
 
 		if (!strncmp(options, "force", endword - options)) {
-			dfuse_force++;
+			st->dfuse_force++;
 			options += 5;
 			continue;
 		}
 		if (!strncmp(options, "leave", endword - options)) {
-			dfuse_leave = 1;
+			st->dfuse_leave = 1;
 			options += 5;
 			continue;
 		}
 		if (!strncmp(options, "unprotect", endword - options)) {
-			dfuse_unprotect = 1;
+			st->dfuse_unprotect = 1;
 			options += 9;
 			continue;
 		}
 		if (!strncmp(options, "mass-erase", endword - options)) {
-			dfuse_mass_erase = 1;
+			st->dfuse_mass_erase = 1;
 			options += 10;
 			continue;
 		}
 		if (!strncmp(options, "will-reset", endword - options)) {
-			dfuse_will_reset = 1;
+			st->dfuse_will_reset = 1;
 			options += 10;
 			continue;
 		}
 		if (!strncmp(options, "fast", endword - options)) {
-			dfuse_fast = 1;
+			st->dfuse_fast = 1;
 			options += 4;
 			continue;
 		}
@@ -123,7 +137,7 @@ static void dfuse_parse_options(const char *options)
 		/* any valid number is interpreted as upload length */
 		number = strtoul(options, &end, 0);
 		if (end == endword) {
-			dfuse_length = number;
+			st->dfuse_length = number;
 		} else {
 			errx(EX_USAGE, "Invalid dfuse modifier: %s", options);
 		}
@@ -182,7 +196,7 @@ static int dfuse_download(struct dfu_if *dif, const unsigned short length,
 
 /* DfuSe only commands */
 /* Leaves the device in dfuDNLOAD-IDLE state */
-static int dfuse_special_command(struct dfu_if *dif, unsigned int address,
+static int dfuse_special_command(struct dfuse_state *st, struct dfu_if *dif, unsigned int address,
 			  enum dfuse_command command)
 {
 	const char* dfuse_command_name[] = { "SET_ADDRESS" , "ERASE_PAGE",
@@ -212,7 +226,7 @@ static int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 			       address & ~(page_size - 1));
 		buf[0] = 0x41;	/* Erase command */
 		length = 5;
-		last_erased_page = address & ~(page_size - 1);
+		st->last_erased_page = address & ~(page_size - 1);
 	} else if (command == SET_ADDRESS) {
 		if (verbose > 1)
 			fprintf(stderr, "  Setting address pointer to 0x%08x\n",
@@ -282,7 +296,7 @@ static int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 		/* A non-null bwPollTimeout for SET_ADDRESS seems a common bootloader bug */
 		if (command == SET_ADDRESS)
 			polltimeout = 0;
-		if (!dfuse_fast && dst.bState == DFU_STATE_dfuDNBUSY)
+		if (!st->dfuse_fast && dst.bState == DFU_STATE_dfuDNBUSY)
 			milli_sleep(polltimeout);
 		if (command == READ_UNPROTECT)
 			return ret;
@@ -303,7 +317,7 @@ static int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 }
 
 /* returns number of bytes sent */
-static int dfuse_dnload_chunk(struct dfu_if *dif, unsigned char *data, int size,
+static int dfuse_dnload_chunk(struct dfuse_state *st, struct dfu_if *dif, unsigned char *data, int size,
 		       int transaction)
 {
 	int bytes_sent;
@@ -338,12 +352,12 @@ static int dfuse_dnload_chunk(struct dfu_if *dif, unsigned char *data, int size,
 		if (verbose > 1)
 			fprintf(stderr, "   Poll timeout %i ms on download (state=%s)\n",
 				dst.bwPollTimeout, dfu_state_to_string(dst.bState));
-		if (!dfuse_fast && dst.bState == DFU_STATE_dfuDNBUSY)
+		if (!st->dfuse_fast && dst.bState == DFU_STATE_dfuDNBUSY)
 			milli_sleep(dst.bwPollTimeout);
 	} while (dst.bState != DFU_STATE_dfuDNLOAD_IDLE &&
 		 dst.bState != DFU_STATE_dfuERROR &&
 		 dst.bState != DFU_STATE_dfuMANIFEST &&
-		 !(dfuse_will_reset && (dst.bState == DFU_STATE_dfuDNBUSY)));
+		 !(st->dfuse_will_reset && (dst.bState == DFU_STATE_dfuDNBUSY)));
 
 	if (dst.bState == DFU_STATE_dfuMANIFEST)
 			printf("Transitioning to dfuMANIFEST state\n");
@@ -358,10 +372,10 @@ static int dfuse_dnload_chunk(struct dfu_if *dif, unsigned char *data, int size,
 	return bytes_sent;
 }
 
-static void dfuse_do_leave(struct dfu_if *dif)
+static void dfuse_do_leave(struct dfuse_state *st, struct dfu_if *dif)
 {
-	if (dfuse_address_present)
-		dfuse_special_command(dif, dfuse_address, SET_ADDRESS);
+	if (st->dfuse_address_present)
+		dfuse_special_command(st, dif, st->dfuse_address, SET_ADDRESS);
 	printf("Submitting leave request...\n");
 	if (dif->quirks & QUIRK_DFUSE_LEAVE) {
 		struct dfu_status dst;
@@ -370,26 +384,28 @@ static void dfuse_do_leave(struct dfu_if *dif)
 		/* Or it might leave after this request, with or without a response */
 		dfu_get_status(dif, &dst);
 	} else {
-		dfuse_dnload_chunk(dif, NULL, 0, 2);
+		dfuse_dnload_chunk(st, dif, NULL, 0, 2);
 	}
 }
 
 int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
 		    const char *dfuse_options)
 {
+	struct dfuse_state state, *st = &state;
 	int total_bytes = 0;
 	int upload_limit = 0;
 	unsigned char *buf;
 	int transaction;
 	int ret;
 
+	dfuse_state_init(st);
 	buf = dfu_malloc(xfer_size);
 
 	if (dfuse_options)
-		dfuse_parse_options(dfuse_options);
-	if (dfuse_length)
-		upload_limit = dfuse_length;
-	if (dfuse_address_present) {
+		dfuse_parse_options(st, dfuse_options);
+	if (st->dfuse_length)
+		upload_limit = st->dfuse_length;
+	if (st->dfuse_address_present) {
 		struct memsegment *mem_layout, *segment;
 
 		mem_layout = parse_memory_layout((char *)dif->alt_name);
@@ -398,15 +414,15 @@ int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
 		if (dif->quirks & QUIRK_DFUSE_LAYOUT)
 			fixup_dfuse_layout(dif, &mem_layout);
 
-		segment = find_segment(mem_layout, dfuse_address);
-		if (!dfuse_force &&
+		segment = find_segment(mem_layout, st->dfuse_address);
+		if (!st->dfuse_force &&
 		    (!segment || !(segment->memtype & DFUSE_READABLE)))
 			errx(EX_USAGE, "Page at 0x%08x is not readable",
-				dfuse_address);
+				st->dfuse_address);
 
 		if (!upload_limit) {
 			if (segment) {
-				upload_limit = segment->end - dfuse_address + 1;
+				upload_limit = segment->end - st->dfuse_address + 1;
 				printf("Limiting upload to end of memory segment, "
 				       "%i bytes\n", upload_limit);
 			} else {
@@ -415,7 +431,7 @@ int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
 				printf("Limiting upload to %i bytes\n", upload_limit);
 			}
 		}
-		dfuse_special_command(dif, dfuse_address, SET_ADDRESS);
+		dfuse_special_command(st, dif, st->dfuse_address, SET_ADDRESS);
 		dfu_abort_to_idle(dif);
 	} else {
 		/* Boot loader decides the start address, unknown to us */
@@ -459,8 +475,8 @@ int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
 	dfu_progress_bar("Upload", total_bytes, total_bytes);
 
 	dfu_abort_to_idle(dif);
-	if (dfuse_leave)
-		dfuse_do_leave(dif);
+	if (st->dfuse_leave)
+		dfuse_do_leave(st, dif);
 
  out_free:
 	free(buf);
@@ -470,7 +486,7 @@ int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
 
 /* Writes an element of any size to the device, taking care of page erases */
 /* returns 0 on success, otherwise -EINVAL */
-static int dfuse_dnload_element(struct dfu_if *dif, unsigned int dwElementAddress,
+static int dfuse_dnload_element(struct dfuse_state *st, struct dfu_if *dif, unsigned int dwElementAddress,
 			 unsigned int dwElementSize, unsigned char *data,
 			 int xfer_size)
 {
@@ -481,7 +497,7 @@ static int dfuse_dnload_element(struct dfu_if *dif, unsigned int dwElementAddres
 	/* Check at least that we can write to the last address */
 	segment =
 	    find_segment(dif->mem_layout, dwElementAddress + dwElementSize - 1);
-	if (!dfuse_force &&
+	if (!st->dfuse_force &&
             (!segment || !(segment->memtype & DFUSE_WRITEABLE))) {
 		errx(EX_USAGE, "Last page at 0x%08x is not writeable",
 			dwElementAddress + dwElementSize - 1);
@@ -498,7 +514,7 @@ static int dfuse_dnload_element(struct dfu_if *dif, unsigned int dwElementAddres
 		int chunk_size = xfer_size;
 
 		segment = find_segment(dif->mem_layout, address);
-		if (!dfuse_force &&
+		if (!st->dfuse_force &&
 		    (!segment || !(segment->memtype & DFUSE_WRITEABLE))) {
 			errx(EX_USAGE, "Page at 0x%08x is not writeable",
 				address);
@@ -515,23 +531,23 @@ static int dfuse_dnload_element(struct dfu_if *dif, unsigned int dwElementAddres
 			chunk_size = dwElementSize - p;
 
 		/* Erase only for flash memory downloads */
-		if ((segment->memtype & DFUSE_ERASABLE) && !dfuse_mass_erase) {
+		if ((segment->memtype & DFUSE_ERASABLE) && !st->dfuse_mass_erase) {
 			/* erase all involved pages */
 			for (erase_address = address;
 			     erase_address < address + chunk_size;
 			     erase_address += page_size)
 				if ((erase_address & ~(page_size - 1)) !=
-				    last_erased_page)
-					dfuse_special_command(dif,
+				    st->last_erased_page)
+					dfuse_special_command(st, dif,
 							      erase_address,
 							      ERASE_PAGE);
 
 			if (((address + chunk_size - 1) & ~(page_size - 1)) !=
-			    last_erased_page) {
+			    st->last_erased_page) {
 				if (verbose > 1)
 					fprintf(stderr, " Chunk extends into next page,"
 					       " erase it as well\n");
-				dfuse_special_command(dif,
+				dfuse_special_command(st, dif,
 						      address + chunk_size - 1,
 						      ERASE_PAGE);
 			}
@@ -562,10 +578,10 @@ static int dfuse_dnload_element(struct dfu_if *dif, unsigned int dwElementAddres
 			dfu_progress_bar("Download", p, dwElementSize);
 		}
 		
-		dfuse_special_command(dif, address, SET_ADDRESS);
+		dfuse_special_command(st, dif, address, SET_ADDRESS);
 
 		/* transaction = 2 for no address offset */
-		ret = dfuse_dnload_chunk(dif, data + p, chunk_size, 2);
+		ret = dfuse_dnload_chunk(st, dif, data + p, chunk_size, 2);
 		if (ret != chunk_size) {
 			errx(EX_IOERR, "Failed to write whole chunk: "
 				"%i of %i bytes", ret, chunk_size);
@@ -591,7 +607,7 @@ dfuse_memcpy(unsigned char *dst, unsigned char **src, int *rem, int size)
 }
 
 /* Download raw binary file to DfuSe device */
-static int dfuse_do_bin_dnload(struct dfu_if *dif, int xfer_size,
+static int dfuse_do_bin_dnload(struct dfuse_state *st, struct dfu_if *dif, int xfer_size,
 			struct dfu_file *file, unsigned int start_address)
 {
 	unsigned int dwElementAddress;
@@ -608,7 +624,7 @@ static int dfuse_do_bin_dnload(struct dfu_if *dif, int xfer_size,
 
 	data = file->firmware + file->size.prefix;
 
-	ret = dfuse_dnload_element(dif, dwElementAddress, dwElementSize, data,
+	ret = dfuse_dnload_element(st, dif, dwElementAddress, dwElementSize, data,
 				   xfer_size);
 	if (ret == 0)
 		printf("File downloaded successfully\n");
@@ -617,7 +633,7 @@ static int dfuse_do_bin_dnload(struct dfu_if *dif, int xfer_size,
 }
 
 /* Parse a DfuSe file and download contents to device */
-static int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
+static int dfuse_do_dfuse_dnload(struct dfuse_state *st, struct dfu_if *dif, int xfer_size,
 			  struct dfu_file *file)
 {
 	uint8_t dfuprefix[11];
@@ -711,14 +727,14 @@ static int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
 
 			if (!bFirstAddressSaved) {
 				bFirstAddressSaved = 1;
-				dfuse_address = dwElementAddress;
+				st->dfuse_address = dwElementAddress;
 			}
 			/* sanity check */
 			if ((int)dwElementSize > rem)
 				errx(EX_DATAERR, "File too small for element size");
 
 			if (adif)
-				ret = dfuse_dnload_element(adif, dwElementAddress,
+				ret = dfuse_dnload_element(st, adif, dwElementAddress,
 							   dwElementSize, data, xfer_size);
 			else
 				ret = 0;
@@ -742,11 +758,13 @@ static int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
 int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file,
 		    const char *dfuse_options)
 {
+	struct dfuse_state state, *st = &state;
 	int ret;
 	struct dfu_if *adif;
 
+	dfuse_state_init(st);
 	if (dfuse_options)
-		dfuse_parse_options(dfuse_options);
+		dfuse_parse_options(st, dfuse_options);
 
 	adif = dif;
 	while (adif) {
@@ -760,40 +778,40 @@ int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file,
 		adif = adif->next;
 	}
 
-	if (dfuse_unprotect) {
-		if (!dfuse_force) {
+	if (st->dfuse_unprotect) {
+		if (!st->dfuse_force) {
 			errx(EX_USAGE, "The read unprotect command "
 				"will erase the flash memory"
 				"and can only be used with force\n");
 		}
-		ret = dfuse_special_command(dif, 0, READ_UNPROTECT);
+		ret = dfuse_special_command(st, dif, 0, READ_UNPROTECT);
 		printf("Device disconnects, erases flash and resets now\n");
 		return ret;
 	}
-	if (dfuse_mass_erase) {
-		if (!dfuse_force) {
+	if (st->dfuse_mass_erase) {
+		if (!st->dfuse_force) {
 			errx(EX_USAGE, "The mass erase command "
 				"can only be used with force");
 		}
 		printf("Performing mass erase, this can take a moment\n");
-		ret = dfuse_special_command(dif, 0, MASS_ERASE);
+		ret = dfuse_special_command(st, dif, 0, MASS_ERASE);
 	}
 	if (!file->name) {
 		printf("DfuSe command mode\n");
 		ret = 0;
-	} else if (dfuse_address_present) {
+	} else if (st->dfuse_address_present) {
 		if (file->bcdDFU == 0x11a) {
 			errx(EX_USAGE, "This is a DfuSe file, not "
 				"meant for raw download");
 		}
-		ret = dfuse_do_bin_dnload(dif, xfer_size, file, dfuse_address);
+		ret = dfuse_do_bin_dnload(st, dif, xfer_size, file, st->dfuse_address);
 	} else {
 		if (file->bcdDFU != 0x11a) {
 			warnx("Only DfuSe file version 1.1a is supported");
 			errx(EX_USAGE, "(for raw binary download, use the "
 			     "--dfuse-address option)");
 		}
-		ret = dfuse_do_dfuse_dnload(dif, xfer_size, file);
+		ret = dfuse_do_dfuse_dnload(st, dif, xfer_size, file);
 	}
 
 	adif = dif;
@@ -802,12 +820,12 @@ int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file,
 		adif = adif->next;
 	}
 
-	if (!dfuse_will_reset) {
+	if (!st->dfuse_will_reset) {
 		dfu_abort_to_idle(dif);
 	}
 
-	if (dfuse_leave)
-		dfuse_do_leave(dif);
+	if (st->dfuse_leave)
+		dfuse_do_leave(st, dif);
 
 	return ret;
 }
@@ -47,20 +47,7 @@
 
 int verbose = 0;
 
-struct dfu_if *dfu_root = NULL;
-
-char *match_path = NULL;
-int match_vendor = -1;
-int match_product = -1;
-int match_vendor_dfu = -1;
-int match_product_dfu = -1;
-int match_config_index = -1;
-int match_iface_index = -1;
-int match_iface_alt_index = -1;
-int match_devnum = -1;
-const char *match_iface_alt_name = NULL;
-const char *match_serial = NULL;
-const char *match_serial_dfu = NULL;
+static struct dfu_ctx dfu_ctx;
 
 static int parse_match_value(const char *str, int default_value)
 {
@@ -88,16 +75,16 @@ static void parse_vendprod(const char *str)
 	const char *colon;
 
 	/* Default to match any DFU device in runtime or DFU mode */
-	match_vendor = -1;
-	match_product = -1;
-	match_vendor_dfu = -1;
-	match_product_dfu = -1;
+	dfu_ctx.match_vendor = -1;
+	dfu_ctx.match_product = -1;
+	dfu_ctx.match_vendor_dfu = -1;
+	dfu_ctx.match_product_dfu = -1;
 
 	comma = strchr(str, ',');
 	if (comma == str) {
 		/* DFU mode vendor/product being specified without any runtime
 		 * vendor/product specification, so don't match any runtime device */
-		match_vendor = match_product = 0x10000;
+		dfu_ctx.match_vendor = dfu_ctx.match_product = 0x10000;
 	} else {
 		colon = strchr(str, ':');
 		if (colon != NULL) {
@@ -106,14 +93,14 @@ static void parse_vendprod(const char *str)
 				colon = NULL;
 			}
 		}
-		match_vendor = parse_match_value(str, match_vendor);
-		match_product = parse_match_value(colon, match_product);
+		dfu_ctx.match_vendor = parse_match_value(str, dfu_ctx.match_vendor);
+		dfu_ctx.match_product = parse_match_value(colon, dfu_ctx.match_product);
 		if (comma != NULL) {
 			/* Both runtime and DFU mode vendor/product specifications are
 			 * available, so default DFU mode match components to the given
 			 * runtime match components */
-			match_vendor_dfu = match_vendor;
-			match_product_dfu = match_product;
+			dfu_ctx.match_vendor_dfu = dfu_ctx.match_vendor;
+			dfu_ctx.match_product_dfu = dfu_ctx.match_product;
 		}
 	}
 	if (comma != NULL) {
@@ -122,8 +109,8 @@ static void parse_vendprod(const char *str)
 		if (colon != NULL) {
 			++colon;
 		}
-		match_vendor_dfu = parse_match_value(comma, match_vendor_dfu);
-		match_product_dfu = parse_match_value(colon, match_product_dfu);
+		dfu_ctx.match_vendor_dfu = parse_match_value(comma, dfu_ctx.match_vendor_dfu);
+		dfu_ctx.match_product_dfu = parse_match_value(colon, dfu_ctx.match_product_dfu);
 	}
 }
 
@@ -131,16 +118,16 @@ static void parse_serial(char *str)
 {
 	char *comma;
 
-	match_serial = str;
+	dfu_ctx.match_serial = str;
 	comma = strchr(str, ',');
 	if (comma == NULL) {
-		match_serial_dfu = match_serial;
+		dfu_ctx.match_serial_dfu = dfu_ctx.match_serial;
 	} else {
 		*comma++ = 0;
-		match_serial_dfu = comma;
+		dfu_ctx.match_serial_dfu = comma;
 	}
-	if (*match_serial == 0) match_serial = NULL;
-	if (*match_serial_dfu == 0) match_serial_dfu = NULL;
+	if (*dfu_ctx.match_serial == 0) dfu_ctx.match_serial = NULL;
+	if (*dfu_ctx.match_serial_dfu == 0) dfu_ctx.match_serial_dfu = NULL;
 }
 
 static int parse_number(char *str, char *nmb)
@@ -258,6 +245,7 @@ int main(int argc, char **argv)
 	uint16_t runtime_product;
 
 	memset(&file, 0, sizeof(file));
+	dfu_ctx_init(&dfu_ctx);
 
 	/* make sure all prints are flushed */
 	setvbuf(stdout, NULL, _IONBF, 0);
@@ -294,29 +282,29 @@ int main(int argc, char **argv)
 			break;
 		case 'p':
 #if (defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102) || (defined(LIBUSBX_API_VERSION) && LIBUSBX_API_VERSION >= 0x01000102)
-			match_path = optarg;
+			dfu_ctx.match_path = optarg;
 #else
 			errx(EX_SOFTWARE, "This dfu-util was built without USB path support");
 #endif
 			break;
 		case 'c':
 			/* Configuration */
-			match_config_index = parse_number("cfg", optarg);
+			dfu_ctx.match_config_index = parse_number("cfg", optarg);
 			break;
 		case 'i':
 			/* Interface */
-			match_iface_index = parse_number("intf", optarg);
+			dfu_ctx.match_iface_index = parse_number("intf", optarg);
 			break;
 		case 'a':
 			/* Interface Alternate Setting */
-			match_iface_alt_index = strtoul(optarg, &end, 0);
+			dfu_ctx.match_iface_alt_index = strtoul(optarg, &end, 0);
 			if (*end) {
-				match_iface_alt_name = optarg;
-				match_iface_alt_index = -1;
+				dfu_ctx.match_iface_alt_name = optarg;
+				dfu_ctx.match_iface_alt_index = -1;
 			}
 			break;
 		case 'n':
-			match_devnum = atoi(optarg);
+			dfu_ctx.match_devnum = atoi(optarg);
 			break;
 		case 'S':
 			parse_serial(optarg);
@@ -378,22 +366,22 @@ int main(int argc, char **argv)
 		exit(EX_USAGE);
 	}
 
-	if (match_config_index == 0) {
+	if (dfu_ctx.match_config_index == 0) {
 		/* Handle "-c 0" (unconfigured device) as don't care */
-		match_config_index = -1;
+		dfu_ctx.match_config_index = -1;
 	}
 
 	if (mode == MODE_DOWNLOAD) {
 		dfu_load_file(&file, MAYBE_SUFFIX, MAYBE_PREFIX);
 		/* If the user didn't specify product and/or vendor IDs to match,
 		 * use any IDs from the file suffix for device matching */
-		if (match_vendor < 0 && file.idVendor != 0xffff) {
-			match_vendor = file.idVendor;
-			printf("Match vendor ID from file: %04x\n", match_vendor);
+		if (dfu_ctx.match_vendor < 0 && file.idVendor != 0xffff) {
+			dfu_ctx.match_vendor = file.idVendor;
+			printf("Match vendor ID from file: %04x\n", dfu_ctx.match_vendor);
 		}
-		if (match_product < 0 && file.idProduct != 0xffff) {
-			match_product = file.idProduct;
-			printf("Match product ID from file: %04x\n", match_product);
+		if (dfu_ctx.match_product < 0 && file.idProduct != 0xffff) {
+			dfu_ctx.match_product = file.idProduct;
+			printf("Match product ID from file: %04x\n", dfu_ctx.match_product);
 		}
 	} else if (mode == MODE_NONE && dfuse_options) {
 		/* for DfuSe special commands, match any device */
@@ -418,16 +406,16 @@ int main(int argc, char **argv)
 #endif
 	}
 probe:
-	probe_devices(ctx);
+	probe_devices(&dfu_ctx, ctx);
 
 	if (mode == MODE_LIST) {
-		list_dfu_interfaces();
-		disconnect_devices();
+		list_dfu_interfaces(&dfu_ctx);
+		disconnect_devices(&dfu_ctx);
 		libusb_exit(ctx);
 		return EX_OK;
 	}
 
-	if (dfu_root == NULL) {
+	if (dfu_ctx.dfu_root == NULL) {
 		if (wait_device) {
 			milli_sleep(20);
 			goto probe;
@@ -436,9 +424,9 @@ probe:
 			libusb_exit(ctx);
 			return EX_IOERR;
 		}
-	} else if (file.bcdDFU == 0x11a && dfuse_multiple_alt(dfu_root)) {
+	} else if (file.bcdDFU == 0x11a && dfuse_multiple_alt(dfu_ctx.dfu_root)) {
 		printf("Multiple alternate interfaces for DfuSe file\n");
-	} else if (dfu_root->next != NULL) {
+	} else if (dfu_ctx.dfu_root->next != NULL) {
 		/* We cannot safely support more than one DFU capable device
 		 * with same vendor/product ID, since during DFU we need to do
 		 * a USB bus reset, after which the target device will get a
@@ -448,69 +436,69 @@ probe:
 		       "or disconnect all but one device\n");
 	}
 
-	/* We have exactly one device. Its libusb_device is now in dfu_root->dev */
+	/* We have exactly one device. Its libusb_device is now in dfu_ctx.dfu_root->dev */
 
 	printf("Opening DFU capable USB device...\n");
-	ret = libusb_open(dfu_root->dev, &dfu_root->dev_handle);
-	if (ret || !dfu_root->dev_handle)
+	ret = libusb_open(dfu_ctx.dfu_root->dev, &dfu_ctx.dfu_root->dev_handle);
+	if (ret || !dfu_ctx.dfu_root->dev_handle)
 		errx(EX_IOERR, "Cannot open device: %s", libusb_error_name(ret));
 
-	printf("Device ID %04x:%04x\n", dfu_root->vendor, dfu_root->product);
+	printf("Device ID %04x:%04x\n", dfu_ctx.dfu_root->vendor, dfu_ctx.dfu_root->product);
 
 	/* If first interface is DFU it is likely not proper run-time */
-	if (dfu_root->interface > 0)
+	if (dfu_ctx.dfu_root->interface > 0)
 		printf("Run-Time device");
 	else
 		printf("Device");
 	printf(" DFU version %04x\n",
-	       libusb_le16_to_cpu(dfu_root->func_dfu.bcdDFUVersion));
+	       libusb_le16_to_cpu(dfu_ctx.dfu_root->func_dfu.bcdDFUVersion));
 
 	if (verbose) {
-		printf("DFU attributes: (0x%02x)", dfu_root->func_dfu.bmAttributes);
-		if (dfu_root->func_dfu.bmAttributes & USB_DFU_CAN_DOWNLOAD)
+		printf("DFU attributes: (0x%02x)", dfu_ctx.dfu_root->func_dfu.bmAttributes);
+		if (dfu_ctx.dfu_root->func_dfu.bmAttributes & USB_DFU_CAN_DOWNLOAD)
 			printf(" bitCanDnload");
-		if (dfu_root->func_dfu.bmAttributes & USB_DFU_CAN_UPLOAD)
+		if (dfu_ctx.dfu_root->func_dfu.bmAttributes & USB_DFU_CAN_UPLOAD)
 			printf(" bitCanUpload");
-		if (dfu_root->func_dfu.bmAttributes & USB_DFU_MANIFEST_TOL)
+		if (dfu_ctx.dfu_root->func_dfu.bmAttributes & USB_DFU_MANIFEST_TOL)
 			printf(" bitManifestationTolerant");
-		if (dfu_root->func_dfu.bmAttributes & USB_DFU_WILL_DETACH)
+		if (dfu_ctx.dfu_root->func_dfu.bmAttributes & USB_DFU_WILL_DETACH)
 			printf(" bitWillDetach");
 		printf("\n");
-		printf("Detach timeout %d ms\n", libusb_le16_to_cpu(dfu_root->func_dfu.wDetachTimeOut));
+		printf("Detach timeout %d ms\n", libusb_le16_to_cpu(dfu_ctx.dfu_root->func_dfu.wDetachTimeOut));
 	}
 
 	/* Transition from run-Time mode to DFU mode */
-	if (!(dfu_root->flags & DFU_IFF_DFU)) {
+	if (!(dfu_ctx.dfu_root->flags & DFU_IFF_DFU)) {
 		int err;
 		/* In the 'first round' during runtime mode, there can only be one
 		* DFU Interface descriptor according to the DFU Spec. */
 
 		/* FIXME: check if the selected device really has only one */
 
-		runtime_vendor = dfu_root->vendor;
-		runtime_product = dfu_root->product;
+		runtime_vendor = dfu_ctx.dfu_root->vendor;
+		runtime_product = dfu_ctx.dfu_root->product;
 
 		printf("Claiming USB DFU (Run-Time) Interface...\n");
-		ret = libusb_claim_interface(dfu_root->dev_handle, dfu_root->interface);
+		ret = libusb_claim_interface(dfu_ctx.dfu_root->dev_handle, dfu_ctx.dfu_root->interface);
 		if (ret < 0) {
 			errx(EX_IOERR, "Cannot claim interface %d: %s",
-				dfu_root->interface, libusb_error_name(ret));
+				dfu_ctx.dfu_root->interface, libusb_error_name(ret));
 		}
 
 		/* Needed for some devices where the DFU interface is not the first,
 		 * and should also be safe if there are multiple alt settings.
 		 * Otherwise skip the request since it might not be supported
 		 * by the device and the USB stack may or may not recover */
-		if (dfu_root->interface > 0 || dfu_root->flags & DFU_IFF_ALT) {
+		if (dfu_ctx.dfu_root->interface > 0 || dfu_ctx.dfu_root->flags & DFU_IFF_ALT) {
 			printf("Setting Alternate Interface zero...\n");
-			ret = libusb_set_interface_alt_setting(dfu_root->dev_handle, dfu_root->interface, 0);
+			ret = libusb_set_interface_alt_setting(dfu_ctx.dfu_root->dev_handle, dfu_ctx.dfu_root->interface, 0);
 			if (ret < 0) {
 				errx(EX_IOERR, "Cannot set alternate interface zero: %s", libusb_error_name(ret));
 			}
 		}
 
 		printf("Determining device status...\n");
-		err = dfu_get_status(dfu_root, &status);
+		err = dfu_get_status(dfu_ctx.dfu_root, &status);
 		if (err == LIBUSB_ERROR_PIPE) {
 			printf("Device does not implement get_status, assuming appIDLE\n");
 			status.bStatus = DFU_STATUS_OK;
@@ -531,15 +519,15 @@ probe:
 		case DFU_STATE_appDETACH:
 			printf("Device really in Run-Time Mode, send DFU "
 			       "detach request...\n");
-			if (dfu_detach(dfu_root->dev_handle,
-				       dfu_root->interface, 1000) < 0) {
+			if (dfu_detach(dfu_ctx.dfu_root->dev_handle,
+				       dfu_ctx.dfu_root->interface, 1000) < 0) {
 				warnx("error detaching");
 			}
-			if (dfu_root->func_dfu.bmAttributes & USB_DFU_WILL_DETACH) {
+			if (dfu_ctx.dfu_root->func_dfu.bmAttributes & USB_DFU_WILL_DETACH) {
 				printf("Device will detach and reattach...\n");
 			} else {
 				printf("Resetting USB...\n");
-				ret = libusb_reset_device(dfu_root->dev_handle);
+				ret = libusb_reset_device(dfu_ctx.dfu_root->dev_handle);
 				if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND)
 					errx(EX_IOERR, "error resetting "
 						"after detach: %s", libusb_error_name(ret));
@@ -547,25 +535,25 @@ probe:
 			break;
 		case DFU_STATE_dfuERROR:
 			printf("dfuERROR, clearing status\n");
-			if (dfu_clear_status(dfu_root->dev_handle,
-					     dfu_root->interface) < 0) {
+			if (dfu_clear_status(dfu_ctx.dfu_root->dev_handle,
+					     dfu_ctx.dfu_root->interface) < 0) {
 				errx(EX_IOERR, "error clear_status");
 			}
 			/* fall through */
 		default:
 			warnx("WARNING: Device already in DFU mode? (bState=%d %s)",
 			      status.bState, dfu_state_to_string(status.bState));
-			libusb_release_interface(dfu_root->dev_handle,
-			    dfu_root->interface);
+			libusb_release_interface(dfu_ctx.dfu_root->dev_handle,
+			    dfu_ctx.dfu_root->interface);
 			goto dfustate;
 		}
-		libusb_release_interface(dfu_root->dev_handle,
-					 dfu_root->interface);
-		libusb_close(dfu_root->dev_handle);
-		dfu_root->dev_handle = NULL;
+		libusb_release_interface(dfu_ctx.dfu_root->dev_handle,
+					 dfu_ctx.dfu_root->interface);
+		libusb_close(dfu_ctx.dfu_root->dev_handle);
+		dfu_ctx.dfu_root->dev_handle = NULL;
 
 		/* keeping handles open might prevent re-enumeration */
-		disconnect_devices();
+		disconnect_devices(&dfu_ctx);
 
 		if (mode == MODE_DETACH) {
 			libusb_exit(ctx);
@@ -576,25 +564,25 @@ probe:
 
 		/* Change match vendor and product to impossible values to force
 		 * only DFU mode matches in the following probe */
-		match_vendor = match_product = 0x10000;
+		dfu_ctx.match_vendor = dfu_ctx.match_product = 0x10000;
 
-		probe_devices(ctx);
+		probe_devices(&dfu_ctx, ctx);
 
-		if (dfu_root == NULL) {
+		if (dfu_ctx.dfu_root == NULL) {
 			errx(EX_IOERR, "Lost device after RESET?");
-		} else if (dfu_root->next != NULL) {
+		} else if (dfu_ctx.dfu_root->next != NULL) {
 			errx(EX_IOERR, "More than one DFU capable USB device found! "
 				"Try `--list' and specify the serial number "
 				"or disconnect all but one device");
 		}
 
 		/* Check for DFU mode device */
-		if (!(dfu_root->flags | DFU_IFF_DFU))
+		if (!(dfu_ctx.dfu_root->flags | DFU_IFF_DFU))
 			errx(EX_PROTOCOL, "Device is not in DFU mode");
 
 		printf("Opening DFU USB Device...\n");
-		ret = libusb_open(dfu_root->dev, &dfu_root->dev_handle);
-		if (ret || !dfu_root->dev_handle) {
+		ret = libusb_open(dfu_ctx.dfu_root->dev, &dfu_ctx.dfu_root->dev_handle);
+		if (ret || !dfu_ctx.dfu_root->dev_handle) {
 			errx(EX_IOERR, "Cannot open device");
 		}
 	} else {
@@ -602,27 +590,27 @@ probe:
 		 * procedure */
 		/* If a match vendor/product was specified, use that as the runtime
 		 * vendor/product, otherwise use the DFU mode vendor/product */
-		runtime_vendor = match_vendor < 0 ? dfu_root->vendor : match_vendor;
-		runtime_product = match_product < 0 ? dfu_root->product : match_product;
+		runtime_vendor = dfu_ctx.match_vendor < 0 ? dfu_ctx.dfu_root->vendor : dfu_ctx.match_vendor;
+		runtime_product = dfu_ctx.match_product < 0 ? dfu_ctx.dfu_root->product : dfu_ctx.match_product;
 	}
 
 dfustate:
 #if 0
-	printf("Setting Configuration %u...\n", dfu_root->configuration);
-	ret = libusb_set_configuration(dfu_root->dev_handle, dfu_root->configuration);
+	printf("Setting Configuration %u...\n", dfu_ctx.dfu_root->configuration);
+	ret = libusb_set_configuration(dfu_ctx.dfu_root->dev_handle, dfu_ctx.dfu_root->configuration);
 	if (ret < 0) {
 		errx(EX_IOERR, "Cannot set configuration: %s", libusb_error_name(ret));
 	}
 #endif
 	printf("Claiming USB DFU Interface...\n");
-	ret = libusb_claim_interface(dfu_root->dev_handle, dfu_root->interface);
+	ret = libusb_claim_interface(dfu_ctx.dfu_root->dev_handle, dfu_ctx.dfu_root->interface);
 	if (ret < 0) {
 		errx(EX_IOERR, "Cannot claim interface - %s", libusb_error_name(ret));
 	}
 
-	if (dfu_root->flags & DFU_IFF_ALT) {
-		printf("Setting Alternate Interface #%d ...\n", dfu_root->altsetting);
-		ret = libusb_set_interface_alt_setting(dfu_root->dev_handle, dfu_root->interface, dfu_root->altsetting);
+	if (dfu_ctx.dfu_root->flags & DFU_IFF_ALT) {
+		printf("Setting Alternate Interface #%d ...\n", dfu_ctx.dfu_root->altsetting);
+		ret = libusb_set_interface_alt_setting(dfu_ctx.dfu_root->dev_handle, dfu_ctx.dfu_root->interface, dfu_ctx.dfu_root->altsetting);
 		if (ret < 0) {
 			errx(EX_IOERR, "Cannot set alternate interface: %s", libusb_error_name(ret));
 		}
@@ -630,7 +618,7 @@ dfustate:
 
 status_again:
 	printf("Determining device status...\n");
-	ret = dfu_get_status(dfu_root, &status );
+	ret = dfu_get_status(dfu_ctx.dfu_root, &status );
 	if (ret < 0) {
 		errx(EX_IOERR, "error get_status: %s", libusb_error_name(ret));
 	}
@@ -647,7 +635,7 @@ status_again:
 		break;
 	case DFU_STATE_dfuERROR:
 		printf("Clearing status\n");
-		if (dfu_clear_status(dfu_root->dev_handle, dfu_root->interface) < 0) {
+		if (dfu_clear_status(dfu_ctx.dfu_root->dev_handle, dfu_ctx.dfu_root->interface) < 0) {
 			errx(EX_IOERR, "error clear_status");
 		}
 		goto status_again;
@@ -655,7 +643,7 @@ status_again:
 	case DFU_STATE_dfuDNLOAD_IDLE:
 	case DFU_STATE_dfuUPLOAD_IDLE:
 		printf("Aborting previous incomplete transfer\n");
-		if (dfu_abort(dfu_root->dev_handle, dfu_root->interface) < 0) {
+		if (dfu_abort(dfu_ctx.dfu_root->dev_handle, dfu_ctx.dfu_root->interface) < 0) {
 			errx(EX_IOERR, "can't send DFU_ABORT");
 		}
 		goto status_again;
@@ -669,9 +657,9 @@ status_again:
 		printf("WARNING: DFU Status: '%s'\n",
 			dfu_status_to_string(status.bStatus));
 		/* Clear our status & try again. */
-		if (dfu_clear_status(dfu_root->dev_handle, dfu_root->interface) < 0)
+		if (dfu_clear_status(dfu_ctx.dfu_root->dev_handle, dfu_ctx.dfu_root->interface) < 0)
 			errx(EX_IOERR, "USB communication error");
-		if (dfu_get_status(dfu_root, &status) < 0)
+		if (dfu_get_status(dfu_ctx.dfu_root, &status) < 0)
 			errx(EX_IOERR, "USB communication error");
 		if (DFU_STATUS_OK != status.bStatus)
 			errx(EX_PROTOCOL, "Status is not OK: %d", status.bStatus);
@@ -680,15 +668,15 @@ status_again:
 	}
 
 	printf("DFU mode device DFU version %04x\n",
-	       libusb_le16_to_cpu(dfu_root->func_dfu.bcdDFUVersion));
+	       libusb_le16_to_cpu(dfu_ctx.dfu_root->func_dfu.bcdDFUVersion));
 
-	if (dfu_root->func_dfu.bcdDFUVersion == libusb_cpu_to_le16(0x11a))
+	if (dfu_ctx.dfu_root->func_dfu.bcdDFUVersion == libusb_cpu_to_le16(0x11a))
 		dfuse_device = 1;
 	else if (dfuse_options)
 		printf("Warning: DfuSe option used on non-DfuSe device\n");
 
 	/* Get from device or user, warn if overridden */
-	int func_dfu_transfer_size = libusb_le16_to_cpu(dfu_root->func_dfu.wTransferSize);
+	int func_dfu_transfer_size = libusb_le16_to_cpu(dfu_ctx.dfu_root->func_dfu.wTransferSize);
 	if (func_dfu_transfer_size) {
 		printf("Device returned transfer size %i\n", func_dfu_transfer_size);
 		if (!transfer_size)
@@ -708,8 +696,8 @@ status_again:
 	}
 #endif /* __linux__ */
 
-	if (transfer_size < dfu_root->bMaxPacketSize0) {
-		transfer_size = dfu_root->bMaxPacketSize0;
+	if (transfer_size < dfu_ctx.dfu_root->bMaxPacketSize0) {
+		transfer_size = dfu_ctx.dfu_root->bMaxPacketSize0;
 		printf("Adjusted transfer size to %i\n", transfer_size);
 	}
 
@@ -724,9 +712,9 @@ status_again:
 		}
 
 		if (dfuse_device || dfuse_options) {
-		    ret = dfuse_do_upload(dfu_root, transfer_size, fd, dfuse_options);
+		    ret = dfuse_do_upload(dfu_ctx.dfu_root, transfer_size, fd, dfuse_options);
 		} else {
-		    ret = dfuload_do_upload(dfu_root, transfer_size, expected_size, fd);
+		    ret = dfuload_do_upload(dfu_ctx.dfu_root, transfer_size, expected_size, fd);
 		}
 		close(fd);
 		if (ret < 0)
@@ -738,18 +726,18 @@ status_again:
 	case MODE_DOWNLOAD:
 		if (((file.idVendor  != 0xffff && file.idVendor  != runtime_vendor) ||
 		     (file.idProduct != 0xffff && file.idProduct != runtime_product)) &&
-		    ((file.idVendor  != 0xffff && file.idVendor  != dfu_root->vendor) ||
-		     (file.idProduct != 0xffff && file.idProduct != dfu_root->product))) {
+		    ((file.idVendor  != 0xffff && file.idVendor  != dfu_ctx.dfu_root->vendor) ||
+		     (file.idProduct != 0xffff && file.idProduct != dfu_ctx.dfu_root->product))) {
 			errx(EX_USAGE, "Error: File ID %04x:%04x does "
 				"not match device (%04x:%04x or %04x:%04x)",
 				file.idVendor, file.idProduct,
 				runtime_vendor, runtime_product,
-				dfu_root->vendor, dfu_root->product);
+				dfu_ctx.dfu_root->vendor, dfu_ctx.dfu_root->product);
 		}
 		if (dfuse_device || dfuse_options || file.bcdDFU == 0x11a) {
-			ret = dfuse_do_dnload(dfu_root, transfer_size, &file, dfuse_options);
+			ret = dfuse_do_dnload(dfu_ctx.dfu_root, transfer_size, &file, dfuse_options);
 		} else {
-			ret = dfuload_do_dnload(dfu_root, transfer_size, &file);
+			ret = dfuload_do_dnload(dfu_ctx.dfu_root, transfer_size, &file);
 	 	}
 		if (ret < 0)
 			ret = EX_IOERR;
@@ -757,7 +745,7 @@ status_again:
 			ret = EX_OK;
 		break;
 	case MODE_DETACH:
-		ret = dfu_detach(dfu_root->dev_handle, dfu_root->interface, 1000);
+		ret = dfu_detach(dfu_ctx.dfu_root->dev_handle, dfu_ctx.dfu_root->interface, 1000);
 		if (ret < 0) {
 			warnx("can't detach");
 			/* allow combination with final_reset */
@@ -771,14 +759,14 @@ status_again:
 	}
 
 	if (!ret && final_reset) {
-		ret = dfu_detach(dfu_root->dev_handle, dfu_root->interface, 1000);
+		ret = dfu_detach(dfu_ctx.dfu_root->dev_handle, dfu_ctx.dfu_root->interface, 1000);
 		if (ret < 0) {
 			/* Even if detach failed, just carry on to leave the
                            device in a known state */
 			warnx("can't detach");
 		}
 		printf("Resetting USB to switch back to Run-Time mode\n");
-		ret = libusb_reset_device(dfu_root->dev_handle);
+		ret = libusb_reset_device(dfu_ctx.dfu_root->dev_handle);
 		if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND) {
 			warnx("error resetting after download: %s", libusb_error_name(ret));
 			ret = EX_IOERR;
@@ -787,10 +775,10 @@ status_again:
 		}
 	}
 
-	libusb_close(dfu_root->dev_handle);
-	dfu_root->dev_handle = NULL;
+	libusb_close(dfu_ctx.dfu_root->dev_handle);
+	dfu_ctx.dfu_root->dev_handle = NULL;
 
-	disconnect_devices();
+	disconnect_devices(&dfu_ctx);
 	libusb_exit(ctx);
 	return ret;
 }
@@ -70,4 +70,11 @@
 # define O_BINARY   0
 #endif
 
+/* State that must not be shared between transfers running on different threads */
+#if defined(_MSC_VER)
+# define DFU_THREAD_LOCAL __declspec(thread)
+#else
+# define DFU_THREAD_LOCAL _Thread_local
+#endif
+
 #endif /* PORTABLE_H */
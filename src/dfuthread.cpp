@@ -9,15 +9,21 @@
 #include "devicewrapper.h"
 #include "devicewrapperfatpartition.h"
 #include "downloadextractthread.h"
+#include "imagesource.h"
 #include <QFile>
 #include <QDebug>
 #include <QThread>
 #include <QCoreApplication>
+#include <QScopeGuard>
+#include <QScopedPointer>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
 
 DfuThread::DfuThread(const QByteArray &url, const QByteArray &localfilename,
                      const QByteArray &expectedHash, QObject *parent)
     : DownloadExtractThread(url, localfilename, expectedHash, parent)
-    , _tempImageFile(nullptr)
 {
     _suppressSuccessSignal = true;
     _ejectEnabled = false;
@@ -28,11 +34,6 @@ DfuThread::~DfuThread()
     for (int i = 0; i < 3; i++)
         if (!_bootloaderFiles[i].isEmpty())
             QFile::remove(_bootloaderFiles[i]);
-
-    if (_tempImageFile) {
-        _tempImageFile->remove();
-        delete _tempImageFile;
-    }
 }
 
 bool DfuThread::isImage()
@@ -42,25 +43,206 @@ bool DfuThread::isImage()
 
 bool DfuThread::_openAndPrepareDevice()
 {
-    _tempImageFile = new QTemporaryFile();
-    _tempImageFile->setAutoRemove(false);
+    /* Nothing to open, the image only passes through memory */
+    return true;
+}
 
-    if (!_tempImageFile->open()) {
-        emit error(tr("Failed to create temporary file for DFU image"));
-        return false;
+void DfuThread::cancelDownload()
+{
+    DownloadExtractThread::cancelDownload();
+    _failStream();
+}
+
+void DfuThread::_onDownloadError(const QString &msg)
+{
+    DownloadExtractThread::_onDownloadError(msg);
+    _failStream();
+}
+
+/* Does not undo a stream that already ended successfully */
+void DfuThread::_failStream()
+{
+    {
+        std::lock_guard<std::mutex> lock(_streamMutex);
+        if (!_streamEnded)
+            _streamFailed = true;
     }
+    _streamCond.notify_all();
+}
 
-    _tempImagePath = _tempImageFile->fileName();
-    _tempImageFile->close();
+size_t DfuThread::_writeFile(const char *buf, size_t len)
+{
+    if (_cancelled)
+        return len;
+
+    /* Only this thread sets it, the lock is for the readers */
+    qint64 prefixSize = _bootPrefixSize;
+    if (prefixSize < 0)
+    {
+        /* Without a recognizable partition table reading the bootloader from the first block fails later on */
+        prefixSize = qMax<qint64>(_bootPartitionEnd(buf, len), len);
+        if (prefixSize > DFU_BOOT_PREFIX_MAX_SIZE)
+        {
+            qDebug() << "Boot partition ends at" << prefixSize << "bytes, more than can be kept in memory";
+            _onDownloadError(tr("The boot partition of this image is too large (%1 MB) to be flashed over DFU")
+                             .arg(prefixSize / 1048576));
+            return 0;
+        }
+    }
 
-    _filename = _tempImagePath.toLatin1();
-    _file.setFileName(_tempImagePath);
-    if (!_file.open(QIODevice::ReadWrite | QIODevice::Unbuffered)) {
-        emit error(tr("Failed to open temporary file for DFU image"));
-        return false;
+    _writehash.addData(buf, len);
+
+    std::unique_lock<std::mutex> lock(_streamMutex);
+    if (_bootPrefixSize < 0)
+    {
+        _bootPrefixSize = prefixSize;
+        _bootPrefix.reserve(_bootPrefixSize);
+        _streamQueueStart = _bootPrefixSize;
     }
 
-    return true;
+    qint64 prefixLen = _bootPrefixReleased ? 0 : qBound<qint64>(0, _bootPrefixSize - _bootPrefix.size(), len);
+    _bootPrefix.append(buf, prefixLen);
+
+    if (prefixLen < (qint64) len)
+    {
+        /* Decoding pauses while the slowest board lags behind, or is still busy with the bootloader */
+        while (_streamQueued >= DFU_STREAM_BUFFER_SIZE && !_cancelled && !_streamFailed)
+            _streamCond.wait_for(lock, std::chrono::milliseconds(200));
+        if (_cancelled || _streamFailed)
+            return len;
+
+        _streamQueue.emplace_back(buf + prefixLen, len - prefixLen);
+        _streamQueued += len - prefixLen;
+    }
+
+    _bytesWritten += len;
+    lock.unlock();
+    _streamCond.notify_all();
+
+    return len;
+}
+
+void DfuThread::_writeComplete()
+{
+    QByteArray computedHash = _writehash.result().toHex();
+    qDebug() << "Hash of uncompressed image:" << computedHash;
+    if (!_expectedHash.isEmpty() && _expectedHash != computedHash)
+    {
+        qDebug() << "Mismatch with expected hash:" << _expectedHash;
+        if (_cachefile.isOpen())
+            _cachefile.remove();
+        _onDownloadError(tr("Download corrupt. Hash does not match"));
+        return;
+    }
+    if (_cacheEnabled && _expectedHash == computedHash)
+    {
+        _cachefile.close();
+        emit cacheFileUpdated(computedHash);
+    }
+
+    qDebug() << "Image decoded in" << _timer.elapsed() / 1000 << "seconds";
+
+    {
+        std::lock_guard<std::mutex> lock(_streamMutex);
+        _streamEnded = true;
+    }
+    _streamCond.notify_all();
+}
+
+/* Blocks until the requested part of the boot partition has been decoded, past its end reads zeroes */
+void DfuThread::_readBootPartition(char *buf, quint64 size, quint64 offset)
+{
+    std::unique_lock<std::mutex> lock(_streamMutex);
+    auto available = [&]() {
+        return _bootPrefixSize >= 0 && (quint64) _bootPrefix.size() >= qMin<quint64>(offset + size, _bootPrefixSize);
+    };
+
+    while (!available() && !_streamEnded && !_streamFailed && !_cancelled)
+        _streamCond.wait_for(lock, std::chrono::milliseconds(200));
+
+    if (_streamFailed || _cancelled)
+        throw std::runtime_error("Image download failed");
+
+    quint64 avail = (offset < (quint64) _bootPrefix.size()) ? qMin<quint64>(size, _bootPrefix.size() - offset) : 0;
+    memcpy(buf, _bootPrefix.constData() + offset, avail);
+    memset(buf + avail, 0, size - avail);
+}
+
+/* Fills buf completely unless the end of the image is reached, -1 if the pipeline failed */
+qint64 DfuThread::_readStream(Board &board, char *buf, qint64 maxlen)
+{
+    qint64 bytesRead = 0;
+    std::unique_lock<std::mutex> lock(_streamMutex);
+
+    while (bytesRead < maxlen)
+    {
+        if (_streamFailed || _cancelled || !board.streaming)
+            return -1;
+
+        qint64 n = 0;
+        if (board.position < qMax<qint64>(_bootPrefixSize, 0))
+        {
+            n = qMin<qint64>(maxlen - bytesRead, _bootPrefix.size() - board.position);
+            if (n > 0)
+                memcpy(buf + bytesRead, _bootPrefix.constData() + board.position, n);
+        }
+        else
+        {
+            qint64 offset = board.position - _streamQueueStart;
+            for (const QByteArray &chunk : _streamQueue)
+            {
+                if (offset < chunk.size())
+                {
+                    n = qMin<qint64>(maxlen - bytesRead, chunk.size() - offset);
+                    memcpy(buf + bytesRead, chunk.constData() + offset, n);
+                    break;
+                }
+                offset -= chunk.size();
+            }
+        }
+
+        if (n > 0)
+        {
+            board.position += n;
+            bytesRead += n;
+            _trimStream();
+        }
+        else if (_streamEnded)
+        {
+            break;
+        }
+        else
+        {
+            _streamCond.wait_for(lock, std::chrono::milliseconds(200));
+        }
+    }
+
+    return bytesRead;
+}
+
+/* Drops what every board still streaming has sent, called with _streamMutex held */
+void DfuThread::_trimStream()
+{
+    qint64 minPosition = std::numeric_limits<qint64>::max();
+    for (const Board &board : _boards)
+        if (board.streaming)
+            minPosition = qMin(minPosition, board.position);
+
+    if (!_bootPrefixReleased && _bootPrefixSize >= 0 && _bootPrefix.size() == _bootPrefixSize
+            && minPosition >= _bootPrefixSize)
+    {
+        _bootPrefix.clear();
+        _bootPrefixReleased = true;
+    }
+
+    while (!_streamQueue.empty() && _streamQueueStart + _streamQueue.front().size() <= minPosition)
+    {
+        _streamQueueStart += _streamQueue.front().size();
+        _streamQueued -= _streamQueue.front().size();
+        _streamQueue.pop_front();
+    }
+
+    _streamCond.notify_all();
 }
 
 void DfuThread::run()
@@ -72,50 +254,177 @@ void DfuThread::run()
         return;
     }
 
+    if (_verifyEnabled)
+        qDebug() << "Image is streamed to the device, it cannot be read back for verification";
+
+    /* Boards already waiting in DFU mode are all flashed, otherwise the first one to show up */
+    const QStringList paths = DfuWrapper::devicePaths(DfuWrapper::TI_VENDOR_ID, DfuWrapper::TI_PRODUCT_ID);
+    _boards.resize(qMax<qsizetype>(paths.size(), 1));
+    for (int i = 0; i < paths.size(); i++)
+        _boards[i].usbPath = paths.at(i);
+    qDebug() << "Flashing" << _boards.size() << "board(s) over DFU:" << paths;
+
     emit dfuProgress(5, tr("Downloading image..."));
-    DownloadExtractThread::run();
-    waitForExtractThread();
-    if (!_successful) return;
 
+    /* Download and extraction run alongside and feed the rawemmc transfers */
+    QScopedPointer<QThread> pipeline(QThread::create([this]() {
+        DownloadExtractThread::run();
+        waitForExtractThread();
+        _failStream();
+    }));
+    pipeline->start();
+
+    auto stopPipeline = qScopeGuard([this, &pipeline]() {
+        cancelDownload();
+        pipeline->wait();
+    });
+
+    /* The bootloader stages run as soon as the boot partition is decoded, while the rest is still downloading */
     emit dfuProgress(38, tr("Extracting bootloader files from image..."));
     if (!extractBootloaderFromImage()) return;
 
-    emit dfuProgress(45, tr("Sending bootloader files..."));
-    if (!sendBootloaderFiles()) return;
+    std::vector<QThread *> workers;
+    for (Board &board : _boards)
+    {
+        workers.push_back(QThread::create([this, &board]() { _flashBoard(board); }));
+        workers.back()->start();
+    }
+    for (QThread *worker : workers)
+    {
+        worker->wait();
+        delete worker;
+    }
 
-    emit dfuProgress(77, tr("Waiting for device to enter DFU mode..."));
-    QThread::sleep(3);
+    if (_cancelled)
+        return;
 
-    emit dfuProgress(80, tr("Sending image to device (this may take several minutes)..."));
-    if (!sendImageToRawemmc()) return;
+    QStringList failures;
+    int flashed = 0;
+    for (const Board &board : _boards)
+    {
+        if (board.done)
+            flashed++;
+        else if (!board.error.isEmpty())
+            failures.append(QString("%1: %2").arg(board.usbPath, board.error));
+    }
 
-    emit dfuProgress(95, tr("Writing boot binaries to eMMC (do not power off)..."));
-    QThread::sleep(15);
+    if (flashed)
+    {
+        /* U-Boot does not report over USB when the boot partition write is done, only that it left DFU mode.
+         * cancelDownload() wakes the stream waiters, so cancelling does not sit out the whole wait */
+        std::unique_lock<std::mutex> lock(_streamMutex);
+        _streamCond.wait_for(lock, std::chrono::milliseconds(DFU_BOOT_WRITE_MSEC), [this]() { return _cancelled; });
+        if (_cancelled)
+            return;
+    }
+
+    if (_boards.size() == 1)
+    {
+        if (!flashed)
+            return;
+        emit dfuProgress(100, tr("System image sent successfully!"));
+    }
+    else if (!failures.isEmpty())
+    {
+        emit error(tr("DFU failed on %1 of %2 boards:<br>%3").arg(failures.size()).arg(_boards.size()).arg(failures.join("<br>")));
+        return;
+    }
+    else
+    {
+        emit dfuProgress(100, tr("System image sent successfully to %1 boards!").arg(_boards.size()));
+    }
 
-    emit dfuProgress(100, tr("System image sent successfully!"));
     QThread::msleep(1000);
     emit success();
 }
 
-// Helper: create a DfuWrapper, find the device, transfer a file, clean up.
-bool DfuThread::runDfu(const QString &altSetting, const QString &filePath, bool resetAfter)
+void DfuThread::_flashBoard(Board &board)
+{
+    _boardProgress(board, 45, tr("Sending bootloader files..."));
+    if (sendBootloaderFiles(board))
+    {
+        _boardProgress(board, 80, tr("Sending image to device (this may take several minutes)..."));
+        if (sendImageToRawemmc(board))
+        {
+            board.done = true;
+            _boardProgress(board, 95, tr("Writing boot binaries to eMMC (do not power off)..."));
+        }
+    }
+
+    /* Finished or failed, it no longer holds back the stream for the other boards */
+    _stopStreaming(board);
+}
+
+/* Drops a board from the fan-out and wakes its reader, which then fails its read */
+void DfuThread::_stopStreaming(Board &board)
+{
+    std::lock_guard<std::mutex> lock(_streamMutex);
+    board.streaming = false;
+    _trimStream();
+}
+
+void DfuThread::_boardProgress(Board &board, int percentage, const QString &msg)
+{
+    if (_boards.size() == 1)
+    {
+        emit dfuProgress(percentage, msg);
+        return;
+    }
+
+    int slowest = 100;
+    QStringList summary;
+    {
+        std::lock_guard<std::mutex> lock(_progressMutex);
+        board.percentage = percentage;
+        board.status = msg;
+
+        for (const Board &b : _boards)
+        {
+            slowest = qMin(slowest, b.percentage);
+            summary.append(QString("%1: %2").arg(b.usbPath, b.status));
+        }
+    }
+
+    emit boardProgress(board.usbPath, percentage, msg);
+    emit dfuProgress(slowest, summary.join(" | "));
+}
+
+void DfuThread::_boardFailed(Board &board, const QString &msg)
+{
+    if (_boards.size() == 1)
+    {
+        emit error(msg);
+        return;
+    }
+
+    board.error = msg;
+    _boardProgress(board, board.percentage, tr("Failed: %1").arg(msg));
+}
+
+// Helper: create a DfuWrapper, find the device, run the transfer, clean up.
+bool DfuThread::runDfu(Board &board, const QString &altSetting, const std::function<bool(DfuWrapper &)> &transfer)
 {
     DfuWrapper *dfu = new DfuWrapper(nullptr);
+    dfu->setUsbPath(board.usbPath);
 
     bool ok = dfu->initialize()
            && dfu->findDevice(DfuWrapper::TI_VENDOR_ID, DfuWrapper::TI_PRODUCT_ID, altSetting)
-           && (resetAfter ? dfu->downloadFile(filePath, true)
-                          : dfu->downloadFileStreaming(filePath));
+           && transfer(*dfu);
+
+    /* The board keeps its USB path while it re-enumerates between stages */
+    if (board.usbPath.isEmpty())
+        board.usbPath = dfu->usbPath();
 
-    if (!ok)
-        emit error(tr("DFU failed (alt: %1): %2").arg(altSetting, dfu->lastError()));
+    /* A failing pipeline has reported its own error */
+    if (!ok && !_cancelled)
+        _boardFailed(board, tr("DFU failed (alt: %1): %2").arg(altSetting, dfu->lastError()));
 
     dfu->cleanup();
     delete dfu;
     return ok;
 }
 
-bool DfuThread::sendBootloaderFiles()
+bool DfuThread::sendBootloaderFiles(Board &board)
 {
     const char *altSettings[] = {
         DfuWrapper::ALT_BOOTLOADER,
@@ -124,15 +433,15 @@ bool DfuThread::sendBootloaderFiles()
     };
 
     for (int i = 0; i < 3; i++) {
-        emit dfuProgress(45 + i * 10, tr("Sending %1...").arg(altSettings[i]));
-        if (!runDfu(altSettings[i], _bootloaderFiles[i], true))
+        _boardProgress(board, 45 + i * 10, tr("Sending %1...").arg(altSettings[i]));
+        const QString &file = _bootloaderFiles[i];
+        if (!runDfu(board, altSettings[i], [&file](DfuWrapper &dfu) { return dfu.downloadFile(file, true); }))
             return false;
-        emit dfuProgress(55 + i * 10, tr("%1 sent").arg(altSettings[i]));
+        _boardProgress(board, 55 + i * 10, tr("%1 sent").arg(altSettings[i]));
 
-        if (i < 2) {
-            emit dfuProgress(55 + i * 10, tr("Waiting for device to reconnect..."));
-            QThread::sleep(2);
-        }
+        /* The next stage finds the device as soon as it re-enumerates with its alt setting */
+        if (i < 2)
+            _boardProgress(board, 55 + i * 10, tr("Waiting for device to reconnect..."));
     }
 
     return true;
@@ -142,18 +451,16 @@ bool DfuThread::extractBootloaderFromImage()
 {
     QStringList fileNames = {"tiboot3.bin", "tispl.bin", "u-boot.img"};
 
-    if (_file.isOpen())
-        _file.close();
-
-    _file.setFileName(_tempImagePath.replace("\\", "/"));
-    if (!_file.open(QIODevice::ReadOnly)) {
-        emit error(tr("Failed to reopen image file: %1").arg(_file.errorString()));
-        return false;
-    }
-
     try {
-        _file.seek(0);
-        DeviceWrapper dw(&_file);
+        /* Seekable images give the boot partition without waiting for the stream to get there */
+        QScopedPointer<ImageSource> src(ImageSource::open(QUrl::fromEncoded(_url), _useragent));
+        DeviceWrapper::BlockReader read = [this](char *buf, quint64 size, quint64 offset) {
+            _readBootPartition(buf, size, offset);
+        };
+        if (src)
+            read = src->blockReader();
+
+        DeviceWrapper dw(read);
         DeviceWrapperFatPartition *fat = dw.fatPartition(1);
 
         for (int i = 0; i < 3; i++) {
@@ -184,18 +491,24 @@ bool DfuThread::extractBootloaderFromImage()
         }
     }
     catch (std::exception &e) {
-        emit error(tr("Error reading bootloader files from image: %1").arg(e.what()));
+        /* A failing pipeline has reported its own error */
+        if (!_cancelled)
+            emit error(tr("Error reading bootloader files from image: %1").arg(e.what()));
         return false;
     }
 
     return true;
 }
 
-bool DfuThread::sendImageToRawemmc()
+bool DfuThread::sendImageToRawemmc(Board &board)
 {
-    if (!QFile::exists(_tempImagePath)) {
-        emit error(tr("Image not found: %1").arg(_tempImagePath));
-        return false;
-    }
-    return runDfu(DfuWrapper::ALT_RAWEMMC, _tempImagePath, false);
+    return runDfu(board, DfuWrapper::ALT_RAWEMMC, [this, &board](DfuWrapper &dfu) {
+        auto read = [this, &board](char *buf, qint64 maxlen) { return _readStream(board, buf, maxlen); };
+        if (!dfu.downloadStream(read, 0, [this, &board]() { _stopStreaming(board); }))
+            return false;
+
+        if (!dfu.waitForDisconnect(DFU_DETACH_TIMEOUT_MSEC))
+            qDebug() << "Device" << board.usbPath << "still in DFU mode" << DFU_DETACH_TIMEOUT_MSEC << "ms after detach";
+        return true;
+    });
 }
@@ -8,7 +8,23 @@
 
 #include "downloadextractthread.h"
 #include <QTemporaryFile>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <mutex>
+#include <vector>
 
+class DfuWrapper;
+
+/*
+ * Decoded image blocks are not written to local disk, but handed from the extract
+ * pipeline to the rawemmc DFU transfer through a bounded queue.
+ * The boot partition at the start of the image is kept in memory and readable while it is
+ * being decoded, so the bootloader stages run while the rest of the image is still downloading.
+ *
+ * Every TI board in DFU mode at the start is flashed in parallel from the same stream,
+ * each pinned to its USB path. The stream advances at the pace of the slowest board.
+ */
 class DfuThread : public DownloadExtractThread
 {
     Q_OBJECT
@@ -18,23 +34,57 @@ public:
     ~DfuThread();
 
     bool isImage() override;
+    void cancelDownload() override;
+    size_t _writeFile(const char *buf, size_t len) override;
 
 signals:
     void dfuProgress(int percentage, QString statusMsg);
+    /* Only when several boards are flashed, dfuProgress() then carries the slowest board and a summary */
+    void boardProgress(QString usbPath, int percentage, QString statusMsg);
 
 protected:
     void run() override;
     bool _openAndPrepareDevice() override;
+    void _writeComplete() override;
+    void _onDownloadError(const QString &msg) override;
 
 private:
+    struct Board
+    {
+        QString usbPath;            // empty: whichever TI device shows up first
+        qint64 position{0};         // next image byte to send in the rawemmc stage
+        bool streaming{true};       // holds back the shared stream until it has sent it
+        bool done{false};
+        int percentage{0};
+        QString status, error;
+    };
+
     QString _bootloaderFiles[3];
-    QTemporaryFile *_tempImageFile;
-    QString _tempImagePath;
+    std::vector<Board> _boards;
+    std::mutex _progressMutex;
+
+    std::mutex _streamMutex;
+    std::condition_variable _streamCond;
+    std::deque<QByteArray> _streamQueue;
+    qint64 _streamQueued{0}, _streamQueueStart{0};
+    QByteArray _bootPrefix;
+    qint64 _bootPrefixSize{-1};
+    bool _bootPrefixReleased{false}, _streamEnded{false}, _streamFailed{false};
+
+    void _failStream();
+    void _trimStream();
+    void _stopStreaming(Board &board);
+    void _readBootPartition(char *buf, quint64 size, quint64 offset);
+    qint64 _readStream(Board &board, char *buf, qint64 maxlen);
+
+    void _boardProgress(Board &board, int percentage, const QString &msg);
+    void _boardFailed(Board &board, const QString &msg);
+    void _flashBoard(Board &board);
 
-    bool runDfu(const QString &altSetting, const QString &filePath, bool resetAfter);
+    bool runDfu(Board &board, const QString &altSetting, const std::function<bool(DfuWrapper &)> &transfer);
     bool extractBootloaderFromImage();
-    bool sendBootloaderFiles();
-    bool sendImageToRawemmc();
+    bool sendBootloaderFiles(Board &board);
+    bool sendImageToRawemmc(Board &board);
 };
 
 #endif // DFUTHREAD_H
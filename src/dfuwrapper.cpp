@@ -4,9 +4,16 @@
  */
 
 #include "dfuwrapper.h"
+#include "config.h"
+#include <QDeadlineTimer>
 #include <QDebug>
+#include <QElapsedTimer>
 #include <QFile>
+#include <QScopedPointer>
 #include <QThread>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <string.h>
 #include <stdlib.h>
 
@@ -18,31 +25,88 @@ extern "C" {
 #include "dfu_util.h"
 }
 
-// dfu-util global state
+// dfu-util log level, the only state it still keeps globally
 extern "C" {
     int verbose = 0;
-    struct dfu_if *dfu_root = nullptr;
-    char *match_path = nullptr;
-    int match_vendor = -1;
-    int match_product = -1;
-    int match_vendor_dfu = -1;
-    int match_product_dfu = -1;
-    int match_config_index = -1;
-    int match_iface_index = -1;
-    int match_iface_alt_index = -1;
-    int match_devnum = -1;
-    const char *match_iface_alt_name = nullptr;
-    const char *match_serial = nullptr;
-    const char *match_serial_dfu = nullptr;
+}
+
+struct HotplugState
+{
+    bool arrived = false;
+    bool left = false;
+    libusb_device *device = nullptr;
+};
+
+static int LIBUSB_CALL onHotplug(libusb_context *, libusb_device *dev, libusb_hotplug_event event, void *userData)
+{
+    HotplugState *state = static_cast<HotplugState *>(userData);
+
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+        state->arrived = true;
+    else if (!state->device || dev == state->device)
+        state->left = true;
+
+    return 0;
 }
 
 DfuWrapper::DfuWrapper(QObject *parent)
-    : QObject(parent), usbContext(nullptr), dfuDevice(nullptr), initialized(false)
-{}
+    : QObject(parent), usbContext(nullptr), dfuDevice(nullptr), initialized(false), _ctx(new dfu_ctx)
+{
+    dfu_ctx_init(_ctx);
+}
 
 DfuWrapper::~DfuWrapper()
 {
     cleanup();
+    delete _ctx;
+}
+
+void DfuWrapper::setUsbPath(const QString &path)
+{
+    _usbPathBytes = path.toLatin1();
+    _ctx->match_path = path.isEmpty() ? nullptr : _usbPathBytes.constData();
+}
+
+void DfuWrapper::setSerial(const QString &serial)
+{
+    _serialBytes = serial.toUtf8();
+    _ctx->match_serial = serial.isEmpty() ? nullptr : _serialBytes.constData();
+}
+
+QString DfuWrapper::usbPath() const
+{
+    if (!dfuDevice)
+        return QString();
+
+    char path[MAX_PATH_LEN];
+    const char *p = get_path(dfuDevice->dev, path, sizeof(path));
+    return p ? QString::fromLatin1(p) : QString();
+}
+
+QStringList DfuWrapper::devicePaths(int vendorId, int productId)
+{
+    QStringList paths;
+    libusb_context *ctx;
+    if (libusb_init(&ctx) < 0)
+        return paths;
+
+    libusb_device **list;
+    ssize_t count = libusb_get_device_list(ctx, &list);
+    for (ssize_t i = 0; i < count; i++) {
+        struct libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(list[i], &desc) || desc.idVendor != vendorId || desc.idProduct != productId)
+            continue;
+
+        char path[MAX_PATH_LEN];
+        const char *p = get_path(list[i], path, sizeof(path));
+        if (p && *p)
+            paths.append(QString::fromLatin1(p));
+    }
+    if (count >= 0)
+        libusb_free_device_list(list, 1);
+
+    libusb_exit(ctx);
+    return paths;
 }
 
 void DfuWrapper::setError(const QString &msg)
@@ -67,45 +131,79 @@ bool DfuWrapper::initialize()
     return true;
 }
 
-bool DfuWrapper::findDevice(int vendorId, int productId, const QString &altSettingName)
+bool DfuWrapper::findDevice(int vendorId, int productId, const QString &altSettingName, int timeoutMsecs)
 {
     if (!initialized) {
         setError("DFU not initialized");
         return false;
     }
 
-    match_vendor  = vendorId;
-    match_product = productId;
+    _ctx->match_vendor  = vendorId;
+    _ctx->match_product = productId;
 
     _altNameBytes = altSettingName.toUtf8();
-    match_iface_alt_name = altSettingName.isEmpty() ? nullptr : _altNameBytes.constData();
-
-    for (int attempt = 0; attempt < 15; attempt++) {
-        if (attempt > 0) {
-            qDebug() << "Retry" << attempt << "searching for DFU device...";
-            QThread::sleep(1);
+    _ctx->match_iface_alt_name = altSettingName.isEmpty() ? nullptr : _altNameBytes.constData();
+
+    /* Probe right away, then again whenever a matching device arrives on the bus */
+    HotplugState state;
+    libusb_hotplug_callback_handle hotplugHandle = 0;
+    bool hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)
+            && libusb_hotplug_register_callback(usbContext, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+                                                vendorId, productId, LIBUSB_HOTPLUG_MATCH_ANY,
+                                                onHotplug, &state, &hotplugHandle) == LIBUSB_SUCCESS;
+
+    QDeadlineTimer deadline(timeoutMsecs);
+    QDeadlineTimer nextProbe(0);
+    bool found = false;
+    int openRet = 0;
+
+    while (true) {
+        if (state.arrived || nextProbe.hasExpired()) {
+            state.arrived = false;
+            disconnect_devices(_ctx);
+            probe_devices(_ctx, usbContext);
+
+            /* A device that is still going away fails to open, keep waiting for its successor */
+            if (_ctx->dfu_root) {
+                openRet = libusb_open(_ctx->dfu_root->dev, &_ctx->dfu_root->dev_handle);
+                if (openRet == 0) {
+                    found = true;
+                    break;
+                }
+            }
+            nextProbe.setRemainingTime(DFU_PROBE_INTERVAL_MSEC);
         }
-        disconnect_devices();
-        probe_devices(usbContext);
-        if (dfu_root)
+
+        if (deadline.hasExpired())
             break;
+
+        qint64 waitMs = qMin(deadline.remainingTime(), nextProbe.remainingTime());
+        if (hotplug) {
+            struct timeval tv = { (long) (waitMs / 1000), (long) ((waitMs % 1000) * 1000) };
+            libusb_handle_events_timeout_completed(usbContext, &tv, nullptr);
+        } else {
+            QThread::msleep(waitMs);
+        }
     }
 
-    if (!dfu_root) {
-        setError(QString("No DFU device found (VID:0x%1 PID:0x%2 alt:%3) after 15 retries")
+    if (hotplug)
+        libusb_hotplug_deregister_callback(usbContext, hotplugHandle);
+
+    if (!found && openRet < 0) {
+        setError(QString("Failed to open DFU device: %1").arg(libusb_error_name(openRet)));
+        return false;
+    }
+    if (!found) {
+        setError(QString("No DFU device found (VID:0x%1 PID:0x%2 alt:%3%4) within %5 seconds")
                 .arg(vendorId, 4, 16, QChar('0'))
                 .arg(productId, 4, 16, QChar('0'))
-                .arg(altSettingName));
+                .arg(altSettingName)
+                .arg(_usbPathBytes.isEmpty() ? QString() : " path:" + QString::fromLatin1(_usbPathBytes))
+                .arg(timeoutMsecs / 1000));
         return false;
     }
 
-    dfuDevice = dfu_root;
-
-    int ret = libusb_open(dfuDevice->dev, &dfuDevice->dev_handle);
-    if (ret < 0) {
-        setError(QString("Failed to open DFU device: %1").arg(libusb_error_name(ret)));
-        return false;
-    }
+    dfuDevice = _ctx->dfu_root;
 
     emit statusMessage(QString("Found DFU device: %1:%2 alt:%3")
                       .arg(dfuDevice->vendor, 4, 16, QChar('0'))
@@ -114,6 +212,54 @@ bool DfuWrapper::findDevice(int vendorId, int productId, const QString &altSetti
     return true;
 }
 
+bool DfuWrapper::waitForDisconnect(int timeoutMsecs)
+{
+    if (!dfuDevice)
+        return true;
+
+    HotplugState state;
+    state.device = dfuDevice->dev;
+    libusb_hotplug_callback_handle hotplugHandle = 0;
+    bool hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)
+            && libusb_hotplug_register_callback(usbContext, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_NO_FLAGS,
+                                                dfuDevice->vendor, dfuDevice->product, LIBUSB_HOTPLUG_MATCH_ANY,
+                                                onHotplug, &state, &hotplugHandle) == LIBUSB_SUCCESS;
+
+    QDeadlineTimer deadline(timeoutMsecs);
+    while (!state.left && !deadline.hasExpired()) {
+        qint64 waitMs = qMin<qint64>(deadline.remainingTime(), DFU_PROBE_INTERVAL_MSEC);
+        if (hotplug) {
+            struct timeval tv = { (long) (waitMs / 1000), (long) ((waitMs % 1000) * 1000) };
+            libusb_handle_events_timeout_completed(usbContext, &tv, nullptr);
+        } else {
+            QThread::msleep(waitMs);
+        }
+
+        if (!state.left && !isConnected(state.device))
+            state.left = true;
+    }
+
+    if (hotplug)
+        libusb_hotplug_deregister_callback(usbContext, hotplugHandle);
+
+    return state.left;
+}
+
+bool DfuWrapper::isConnected(struct libusb_device *device)
+{
+    libusb_device **list;
+    ssize_t count = libusb_get_device_list(usbContext, &list);
+    if (count < 0)
+        return true;
+
+    bool connected = false;
+    for (ssize_t i = 0; i < count && !connected; i++)
+        connected = (list[i] == device);
+
+    libusb_free_device_list(list, 1);
+    return connected;
+}
+
 // Claim the USB interface and put the device in a known good state.
 // Caller is responsible for releasing the interface on success.
 bool DfuWrapper::claimInterface()
@@ -214,6 +360,39 @@ bool DfuWrapper::downloadFile(const QString &filePath, bool resetAfter)
 }
 
 bool DfuWrapper::downloadFileStreaming(const QString &filePath)
+{
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        setError(QString("Failed to open file: %1").arg(filePath));
+        return false;
+    }
+
+    return downloadStream([&file](char *buf, qint64 maxlen) -> qint64 {
+        qint64 bytesRead = 0;
+        while (bytesRead < maxlen && !file.atEnd()) {
+            qint64 r = file.read(buf + bytesRead, maxlen - bytesRead);
+            if (r < 0)
+                return -1;
+            bytesRead += r;
+        }
+        return bytesRead;
+    }, file.size());
+}
+
+/* msleep() can overshoot by a scheduler tick, so sleep short of the deadline and yield for the rest */
+static void preciseSleep(qint64 usecs)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    if (usecs > 1000)
+        QThread::usleep(usecs - 1000);
+    while (timer.nsecsElapsed() < usecs * 1000)
+        QThread::yieldCurrentThread();
+}
+
+bool DfuWrapper::downloadStream(const std::function<qint64(char *, qint64)> &read, qint64 totalSize,
+                                const std::function<void()> &stopRead)
 {
     if (!dfuDevice || !dfuDevice->dev_handle) {
         setError("No DFU device");
@@ -223,52 +402,107 @@ bool DfuWrapper::downloadFileStreaming(const QString &filePath)
     if (!claimInterface())
         return false;
 
-    QFile file(filePath);
-    if (!file.open(QIODevice::ReadOnly)) {
-        setError(QString("Failed to open file: %1").arg(filePath));
-        libusb_release_interface(dfuDevice->dev_handle, dfuDevice->interface);
-        return false;
-    }
-
-    qint64 fileSize = file.size();
     int xfer_size = getTransferSize();
-    if (xfer_size <= 0)
-        xfer_size = 4096;
 
     // U-Boot's rawemmc alt-setting can take minutes to flush its DFU buffer to eMMC
     dfu_set_timeout(300000);
 
-    emit statusMessage(QString("Streaming %1 MB to device (this may take several minutes)...")
-                       .arg(fileSize / 1024 / 1024));
+    if (totalSize > 0)
+        emit statusMessage(QString("Streaming %1 MB to device (this may take several minutes)...")
+                           .arg(totalSize / 1024 / 1024));
+    else
+        emit statusMessage("Streaming image to device (this may take several minutes)...");
+
+    /* Read-ahead, so reading the source overlaps with the USB transfers */
+    std::mutex readMutex;
+    std::condition_variable readCond;
+    std::deque<QByteArray> readBlocks;
+    bool readEnded = false, readFailed = false, readStop = false;
+    const qint64 blockSize = (DFU_READAHEAD_BLOCKSIZE / xfer_size) * xfer_size;
+
+    QScopedPointer<QThread> reader(QThread::create([&]() {
+        while (true) {
+            QByteArray block(blockSize, Qt::Uninitialized);
+            qint64 bytesRead = read(block.data(), blockSize);
+
+            std::unique_lock<std::mutex> lock(readMutex);
+            if (bytesRead < 0) {
+                readFailed = true;
+                break;
+            }
+            if (bytesRead > 0) {
+                block.truncate(bytesRead);
+                readCond.wait(lock, [&]() { return readBlocks.size() < DFU_READAHEAD_BLOCKS || readStop; });
+                if (readStop)
+                    break;
+                readBlocks.push_back(block);
+                readCond.notify_all();
+            }
+            if (bytesRead < blockSize) {
+                readEnded = true;
+                break;
+            }
+        }
+        readCond.notify_all();
+    }));
+    reader->start();
+
+    _stats = TransferStats();
+    _stats.transferSize = xfer_size;
+    QElapsedTimer elapsed, chunkTimer;
+    elapsed.start();
 
-    QByteArray buf(xfer_size, 0);
+    QByteArray block;
+    qint64 blockOffset = 0;
     unsigned short transaction = 0;
     qint64 bytesSent = 0;
     bool ok = true;
 
-    while (bytesSent < fileSize && ok) {
-        qint64 bytesRead = file.read(buf.data(), qMin((qint64)xfer_size, fileSize - bytesSent));
-        if (bytesRead <= 0) {
-            setError("File read error during streaming");
-            ok = false;
-            break;
+    while (ok) {
+        if (blockOffset == block.size()) {
+            chunkTimer.start();
+            std::unique_lock<std::mutex> lock(readMutex);
+            readCond.wait(lock, [&]() { return !readBlocks.empty() || readEnded || readFailed; });
+            _stats.sourceWaitUs += chunkTimer.nsecsElapsed() / 1000;
+
+            if (readBlocks.empty()) {
+                if (readFailed) {
+                    setError("Image read error during streaming");
+                    ok = false;
+                }
+                break;
+            }
+            block = readBlocks.front();
+            readBlocks.pop_front();
+            blockOffset = 0;
+            readCond.notify_all();
         }
 
+        // Only the last packet may be shorter than wTransferSize
+        qint64 len = qMin<qint64>(xfer_size, block.size() - blockOffset);
+
+        chunkTimer.start();
         int ret = dfu_download(dfuDevice->dev_handle, dfuDevice->interface,
-                               (unsigned short)bytesRead, transaction++,
-                               (unsigned char *)buf.data());
+                               (unsigned short)len, transaction++,
+                               (unsigned char *)block.data() + blockOffset);
         if (ret < 0) {
             setError(QString("Download error: %1").arg(libusb_error_name(ret)));
             ok = false;
             break;
         }
+        qint64 dnloadUs = chunkTimer.nsecsElapsed() / 1000;
+        _stats.dnloadUs += dnloadUs;
+        _stats.dnloadMaxUs = qMax(_stats.dnloadMaxUs, dnloadUs);
 
-        bytesSent += bytesRead;
+        blockOffset += len;
+        bytesSent += len;
 
-        // Poll until device is ready for the next chunk
+        // Poll until device is ready for the next chunk, the next GET_STATUS is due after bwPollTimeout
         struct dfu_status dst;
+        chunkTimer.start();
         do {
             ret = dfu_get_status(dfuDevice, &dst);
+            _stats.statusPolls++;
             if (ret < 0) {
                 setError(QString("Status poll error: %1").arg(libusb_error_name(ret)));
                 ok = false;
@@ -276,9 +510,14 @@ bool DfuWrapper::downloadFileStreaming(const QString &filePath)
             }
             if (dst.bState == DFU_STATE_dfuDNLOAD_IDLE || dst.bState == DFU_STATE_dfuERROR)
                 break;
-            QThread::msleep(dst.bwPollTimeout > 0 ? dst.bwPollTimeout : 1);
+            preciseSleep(dst.bwPollTimeout * 1000LL);
         } while (1);
 
+        qint64 busyUs = chunkTimer.nsecsElapsed() / 1000;
+        _stats.busyUs += busyUs;
+        _stats.busyMaxUs = qMax(_stats.busyMaxUs, busyUs);
+        _stats.chunks++;
+
         if (!ok) break;
 
         if (dst.bStatus != DFU_STATUS_OK) {
@@ -287,12 +526,35 @@ bool DfuWrapper::downloadFileStreaming(const QString &filePath)
             break;
         }
 
-        if ((bytesSent % (10LL * 1024 * 1024)) < xfer_size || bytesSent == fileSize)
-            emit statusMessage(QString("Transferred %1 / %2 MB...")
-                               .arg(bytesSent / 1024 / 1024).arg(fileSize / 1024 / 1024));
+        if ((bytesSent % (10LL * 1024 * 1024)) < xfer_size || bytesSent == totalSize) {
+            if (totalSize > 0)
+                emit statusMessage(QString("Transferred %1 / %2 MB...")
+                                   .arg(bytesSent / 1024 / 1024).arg(totalSize / 1024 / 1024));
+            else
+                emit statusMessage(QString("Transferred %1 MB...").arg(bytesSent / 1024 / 1024));
+        }
     }
 
-    file.close();
+    bool readDone;
+    {
+        std::lock_guard<std::mutex> lock(readMutex);
+        readStop = true;
+        readDone = readEnded || readFailed;
+    }
+    readCond.notify_all();
+    /* The reader may be blocked inside read() itself, waiting for image data */
+    if (!readDone && stopRead)
+        stopRead();
+    reader->wait();
+
+    _stats.bytes = bytesSent;
+    _stats.elapsedUs = elapsed.nsecsElapsed() / 1000;
+    _logTransferStats();
+
+    if (!ok) {
+        // Leave the half written image unterminated, the device must not treat it as complete
+        dfu_abort(dfuDevice->dev_handle, dfuDevice->interface);
+    }
 
     if (ok) {
         // Zero-length packet signals end of transfer
@@ -342,7 +604,7 @@ void DfuWrapper::cleanup()
         libusb_close(dfuDevice->dev_handle);
         dfuDevice->dev_handle = nullptr;
     }
-    disconnect_devices();
+    disconnect_devices(_ctx);
     dfuDevice = nullptr;
 
     if (usbContext) {
@@ -356,6 +618,25 @@ int DfuWrapper::getTransferSize()
 {
     if (!dfuDevice)
         return 0;
-    int size = dfuDevice->func_dfu.wTransferSize;
-    return size > 0 ? size : 1024;
+
+    /* The largest the device accepts, within what the libusb backends allow for one control transfer */
+    int size = qMin<int>(libusb_le16_to_cpu(dfuDevice->func_dfu.wTransferSize), DFU_MAX_CONTROL_TRANSFER);
+    if (size <= 0)
+        size = DFU_MAX_CONTROL_TRANSFER;
+    return qMax<int>(size, dfuDevice->bMaxPacketSize0);
+}
+
+void DfuWrapper::_logTransferStats()
+{
+    if (!_stats.chunks)
+        return;
+
+    qint64 elapsedUs = qMax<qint64>(_stats.elapsedUs, 1);
+    qDebug() << "DFU transfer:" << _stats.bytes << "bytes in" << _stats.chunks << "chunks of" << _stats.transferSize
+             << "at" << _stats.bytes / elapsedUs << "MB/s";
+    qDebug() << "  DNLOAD avg/max us:" << _stats.dnloadUs / _stats.chunks << "/" << _stats.dnloadMaxUs
+             << " device busy avg/max us:" << _stats.busyUs / _stats.chunks << "/" << _stats.busyMaxUs
+             << " GET_STATUS per chunk:" << (double) _stats.statusPolls / _stats.chunks;
+    qDebug() << "  Time waiting for image data:" << _stats.sourceWaitUs * 100 / elapsedUs << "%"
+             << "(device bound if close to 0)";
 }
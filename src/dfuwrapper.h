@@ -8,9 +8,15 @@
 
 #include <QString>
 #include <QObject>
+#include <QStringList>
+#include <functional>
+
+#include "config.h"
 
 struct dfu_if;
+struct dfu_ctx;
 struct libusb_context;
+struct libusb_device;
 
 class DfuWrapper : public QObject
 {
@@ -28,11 +34,60 @@ public:
     explicit DfuWrapper(QObject *parent = nullptr);
     ~DfuWrapper();
 
+    /*
+     * USB paths ("bus-port.port...") of the connected devices with this id.
+     * The path stays the same while a board re-enumerates between DFU stages.
+     */
+    static QStringList devicePaths(int vendorId, int productId);
+
+    /*
+     * Restrict findDevice() to the device at this USB path or with this serial, empty matches any
+     */
+    void setUsbPath(const QString &path);
+    void setSerial(const QString &serial);
+    QString usbPath() const;
+
     bool initialize();
-    bool findDevice(int vendorId, int productId, const QString &altSettingName);
+    /*
+     * Waits up to timeoutMsecs for the device to (re)enumerate with the alt setting,
+     * woken by libusb hotplug events where the platform supports them
+     */
+    bool findDevice(int vendorId, int productId, const QString &altSettingName,
+                    int timeoutMsecs = DFU_ENUMERATION_TIMEOUT_MSEC);
+
+    /*
+     * Waits up to timeoutMsecs for the found device to drop off the bus, e.g. after a detach
+     */
+    bool waitForDisconnect(int timeoutMsecs);
     bool downloadFile(const QString &filePath, bool resetAfter = true);
     bool downloadFileStreaming(const QString &filePath);
 
+    /*
+     * Streams an image of unknown length to the device.
+     * read() fills up to maxlen bytes, returning fewer only at the end of the image, 0 at the end or -1 on failure.
+     * On failure the transfer is aborted without the terminating zero-length packet.
+     * stopRead() is called when the transfer stops before the end of the image, it must make a read()
+     * that is still blocked return soon.
+     */
+    bool downloadStream(const std::function<qint64(char *buf, qint64 maxlen)> &read, qint64 totalSize = 0,
+                        const std::function<void()> &stopRead = {});
+
+    /*
+     * Timing of the last streamed download, to tell whether the host or the device is the bottleneck
+     */
+    struct TransferStats
+    {
+        qint64 bytes{0};
+        int chunks{0};
+        int transferSize{0};
+        qint64 elapsedUs{0};
+        qint64 sourceWaitUs{0};                 // waiting for the read-ahead to deliver image data
+        qint64 dnloadUs{0}, dnloadMaxUs{0};     // DFU_DNLOAD control transfers
+        qint64 busyUs{0}, busyMaxUs{0};         // GET_STATUS until the device is idle again
+        int statusPolls{0};
+    };
+    TransferStats transferStats() const { return _stats; }
+
     QString lastError() const { return _lastError; }
     void cleanup();
 
@@ -44,11 +99,15 @@ private:
     struct dfu_if *dfuDevice;
     bool initialized;
     QString _lastError;
-    QByteArray _altNameBytes;
+    QByteArray _altNameBytes, _usbPathBytes, _serialBytes;
+    struct dfu_ctx *_ctx;
+    TransferStats _stats;
 
     int  getTransferSize();
     void setError(const QString &msg);
     bool claimInterface();
+    bool isConnected(struct libusb_device *device);
+    void _logTransferStats();
 };
 
 #endif // DFUWRAPPER_H
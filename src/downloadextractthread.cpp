@@ -147,13 +147,20 @@ void DownloadExtractThread::extractImageRun()
     archive_read_support_format_zip(a);
     archive_read_support_format_7zip(a);
     archive_read_support_format_raw(a); // for .gz and such
-    archive_read_open(a, this, NULL, &DownloadExtractThread::_archive_read, &DownloadExtractThread::_archive_close);
+    _openArchive(a);
 
     try
     {
         r = archive_read_next_header(a, &entry);
         _checkResult(r, a);
 
+        /* Entries in front of the image, skipping them only costs a seek with the zip central directory */
+        for (int i = 0; i < _imageEntry; i++)
+        {
+            r = archive_read_next_header(a, &entry);
+            _checkResult(r, a);
+        }
+
         while (true)
         {
             ssize_t size = archive_read_data(a, _abuf[_activeBuf], _abufsize);
@@ -294,11 +301,9 @@ void DownloadExtractThread::extractMultiFileRun()
 
     QString currentDir;
     struct archive *a = archive_read_new();
-    struct archive *ext = archive_write_disk_new();
-    struct archive_entry *entry;
     /* Extra safety checks: do not allow existing files to be overwritten (SD card should be formatted by previous step),
      * do not allow absolute paths, do not allow insecure symlinks, no special permissions */
-    int r, flags = ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS
+    int flags = ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS
             | ARCHIVE_EXTRACT_SECURE_NODOTDOT | ARCHIVE_EXTRACT_SECURE_SYMLINKS | ARCHIVE_EXTRACT_NO_OVERWRITE
             /*ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_ACL | ARCHIVE_EXTRACT_FFLAGS | ARCHIVE_EXTRACT_XATTR*/;
 #ifndef Q_OS_WIN
@@ -317,40 +322,43 @@ void DownloadExtractThread::extractMultiFileRun()
 
     archive_read_support_filter_all(a);
     archive_read_support_format_all(a);
-    archive_write_disk_set_options(ext, flags);
-    archive_read_open(a, this, NULL, &DownloadExtractThread::_archive_read, &DownloadExtractThread::_archive_close);
+    _openArchive(a);
 
     try
     {
-        while ( (r = archive_read_next_header(a, &entry)) != ARCHIVE_EOF)
+        /* Zip entries are compressed independently, further readers of the local file extract every n-th one */
+        QVector<QStringList> workerFiles(_entryWorkers), workerDirs(_entryWorkers);
+        QList<QFuture<QString>> workers;
+        for (int w = 1; w < _entryWorkers; w++)
         {
-          _checkResult(r, a);
-          r = archive_write_header(ext, entry);
-          if (r < ARCHIVE_OK)
-              qDebug() << archive_error_string(ext);
-          else if (archive_entry_size(entry) > 0)
-          {
-              //checkResult(copyData(a, ext), a);
-              const void *buff;
-              size_t size;
-              int64_t offset;
-              QString filename = QString::fromWCharArray(archive_entry_pathname_w(entry));
-
-              if (archive_entry_filetype(entry) == AE_IFDIR) // Empty directory
-                  dirExtracted.append(filename);
-              else
-                  filesExtracted.append(filename);
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+            workers.append(QtConcurrent::run(&DownloadExtractThread::_extractEntriesWorker, this, w, flags, &workerFiles[w], &workerDirs[w]));
+#else
+            workers.append(QtConcurrent::run(this, &DownloadExtractThread::_extractEntriesWorker, w, flags, &workerFiles[w], &workerDirs[w]));
+#endif
+        }
 
-              while ( (r = archive_read_data_block(a, &buff, &size, &offset)) != ARCHIVE_EOF)
-              {
-                  _checkResult(r, a);
-                  _checkResult(archive_write_data_block(ext, buff, size, offset), ext);
-                  _bytesWritten += size;
-              }
-          }
-          _checkResult(archive_write_finish_entry(ext), ext);
+        QString extractError;
+        try
+        {
+            _extractEntries(a, flags, 0, filesExtracted, dirExtracted);
         }
+        catch (exception &e)
+        {
+            extractError = e.what();
+        }
+        for (int w = 1; w < _entryWorkers; w++)
+        {
+            QString workerError = workers[w-1].result();
+            if (extractError.isEmpty())
+                extractError = workerError;
+            filesExtracted += workerFiles[w];
+            dirExtracted += workerDirs[w];
+        }
+        if (!extractError.isEmpty())
+            throw runtime_error(extractError.toStdString());
 
+        _inputHashFuture.waitForFinished();
         QByteArray computedHash = _inputHash.result().toHex();
         qDebug() << "Hash of compressed multi-file zip:" << computedHash;
         if (!_expectedHash.isEmpty() && _expectedHash != computedHash)
@@ -402,7 +410,6 @@ void DownloadExtractThread::extractMultiFileRun()
     }
 
     archive_read_free(a);
-    archive_write_free(ext);
     QDir::setCurrent(currentDir);
 
 #ifdef Q_OS_LINUX
@@ -419,6 +426,99 @@ void DownloadExtractThread::extractMultiFileRun()
     eject_disk(_filename.constData());
 }
 
+/* Extracts the entries whose index modulo _entryWorkers is worker, throws on errors */
+void DownloadExtractThread::_extractEntries(struct archive *a, int flags, int worker, QStringList &filesExtracted, QStringList &dirExtracted)
+{
+    struct archive *ext = archive_write_disk_new();
+    struct archive_entry *entry;
+    int r;
+
+    archive_write_disk_set_options(ext, flags);
+
+    try
+    {
+        for (int index = 0; (r = archive_read_next_header(a, &entry)) != ARCHIVE_EOF; index++)
+        {
+          /* Additional readers work on the file directly, cancelling does not make their reads fail */
+          if (_cancelled)
+              throw runtime_error("Extraction cancelled");
+          _checkResult(r, a);
+          if (index % _entryWorkers != worker)
+              continue;
+
+          r = archive_write_header(ext, entry);
+          if (r < ARCHIVE_OK)
+              qDebug() << archive_error_string(ext);
+          else if (archive_entry_size(entry) > 0)
+          {
+              //checkResult(copyData(a, ext), a);
+              const void *buff;
+              size_t size;
+              int64_t offset;
+              QString filename = QString::fromWCharArray(archive_entry_pathname_w(entry));
+
+              if (archive_entry_filetype(entry) == AE_IFDIR) // Empty directory
+                  dirExtracted.append(filename);
+              else
+                  filesExtracted.append(filename);
+
+              while ( (r = archive_read_data_block(a, &buff, &size, &offset)) != ARCHIVE_EOF)
+              {
+                  if (_cancelled)
+                      throw runtime_error("Extraction cancelled");
+                  _checkResult(r, a);
+                  _checkResult(archive_write_data_block(ext, buff, size, offset), ext);
+                  _bytesWritten += size;
+              }
+          }
+          _checkResult(archive_write_finish_entry(ext), ext);
+        }
+    }
+    catch (exception &)
+    {
+        archive_write_free(ext);
+        throw;
+    }
+
+    archive_write_free(ext);
+}
+
+/* Additional reader of a local multi-file zip, returns an error message or an empty string */
+QString DownloadExtractThread::_extractEntriesWorker(int worker, int flags, QStringList *filesExtracted, QStringList *dirExtracted)
+{
+    struct archive *a = archive_read_new();
+    QByteArray fn = QUrl(_url).toLocalFile().toLocal8Bit();
+    QString result;
+
+    archive_read_support_filter_all(a);
+    archive_read_support_format_all(a);
+
+    try
+    {
+        _checkResult(archive_read_open_filename(a, fn.constData(), IMAGEWRITER_BLOCKSIZE), a);
+        _extractEntries(a, flags, worker, *filesExtracted, *dirExtracted);
+    }
+    catch (exception &e)
+    {
+        result = e.what();
+    }
+
+    archive_read_free(a);
+    return result;
+}
+
+/* Reads through the object oriented callbacks, seeking where the input allows it */
+int DownloadExtractThread::_openArchive(struct archive *a)
+{
+    archive_read_set_callback_data(a, this);
+    archive_read_set_read_callback(a, &DownloadExtractThread::_archive_read);
+    archive_read_set_close_callback(a, &DownloadExtractThread::_archive_close);
+    if (_seekableInput)
+        archive_read_set_seek_callback(a, &DownloadExtractThread::_archive_seek);
+
+    return archive_read_open1(a);
+}
+
 ssize_t DownloadExtractThread::_on_read(struct archive *, const void **buff)
 {
     _buf = _popQueue();
@@ -426,6 +526,11 @@ ssize_t DownloadExtractThread::_on_read(struct archive *, const void **buff)
     return _buf.size();
 }
 
+int64_t DownloadExtractThread::_on_seek(struct archive *, int64_t, int)
+{
+    return ARCHIVE_FATAL;
+}
+
 int DownloadExtractThread::_on_close(struct archive *)
 {
     return 0;
@@ -437,6 +542,11 @@ ssize_t DownloadExtractThread::_archive_read(struct archive *a, void *client_dat
    return qobject_cast<DownloadExtractThread *>((QObject *) client_data)->_on_read(a, buff);
 }
 
+int64_t DownloadExtractThread::_archive_seek(struct archive *a, void *client_data, int64_t offset, int whence)
+{
+   return qobject_cast<DownloadExtractThread *>((QObject *) client_data)->_on_seek(a, offset, whence);
+}
+
 int DownloadExtractThread::_archive_close(struct archive *a, void *client_data)
 {
    return qobject_cast<DownloadExtractThread *>((QObject *) client_data)->_on_close(a);
@@ -48,17 +48,31 @@ protected:
     bool _writeThreadStarted;
     QFuture<size_t> _writeFuture;
 
+    /*
+     * Set by subclasses reading a local file: the input can seek (zip central directory, 7z header),
+     * the index of the image entry, and the number of readers extracting entries side by side
+     */
+    bool _seekableInput{false};
+    int _imageEntry{0}, _entryWorkers{1};
+    /* Hash of the input computed apart from reading it, as seeking makes reads skip and repeat */
+    QFuture<void> _inputHashFuture;
+
     QByteArray _popQueue();
     void _pushQueue(const char *data, size_t len);
     void _cancelExtract();
     virtual size_t _writeData(const char *buf, size_t len);
     virtual void _onDownloadSuccess();
     virtual void _onDownloadError(const QString &msg);
+    int _openArchive(struct archive *a);
+    void _extractEntries(struct archive *a, int flags, int worker, QStringList &filesExtracted, QStringList &dirExtracted);
+    QString _extractEntriesWorker(int worker, int flags, QStringList *filesExtracted, QStringList *dirExtracted);
 
     virtual ssize_t _on_read(struct archive *a, const void **buff);
+    virtual int64_t _on_seek(struct archive *a, int64_t offset, int whence);
     virtual int _on_close(struct archive *a);
 
     static ssize_t _archive_read(struct archive *a, void *client_data, const void **buff);
+    static int64_t _archive_seek(struct archive *a, void *client_data, int64_t offset, int whence);
     static int _archive_close(struct archive *a, void *client_data);
 };
 
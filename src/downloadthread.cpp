@@ -20,9 +20,12 @@
 #include <regex>
 #include <QDebug>
 #include <QProcess>
+#include <QScopeGuard>
 #include <QSettings>
 #include <QtConcurrent/QtConcurrent>
 #include <QtNetwork/QNetworkProxy>
+#include <QtEndian>
+#include <limits>
 
 #ifdef Q_OS_LINUX
 #include <sys/ioctl.h>
@@ -38,7 +41,7 @@ int DownloadThread::_curlCount = 0;
 DownloadThread::DownloadThread(const QByteArray &url, const QByteArray &localfilename, const QByteArray &expectedHash, bool isNormalFile, QObject *parent) :
     QThread(parent), _startOffset(0), _lastDlTotal(0), _lastDlNow(0), _verifyTotal(0), _lastVerifyNow(0), _bytesWritten(0), _lastFailureOffset(0), _sectorsStart(-1), _url(url), _filename(localfilename), _expectedHash(expectedHash),
     _firstBlock(nullptr), _cancelled(false), _successful(false), _verifyEnabled(false), _cacheEnabled(false), _lastModified(0), _serverTime(0),  _lastFailureTime(0),
-    _inputBufferSize(0), _file(NULL), _writehash(OSLIST_HASH_ALGORITHM), _verifyhash(OSLIST_HASH_ALGORITHM), _isNormalFile(isNormalFile)
+    _inputBufferSize(0), _file(NULL), _writehash(OSLIST_HASH_ALGORITHM), _segmentHash(OSLIST_HASH_ALGORITHM), _isNormalFile(isNormalFile)
 {
     if (!_curlCount)
         curl_global_init(CURL_GLOBAL_DEFAULT);
@@ -46,6 +49,7 @@ DownloadThread::DownloadThread(const QByteArray &url, const QByteArray &localfil
 
     QSettings settings;
     _ejectEnabled = settings.value("eject", true).toBool();
+    _differential = settings.value("differentialWrite", false).toBool();
     _suppressSuccessSignal = false;
 }
 
@@ -58,6 +62,8 @@ DownloadThread::~DownloadThread()
 
     if (_firstBlock)
         qFreeAligned(_firstBlock);
+    if (_diffBuf)
+        qFreeAligned(_diffBuf);
 
     if (!--_curlCount)
         curl_global_cleanup();
@@ -81,7 +87,12 @@ void DownloadThread::setUserAgent(const QByteArray &ua)
 /* Curl write callback function, let it call the object oriented version */
 size_t DownloadThread::_curl_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
-    return static_cast<DownloadThread *>(userdata)->_writeData(ptr, size * nmemb);
+    DownloadThread *t = static_cast<DownloadThread *>(userdata);
+
+    if (t->_chunkSize)
+        return t->_receiveChunk(ptr, size * nmemb);
+    else
+        return t->_writeData(ptr, size * nmemb);
 }
 
 int DownloadThread::_curl_xferinfo_callback(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
@@ -244,6 +255,12 @@ bool DownloadThread::_openAndPrepareDevice()
     }
 #endif
 
+    if (_journalEnabled)
+    {
+        _resumeOffset = _checkJournal();
+        _startJournal();
+    }
+
 #ifdef Q_OS_LINUX
     /* Optional optimizations for Linux */
 
@@ -261,7 +278,11 @@ bool DownloadThread::_openAndPrepareDevice()
 
         QByteArray discardmax = _fileGetContentsTrimmed("/sys/block/"+devname+"/queue/discard_max_bytes");
 
-        if (discardmax.isEmpty() || discardmax == "0")
+        if (_resumeOffset || _differential)
+        {
+            qDebug() << "Not discarding, data already on the device is kept";
+        }
+        else if (discardmax.isEmpty() || discardmax == "0")
         {
             qDebug() << "BLKDISCARD not supported";
         }
@@ -295,7 +316,8 @@ bool DownloadThread::_openAndPrepareDevice()
 #endif
 
 #ifndef Q_OS_WIN
-    if (_filename != "uniflash" && !_isNormalFile)
+    /* When resuming, the first block is still zero from the interrupted attempt, as it is written last */
+    if (_filename != "uniflash" && !_isNormalFile && !_resumeOffset)
     {
         // Zero out MBR
         qint64 knownsize = _file.size();
@@ -376,6 +398,18 @@ void DownloadThread::run()
     if (!_useragent.isEmpty())
         curl_easy_setopt(_c, CURLOPT_USERAGENT, _useragent.constData());
 
+    struct curl_slist *headers = NULL;
+    if (!_ifNoneMatch.isEmpty())
+    {
+        headers = curl_slist_append(headers, QByteArray("If-None-Match: "+_ifNoneMatch).constData());
+        curl_easy_setopt(_c, CURLOPT_HTTPHEADER, headers);
+    }
+    if (_ifModifiedSince)
+    {
+        curl_easy_setopt(_c, CURLOPT_TIMECONDITION, (long) CURL_TIMECOND_IFMODSINCE);
+        curl_easy_setopt(_c, CURLOPT_TIMEVALUE_LARGE, (curl_off_t) _ifModifiedSince);
+    }
+
     if (_proxy.isEmpty())
     {
 #ifndef QT_NO_NETWORKPROXY
@@ -413,38 +447,74 @@ void DownloadThread::run()
     _timer.start();
     CURLcode ret = curl_easy_perform(_c);
 
-    /* Deal with badly configured HTTP servers that terminate the connection quickly
-       if connections stalls for some seconds while kernel commits buffers to slow SD card.
-       And also reconnect if we detect from our end that transfer stalled for more than one minute */
-    while (ret == CURLE_PARTIAL_FILE || ret == CURLE_OPERATION_TIMEDOUT
-           || (ret == CURLE_HTTP2_STREAM && _lastDlNow != _lastFailureOffset)
-           || (ret == CURLE_RECV_ERROR && _lastDlNow != _lastFailureOffset) )
+    while (true)
     {
-        time_t t = time(NULL);
-        qDebug() << "HTTP connection lost. Time:" << t;
+        if (ret == CURLE_WRITE_ERROR && _chunkRefetchPending && !_cancelled)
+        {
+            /* A chunk that did not match the manifest stopped the transfer, continue after it once it is fetched again */
+            if (!_recoverChunk())
+                break;
+
+            _startOffset = (qint64) _chunkIndex * _chunkSize;
+            _lastDlNow = _startOffset;
+        }
+        else if (ret == CURLE_PARTIAL_FILE || ret == CURLE_OPERATION_TIMEDOUT
+                 || (ret == CURLE_HTTP2_STREAM && _lastDlNow != _lastFailureOffset)
+                 || (ret == CURLE_RECV_ERROR && _lastDlNow != _lastFailureOffset) )
+        {
+            /* Deal with badly configured HTTP servers that terminate the connection quickly
+               if connections stalls for some seconds while kernel commits buffers to slow SD card.
+               And also reconnect if we detect from our end that transfer stalled for more than one minute */
+            time_t t = time(NULL);
+            qDebug() << "HTTP connection lost. Time:" << t;
+
+            /* If last failure happened less than 5 seconds ago, something else may
+               be wrong. Sleep some time to prevent hammering server */
+            if (t - _lastFailureTime < 5)
+            {
+                qDebug() << "Sleeping 5 seconds";
+                ::sleep(5);
+            }
+            _lastFailureTime = t;
 
-        /* If last failure happened less than 5 seconds ago, something else may
-           be wrong. Sleep some time to prevent hammering server */
-        if (t - _lastFailureTime < 5)
+            _startOffset = _lastDlNow;
+            _lastFailureOffset = _lastDlNow;
+        }
+        else
         {
-            qDebug() << "Sleeping 5 seconds";
-            ::sleep(5);
+            break;
         }
-        _lastFailureTime = t;
 
-        _startOffset = _lastDlNow;
-        _lastFailureOffset = _lastDlNow;
         curl_easy_setopt(_c, CURLOPT_RESUME_FROM_LARGE, _startOffset);
-
         ret = curl_easy_perform(_c);
     }
 
-    curl_easy_cleanup(_c);
+    if (ret == CURLE_OK)
+    {
+        long httpCode = 0, conditionUnmet = 0;
+        curl_easy_getinfo(_c, CURLINFO_RESPONSE_CODE, &httpCode);
+        curl_easy_getinfo(_c, CURLINFO_CONDITION_UNMET, &conditionUnmet);
+        _notModified = (httpCode == 304 || conditionUnmet);
+    }
 
+    /* _c stays around for _finishChunks(), which may fetch the last chunk again */
     switch (ret)
     {
         case CURLE_OK:
             _successful = true;
+            if (_notModified)
+            {
+                qDebug() << "Not modified on server, keeping local copy";
+                _closeFiles();
+                if (!_suppressSuccessSignal)
+                    emit success();
+                break;
+            }
+            if (_chunkSize && !_finishChunks())
+            {
+                _onWriteError();
+                break;
+            }
             qDebug() << "Download done in" << _timer.elapsed() / 1000 << "seconds";
             _onDownloadSuccess();
             break;
@@ -471,6 +541,9 @@ void DownloadThread::run()
 
             _onDownloadError(tr("Error downloading: %1").arg(errorMsg));
     }
+
+    curl_easy_cleanup(_c);
+    curl_slist_free_all(headers);
 }
 
 size_t DownloadThread::_writeData(const char *buf, size_t len)
@@ -519,9 +592,519 @@ void DownloadThread::setCacheFile(const QString &filename, qint64 filesize)
     }
 }
 
+void DownloadThread::setRawCacheFile(const QString &filename, qint64 maxSize)
+{
+    _rawCachefile.setFileName(filename);
+    if (_rawCachefile.open(QIODevice::WriteOnly))
+    {
+        _rawCacheEnabled = true;
+        _rawCacheMaxSize = maxSize;
+    }
+    else
+    {
+        qDebug() << "Error opening decompressed image cache file for writing. Disabling it.";
+    }
+}
+
+void DownloadThread::setChunkManifest(qint64 chunkSize, const QList<QByteArray> &sha256)
+{
+    _chunkSize = chunkSize;
+    _chunkDigests = sha256;
+    _chunkBuf.reserve(chunkSize);
+}
+
+/* Holds the data back until the chunk it belongs to is complete and checked */
+size_t DownloadThread::_receiveChunk(const char *buf, size_t len)
+{
+    for (size_t pos = 0; pos < len; )
+    {
+        if (_chunkIndex >= _chunkDigests.size())
+        {
+            _onDownloadError(tr("Download corrupt. It is larger than its chunk manifest"));
+            return 0;
+        }
+
+        qint64 n = qMin<qint64>(len - pos, _chunkSize - _chunkBuf.size());
+        _chunkBuf.append(buf + pos, n);
+        _chunkHash.addData(QByteArrayView(buf + pos, n));
+        pos += n;
+
+        if (_chunkBuf.size() == _chunkSize && !_completeChunk())
+            return 0;
+    }
+
+    return len;
+}
+
+/*
+ * Checks the buffered chunk and passes it on. A mismatch stops the transfer with the chunk
+ * still buffered, run() fetches it again once curl has returned and then resumes after it.
+ */
+bool DownloadThread::_completeChunk()
+{
+    QByteArray digest = _chunkHash.result().toHex();
+    _chunkHash.reset();
+
+    if (digest != _chunkDigests.at(_chunkIndex))
+    {
+        _chunkRefetchPending = true;
+        return false;
+    }
+
+    return _passChunk();
+}
+
+/* Fetches the buffered chunk again and passes it on */
+bool DownloadThread::_recoverChunk()
+{
+    _chunkRefetchPending = false;
+    if (!_refetchChunk())
+    {
+        if (!_cancelled)
+            _onDownloadError(tr("Download corrupt. Part %1 of the image could not be fetched intact").arg(_chunkIndex+1));
+        return false;
+    }
+
+    return _passChunk();
+}
+
+/* Passes the checked chunk on in pieces the size curl hands out */
+bool DownloadThread::_passChunk()
+{
+    for (qint64 pos = 0; pos < _chunkBuf.size(); pos += CURL_MAX_WRITE_SIZE)
+    {
+        size_t n = qMin<qint64>(_chunkBuf.size() - pos, CURL_MAX_WRITE_SIZE);
+        if (_writeData(_chunkBuf.constData() + pos, n) != n)
+            return false;
+    }
+
+    _chunkBuf.resize(0);
+    _chunkIndex++;
+    return true;
+}
+
+namespace {
+    struct RangeBuffer
+    {
+        QByteArray data;
+        qint64 limit;
+        const bool *cancelled;
+    };
+}
+
+static size_t rangeWriteCallback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    RangeBuffer *rb = static_cast<RangeBuffer *>(userdata);
+    size_t len = size * nmemb;
+
+    /* A server ignoring the range sends the whole file, stop right away */
+    if (*rb->cancelled || rb->data.size() + (qint64) len > rb->limit)
+        return 0;
+
+    rb->data.append(ptr, len);
+    return len;
+}
+
+/*
+ * Fetches the buffered chunk again until it matches its digest. Only called while no transfer
+ * is running on _c, the range request is made with a copy of it so proxy, TLS and timeouts are the same.
+ */
+bool DownloadThread::_refetchChunk()
+{
+    qint64 start = (qint64) _chunkIndex * _chunkSize;
+    QByteArray range = QByteArray::number(start)+"-"+QByteArray::number(start + _chunkBuf.size() - 1);
+
+    for (int attempt = 1; attempt <= IMAGEWRITER_DOWNLOAD_CHUNK_REFETCHES && !_cancelled; attempt++)
+    {
+        qDebug() << "Chunk" << _chunkIndex << "does not match the manifest. Fetching bytes" << range << "again, attempt" << attempt;
+
+        RangeBuffer rb;
+        rb.limit = _chunkBuf.size();
+        rb.cancelled = &_cancelled;
+        rb.data.reserve(rb.limit);
+
+        CURL *c = curl_easy_duphandle(_c);
+        curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, &rangeWriteCallback);
+        curl_easy_setopt(c, CURLOPT_WRITEDATA, &rb);
+        curl_easy_setopt(c, CURLOPT_NOPROGRESS, 1L);
+        curl_easy_setopt(c, CURLOPT_ERRORBUFFER, NULL);
+        curl_easy_setopt(c, CURLOPT_RESUME_FROM_LARGE, (curl_off_t) 0);
+        curl_easy_setopt(c, CURLOPT_RANGE, range.constData());
+        /* A conditional request could be answered with 304 instead of the range */
+        curl_easy_setopt(c, CURLOPT_HTTPHEADER, NULL);
+        curl_easy_setopt(c, CURLOPT_TIMECONDITION, (long) CURL_TIMECOND_NONE);
+
+        CURLcode ret = curl_easy_perform(c);
+        long httpCode = 0;
+        curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &httpCode);
+        curl_easy_cleanup(c);
+
+        if (ret != CURLE_OK || httpCode != 206 || rb.data.size() != _chunkBuf.size())
+        {
+            qDebug() << "Range request failed:" << curl_easy_strerror(ret) << "HTTP status" << httpCode;
+        }
+        else if (QCryptographicHash::hash(rb.data, QCryptographicHash::Sha256).toHex() == _chunkDigests.at(_chunkIndex))
+        {
+            _chunkBuf = rb.data;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* The last chunk is only known to be complete once the transfer is */
+bool DownloadThread::_finishChunks()
+{
+    if (!_chunkBuf.isEmpty() && !_completeChunk() && !(_chunkRefetchPending && _recoverChunk()))
+        return false;
+
+    if (_chunkIndex != _chunkDigests.size())
+    {
+        _onDownloadError(tr("Download corrupt. It is shorter than its chunk manifest"));
+        return false;
+    }
+
+    return true;
+}
+
+void DownloadThread::setWriteJournal(const QString &filename)
+{
+    _journalFile.setFileName(filename);
+    _journalEnabled = true;
+}
+
+/* Cheap check that the device is the one the journal was written for, reading it back settles it */
+QByteArray DownloadThread::_deviceIdentity()
+{
+    QByteArray id = "size="+QByteArray::number(_file.size());
+    QByteArray dev = _filename.toLower();
+#ifdef Q_OS_DARWIN
+    dev.replace("/dev/rdisk", "/dev/disk");
+#endif
+
+    auto l = Drivelist::ListStorageDevices();
+    for (const auto &i : l)
+    {
+        if (QByteArray::fromStdString(i.device).toLower() == dev)
+        {
+            id += " description="+QByteArray::fromStdString(i.description);
+            break;
+        }
+    }
+
+#ifdef Q_OS_LINUX
+    if (_filename.startsWith("/dev/"))
+    {
+        QByteArray cid = _fileGetContentsTrimmed("/sys/block/"+_filename.mid(5)+"/device/cid");
+        if (!cid.isEmpty())
+            id += " cid="+cid;
+    }
+#endif
+
+    return id;
+}
+
+/*
+ * Returns the offset up to which the device still holds the image, as left by an interrupted write
+ * of the same image, or 0 if it all has to be written
+ */
+qint64 DownloadThread::_checkJournal()
+{
+    _journalDevice = _deviceIdentity();
+    _journalDigests.clear();
+
+    if (_expectedHash.isEmpty() || !_journalFile.open(QIODevice::ReadOnly))
+        return 0;
+
+    QList<QByteArray> lines = _journalFile.readAll().split('\n');
+    _journalFile.close();
+    lines.removeAll(QByteArray());
+
+    if (lines.size() < 4 || lines.at(0) != "image "+_expectedHash || lines.at(1) != "device "+_journalDevice
+            || lines.at(2) != "chunksize "+QByteArray::number(IMAGEWRITER_JOURNAL_CHUNK_SIZE))
+    {
+        return 0;
+    }
+    lines.remove(0, 3);
+
+    emit preparationStatusUpdate(tr("checking data of the interrupted write"));
+    qDebug() << "Write journal lists" << lines.size() << "chunks written before, reading them back";
+    QElapsedTimer t1;
+    t1.start();
+
+#ifdef Q_OS_LINUX
+    posix_fadvise(_file.handle(), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+    /* The first chunk held the first block, which never got written */
+    char *buf = (char *) qMallocAligned(IMAGEWRITER_JOURNAL_CHUNK_SIZE, 4096);
+    qsizetype good = 1;
+    for (; good < lines.size() && !_cancelled; good++)
+    {
+        if (!_file.seek((qint64) good * IMAGEWRITER_JOURNAL_CHUNK_SIZE)
+                || _file.read(buf, IMAGEWRITER_JOURNAL_CHUNK_SIZE) != IMAGEWRITER_JOURNAL_CHUNK_SIZE
+                || QCryptographicHash::hash(QByteArrayView(buf, IMAGEWRITER_JOURNAL_CHUNK_SIZE), QCryptographicHash::Sha256).toHex() != lines.at(good))
+        {
+            break;
+        }
+    }
+    qFreeAligned(buf);
+
+    if (good < 2)
+    {
+        qDebug() << "Nothing of the interrupted write can be kept";
+        return 0;
+    }
+
+    lines.resize(good);
+    _journalDigests = lines;
+    qint64 offset = (qint64) good * IMAGEWRITER_JOURNAL_CHUNK_SIZE;
+    qDebug() << "Resuming write at offset" << offset << "checked in" << t1.elapsed() / 1000.0 << "seconds";
+    return offset;
+}
+
+/* Rewrites the journal with the chunks that are kept, new ones are appended as they become durable */
+void DownloadThread::_startJournal()
+{
+    QByteArray header = "image "+_expectedHash+"\n"
+                        "device "+_journalDevice+"\n"
+                        "chunksize "+QByteArray::number(IMAGEWRITER_JOURNAL_CHUNK_SIZE)+"\n";
+    for (const QByteArray &digest : std::as_const(_journalDigests))
+        header += digest+"\n";
+
+    if (_expectedHash.isEmpty() || !_journalFile.open(QIODevice::WriteOnly | QIODevice::Truncate)
+            || _journalFile.write(header) != header.size() || !_journalFile.flush())
+    {
+        qDebug() << "Error creating write journal. Disabling it.";
+        _journalFile.close();
+        _journalEnabled = false;
+        return;
+    }
+
+    _journalChunks = _journalDigests.size();
+    _journalDigests.clear();
+}
+
+/* Digest per chunk of the image, chunks already in the journal are not hashed again */
+void DownloadThread::_journalData(const char *buf, size_t len)
+{
+    if (!_journalEnabled)
+        return;
+
+    for (size_t pos = 0; pos < len; )
+    {
+        qint64 n = qMin<qint64>(len - pos, IMAGEWRITER_JOURNAL_CHUNK_SIZE - _journalPos % IMAGEWRITER_JOURNAL_CHUNK_SIZE);
+        bool known = _journalPos / IMAGEWRITER_JOURNAL_CHUNK_SIZE < _journalChunks;
+        if (!known)
+            _journalHash.addData(QByteArrayView(buf + pos, n));
+        _journalPos += n;
+        pos += n;
+
+        if (!known && _journalPos % IMAGEWRITER_JOURNAL_CHUNK_SIZE == 0)
+        {
+            _journalPending += _journalHash.result().toHex()+"\n";
+            _journalHash.reset();
+            _journalChunks++;
+        }
+    }
+}
+
+/* Chunks only go into the journal once the device has been synced */
+void DownloadThread::_syncJournal()
+{
+    if (!_journalEnabled || _journalPending.isEmpty())
+        return;
+
+    if (!_file.flush()
+#ifndef Q_OS_WIN
+            || ::fsync(_file.handle()) != 0
+#endif
+            || _journalFile.write(_journalPending) != _journalPending.size() || !_journalFile.flush())
+    {
+        qDebug() << "Error updating write journal. Disabling it.";
+        _journalFile.remove();
+        _journalEnabled = false;
+    }
+    _journalPending.clear();
+}
+
+/* Writes only the blocks that differ from what the device holds. Returns len, or -1 on a write error */
+qint64 DownloadThread::_writeDifferent(const char *buf, qint64 len)
+{
+    qint64 pos = _file.pos();
+    if (len > _diffBufSize)
+    {
+        if (_diffBuf)
+            qFreeAligned(_diffBuf);
+        _diffBuf = (char *) qMallocAligned(len, 4096);
+        _diffBufSize = len;
+    }
+
+#ifdef Q_OS_LINUX
+    /* The next block of the image most likely follows right after */
+    posix_fadvise(_file.handle(), pos + len, len, POSIX_FADV_WILLNEED);
+#endif
+    /* Whatever cannot be read back is simply written */
+    qint64 have = qMax<qint64>(_file.read(_diffBuf, len), 0);
+
+    auto same = [&](qint64 off) {
+        qint64 n = qMin<qint64>(len - off, IMAGEWRITER_DIFFERENTIAL_BLOCKSIZE);
+        return off + n <= have && ::memcmp(buf + off, _diffBuf + off, n) == 0;
+    };
+
+    /* Compare each block once: the block that ends a run starts the next */
+    bool identical = same(0);
+    for (qint64 off = 0; off < len; )
+    {
+        qint64 runEnd = off;
+        bool next;
+        do
+        {
+            runEnd += qMin<qint64>(len - runEnd, IMAGEWRITER_DIFFERENTIAL_BLOCKSIZE);
+            next = runEnd < len && same(runEnd);
+        } while (runEnd < len && next == identical);
+
+        if (identical)
+        {
+            _bytesSkipped += runEnd - off;
+        }
+        else if (!_file.seek(pos + off) || _file.write(buf + off, runEnd - off) != runEnd - off)
+        {
+            return -1;
+        }
+        off = runEnd;
+        identical = next;
+    }
+
+    return _file.seek(pos + len) ? len : -1;
+}
+
+static bool isZeroBlock(const char *buf, qint64 len)
+{
+    return len > 0 && buf[0] == 0 && ::memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+void DownloadThread::_writeRawCache(const char *buf, size_t len)
+{
+    if (!_rawCacheEnabled || _cancelled)
+        return;
+
+    if (_rawCacheSize + (qint64) len > _rawCacheMaxSize)
+    {
+        qDebug() << "Image is larger than the decompressed image cache budget. Disabling it.";
+        _finishRawCache(false);
+        return;
+    }
+
+    /* Runs of all-zero blocks are skipped, they stay holes once the file is extended to its full size */
+    const char *end = buf + len;
+    for (const char *p = buf; p < end; )
+    {
+        bool zero = isZeroBlock(p, qMin<qint64>(end - p, IMAGEWRITER_RAW_CACHE_SPARSE_BLOCKSIZE));
+        const char *runEnd = p;
+        while (runEnd < end && isZeroBlock(runEnd, qMin<qint64>(end - runEnd, IMAGEWRITER_RAW_CACHE_SPARSE_BLOCKSIZE)) == zero)
+            runEnd += qMin<qint64>(end - runEnd, IMAGEWRITER_RAW_CACHE_SPARSE_BLOCKSIZE);
+
+        if (!zero && (!_rawCachefile.seek(_rawCacheSize + (p - buf))
+                      || _rawCachefile.write(p, runEnd - p) != runEnd - p))
+        {
+            qDebug() << "Error writing to decompressed image cache file. Disabling it.";
+            _finishRawCache(false);
+            return;
+        }
+        p = runEnd;
+    }
+
+    for (size_t pos = 0; pos < len; )
+    {
+        qint64 n = qMin<qint64>(len - pos, IMAGEWRITER_RAW_CACHE_CHUNK_SIZE - _rawChunkFill);
+        _rawChunkHash.addData(QByteArrayView(buf + pos, n));
+        _rawChunkFill += n;
+        pos += n;
+
+        if (_rawChunkFill == IMAGEWRITER_RAW_CACHE_CHUNK_SIZE)
+        {
+            _rawChunkDigests += _rawChunkHash.result().toHex()+"\n";
+            _rawChunkHash.reset();
+            _rawChunkFill = 0;
+        }
+    }
+    _rawCacheSize += len;
+}
+
+/* Either completes the decompressed image cache file and its digest list, or deletes it */
+void DownloadThread::_finishRawCache(bool keep)
+{
+    if (!_rawCacheEnabled)
+        return;
+    _rawCacheEnabled = false;
+
+    if (keep)
+    {
+        if (_rawChunkFill)
+        {
+            _rawChunkDigests += _rawChunkHash.result().toHex()+"\n";
+            _rawChunkHash.reset();
+            _rawChunkFill = 0;
+        }
+
+        QFile digests(_rawCachefile.fileName()+".sha256sums");
+        keep = _rawCachefile.resize(_rawCacheSize)
+                && digests.open(QIODevice::WriteOnly)
+                && digests.write(_rawChunkDigests) == _rawChunkDigests.size()
+                && digests.flush();
+        if (!keep)
+            qDebug() << "Error finishing decompressed image cache file";
+    }
+
+    _rawCachefile.close();
+    _rawChunkDigests.clear();
+    if (!keep)
+    {
+        _rawCachefile.remove();
+        QFile::remove(_rawCachefile.fileName()+".sha256sums");
+    }
+}
+
 void DownloadThread::_hashData(const char *buf, size_t len)
 {
     _writehash.addData(buf, len);
+    if (_earlyCustomization)
+        _segmentHash.addData(QByteArrayView(buf, len));
+    _journalData(buf, len);
+}
+
+/*
+ * Everything up to the end of the boot partition has been written. Verifies it as it came in,
+ * then customizes it and writes the first block, so nothing below _pendingRewriteEnd changes anymore.
+ * The final verify only covers what was written after this point.
+ */
+bool DownloadThread::_customizeBootPartition()
+{
+    qint64 pos = _file.pos();
+    qDebug() << "Boot partition complete at offset" << pos << ", customizing it before the rest of the image";
+
+    if (_verifyEnabled && !_verify())
+        return false;
+
+    _segmentHash.reset();
+    _verifyStart = pos;
+
+    if (!_customizeImage())
+    {
+        _cancelled = true;
+        return false;
+    }
+    if (!_file.seek(pos))
+    {
+        DownloadThread::_onDownloadError(tr("Error writing to storage (while customizing)"));
+        return false;
+    }
+
+    _customized = true;
+    _pendingRewriteEnd = 0;
+    return true;
 }
 
 size_t DownloadThread::_writeFile(const char *buf, size_t len)
@@ -529,23 +1112,61 @@ size_t DownloadThread::_writeFile(const char *buf, size_t len)
     if (_cancelled)
         return len;
 
+    /* Zero scan, chunk digests and the cache file write run alongside the write to the device */
+    QFuture<void> rc;
+    if (_rawCacheEnabled)
+    {
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+        rc = QtConcurrent::run(&DownloadThread::_writeRawCache, this, buf, len);
+#else
+        rc = QtConcurrent::run(this, &DownloadThread::_writeRawCache, buf, len);
+#endif
+    }
+    /* buf is only valid until this returns */
+    auto waitForRawCache = qScopeGuard([&rc]() { rc.waitForFinished(); });
+
     if (!_firstBlock)
     {
-        _writehash.addData(buf, len);
         _firstBlock = (char *) qMallocAligned(len, 4096);
         _firstBlockSize = len;
         ::memcpy(_firstBlock, buf, len);
 
+        qint64 rewriteEnd = len;
+        if (_hasCustomization())
+        {
+            qint64 partEnd = _bootPartitionEnd(buf, len);
+            rewriteEnd = (partEnd < 0) ? std::numeric_limits<qint64>::max() : qMax(partEnd, rewriteEnd);
+            /* uniflash parts are served while the rest is still being written, so do not hold the boot partition until the end */
+            _earlyCustomization = (_destination == "uniflash" && partEnd >= 0);
+        }
+        _pendingRewriteEnd = rewriteEnd;
+        _hashData(buf, len);
+
         return _file.seek(len) ? len : 0;
     }
+
+    /*
+     * What an interrupted write already left on the device is skipped. Not the first chunk,
+     * _checkJournal() cannot read it back as its first block was never written.
+     */
+    qint64 skip = (_file.pos() >= IMAGEWRITER_JOURNAL_CHUNK_SIZE) ? qBound<qint64>(0, _resumeOffset - _file.pos(), len) : 0;
+    if (skip && !_file.seek(_file.pos() + skip))
+        return 0;
+
 #if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
     QFuture<void> wh = QtConcurrent::run(&DownloadThread::_hashData, this, buf, len);
 #else
     QFuture<void> wh = QtConcurrent::run(this, &DownloadThread::_hashData, buf, len);
 #endif
 
-    qint64 written = _file.write(buf, len);
+    qint64 written = skip;
+    if (skip < (qint64) len)
+    {
+        qint64 n = _differential ? _writeDifferent(buf + skip, len - skip) : _file.write(buf + skip, len - skip);
+        written = (n < 0) ? n : skip + n;
+    }
     _bytesWritten += written;
+    _bytesSkipped += skip;
 
     if ((size_t) written != len)
     {
@@ -553,6 +1174,10 @@ size_t DownloadThread::_writeFile(const char *buf, size_t len)
     }
 
     wh.waitForFinished();
+    if (_earlyCustomization && !_customized && !_cancelled && _file.pos() >= _pendingRewriteEnd && !_customizeBootPartition())
+        return 0;
+    if ((qint64) _journalPending.count('\n') * IMAGEWRITER_JOURNAL_CHUNK_SIZE >= IMAGEWRITER_JOURNAL_SYNC_INTERVAL)
+        _syncJournal();
     return (written < 0) ? 0 : written;
 }
 
@@ -575,6 +1200,10 @@ void DownloadThread::_header(const string &header)
     {
         _lastModified = curl_getdate(header.data()+15, NULL);
     }
+    else if (QByteArray::fromStdString(header).toLower().startsWith("etag:"))
+    {
+        _etag = QByteArray::fromStdString(header).mid(5).trimmed();
+    }
     qDebug() << "Received header:" << QByteArray(header.c_str()).trimmed();
 }
 
@@ -604,6 +1233,22 @@ time_t DownloadThread::serverTime()
     return _serverTime;
 }
 
+void DownloadThread::setConditionalRequest(const QByteArray &etag, time_t lastModified)
+{
+    _ifNoneMatch = etag;
+    _ifModifiedSince = lastModified;
+}
+
+bool DownloadThread::notModified()
+{
+    return _notModified;
+}
+
+QByteArray DownloadThread::etag()
+{
+    return _etag;
+}
+
 void DownloadThread::deleteDownloadedFile()
 {
     if (!_filename.isEmpty())
@@ -642,14 +1287,55 @@ uint64_t DownloadThread::verifyTotal()
     return _verifyTotal;
 }
 
+qint64 DownloadThread::pendingRewriteEnd()
+{
+    return _pendingRewriteEnd;
+}
+
+bool DownloadThread::_hasCustomization()
+{
+    return !_config.isEmpty() || !_cmdline.isEmpty() || !_firstrun.isEmpty() || !_cloudinit.isEmpty() || !_geminit.isEmpty() || _destination == "uniflash";
+}
+
+qint64 DownloadThread::_bootPartitionEnd(const char *buf, size_t len)
+{
+    const uchar *b = (const uchar *) buf;
+
+    if (len < 512 || b[510] != 0x55 || b[511] != 0xAA)
+        return -1;
+
+    const uchar *entry = b + 446;
+    if (entry[4] != 0xEE)
+    {
+        /* MBR, first partition entry */
+        return ((qint64) qFromLittleEndian<quint32>(entry + 8) + qFromLittleEndian<quint32>(entry + 12)) * 512;
+    }
+
+    /* Protective MBR, first GPT partition entry */
+    if (len < 1024 || ::memcmp(b + 512, "EFI PART", 8) != 0)
+        return -1;
+
+    quint64 entriesOffset = qFromLittleEndian<quint64>(b + 512 + 72) * 512;
+    if (entriesOffset + 128 > len)
+        return -1;
+
+    return ((qint64) qFromLittleEndian<quint64>(b + entriesOffset + 40) + 1) * 512;
+}
+
 uint64_t DownloadThread::bytesWritten()
 {
+    /* Skipped data never shows up in the sector count */
     if (_sectorsStart != -1)
-        return qMin((uint64_t) (_sectorsWritten()-_sectorsStart)*512, (uint64_t) _bytesWritten);
+        return qMin((uint64_t) (_sectorsWritten()-_sectorsStart)*512 + _bytesSkipped, (uint64_t) _bytesWritten);
     else
         return _bytesWritten;
 }
 
+uint64_t DownloadThread::bytesSkipped()
+{
+    return _bytesSkipped;
+}
+
 void DownloadThread::_onDownloadSuccess()
 {
     _writeComplete();
@@ -681,6 +1367,11 @@ void DownloadThread::_onWriteError()
         _onDownloadError(tr("Error writing file to disk"));
 }
 
+/* For subclasses whose input was written by someone else and is only checked by this write */
+void DownloadThread::_onHashChecked(bool /*matches*/)
+{
+}
+
 void DownloadThread::_closeFiles()
 {
     _file.close();
@@ -689,6 +1380,9 @@ void DownloadThread::_closeFiles()
 #endif
     if (_cachefile.isOpen())
         _cachefile.close();
+    _journalFile.close();
+    /* Still open means the image never completed */
+    _finishRawCache(false);
 }
 
 void DownloadThread::_writeComplete()
@@ -700,6 +1394,10 @@ void DownloadThread::_writeComplete()
         qDebug() << "Mismatch with expected hash:" << _expectedHash;
         if (_cachefile.isOpen())
             _cachefile.remove();
+        if (_journalEnabled)
+            _journalFile.remove();
+        _finishRawCache(false);
+        _onHashChecked(false);
         DownloadThread::_onDownloadError(tr("Download corrupt. Hash does not match"));
         _closeFiles();
         return;
@@ -709,6 +1407,14 @@ void DownloadThread::_writeComplete()
         _cachefile.close();
         emit cacheFileUpdated(computedHash);
     }
+    if (_expectedHash == computedHash)
+        _onHashChecked(true);
+    if (_rawCacheEnabled && _expectedHash == computedHash)
+    {
+        _finishRawCache(true);
+        if (_rawCachefile.exists())
+            emit rawCacheFileUpdated(computedHash);
+    }
 
     if (!_file.flush())
     {
@@ -726,17 +1432,21 @@ void DownloadThread::_writeComplete()
 #endif
 
     qDebug() << "Write done in" << _timer.elapsed() / 1000 << "seconds";
+    if (_bytesSkipped)
+        qDebug() << "Skipped" << _bytesSkipped / 1048576 << "MB already on the device, wrote" << (_bytesWritten - _bytesSkipped) / 1048576 << "MB";
 
     /* Verify */
     if (_verifyEnabled && !_verify())
     {
+        if (_journalEnabled)
+            _journalFile.remove();
         _closeFiles();
         return;
     }
 
     emit finalizing();
 
-    if (!_config.isEmpty() || !_cmdline.isEmpty() || !_firstrun.isEmpty() || !_cloudinit.isEmpty() || !_geminit.isEmpty() || _destination == "uniflash")
+    if (_hasCustomization() && !_customized)
     {
         if (!_customizeImage())
         {
@@ -777,6 +1487,8 @@ void DownloadThread::_writeComplete()
     }
 #endif
 
+    if (_journalEnabled)
+        _journalFile.remove();
     _closeFiles();
 
 #ifdef Q_OS_DARWIN
@@ -784,7 +1496,7 @@ void DownloadThread::_writeComplete()
     _filename.replace("/dev/rdisk", "/dev/disk");
 #endif
 
-    if (_ejectEnabled)
+    if (_ejectEnabled && !_isNormalFile)
     {
         eject_disk(_filename.constData());
 #ifdef Q_OS_LINUX
@@ -804,6 +1516,7 @@ void DownloadThread::_writeComplete()
 bool DownloadThread::_verify()
 {
     char *verifyBuf = (char *) qMallocAligned(IMAGEWRITER_VERIFY_BLOCKSIZE, 4096);
+    AcceleratedCryptographicHash verifyhash(OSLIST_HASH_ALGORITHM);
     _lastVerifyNow = 0;
     _verifyTotal = _file.pos();
     QElapsedTimer t1;
@@ -815,13 +1528,19 @@ bool DownloadThread::_verify()
     posix_fadvise(_file.handle(), 0, 0, POSIX_FADV_DONTNEED);
 #endif
 
-    if (!_firstBlock)
+    if (_verifyStart)
+    {
+        /* What comes before was verified before the boot partition got customized */
+        _file.seek(_verifyStart);
+        _lastVerifyNow += _verifyStart;
+    }
+    else if (!_firstBlock)
     {
         _file.seek(0);
     }
     else
     {
-        _verifyhash.addData(_firstBlock, _firstBlockSize);
+        verifyhash.addData(_firstBlock, _firstBlockSize);
         _file.seek(_firstBlockSize);
         _lastVerifyNow += _firstBlockSize;
     }
@@ -836,15 +1555,17 @@ bool DownloadThread::_verify()
             return false;
         }
 
-        _verifyhash.addData(verifyBuf, lenRead);
+        verifyhash.addData(verifyBuf, lenRead);
         _lastVerifyNow += lenRead;
     }
     qFreeAligned(verifyBuf);
 
-    qDebug() << "Verify hash:" << _verifyhash.result().toHex();
+    QByteArray verifyResult = verifyhash.result();
+    qDebug() << "Verify hash:" << verifyResult.toHex();
     qDebug() << "Verify done in" << t1.elapsed() / 1000.0 << "seconds";
 
-    if (_verifyhash.result() == _writehash.result() || !_verifyEnabled || _cancelled)
+    QByteArray writeResult = _earlyCustomization ? _segmentHash.result() : _writehash.result();
+    if (verifyResult == writeResult || !_verifyEnabled || _cancelled)
     {
         return true;
     }
@@ -1024,7 +1745,5 @@ bool DownloadThread::_customizeImage()
         return false;
     }
 
-    emit finalizing();
-
     return true;
 }
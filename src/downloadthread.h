@@ -13,6 +13,7 @@
 #endif
 
 #include <QString>
+#include <QList>
 #include <QThread>
 #include <QFile>
 #include <QElapsedTimer>
@@ -100,6 +101,22 @@ public:
      */
     time_t serverTime();
 
+    /*
+     * Only transfer the file if it differs from the copy identified by etag and/or lastModified.
+     * If the server reports it unchanged, nothing is written and notModified() returns true.
+     */
+    void setConditionalRequest(const QByteArray &etag, time_t lastModified);
+
+    /*
+     * Returns true if a conditional request found the local copy up to date
+     */
+    bool notModified();
+
+    /*
+     * Return ETag header sent by the server (if available)
+     */
+    QByteArray etag();
+
     /*
      * Enable/disable verification
      */
@@ -110,6 +127,25 @@ public:
      */
     void setCacheFile(const QString &filename, qint64 filesize = 0);
 
+    /*
+     * Also keep the decompressed image, sparse, with a digest per IMAGEWRITER_RAW_CACHE_CHUNK_SIZE
+     * in filename.sha256sums. Given up if the image turns out larger than maxSize.
+     */
+    void setRawCacheFile(const QString &filename, qint64 maxSize);
+
+    /*
+     * Check the download against a SHA256 per chunkSize bytes (the last chunk may be shorter).
+     * A chunk is only passed on once it matches, a corrupt one is fetched again with a range request.
+     */
+    void setChunkManifest(qint64 chunkSize, const QList<QByteArray> &sha256);
+
+    /*
+     * Keep track of the data that is durably on the device in a journal file, so a write of the same
+     * image to the same device that got interrupted continues where it left off, after reading back
+     * what is there. The journal is removed once the write either succeeds or turns out corrupt.
+     */
+    void setWriteJournal(const QString &filename);
+
     /*
      * Set input buffer size
      */
@@ -129,13 +165,28 @@ public:
     uint64_t verifyTotal();
     uint64_t bytesWritten();
 
+    /*
+     * Bytes that were already on the device and not written again, with the
+     * "differentialWrite" setting or when resuming from a write journal
+     */
+    uint64_t bytesSkipped();
+
+    /*
+     * End offset of the region that may still be rewritten after the stream ended
+     * (held back first block and the boot partition if the image gets customized).
+     * Returns -1 until the first block has been received. For uniflash it drops to 0 as soon as
+     * the boot partition has been written and customized.
+     */
+    qint64 pendingRewriteEnd();
+
     virtual bool isImage();
-    size_t _writeFile(const char *buf, size_t len);
+    virtual size_t _writeFile(const char *buf, size_t len);
 
 signals:
     void success();
     void error(QString msg);
     void cacheFileUpdated(QByteArray sha256);
+    void rawCacheFileUpdated(QByteArray sha256);
     void finalizing();
     void preparationStatusUpdate(QString msg);
     void updateNumProgress(QVariant pos);
@@ -145,17 +196,35 @@ protected:
     virtual void _onDownloadSuccess();
     virtual void _onDownloadError(const QString &msg);
     virtual void _onWriteError();
+    virtual void _onHashChecked(bool matches);
 
     void _hashData(const char *buf, size_t len);
-    void _writeComplete();
-    bool _verify();
+    virtual void _writeComplete();
+    virtual bool _verify();
     int _authopen(const QByteArray &filename);
     virtual bool _openAndPrepareDevice();
     void _writeCache(const char *buf, size_t len);
+    void _writeRawCache(const char *buf, size_t len);
+    void _finishRawCache(bool keep);
+    size_t _receiveChunk(const char *buf, size_t len);
+    bool _completeChunk();
+    bool _passChunk();
+    bool _recoverChunk();
+    bool _refetchChunk();
+    bool _finishChunks();
+    QByteArray _deviceIdentity();
+    qint64 _checkJournal();
+    void _startJournal();
+    void _journalData(const char *buf, size_t len);
+    void _syncJournal();
+    qint64 _writeDifferent(const char *buf, qint64 len);
     qint64 _sectorsWritten();
     void _closeFiles();
     QByteArray _fileGetContentsTrimmed(const QString &filename);
     bool _customizeImage();
+    bool _customizeBootPartition();
+    bool _hasCustomization();
+    static qint64 _bootPartitionEnd(const char *buf, size_t len);
 
     /*
      * libcurl callbacks
@@ -178,12 +247,16 @@ protected:
     size_t _firstBlockSize;
     static QByteArray _proxy;
     static int _curlCount;
-    bool _cancelled, _successful, _verifyEnabled, _cacheEnabled, _ejectEnabled;
+    bool _cancelled, _successful, _verifyEnabled, _cacheEnabled, _ejectEnabled, _differential;
     bool _suppressSuccessSignal;  // For subclasses that want to emit success themselves
     time_t _lastModified, _serverTime, _lastFailureTime;
     QElapsedTimer _timer;
     int _inputBufferSize;
     bool _isNormalFile{false};
+    QByteArray _etag, _ifNoneMatch;
+    time_t _ifModifiedSince{0};
+    bool _notModified{false};
+    std::atomic<qint64> _pendingRewriteEnd{-1};
 
 #ifdef Q_OS_WIN
     WinFile _file, _volumeFile;
@@ -193,9 +266,32 @@ protected:
 #else
     QFile _file;
 #endif
-    QFile _cachefile;
+    QFile _cachefile, _rawCachefile;
+    bool _rawCacheEnabled{false};
+    qint64 _rawCacheMaxSize{0}, _rawCacheSize{0}, _rawChunkFill{0};
+    QCryptographicHash _rawChunkHash{QCryptographicHash::Sha256};
+    QByteArray _rawChunkDigests;
+    qint64 _chunkSize{0};
+    int _chunkIndex{0};
+    bool _chunkRefetchPending{false};
+    QList<QByteArray> _chunkDigests;
+    QByteArray _chunkBuf;
+    QCryptographicHash _chunkHash{QCryptographicHash::Sha256};
+    QFile _journalFile;
+    bool _journalEnabled{false};
+    QByteArray _journalDevice, _journalPending;
+    QList<QByteArray> _journalDigests;
+    qint64 _resumeOffset{0}, _journalPos{0}, _journalChunks{0};
+    QCryptographicHash _journalHash{QCryptographicHash::Sha256};
+    char *_diffBuf{nullptr};
+    qint64 _diffBufSize{0};
+    std::atomic<std::uint64_t> _bytesSkipped{0};
 
-    AcceleratedCryptographicHash _writehash, _verifyhash;
+    AcceleratedCryptographicHash _writehash;
+    /* uniflash: boot partition customized while the image is still being written, verify covers the data from _verifyStart on */
+    bool _earlyCustomization{false}, _customized{false};
+    qint64 _verifyStart{0};
+    QCryptographicHash _segmentHash;
 };
 
 #endif // DOWNLOADTHREAD_H
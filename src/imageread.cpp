@@ -0,0 +1,76 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Reads part of an image through ImageSource, the random access used to pick the
+ * bootloader out of a compressed image without decompressing all of it.
+ * Writes the uncompressed bytes to stdout, see tests/test_image_source.py
+ */
+
+#include "imagesource.h"
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QScopedPointer>
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app{argc, argv};
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Read a range of an image without decompressing all of it");
+    parser.addOptions({
+        {{"o", "offset"},
+            QCoreApplication::translate("main", "Offset in the uncompressed image."),
+            QCoreApplication::translate("main", "bytes"), "0"},
+        {{"l", "length"},
+            QCoreApplication::translate("main", "Number of bytes to read, the rest of the image if not set."),
+            QCoreApplication::translate("main", "bytes")},
+        {"size", QCoreApplication::translate("main", "Only print the uncompressed size.")},
+    });
+    parser.addPositionalArgument("image", QCoreApplication::translate("main", "Image file or URL."));
+    parser.addHelpOption();
+    parser.process(app);
+
+    if(parser.positionalArguments().size() != 1)
+    {
+        parser.showHelp(1);
+    }
+
+    QScopedPointer<ImageSource> src{ImageSource::open(QUrl::fromUserInput(parser.positionalArguments().first(), QDir::currentPath(), QUrl::AssumeLocalFile))};
+    if(!src)
+    {
+        qCritical() << "Image cannot be accessed randomly";
+        return 2;
+    }
+
+    QFile out;
+    if(!out.open(stdout, QIODevice::WriteOnly))
+    {
+        return 1;
+    }
+    if(parser.isSet("size"))
+    {
+        out.write(QByteArray::number(src->size()) + '\n');
+        return 0;
+    }
+
+    qint64 offset = parser.value("offset").toLongLong();
+    qint64 end = parser.isSet("length") ? qMin(offset + parser.value("length").toLongLong(), src->size()) : src->size();
+    QByteArray buf(IMAGESOURCE_RAW_CHUNK_SIZE, Qt::Uninitialized);
+
+    while(offset < end)
+    {
+        qint64 n = src->pread(buf.data(), qMin<qint64>(buf.size(), end - offset), offset);
+        if(n <= 0)
+        {
+            qCritical() << "Read failed at offset" << offset << ":" << src->errorString();
+            return 1;
+        }
+        out.write(buf.constData(), n);
+        offset += n;
+    }
+
+    return 0;
+}
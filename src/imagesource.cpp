@@ -0,0 +1,694 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "imagesource.h"
+#include <QFile>
+#include <QDebug>
+#include <QMutexLocker>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <curl/curl.h>
+#include <lzma.h>
+#include <zstd.h>
+
+#define ZSTD_SEEKABLE_MAGIC        0x8F92EAB1
+#define ZSTD_SEEKTABLE_FRAME_MAGIC 0x184D2A5E
+#define ZSTD_SEEKTABLE_FOOTER_SIZE 9
+
+#define ZIP_LOCAL_HEADER_SIG       0x04034b50
+#define ZIP_CENTRAL_HEADER_SIG     0x02014b50
+#define ZIP_EOCD_SIG               0x06054b50
+#define ZIP64_EOCD_LOCATOR_SIG     0x07064b50
+#define ZIP64_EOCD_SIG             0x06064b50
+#define ZIP_EOCD_SIZE              22
+#define ZIP_MAX_COMMENT_SIZE       0xFFFF
+
+/*
+ * Where the compressed bytes come from
+ */
+class ImageSource::Input
+{
+public:
+    virtual ~Input() {}
+    virtual qint64 size() = 0;
+    /* Reads exactly len bytes or fails */
+    virtual bool read(char *buf, qint64 len, qint64 offset) = 0;
+
+    QByteArray read(qint64 len, qint64 offset)
+    {
+        QByteArray buf(len, Qt::Uninitialized);
+        if (len < 0 || offset < 0 || offset + len > size() || !read(buf.data(), len, offset))
+            return QByteArray();
+        return buf;
+    }
+
+    QString errorString;
+};
+
+namespace {
+
+class FileInput : public ImageSource::Input
+{
+public:
+    explicit FileInput(const QString &filename) : _file(filename) {}
+
+    bool open()
+    {
+        if (!_file.open(QIODevice::ReadOnly))
+        {
+            errorString = _file.errorString();
+            return false;
+        }
+        return true;
+    }
+
+    qint64 size() override
+    {
+        return _file.size();
+    }
+
+    bool read(char *buf, qint64 len, qint64 offset) override
+    {
+        if (!_file.seek(offset) || _file.read(buf, len) != len)
+        {
+            errorString = _file.errorString();
+            return false;
+        }
+        return true;
+    }
+
+protected:
+    QFile _file;
+};
+
+/*
+ * HTTP(S) server that honours range requests. One connection is kept open for all reads.
+ */
+class HttpInput : public ImageSource::Input
+{
+public:
+    HttpInput(const QByteArray &url, const QByteArray &userAgent)
+        : _url(url), _userAgent(userAgent), _size(-1), _c(nullptr)
+    {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+    }
+
+    ~HttpInput()
+    {
+        if (_c)
+            curl_easy_cleanup(_c);
+        curl_global_cleanup();
+    }
+
+    bool open()
+    {
+        _c = curl_easy_init();
+        if (!_c)
+        {
+            errorString = "Error initializing libcurl";
+            return false;
+        }
+
+        /* Content-Range of the reply tells the total size, and that ranges are supported at all */
+        char b;
+        return read(&b, 1, 0) && _size > 0;
+    }
+
+    qint64 size() override
+    {
+        return _size;
+    }
+
+    bool read(char *buf, qint64 len, qint64 offset) override
+    {
+        char errorBuf[CURL_ERROR_SIZE] = {0};
+        QByteArray range = QByteArray::number(offset)+"-"+QByteArray::number(offset+len-1);
+        _buf = buf;
+        _len = len;
+        _received = 0;
+
+        curl_easy_reset(_c);
+        curl_easy_setopt(_c, CURLOPT_NOSIGNAL, 1);
+        curl_easy_setopt(_c, CURLOPT_URL, _url.constData());
+        curl_easy_setopt(_c, CURLOPT_RANGE, range.constData());
+        curl_easy_setopt(_c, CURLOPT_WRITEFUNCTION, &HttpInput::_writeCallback);
+        curl_easy_setopt(_c, CURLOPT_WRITEDATA, this);
+        curl_easy_setopt(_c, CURLOPT_HEADERFUNCTION, &HttpInput::_headerCallback);
+        curl_easy_setopt(_c, CURLOPT_HEADERDATA, this);
+        curl_easy_setopt(_c, CURLOPT_FOLLOWLOCATION, 1);
+        curl_easy_setopt(_c, CURLOPT_MAXREDIRS, 10);
+        curl_easy_setopt(_c, CURLOPT_ERRORBUFFER, errorBuf);
+        curl_easy_setopt(_c, CURLOPT_FAILONERROR, 1);
+        curl_easy_setopt(_c, CURLOPT_CONNECTTIMEOUT, 30);
+        curl_easy_setopt(_c, CURLOPT_LOW_SPEED_TIME, 60);
+        curl_easy_setopt(_c, CURLOPT_LOW_SPEED_LIMIT, 100);
+        if (!_userAgent.isEmpty())
+            curl_easy_setopt(_c, CURLOPT_USERAGENT, _userAgent.constData());
+
+        CURLcode ret = curl_easy_perform(_c);
+        long httpCode = 0;
+        curl_easy_getinfo(_c, CURLINFO_RESPONSE_CODE, &httpCode);
+
+        if (ret != CURLE_OK && ret != CURLE_WRITE_ERROR)
+        {
+            errorString = QString::fromLatin1(*errorBuf ? errorBuf : curl_easy_strerror(ret));
+            return false;
+        }
+        /* A 200 would be the whole image, abort it rather than download everything */
+        if (httpCode != 206)
+        {
+            errorString = QString("Server does not support range requests (HTTP status %1)").arg(httpCode);
+            return false;
+        }
+        if (_received != len)
+        {
+            errorString = QString("Short read from server at offset %1").arg(offset);
+            return false;
+        }
+
+        return true;
+    }
+
+protected:
+    static size_t _writeCallback(char *ptr, size_t size, size_t nmemb, void *userdata)
+    {
+        HttpInput *in = static_cast<HttpInput *>(userdata);
+        qint64 len = size * nmemb;
+
+        if (in->_received + len > in->_len)
+            return 0;
+        memcpy(in->_buf + in->_received, ptr, len);
+        in->_received += len;
+        return len;
+    }
+
+    static size_t _headerCallback(char *ptr, size_t size, size_t nmemb, void *userdata)
+    {
+        HttpInput *in = static_cast<HttpInput *>(userdata);
+        QByteArray header(ptr, size * nmemb);
+
+        /* Content-Range: bytes 0-0/1234 */
+        if (header.toLower().startsWith("content-range:"))
+        {
+            int slash = header.lastIndexOf('/');
+            bool ok;
+            qint64 total = header.mid(slash + 1).trimmed().toLongLong(&ok);
+            if (slash > 0 && ok)
+                in->_size = total;
+        }
+
+        return size * nmemb;
+    }
+
+    QByteArray _url, _userAgent;
+    qint64 _size;
+    CURL *_c;
+    char *_buf;
+    qint64 _len, _received;
+};
+
+}
+
+ImageSource *ImageSource::open(const QUrl &url, const QByteArray &userAgent)
+{
+    Input *input;
+    bool opened;
+
+    if (url.isLocalFile())
+    {
+        FileInput *f = new FileInput(url.toLocalFile());
+        opened = f->open();
+        input = f;
+    }
+    else if (url.scheme() == "http" || url.scheme() == "https")
+    {
+        HttpInput *h = new HttpInput(url.toString(QUrl::FullyEncoded).toLatin1(), userAgent);
+        opened = h->open();
+        input = h;
+    }
+    else
+    {
+        return nullptr;
+    }
+
+    std::unique_ptr<ImageSource> src(new ImageSource(input));
+    if (!opened)
+    {
+        qDebug() << "Cannot open" << url << "for random access:" << input->errorString;
+        return nullptr;
+    }
+
+    QByteArray magic = input->read(qMin<qint64>(6, input->size()), 0);
+    bool ok;
+
+    if (magic.startsWith("\xFD" "7zXZ"))
+        ok = src->_parseXz();
+    else if (magic.startsWith("\x28\xB5\x2F\xFD"))
+        ok = src->_parseZstd();
+    else if (magic.startsWith("PK\x03\x04"))
+        ok = src->_parseZip();
+    else
+        ok = src->_parseRaw(0, input->size()); /* fails for anything without a partition table, e.g. .gz, .bz2, .lz4 */
+
+    if (ok)
+    {
+        for (const Extent &e : src->_extents)
+        {
+            if (e.size > IMAGESOURCE_MAX_EXTENT_SIZE)
+            {
+                qDebug() << "Image" << url << "has" << e.size << "byte blocks, not using random access";
+                ok = false;
+                break;
+            }
+        }
+    }
+    if (!ok)
+        return nullptr;
+
+    qDebug() << "Random access to" << url << ":" << src->_extents.size() << "blocks, uncompressed size" << src->_size;
+    return src.release();
+}
+
+ImageSource::ImageSource(Input *input)
+    : _input(input), _format(Raw), _size(0)
+{
+}
+
+ImageSource::~ImageSource()
+{
+}
+
+qint64 ImageSource::size() const
+{
+    return _size;
+}
+
+QString ImageSource::errorString() const
+{
+    return _error;
+}
+
+/* Only accepts data starting with an MBR or protective MBR, so an unknown compression format is never taken as image */
+bool ImageSource::_parseRaw(qint64 dataOffset, qint64 size)
+{
+    _format = Raw;
+    _extents.clear();
+
+    QByteArray signature = (size >= 512) ? _input->read(2, dataOffset + 510) : QByteArray();
+    if (signature != QByteArray("\x55\xAA", 2))
+    {
+        qDebug() << "No partition table at the start of the image, not using random access";
+        return false;
+    }
+
+    for (qint64 pos = 0; pos < size; pos += IMAGESOURCE_RAW_CHUNK_SIZE)
+    {
+        qint64 len = qMin<qint64>(IMAGESOURCE_RAW_CHUNK_SIZE, size - pos);
+        _extents.append({pos, len, dataOffset + pos, len, 0, 0});
+    }
+    _size = size;
+
+    return size > 0;
+}
+
+/*
+ * Walks the streams backwards through their footers and indexes, every block listed there
+ * can be decoded on its own
+ */
+bool ImageSource::_parseXz()
+{
+    QVector<QVector<Extent>> streams;
+    qint64 end = _input->size();
+
+    while (end > 0)
+    {
+        QByteArray footer = _input->read(LZMA_STREAM_HEADER_SIZE, end - LZMA_STREAM_HEADER_SIZE);
+        if (footer.size() != LZMA_STREAM_HEADER_SIZE)
+            return false;
+        /* Stream padding comes in multiples of 4 bytes */
+        if (footer.endsWith(QByteArray(4, '\0')))
+        {
+            end -= 4;
+            continue;
+        }
+
+        lzma_stream_flags flags;
+        if (lzma_stream_footer_decode(&flags, (const uint8_t *) footer.constData()) != LZMA_OK
+                || (qint64) flags.backward_size > end - 2 * LZMA_STREAM_HEADER_SIZE)
+        {
+            qDebug() << "Unable to parse footer of .xz file";
+            return false;
+        }
+
+        QByteArray indexData = _input->read(flags.backward_size, end - LZMA_STREAM_HEADER_SIZE - flags.backward_size);
+        lzma_index *idx = nullptr;
+        uint64_t memlimit = UINT64_MAX;
+        size_t pos = 0;
+
+        if (indexData.isEmpty() || lzma_index_buffer_decode(&idx, &memlimit, NULL, (const uint8_t *) indexData.constData(), &pos, indexData.size()) != LZMA_OK)
+        {
+            qDebug() << "Unable to parse index of .xz file";
+            return false;
+        }
+
+        /* Stream header, blocks, index and footer */
+        qint64 streamStart = end - (qint64) lzma_index_stream_size(idx);
+        QVector<Extent> extents;
+        lzma_index_iter iter;
+
+        lzma_index_iter_init(&iter, idx);
+        while (streamStart >= 0 && !lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK))
+        {
+            extents.append({(qint64) iter.block.uncompressed_stream_offset,
+                            (qint64) iter.block.uncompressed_size,
+                            streamStart + (qint64) iter.block.compressed_stream_offset,
+                            (qint64) iter.block.total_size,
+                            (qint64) iter.block.unpadded_size,
+                            (int) flags.check});
+        }
+        lzma_index_end(idx, NULL);
+
+        if (streamStart < 0)
+            return false;
+        streams.prepend(extents);
+        end = streamStart;
+    }
+
+    _format = Xz;
+    _extents.clear();
+    _size = 0;
+    for (const QVector<Extent> &stream : streams)
+    {
+        qint64 streamSize = 0;
+        for (Extent e : stream)
+        {
+            streamSize = e.offset + e.size;
+            e.offset += _size;
+            _extents.append(e);
+        }
+        _size += streamSize;
+    }
+
+    return !_extents.isEmpty();
+}
+
+/*
+ * Seekable zstd: regular frames followed by a skippable frame listing their sizes
+ */
+bool ImageSource::_parseZstd()
+{
+    qint64 fileSize = _input->size();
+    QByteArray footer = _input->read(ZSTD_SEEKTABLE_FOOTER_SIZE, fileSize - ZSTD_SEEKTABLE_FOOTER_SIZE);
+
+    if (footer.size() != ZSTD_SEEKTABLE_FOOTER_SIZE || qFromLittleEndian<quint32>(footer.constData() + 5) != ZSTD_SEEKABLE_MAGIC)
+    {
+        qDebug() << "zstd image has no seek table";
+        return false;
+    }
+
+    quint32 numFrames = qFromLittleEndian<quint32>(footer.constData());
+    bool checksums = footer.at(4) & 0x80;
+    qint64 entrySize = checksums ? 12 : 8;
+    qint64 tableSize = numFrames * entrySize;
+    qint64 tableStart = fileSize - ZSTD_SEEKTABLE_FOOTER_SIZE - tableSize;
+
+    QByteArray header = _input->read(8, tableStart - 8);
+    QByteArray table = _input->read(tableSize, tableStart);
+    if (header.size() != 8 || table.size() != tableSize
+            || qFromLittleEndian<quint32>(header.constData()) != ZSTD_SEEKTABLE_FRAME_MAGIC
+            || qFromLittleEndian<quint32>(header.constData() + 4) != tableSize + ZSTD_SEEKTABLE_FOOTER_SIZE)
+    {
+        qDebug() << "Invalid zstd seek table";
+        return false;
+    }
+
+    _format = Zstd;
+    _extents.clear();
+    _size = 0;
+    qint64 compressedPos = 0;
+
+    for (quint32 i = 0; i < numFrames; i++)
+    {
+        const char *entry = table.constData() + i * entrySize;
+        qint64 csize = qFromLittleEndian<quint32>(entry);
+        qint64 usize = qFromLittleEndian<quint32>(entry + 4);
+
+        if (usize)
+            _extents.append({_size, usize, compressedPos, csize, 0, 0});
+        _size += usize;
+        compressedPos += csize;
+    }
+
+    if (compressedPos != tableStart - 8)
+    {
+        qDebug() << "zstd seek table does not match the file size";
+        return false;
+    }
+
+    return !_extents.isEmpty();
+}
+
+/*
+ * Image stored without compression as only file of a zip archive
+ */
+bool ImageSource::_parseZip()
+{
+    qint64 fileSize = _input->size();
+    qint64 tailSize = qMin<qint64>(fileSize, ZIP_EOCD_SIZE + ZIP_MAX_COMMENT_SIZE);
+    QByteArray tail = _input->read(tailSize, fileSize - tailSize);
+    qint64 eocd = -1;
+
+    for (qint64 i = tail.size() - ZIP_EOCD_SIZE; i >= 0; i--)
+    {
+        if (qFromLittleEndian<quint32>(tail.constData() + i) == ZIP_EOCD_SIG)
+        {
+            eocd = i;
+            break;
+        }
+    }
+    if (eocd < 0)
+        return false;
+
+    const char *e = tail.constData() + eocd;
+    qint64 numEntries = qFromLittleEndian<quint16>(e + 10);
+    qint64 cdSize = qFromLittleEndian<quint32>(e + 12);
+    qint64 cdOffset = qFromLittleEndian<quint32>(e + 16);
+
+    if (cdOffset == 0xFFFFFFFF || numEntries == 0xFFFF)
+    {
+        if (eocd < 20 || qFromLittleEndian<quint32>(e - 20) != ZIP64_EOCD_LOCATOR_SIG)
+            return false;
+
+        QByteArray eocd64 = _input->read(56, qFromLittleEndian<quint64>(e - 12));
+        if (eocd64.size() != 56 || qFromLittleEndian<quint32>(eocd64.constData()) != ZIP64_EOCD_SIG)
+            return false;
+
+        numEntries = qFromLittleEndian<quint64>(eocd64.constData() + 32);
+        cdSize = qFromLittleEndian<quint64>(eocd64.constData() + 40);
+        cdOffset = qFromLittleEndian<quint64>(eocd64.constData() + 48);
+    }
+
+    QByteArray cd = _input->read(cdSize, cdOffset);
+    if (cd.isEmpty())
+        return false;
+
+    qint64 pos = 0, dataSize = 0, localHeader = -1;
+    for (qint64 n = 0; n < numEntries; n++)
+    {
+        if (pos + 46 > cd.size() || qFromLittleEndian<quint32>(cd.constData() + pos) != ZIP_CENTRAL_HEADER_SIG)
+            return false;
+
+        const char *h = cd.constData() + pos;
+        quint16 flags = qFromLittleEndian<quint16>(h + 8);
+        quint16 method = qFromLittleEndian<quint16>(h + 10);
+        qint64 csize = qFromLittleEndian<quint32>(h + 20);
+        qint64 usize = qFromLittleEndian<quint32>(h + 24);
+        qint64 nameLen = qFromLittleEndian<quint16>(h + 28);
+        qint64 extraLen = qFromLittleEndian<quint16>(h + 30);
+        qint64 commentLen = qFromLittleEndian<quint16>(h + 32);
+        qint64 offset = qFromLittleEndian<quint32>(h + 42);
+
+        if (pos + 46 + nameLen + extraLen > cd.size())
+            return false;
+
+        /* ZIP64 extended information, holds only the fields that overflowed */
+        for (qint64 x = pos + 46 + nameLen; x + 4 <= pos + 46 + nameLen + extraLen; )
+        {
+            quint16 id = qFromLittleEndian<quint16>(cd.constData() + x);
+            quint16 len = qFromLittleEndian<quint16>(cd.constData() + x + 2);
+            const char *field = cd.constData() + x + 4;
+            const char *fieldEnd = field + len;
+
+            if (id == 0x0001)
+            {
+                for (qint64 *value : {&usize, &csize, &offset})
+                {
+                    if (*value == 0xFFFFFFFF && field + 8 <= fieldEnd)
+                    {
+                        *value = qFromLittleEndian<quint64>(field);
+                        field += 8;
+                    }
+                }
+            }
+            x += 4 + len;
+        }
+
+        if (usize > 0)
+        {
+            if (localHeader != -1)
+            {
+                qDebug() << "zip archive contains multiple files, not using random access";
+                return false;
+            }
+            if (method != 0 || (flags & 1) || csize != usize)
+            {
+                qDebug() << "Image in zip archive is compressed or encrypted, not using random access";
+                return false;
+            }
+            localHeader = offset;
+            dataSize = usize;
+        }
+
+        pos += 46 + nameLen + extraLen + commentLen;
+    }
+
+    if (localHeader < 0)
+        return false;
+
+    QByteArray lh = _input->read(30, localHeader);
+    if (lh.size() != 30 || qFromLittleEndian<quint32>(lh.constData()) != ZIP_LOCAL_HEADER_SIG)
+        return false;
+
+    qint64 dataStart = localHeader + 30 + qFromLittleEndian<quint16>(lh.constData() + 26) + qFromLittleEndian<quint16>(lh.constData() + 28);
+    if (dataStart + dataSize > fileSize)
+        return false;
+
+    return _parseRaw(dataStart, dataSize);
+}
+
+bool ImageSource::_decodeXzBlock(const Extent &extent, const QByteArray &in, QByteArray &out)
+{
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block = {};
+    block.version = 1;
+    block.check = (lzma_check) extent.check;
+    block.filters = filters;
+    block.header_size = lzma_block_header_size_decode((uint8_t) in.at(0));
+
+    if (block.header_size > (quint32) in.size()
+            || lzma_block_header_decode(&block, NULL, (const uint8_t *) in.constData()) != LZMA_OK)
+    {
+        _error = "Invalid .xz block header";
+        return false;
+    }
+
+    size_t inPos = block.header_size, outPos = 0;
+    lzma_ret ret = lzma_block_compressed_size(&block, extent.unpaddedSize);
+    if (ret == LZMA_OK)
+        ret = lzma_block_buffer_decode(&block, NULL, (const uint8_t *) in.constData(), &inPos, in.size(),
+                                       (uint8_t *) out.data(), &outPos, out.size());
+    lzma_filters_free(filters, NULL);
+
+    if (ret != LZMA_OK || (qint64) outPos != extent.size)
+    {
+        _error = QString("Error decompressing .xz block (%1)").arg(ret);
+        return false;
+    }
+
+    return true;
+}
+
+bool ImageSource::_extentData(int index, QByteArray &data)
+{
+    for (int i = 0; i < _cache.size(); i++)
+    {
+        if (_cache.at(i).first == index)
+        {
+            _cache.move(i, 0);
+            data = _cache.first().second;
+            return true;
+        }
+    }
+
+    const Extent &extent = _extents.at(index);
+    QByteArray in = _input->read(extent.compressedSize, extent.compressedOffset);
+    if (in.isEmpty())
+    {
+        _error = _input->errorString;
+        return false;
+    }
+
+    if (_format == Raw)
+    {
+        data = in;
+    }
+    else
+    {
+        data = QByteArray(extent.size, Qt::Uninitialized);
+
+        if (_format == Xz)
+        {
+            if (!_decodeXzBlock(extent, in, data))
+                return false;
+        }
+        else
+        {
+            size_t ret = ZSTD_decompress(data.data(), data.size(), in.constData(), in.size());
+            if (ZSTD_isError(ret) || (qint64) ret != extent.size)
+            {
+                _error = QString("Error decompressing zstd frame: %1").arg(ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "size mismatch");
+                return false;
+            }
+        }
+    }
+
+    _cache.prepend(qMakePair(index, data));
+    while (_cache.size() > IMAGESOURCE_CACHED_EXTENTS)
+        _cache.removeLast();
+
+    return true;
+}
+
+qint64 ImageSource::pread(char *buf, qint64 len, qint64 offset)
+{
+    QMutexLocker lock(&_mutex);
+    qint64 done = 0;
+
+    if (offset < 0)
+        return -1;
+
+    while (done < len && offset + done < _size)
+    {
+        qint64 pos = offset + done;
+        auto it = std::upper_bound(_extents.cbegin(), _extents.cend(), pos, [](qint64 p, const Extent &e) {
+            return p < e.offset;
+        }) - 1;
+        int index = it - _extents.cbegin();
+        QByteArray data;
+
+        if (!_extentData(index, data))
+        {
+            qDebug() << "Error reading image at offset" << pos << ":" << _error;
+            return -1;
+        }
+
+        qint64 n = qMin(len - done, it->offset + it->size - pos);
+        memcpy(buf + done, data.constData() + (pos - it->offset), n);
+        done += n;
+    }
+
+    return done;
+}
+
+DeviceWrapper::BlockReader ImageSource::blockReader()
+{
+    return [this](char *buf, quint64 size, quint64 offset) {
+        qint64 n = pread(buf, size, offset);
+        if (n < 0)
+            throw std::runtime_error(_error.toStdString());
+        memset(buf + n, 0, size - n);
+    };
+}
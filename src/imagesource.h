@@ -0,0 +1,92 @@
+#ifndef IMAGESOURCE_H
+#define IMAGESOURCE_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "devicewrapper.h"
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <QPair>
+#include <QString>
+#include <QUrl>
+#include <QVector>
+#include <memory>
+
+/* Granularity at which uncompressed images and stored zip entries are fetched */
+#define IMAGESOURCE_RAW_CHUNK_SIZE (1024 * 1024)
+/* Images with larger independently decodable units are not worth random access */
+#define IMAGESOURCE_MAX_EXTENT_SIZE (256 * 1024 * 1024)
+/* Decoded units kept around, reads tend to cluster (FAT, then the file it points to) */
+#define IMAGESOURCE_CACHED_EXTENTS 4
+
+/*
+ * Random access to the uncompressed contents of an image, fetching and decoding only the parts that are read.
+ *
+ * Works on uncompressed images, multi-block .xz (through the block index), seekable .zst (through
+ * the seek table frame) and zip entries stored without compression, either as local file or over
+ * HTTP(S) with range requests. The format is recognized by its magic bytes, not by the file name.
+ * Data is only taken as uncompressed image if it starts with a partition table.
+ */
+class ImageSource
+{
+public:
+    /*
+     * Returns nullptr if the image cannot be accessed randomly (e.g. single block .xz, .gz,
+     * deflated zip entries) or not at all, the caller then has to decompress it as a stream
+     */
+    static ImageSource *open(const QUrl &url, const QByteArray &userAgent = QByteArray());
+    virtual ~ImageSource();
+
+    /* Uncompressed size */
+    qint64 size() const;
+
+    /*
+     * Returns the number of bytes read, fewer than len only at the end of the image, or -1 on error
+     */
+    qint64 pread(char *buf, qint64 len, qint64 offset);
+
+    /*
+     * For a read-only DeviceWrapper on top of the image, reads past its end return zeroes
+     */
+    DeviceWrapper::BlockReader blockReader();
+
+    QString errorString() const;
+
+    class Input;
+
+protected:
+    /* Independently decodable part of the image */
+    struct Extent
+    {
+        qint64 offset;              // in the uncompressed image
+        qint64 size;
+        qint64 compressedOffset;    // in the input
+        qint64 compressedSize;
+        qint64 unpaddedSize;        // xz only
+        int check;                  // xz only
+    };
+
+    enum Format { Raw, Xz, Zstd };
+
+    explicit ImageSource(Input *input);
+
+    bool _parseRaw(qint64 dataOffset, qint64 size);
+    bool _parseXz();
+    bool _parseZstd();
+    bool _parseZip();
+    bool _extentData(int index, QByteArray &data);
+    bool _decodeXzBlock(const Extent &extent, const QByteArray &in, QByteArray &out);
+
+    std::unique_ptr<Input> _input;
+    Format _format;
+    QVector<Extent> _extents;
+    qint64 _size;
+    QList<QPair<int, QByteArray>> _cache;
+    QMutex _mutex;
+    QString _error;
+};
+
+#endif // IMAGESOURCE_H
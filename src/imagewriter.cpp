@@ -17,6 +17,9 @@
  #include "wlancredentials.h"
  #include "writeinplacethread.h"
  #include "dfuthread.h"
+ #include "rawcachewritethread.h"
+ #include "prefetchthread.h"
+ #include "imagesource.h"
  #include <archive.h>
  #include <archive_entry.h>
  #include <lzma.h>
@@ -66,7 +69,7 @@
  
  ImageWriter::ImageWriter(QObject *parent)
      : QObject(parent), _repo(QUrl(QString(OSLIST_URL))), _dlnow(0), _verifynow(0),
-       _engine(nullptr), _thread(nullptr), _verifyEnabled(false), _cachingEnabled(false),
+       _downloadChunkSize(0), _engine(nullptr), _thread(nullptr), _prefetch(nullptr), _verifyEnabled(false), _cachingEnabled(false),
        _embeddedMode(false), _online(false), _customCacheFile(false), _trans(nullptr),
        _networkManager(this)
  {
@@ -186,6 +189,24 @@
              _settings.sync();
          }
      }
+
+     /* Second tier: the decompressed image of the last write, only if it fits the budget */
+     _rawCacheBudget = _settings.value("rawBudgetMB", IMAGEWRITER_RAW_CACHE_BUDGET_DEFAULT).toLongLong()*1024*1024;
+     _rawCachedFileHash = _settings.value("lastRawImageSHA256").toByteArray();
+     _rawCacheFileName = QStandardPaths::writableLocation(QStandardPaths::CacheLocation)+QDir::separator()+"lastimage.raw";
+     if (!_rawCachedFileHash.isEmpty())
+     {
+         QFileInfo f(_rawCacheFileName);
+         if (!_cachingEnabled || !_rawCacheBudget || !f.exists() || !f.isReadable() || !f.size()
+                 || !QFile::exists(_rawCacheFileName+".sha256sums"))
+         {
+             QFile::remove(_rawCacheFileName);
+             QFile::remove(_rawCacheFileName+".sha256sums");
+             _rawCachedFileHash.clear();
+             _settings.remove("lastRawImageSHA256");
+             _settings.sync();
+         }
+     }
      _settings.endGroup();
  
      QDir dir(":/i18n", "gem-imager_*.qm");
@@ -221,6 +242,7 @@
  
  ImageWriter::~ImageWriter()
  {
+     _cancelPrefetch();
      if (_trans)
      {
          QCoreApplication::removeTranslator(_trans);
@@ -244,7 +266,7 @@
  }
  
  /* Set URL to download from */
- void ImageWriter::setSrc(const QUrl &url, quint64 downloadLen, quint64 extrLen, QByteArray expectedHash, bool multifilesinzip, QString parentcategory, QString osname, QByteArray initFormat)
+ void ImageWriter::setSrc(const QUrl &url, quint64 downloadLen, quint64 extrLen, QByteArray expectedHash, bool multifilesinzip, QString parentcategory, QString osname, QByteArray initFormat, QByteArray downloadChunks)
  {
      _src = url;
      _downloadLen = downloadLen;
@@ -264,6 +286,121 @@
      {
          _initFormat = "geminit";
      }
+ 
+     /* Optional digest per chunk of the download: {"chunk_size": n, "sha256": [...]} */
+     QJsonObject chunks = QJsonDocument::fromJson(downloadChunks).object();
+     qint64 chunkSize = chunks.value("chunk_size").toInteger();
+     QJsonArray chunkDigests = chunks.value("sha256").toArray();
+     _downloadChunkSize = 0;
+     _downloadChunkDigests.clear();
+     if (!url.isLocalFile() && _downloadLen
+             && chunkSize >= IMAGEWRITER_DOWNLOAD_CHUNK_MIN_SIZE && chunkSize <= IMAGEWRITER_DOWNLOAD_CHUNK_MAX_SIZE
+             && chunkDigests.size() == (qint64) ((_downloadLen + chunkSize - 1) / chunkSize))
+     {
+         for (const QJsonValue &digest : chunkDigests)
+             _downloadChunkDigests.append(digest.toString().toLatin1().toLower());
+         _downloadChunkSize = chunkSize;
+     }
+     else if (!downloadChunks.isEmpty())
+     {
+         qDebug() << "Ignoring download chunk manifest that does not match the image";
+     }
+ 
+     /* Only once a device is chosen as well, selecting an image alone does not start a download */
+     if (readyToWrite())
+         _startPrefetch();
+     else
+         _cancelPrefetch();
+ }
+ 
+ /*
+  * Start downloading the selected image into the cache, replacing a prefetch of another image.
+  * elastic: for the write about to start, at full speed and without decompressing, the writer checks the hash
+  */
+ void ImageWriter::_startPrefetch(bool elastic)
+ {
+     QByteArray urlstr = _src.toString(_src.FullyEncoded).toLatin1();
+     if (_prefetch && _prefetch->url() == urlstr && !_prefetch->hasFailed())
+         return;
+     _cancelPrefetch();
+ 
+     if (!_cachingEnabled || _customCacheFile
+             || (!elastic && !_settings.value("caching/prefetch", IMAGEWRITER_PREFETCH_DEFAULT).toBool())
+             || _src.isLocalFile() || _expectedHash.isEmpty() || _multipleFilesInZip || !_downloadLen
+             || _cachedFileHash == _expectedHash || _rawCachedFileHash == _expectedHash)
+     {
+         return;
+     }
+ 
+     qint64 budget = _settings.value("caching/prefetchBudgetMB", IMAGEWRITER_PREFETCH_BUDGET_DEFAULT).toLongLong()*1024*1024;
+     QStorageInfo si(QStandardPaths::writableLocation(QStandardPaths::CacheLocation));
+     if ((!elastic && (qint64) _downloadLen > budget) || si.bytesAvailable()-(qint64) _downloadLen < IMAGEWRITER_MINIMAL_SPACE_FOR_CACHING)
+     {
+         qDebug() << "Not prefetching image, it exceeds the prefetch budget or the free disk space";
+         return;
+     }
+ 
+     if (!_cachedFileHash.isEmpty())
+     {
+         if (!_settings.isWritable() || !QFile::remove(_cacheFileName))
+         {
+             qDebug() << "Error removing old cache file. Not prefetching";
+             return;
+         }
+         _settings.remove("caching/lastDownloadSHA256");
+         _settings.sync();
+         _cachedFileHash.clear();
+     }
+ 
+     _prefetch = new PrefetchThread(urlstr, _expectedHash, this);
+     _prefetch->setUserAgent(QString("Mozilla/5.0 gem-imager/%1").arg(constantVersion()).toUtf8());
+     _prefetch->setCacheFile(_cacheFileName, _downloadLen);
+     if (_downloadChunkSize)
+         _prefetch->setChunkManifest(_downloadChunkSize, _downloadChunkDigests);
+     _prefetch->setExtractEnabled(!elastic);
+     if (elastic)
+     {
+         _prefetch->start();
+         return;
+     }
+ 
+     _prefetch->setMaxSpeed(_settings.value("caching/prefetchMaxKBps", IMAGEWRITER_PREFETCH_MAX_SPEED_DEFAULT).toLongLong()*1024);
+     /* With the prefetch as context, notifications still queued when it is deleted are dropped, _cancelPrefetch() asks it directly */
+     connect(_prefetch, &PrefetchThread::cacheFileUpdated, _prefetch, [this](QByteArray sha256) { onCacheFileUpdated(sha256); });
+     if (_prepareRawCache(_prefetch))
+         connect(_prefetch, &PrefetchThread::rawCacheFileUpdated, _prefetch, [this](QByteArray sha256) { onRawCacheFileUpdated(sha256); });
+     _prefetch->start(QThread::LowPriority);
+ }
+ 
+ /* Counts a write that downloads an image from the default repository */
+ void ImageWriter::_startDownloadTelemetry(const QByteArray &url)
+ {
+     if (_repo.toString() != OSLIST_URL)
+         return;
+ 
+     DownloadStatsTelemetry *tele = new DownloadStatsTelemetry(url, _parentCategory.toLatin1(), _osName.toLatin1(), _embeddedMode, _currentLangcode, this);
+     connect(tele, SIGNAL(finished()), tele, SLOT(deleteLater()));
+     tele->start();
+ }
+ 
+ void ImageWriter::_cancelPrefetch()
+ {
+     if (!_prefetch)
+         return;
+ 
+     /* Its cleanup must be done before the cache file name is reused */
+     _prefetch->cancelDownload();
+     _prefetch->wait();
+ 
+     /* It may have completed with its notifications still queued, those are dropped along with it */
+     QByteArray cacheFileHash = _prefetch->cacheFileHash(), rawCacheFileHash = _prefetch->rawCacheFileHash();
+     if (!cacheFileHash.isEmpty() && cacheFileHash != _cachedFileHash)
+         onCacheFileUpdated(cacheFileHash);
+     if (!rawCacheFileHash.isEmpty() && rawCacheFileHash != _rawCachedFileHash)
+         onRawCacheFileUpdated(rawCacheFileHash);
+ 
+     delete _prefetch;
+     _prefetch = nullptr;
  }
  
  /* Set device to write to */
@@ -271,6 +408,9 @@
  {
      _dst = device;
      _devLen = deviceSize;
+ 
+     if (readyToWrite())
+         _startPrefetch();
  }
  
  /* Returns true if src and dst are set */
@@ -296,6 +436,10 @@
  
      QByteArray urlstr = _src.toString(_src.FullyEncoded).toLatin1();
      QString lowercaseurl = urlstr.toLower();
+     /* A finished buffer download has been consumed by the previous write, which cached or rejected it */
+     if (_prefetch && (_prefetch->url() != urlstr || _prefetch->hasFailed()
+                       || (!_prefetch->isExtracting() && _prefetch->downloadComplete())))
+         _cancelPrefetch();
      bool compressed = lowercaseurl.endsWith(".zip") || lowercaseurl.endsWith(".xz") || lowercaseurl.endsWith(".bz2") || lowercaseurl.endsWith(".gz") || lowercaseurl.endsWith(".7z") || lowercaseurl.endsWith(".zst") || lowercaseurl.endsWith(".cache");
      if (!_extrLen && _src.isLocalFile())
      {
@@ -305,6 +449,13 @@
              _parseCompressedFile();
          else if (lowercaseurl.endsWith(".xz"))
              _parseXZFile();
+         else if (lowercaseurl.endsWith(".zst"))
+         {
+             /* Only seekable zstd images list their uncompressed size */
+             QScopedPointer<ImageSource> src(ImageSource::open(_src));
+             if (src)
+                 _extrLen = src->size();
+         }
      }
  
      if (_devLen && _extrLen > _devLen)
@@ -371,6 +522,14 @@
          return "";
      };
  
+     bool fromRawCache = !_expectedHash.isEmpty() && _rawCachedFileHash == _expectedHash && !_multipleFilesInZip && _dst != "uniflash";
+     /* Download at network speed into the cache file and write from there, so the device no longer holds back the connection */
+     if (!_prefetch && !fromRawCache && _dst != "uniflash")
+         _startPrefetch(true);
+     /* Still downloading the image in the background, write from the growing cache file */
+     bool followPrefetch = _prefetch && !fromRawCache && _cachedFileHash != _expectedHash && _dst != "uniflash";
+     bool prefetchHoldsRawCache = false;
+ 
      if(_dst.toLatin1() == "uniflash")
      {
          // if device filter set pull board name from filter
@@ -384,9 +543,30 @@
          WriteInPlaceThread* th = new WriteInPlaceThread(urlstr, _dst.toLatin1(), _expectedHash, boardName, this);
          th->setPortNames(_selSerPort, _selEthPort);
          th->setSerPortbaudRate(UNIFLASH_BAUD_RATE);
+         th->setExtractSize(_extrLen);
          _thread = th;
          QObject::connect(_thread, &DownloadThread::updateNumProgress, this, &ImageWriter::sendProgress);
      }
+     else if (fromRawCache)
+     {
+         qDebug() << "Writing image from decompressed image cache";
+         _thread = new RawCacheWriteThread(_rawCacheFileName, _dst.toLatin1(), this);
+     }
+     else if (followPrefetch)
+     {
+         qDebug() << "Continuing from prefetched data";
+         _prefetch->setMaxSpeed(0);
+         /* The writer decompresses the cache file anyway, the prefetch no longer needs to. It still holds the decompressed image cache file */
+         prefetchHoldsRawCache = _prefetch->isExtracting();
+         _prefetch->stopExtracting();
+         LocalFileExtractThread *lfet = new LocalFileExtractThread(QUrl::fromLocalFile(_cacheFileName).toEncoded(), _dst.toLatin1(), _expectedHash, this);
+         lfet->followPrefetch(_prefetch);
+         _thread = lfet;
+         QObject::connect(_thread, &DownloadThread::updateNumProgress, this, &ImageWriter::sendProgress);
+         connect(_thread, SIGNAL(cacheFileUpdated(QByteArray)), SLOT(onCacheFileUpdated(QByteArray)));
+         /* The prefetch is the download of this write */
+         _startDownloadTelemetry(urlstr);
+     }
      else if (QUrl(urlstr).isLocalFile())
      {
          _thread = new LocalFileExtractThread(urlstr, _dst.toLatin1(), _expectedHash, this);
@@ -395,12 +575,9 @@
      else
      {
          _thread = new DownloadExtractThread(urlstr, _dst.toLatin1(), _expectedHash, this);
-         if (_repo.toString() == OSLIST_URL)
-         {
-             DownloadStatsTelemetry *tele = new DownloadStatsTelemetry(urlstr, _parentCategory.toLatin1(), _osName.toLatin1(), _embeddedMode, _currentLangcode, this);
-             connect(tele, SIGNAL(finished()), tele, SLOT(deleteLater()));
-             tele->start();
-         }
+         if (_downloadChunkSize)
+             _thread->setChunkManifest(_downloadChunkSize, _downloadChunkDigests);
+         _startDownloadTelemetry(urlstr);
      }
  
      connect(_thread, SIGNAL(success()), SLOT(onSuccess()));
@@ -410,8 +587,11 @@
      _thread->setVerifyEnabled(_verifyEnabled);
      _thread->setUserAgent(QString("Mozilla/5.0 gem-imager/%1").arg(constantVersion()).toUtf8());
      _thread->setImageCustomization(_config, _cmdline, _firstrun, _cloudinit, _cloudinitNetwork, _geminit, _initFormat, _dst.toLatin1());
+     /* An interrupted write of the same image to the same device continues where it left off next time */
+     if (!_expectedHash.isEmpty() && !fromRawCache && _dst != "uniflash")
+         _thread->setWriteJournal(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)+QDir::separator()+"lastwrite.journal");
  
-     if (!_expectedHash.isEmpty() && _cachedFileHash != _expectedHash && _cachingEnabled)
+     if (!_expectedHash.isEmpty() && _cachedFileHash != _expectedHash && _cachingEnabled && !fromRawCache && !followPrefetch)
      {
          if (!_cachedFileHash.isEmpty())
          {
@@ -446,6 +626,9 @@
          }
      }
  
+     if (!fromRawCache && !prefetchHoldsRawCache && _dst != "uniflash" && _prepareRawCache(_thread))
+         connect(_thread, SIGNAL(rawCacheFileUpdated(QByteArray)), SLOT(onRawCacheFileUpdated(QByteArray)));
+ 
      if (_multipleFilesInZip)
      {
          static_cast<DownloadExtractThread *>(_thread)->enableMultipleFileExtraction();
@@ -473,6 +656,55 @@
      qDebug() << "Done writing cache file";
  }
  
+ /* Also keep the decompressed image if it fits the budget of the second cache tier */
+ bool ImageWriter::_prepareRawCache(DownloadThread *thread)
+ {
+     if (_expectedHash.isEmpty() || _rawCachedFileHash == _expectedHash || !_cachingEnabled || !_rawCacheBudget
+             || _multipleFilesInZip)
+     {
+         return false;
+     }
+ 
+     if (!_rawCachedFileHash.isEmpty())
+     {
+         QFile::remove(_rawCacheFileName+".sha256sums");
+         if (!_settings.isWritable() || !QFile::remove(_rawCacheFileName))
+         {
+             qDebug() << "Error removing old decompressed image cache file. Not caching the image.";
+             return false;
+         }
+         _settings.remove("caching/lastRawImageSHA256");
+         _settings.sync();
+         _rawCachedFileHash.clear();
+     }
+ 
+     QStorageInfo si(QStandardPaths::writableLocation(QStandardPaths::CacheLocation));
+     qint64 needed = _extrLen ? (qint64) _extrLen : _rawCacheBudget;
+ 
+     if (_extrLen && (qint64) _extrLen > _rawCacheBudget)
+     {
+         qDebug() << "Image is larger than the decompressed image cache budget. Not caching it.";
+     }
+     else if (si.bytesAvailable()-needed < IMAGEWRITER_MINIMAL_SPACE_FOR_CACHING)
+     {
+         qDebug() << "Low disk space. Not caching decompressed image.";
+     }
+     else
+     {
+         thread->setRawCacheFile(_rawCacheFileName, _rawCacheBudget);
+         return true;
+     }
+     return false;
+ }
+ 
+ void ImageWriter::onRawCacheFileUpdated(QByteArray sha256)
+ {
+     _settings.setValue("caching/lastRawImageSHA256", sha256);
+     _settings.sync();
+     _rawCachedFileHash = sha256;
+     qDebug() << "Done writing decompressed image cache file";
+ }
+ 
  /* Cancel write */
  void ImageWriter::cancelWrite()
  {
@@ -481,6 +713,9 @@
          connect(_thread, SIGNAL(finished()), SLOT(onCancelled()));
          _thread->cancelDownload();
      }
+     /* A download serving as buffer for this write is part of it */
+     if (_prefetch && !_prefetch->isExtracting())
+         _prefetch->cancelDownload();
  
      if (!_thread || !_thread->isRunning())
      {
@@ -488,7 +723,12 @@
      }
  }
  
- void ImageWriter::onCancelled()
+ quint64 ImageWriter::bytesSkipped()
+{
+    return _thread ? _thread->bytesSkipped() : 0;
+}
+
+void ImageWriter::onCancelled()
  {
      sender()->deleteLater();
      if (sender() == _thread)
@@ -939,6 +1179,9 @@ void ImageWriter::startDfu()
         return;
     }
 
+    /* DFU downloads on its own */
+    _cancelPrefetch();
+
     QByteArray urlstr = _src.toString(_src.FullyEncoded).toLatin1();
 
     DfuThread *dfuThread = new DfuThread(urlstr, _dst.toLatin1(), _expectedHash, this);
@@ -1057,20 +1300,22 @@ void ImageWriter::startDfu()
      int numFiles = 0;
      _extrLen = 0;
  
-     archive_read_support_filter_all(a);
-     archive_read_support_format_all(a);
+     /* Reading a file it can seek in, the zip reader takes the sizes from the central directory (also of
+        entries written with data descriptors) and seeks past the data instead of decompressing it */
+     archive_read_support_format_zip(a);
  
-     if (archive_read_open_filename(a, fn.data(), 10240) == ARCHIVE_OK)
+     if (archive_read_open_filename(a, fn.data(), IMAGEWRITER_BLOCKSIZE) == ARCHIVE_OK)
      {
          while ( (archive_read_next_header(a, &entry)) == ARCHIVE_OK)
          {
-             if (archive_entry_size(entry) > 0)
+             if (archive_entry_size_is_set(entry) && archive_entry_size(entry) > 0)
              {
                _extrLen += archive_entry_size(entry);
                numFiles++;
              }
          }
      }
+     archive_read_free(a);
  
      if (numFiles > 1)
          _multipleFilesInZip = true;
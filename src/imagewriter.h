@@ -26,6 +26,7 @@
 class QQmlApplicationEngine;
 class DownloadThread;
 class DfuThread;
+class PrefetchThread;
 class QNetworkReply;
 class QTranslator;
 
@@ -42,7 +43,7 @@ public:
     Q_INVOKABLE void setEthPort(const QString& ethPort);
 
     /* Set URL to download from, and if known download length and uncompressed length */
-    Q_INVOKABLE void setSrc(const QUrl &url, quint64 downloadLen = 0, quint64 extrLen = 0, QByteArray expectedHash = "", bool multifilesinzip = false, QString parentcategory = "", QString osname = "", QByteArray initFormat = "");
+    Q_INVOKABLE void setSrc(const QUrl &url, quint64 downloadLen = 0, quint64 extrLen = 0, QByteArray expectedHash = "", bool multifilesinzip = false, QString parentcategory = "", QString osname = "", QByteArray initFormat = "", QByteArray downloadChunks = "");
 
     /* Set device to write to */
     Q_INVOKABLE void setDst(const QString &device, quint64 deviceSize = 0);
@@ -62,6 +63,9 @@ public:
     /* Cancel write */
     Q_INVOKABLE void cancelWrite();
 
+    /* Bytes of the last write that were already on the device and not rewritten */
+    Q_INVOKABLE quint64 bytesSkipped();
+
     /* Return true if url is in our local disk cache */
     Q_INVOKABLE bool isCached(const QUrl &url, const QByteArray &sha256);
 
@@ -189,6 +193,7 @@ protected slots:
     void onFileSelected(QString filename);
     void onCancelled();
     void onCacheFileUpdated(QByteArray sha256);
+    void onRawCacheFileUpdated(QByteArray sha256);
     void onFinalizing();
     void onTimeSyncReply(QNetworkReply *reply);
     void onPreparationStatusUpdate(QString msg);
@@ -207,16 +212,19 @@ private:
 
 protected:
     QUrl _src, _repo;
-    QString _dst, _cacheFileName, _parentCategory, _osName, _currentLang, _currentLangcode, _currentKeyboard;
+    QString _dst, _cacheFileName, _rawCacheFileName, _parentCategory, _osName, _currentLang, _currentLangcode, _currentKeyboard;
     QString _selSerPort, _selEthPort;
     QString _imageTargetBoard;
-    QByteArray _expectedHash, _cachedFileHash, _cmdline, _config, _firstrun, _cloudinit, _cloudinitNetwork, _geminit, _initFormat;
+    QByteArray _expectedHash, _cachedFileHash, _rawCachedFileHash, _cmdline, _config, _firstrun, _cloudinit, _cloudinitNetwork, _geminit, _initFormat;
     quint64 _downloadLen, _extrLen, _devLen, _dlnow, _verifynow;
+    qint64 _rawCacheBudget, _downloadChunkSize;
+    QList<QByteArray> _downloadChunkDigests;
     DriveListModel _drivelist;
     QQmlApplicationEngine *_engine;
     QTimer _polltimer, _networkchecktimer;
     PowerSaveBlocker _powersave;
     DownloadThread *_thread;
+    PrefetchThread *_prefetch;
     bool _verifyEnabled, _multipleFilesInZip, _cachingEnabled, _embeddedMode, _online;
     QSettings _settings;
     QMap<QString,QString> _translations;
@@ -224,6 +232,10 @@ protected:
     QTranslator *_trans;
 
     void _parseCompressedFile();
+    void _startPrefetch(bool elastic = false);
+    void _cancelPrefetch();
+    void _startDownloadTelemetry(const QByteArray &url);
+    bool _prepareRawCache(DownloadThread *thread);
     void _parseXZFile();
     QString _pubKeyFileName();
     QString _privKeyFileName();
@@ -0,0 +1,321 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Replaces the `ip link`, `ip addr` and `ethtool -s` invocations
+ * of the network boot helper with direct kernel calls
+ */
+
+#include "netlinkconfig.h"
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+#include <QDeadlineTimer>
+#include <QDebug>
+
+#define NETLINK_REPLY_TIMEOUT_MSEC 1000
+
+/* Advertising bits that describe the port rather than a link mode */
+#define ETHTOOL_NON_MODE_BITS (ADVERTISED_Autoneg | ADVERTISED_TP | ADVERTISED_AUI | ADVERTISED_MII \
+                               | ADVERTISED_FIBRE | ADVERTISED_BNC | ADVERTISED_Backplane)
+
+static bool addAttr(struct nlmsghdr *nh, size_t maxlen, int type, const void *data, int len)
+{
+    int attrlen = RTA_LENGTH(len);
+    if (NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(attrlen) > maxlen)
+        return false;
+
+    struct rtattr *rta = (struct rtattr *) (((char *) nh) + NLMSG_ALIGN(nh->nlmsg_len));
+    rta->rta_type = type;
+    rta->rta_len = attrlen;
+    memcpy(RTA_DATA(rta), data, len);
+    nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + RTA_ALIGN(attrlen);
+    return true;
+}
+
+static uint32_t advertisedModes(int speed, bool fullDuplex)
+{
+    switch (speed)
+    {
+    case 10:
+        return fullDuplex ? ADVERTISED_10baseT_Full : ADVERTISED_10baseT_Half;
+    case 100:
+        return fullDuplex ? ADVERTISED_100baseT_Full : ADVERTISED_100baseT_Half;
+    case 1000:
+        return fullDuplex ? ADVERTISED_1000baseT_Full : ADVERTISED_1000baseT_Half;
+    default:
+        return 0;
+    }
+}
+
+NetlinkConfig::NetlinkConfig(const QByteArray &ifname)
+    : _ifname(ifname), _ifindex(0), _rtnl(-1), _monitor(-1), _ioctlSock(-1), _seq(0)
+{
+    _ifindex = if_nametoindex(ifname.constData());
+    if (!_ifindex)
+    {
+        qDebug() << "Network interface not found:" << ifname;
+        return;
+    }
+
+    _rtnl = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    _ioctlSock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    _monitor = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+
+    if (_monitor >= 0)
+    {
+        struct sockaddr_nl sa = {};
+        sa.nl_family = AF_NETLINK;
+        sa.nl_groups = RTMGRP_LINK;
+        if (::bind(_monitor, (struct sockaddr *) &sa, sizeof(sa)) < 0)
+        {
+            qDebug() << "Error subscribing to link notifications:" << strerror(errno);
+            ::close(_monitor);
+            _monitor = -1;
+        }
+    }
+}
+
+NetlinkConfig::~NetlinkConfig()
+{
+    if (_rtnl >= 0)
+        ::close(_rtnl);
+    if (_monitor >= 0)
+        ::close(_monitor);
+    if (_ioctlSock >= 0)
+        ::close(_ioctlSock);
+}
+
+bool NetlinkConfig::isValid()
+{
+    return _ifindex && _rtnl >= 0 && _ioctlSock >= 0;
+}
+
+int NetlinkConfig::_request(struct nlmsghdr *nh)
+{
+    struct sockaddr_nl kernel = {};
+    kernel.nl_family = AF_NETLINK;
+
+    nh->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+    nh->nlmsg_seq = ++_seq;
+
+    if (::sendto(_rtnl, nh, nh->nlmsg_len, 0, (struct sockaddr *) &kernel, sizeof(kernel)) < 0)
+        return -errno;
+
+    char buf[8192];
+    QDeadlineTimer deadline(NETLINK_REPLY_TIMEOUT_MSEC);
+
+    while (!deadline.hasExpired())
+    {
+        struct pollfd pfd = { _rtnl, POLLIN, 0 };
+        if (::poll(&pfd, 1, deadline.remainingTime()) <= 0)
+            break;
+
+        ssize_t len = ::recv(_rtnl, buf, sizeof(buf), 0);
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        for (struct nlmsghdr *reply = (struct nlmsghdr *) buf; NLMSG_OK(reply, len); reply = NLMSG_NEXT(reply, len))
+        {
+            if (reply->nlmsg_seq != _seq || reply->nlmsg_type != NLMSG_ERROR)
+                continue;
+
+            /* error 0 is the acknowledgement */
+            struct nlmsgerr *err = (struct nlmsgerr *) NLMSG_DATA(reply);
+            return err->error;
+        }
+    }
+
+    return -ETIMEDOUT;
+}
+
+bool NetlinkConfig::setLinkUp(bool up)
+{
+    struct {
+        struct nlmsghdr nh;
+        struct ifinfomsg ifi;
+    } req = {};
+
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+    req.nh.nlmsg_type = RTM_NEWLINK;
+    req.ifi.ifi_family = AF_UNSPEC;
+    req.ifi.ifi_index = _ifindex;
+    req.ifi.ifi_change = IFF_UP;
+    req.ifi.ifi_flags = up ? IFF_UP : 0;
+
+    int err = _request(&req.nh);
+    if (err)
+    {
+        qDebug() << "Error setting link" << _ifname << (up ? "up:" : "down:") << strerror(-err);
+        return false;
+    }
+
+    return true;
+}
+
+bool NetlinkConfig::_changeAddress(int type, int flags, const QHostAddress &addr, int prefixLength)
+{
+    struct {
+        struct nlmsghdr nh;
+        struct ifaddrmsg ifa;
+        char attrbuf[64];
+    } req = {};
+
+    bool ok;
+    struct in_addr in;
+    in.s_addr = htonl(addr.toIPv4Address(&ok));
+    if (!ok)
+    {
+        qDebug() << "Only IPv4 addresses are supported:" << addr;
+        return false;
+    }
+
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifa));
+    req.nh.nlmsg_type = type;
+    req.nh.nlmsg_flags = flags;
+    req.ifa.ifa_family = AF_INET;
+    req.ifa.ifa_prefixlen = prefixLength;
+    req.ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+    req.ifa.ifa_index = _ifindex;
+    addAttr(&req.nh, sizeof(req), IFA_LOCAL, &in, sizeof(in));
+    addAttr(&req.nh, sizeof(req), IFA_ADDRESS, &in, sizeof(in));
+
+    int err = _request(&req.nh);
+    if (err)
+    {
+        qDebug() << "Error changing address" << addr << "on" << _ifname << ":" << strerror(-err);
+        return false;
+    }
+
+    return true;
+}
+
+bool NetlinkConfig::addAddress(const QHostAddress &addr, int prefixLength)
+{
+    return _changeAddress(RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, addr, prefixLength);
+}
+
+bool NetlinkConfig::removeAddress(const QHostAddress &addr, int prefixLength)
+{
+    return _changeAddress(RTM_DELADDR, 0, addr, prefixLength);
+}
+
+bool NetlinkConfig::setLinkMode(int speed, bool fullDuplex, bool autoneg)
+{
+    struct ethtool_cmd ecmd = {};
+    struct ifreq ifr = {};
+
+    strncpy(ifr.ifr_name, _ifname.constData(), IFNAMSIZ - 1);
+    ifr.ifr_data = (char *) &ecmd;
+
+    ecmd.cmd = ETHTOOL_GSET;
+    if (::ioctl(_ioctlSock, SIOCETHTOOL, &ifr) < 0)
+    {
+        qDebug() << "Error reading link settings of" << _ifname << ":" << strerror(errno);
+        return false;
+    }
+
+    ecmd.cmd = ETHTOOL_SSET;
+    if (autoneg)
+    {
+        uint32_t modes = advertisedModes(speed, fullDuplex) & ecmd.supported;
+        ecmd.autoneg = AUTONEG_ENABLE;
+        ecmd.advertising = modes ? modes : (ecmd.supported & ~ETHTOOL_NON_MODE_BITS);
+    }
+    else
+    {
+        ecmd.autoneg = AUTONEG_DISABLE;
+        ethtool_cmd_speed_set(&ecmd, speed);
+        ecmd.duplex = fullDuplex ? DUPLEX_FULL : DUPLEX_HALF;
+    }
+
+    if (::ioctl(_ioctlSock, SIOCETHTOOL, &ifr) < 0)
+    {
+        qDebug() << "Error changing link settings of" << _ifname << ":" << strerror(errno);
+        return false;
+    }
+
+    return true;
+}
+
+bool NetlinkConfig::hasCarrier()
+{
+    struct ifreq ifr = {};
+    strncpy(ifr.ifr_name, _ifname.constData(), IFNAMSIZ - 1);
+
+    if (::ioctl(_ioctlSock, SIOCGIFFLAGS, &ifr) < 0)
+        return false;
+
+    return (ifr.ifr_flags & IFF_UP) && (ifr.ifr_flags & IFF_RUNNING);
+}
+
+bool NetlinkConfig::waitForCarrier(int msecs)
+{
+    bool carrier = false;
+
+    /* Subscription is active before the check, so no transition can be missed */
+    readLinkEvents(carrier);
+    if (hasCarrier())
+        return true;
+
+    if (_monitor < 0)
+        return false;
+
+    QDeadlineTimer deadline(msecs);
+    while (!deadline.hasExpired())
+    {
+        struct pollfd pfd = { _monitor, POLLIN, 0 };
+        if (::poll(&pfd, 1, deadline.remainingTime()) <= 0)
+            break;
+
+        if (readLinkEvents(carrier) && carrier)
+            return true;
+    }
+
+    return hasCarrier();
+}
+
+int NetlinkConfig::monitorSocket()
+{
+    return _monitor;
+}
+
+bool NetlinkConfig::readLinkEvents(bool &carrier)
+{
+    bool found = false;
+    char buf[8192];
+    ssize_t len;
+
+    if (_monitor < 0)
+        return false;
+
+    while ((len = ::recv(_monitor, buf, sizeof(buf), 0)) > 0)
+    {
+        for (struct nlmsghdr *nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len))
+        {
+            if (nh->nlmsg_type != RTM_NEWLINK)
+                continue;
+
+            struct ifinfomsg *ifi = (struct ifinfomsg *) NLMSG_DATA(nh);
+            if (ifi->ifi_index != _ifindex)
+                continue;
+
+            carrier = (ifi->ifi_flags & IFF_UP) && (ifi->ifi_flags & IFF_RUNNING);
+            found = true;
+        }
+    }
+
+    return found;
+}
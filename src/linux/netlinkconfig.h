@@ -0,0 +1,63 @@
+#ifndef NETLINKCONFIG_H
+#define NETLINKCONFIG_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <QByteArray>
+#include <QHostAddress>
+
+/*
+ * Configures a network interface in-process through rtnetlink (link state, addresses)
+ * and the ethtool ioctl (speed, duplex, autonegotiation). Requires CAP_NET_ADMIN.
+ */
+class NetlinkConfig
+{
+public:
+    explicit NetlinkConfig(const QByteArray &ifname);
+    virtual ~NetlinkConfig();
+
+    /*
+     * Returns false if the interface does not exist or the sockets could not be opened
+     */
+    bool isValid();
+
+    bool setLinkUp(bool up);
+    bool addAddress(const QHostAddress &addr, int prefixLength);
+    bool removeAddress(const QHostAddress &addr, int prefixLength);
+
+    /*
+     * Forces speed (Mbit/s) and duplex if autoneg is false.
+     * With autoneg enabled only the given speed/duplex is advertised, or every supported mode if speed is 0.
+     */
+    bool setLinkMode(int speed, bool fullDuplex, bool autoneg);
+
+    bool hasCarrier();
+
+    /*
+     * Blocks until the interface reports carrier or msecs elapsed
+     */
+    bool waitForCarrier(int msecs);
+
+    /*
+     * Non-blocking socket subscribed to link notifications, suitable for QSocketNotifier
+     */
+    int monitorSocket();
+
+    /*
+     * Drains pending link notifications.
+     * Returns true and sets carrier if the state of this interface was reported.
+     */
+    bool readLinkEvents(bool &carrier);
+
+protected:
+    int _request(struct nlmsghdr *nh);
+    bool _changeAddress(int type, int flags, const QHostAddress &addr, int prefixLength);
+
+    QByteArray _ifname;
+    int _ifindex, _rtnl, _monitor, _ioctlSock;
+    uint32_t _seq;
+};
+
+#endif // NETLINKCONFIG_H
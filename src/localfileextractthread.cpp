@@ -5,6 +5,14 @@
 
 #include "localfileextractthread.h"
 #include "config.h"
+#include "prefetchthread.h"
+#include <archive.h>
+#include <archive_entry.h>
+#include <cerrno>
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#endif
 
 LocalFileExtractThread::LocalFileExtractThread(const QByteArray &url, const QByteArray &dst, const QByteArray &expectedHash, QObject *parent)
     : DownloadExtractThread(url, dst, expectedHash, parent)
@@ -16,9 +24,15 @@ LocalFileExtractThread::~LocalFileExtractThread()
 {
     _cancelled = true;
     wait();
+    _inputHashFuture.waitForFinished();
     qFreeAligned(_inputBuf);
 }
 
+void LocalFileExtractThread::followPrefetch(PrefetchThread *prefetch)
+{
+    _prefetch = prefetch;
+}
+
 void LocalFileExtractThread::_cancelExtract()
 {
     _cancelled = true;
@@ -40,6 +54,7 @@ void LocalFileExtractThread::run()
         _closeFiles();
         return;
     }
+    /* A growing cache file is preallocated to the full download size */
     _lastDlTotal = _inputfile.size();
 
     if(_filename == "uniflash")
@@ -47,27 +62,66 @@ void LocalFileExtractThread::run()
         // Download needed tiboot3.bin linux.appimage and u-boot.img
     }
 
-    if (isImage())
-        extractImageRun();
+    if (isImage() && !_prefetch && _filename != "uniflash" && _isUncompressed())
+    {
+        _writeUncompressedRun();
+    }
     else
-        extractMultiFileRun();
+    {
+        /* A complete file can be read in any order, one prefetch is still downloading cannot */
+        if (!_prefetch)
+        {
+            _seekableInput = true;
+            _scanArchive();
+            if (!isImage())
+            {
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+                _inputHashFuture = QtConcurrent::run(&LocalFileExtractThread::_hashInputFile, this);
+#else
+                _inputHashFuture = QtConcurrent::run(this, &LocalFileExtractThread::_hashInputFile);
+#endif
+            }
+        }
+
+        if (isImage())
+            extractImageRun();
+        else
+            extractMultiFileRun();
+    }
 
     if (_cancelled)
         _closeFiles();
 }
 
-ssize_t LocalFileExtractThread::_on_read(struct archive *, const void **buff)
+ssize_t LocalFileExtractThread::_on_read(struct archive *a, const void **buff)
 {
     if (_cancelled)
         return -1;
 
+    qint64 maxlen = IMAGEWRITER_UNCOMPRESSED_BLOCKSIZE;
+    if (_prefetch)
+    {
+        qint64 available;
+        while ((available = _prefetch->bytesCached() - _inputfile.pos()) <= 0 && !_prefetch->downloadComplete())
+        {
+            if (_cancelled || _prefetch->hasFailed())
+            {
+                archive_set_error(a, EIO, "%s", _prefetch->errorString().toUtf8().constData());
+                return -1;
+            }
+            msleep(20);
+        }
+        maxlen = qBound<qint64>(0, available, maxlen);
+    }
+
     *buff = _inputBuf;
-    ssize_t len = _inputfile.read(_inputBuf, IMAGEWRITER_UNCOMPRESSED_BLOCKSIZE);
+    ssize_t len = _inputfile.read(_inputBuf, maxlen);
 
     if (len > 0)
     {
-        _lastDlNow += len;
-        if (!_isImage)
+        /* Following a prefetch, download progress is that of the network transfer, as with DownloadExtractThread */
+        _lastDlNow = _prefetch ? _prefetch->bytesCached() : _lastDlNow + len;
+        if (!_isImage && !_seekableInput)
         {
             _inputHash.addData(_inputBuf, len);
         }
@@ -76,8 +130,186 @@ ssize_t LocalFileExtractThread::_on_read(struct archive *, const void **buff)
     return len;
 }
 
+/* Asks libarchive, set up as in extractImageRun(), whether it would pass the file through unchanged */
+bool LocalFileExtractThread::_isUncompressed()
+{
+    struct archive *a = archive_read_new();
+    struct archive_entry *entry;
+    QByteArray fn = _inputfile.fileName().toLocal8Bit();
+
+    archive_read_support_filter_all(a);
+    archive_read_support_format_zip(a);
+    archive_read_support_format_7zip(a);
+    archive_read_support_format_raw(a);
+
+    bool raw = archive_read_open_filename(a, fn.constData(), IMAGEWRITER_BLOCKSIZE) == ARCHIVE_OK
+            && archive_read_next_header(a, &entry) == ARCHIVE_OK
+            && archive_filter_code(a, 0) == ARCHIVE_FILTER_NONE
+            && archive_format(a) == ARCHIVE_FORMAT_RAW;
+
+    archive_read_free(a);
+    return raw;
+}
+
+/*
+ * Writes an uncompressed image straight from a mapping of the file, instead of having libarchive
+ * copy it around. DownloadThread::_writeFile() hashes each block on another core while writing it.
+ */
+void LocalFileExtractThread::_writeUncompressedRun()
+{
+    /* A mapping of its own, cancelling closes _inputfile from another thread */
+    QFile input(_inputfile.fileName());
+    _inputfile.close();
+    if (!input.open(QIODevice::ReadOnly))
+    {
+        if (!_cancelled)
+            _onDownloadError(tr("Error opening image file"));
+        return;
+    }
+
+    qint64 size = input.size();
+    qDebug() << "Writing uncompressed image from a mapping of the file";
+#ifdef Q_OS_LINUX
+    posix_fadvise(input.handle(), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    for (qint64 offset = 0; offset < size && !_cancelled; offset += IMAGEWRITER_MAPPED_WINDOW_SIZE)
+    {
+        qint64 windowLen = qMin<qint64>(size - offset, IMAGEWRITER_MAPPED_WINDOW_SIZE);
+        uchar *window = input.map(offset, windowLen);
+        if (!window)
+        {
+            if (!_cancelled)
+                _onDownloadError(tr("Error reading image file"));
+            return;
+        }
+#ifdef Q_OS_LINUX
+        /* Have the next window read from disk while this one is written */
+        posix_fadvise(input.handle(), offset + windowLen, IMAGEWRITER_MAPPED_WINDOW_SIZE, POSIX_FADV_WILLNEED);
+#endif
+
+        for (qint64 pos = 0; pos < windowLen && !_cancelled; pos += IMAGEWRITER_MAPPED_WRITE_SIZE)
+        {
+            qint64 len = qMin<qint64>(windowLen - pos, IMAGEWRITER_MAPPED_WRITE_SIZE);
+            const char *data = (const char *) window + pos;
+            QByteArray padded;
+
+            if (len % 512 != 0)
+            {
+                qDebug() << "Image is NOT a valid disk image, as its length is not a multiple of the sector size of 512 bytes long";
+                padded = QByteArray(data, len);
+                padded.append(512 - (len % 512), '\0');
+                data = padded.constData();
+                len = padded.size();
+            }
+
+            if (_writeFile(data, len) != (size_t) len)
+            {
+                input.unmap(window);
+                if (!_cancelled)
+                    _onWriteError();
+                return;
+            }
+            _lastDlNow += qMin<qint64>(len, windowLen - pos);
+        }
+
+        input.unmap(window);
+    }
+
+    input.close();
+    if (!_cancelled)
+        _writeComplete();
+}
+
+int64_t LocalFileExtractThread::_on_seek(struct archive *, int64_t offset, int whence)
+{
+    if (whence == SEEK_CUR)
+        offset += _inputfile.pos();
+    else if (whence == SEEK_END)
+        offset += _inputfile.size();
+
+    if (offset < 0 || !_inputfile.seek(offset))
+        return ARCHIVE_FATAL;
+
+    return offset;
+}
+
+/*
+ * Zip only: the central directory lists all entries, so this is quick. The image is taken to be
+ * the largest file, and as each entry is compressed on its own several readers can extract them.
+ */
+void LocalFileExtractThread::_scanArchive()
+{
+    struct archive *a = archive_read_new();
+    struct archive_entry *entry;
+    QByteArray fn = _inputfile.fileName().toLocal8Bit();
+
+    archive_read_support_format_zip(a);
+
+    if (archive_read_open_filename(a, fn.constData(), IMAGEWRITER_BLOCKSIZE) == ARCHIVE_OK)
+    {
+        int64_t largest = -1;
+        for (int index = 0; archive_read_next_header(a, &entry) == ARCHIVE_OK; index++)
+        {
+            if (archive_entry_filetype(entry) == AE_IFREG && archive_entry_size_is_set(entry)
+                    && archive_entry_size(entry) > largest)
+            {
+                largest = archive_entry_size(entry);
+                _imageEntry = index;
+            }
+        }
+
+        if (largest >= 0)
+        {
+            _entryWorkers = qBound(1, QThread::idealThreadCount(), IMAGEWRITER_EXTRACT_WORKERS);
+            qDebug() << "Zip archive: image is entry" << _imageEntry << "-" << _entryWorkers << "readers for multi-file extraction";
+        }
+    }
+
+    archive_read_free(a);
+}
+
+/* Hash of the archive as a whole, read separately as extraction seeks around in it */
+void LocalFileExtractThread::_hashInputFile()
+{
+    QFile f(_inputfile.fileName());
+    if (!f.open(QIODevice::ReadOnly))
+        return;
+
+    QByteArray buf;
+    while (!_cancelled && !(buf = f.read(IMAGEWRITER_BLOCKSIZE)).isEmpty())
+        _inputHash.addData(buf);
+}
+
 int LocalFileExtractThread::_on_close(struct archive *)
 {
     _inputfile.close();
     return 0;
 }
+
+void LocalFileExtractThread::_writeComplete()
+{
+    /* Done with the cache file before its fate is decided in _onHashChecked() */
+    if (_prefetch && !_prefetch->isExtracting() && _prefetch->downloadComplete())
+        _prefetch->wait();
+
+    DownloadExtractThread::_writeComplete();
+}
+
+/* A download that served as buffer only has not checked the cache file, the hash check of this write covers it */
+void LocalFileExtractThread::_onHashChecked(bool matches)
+{
+    if (!_prefetch || _prefetch->isExtracting() || !_prefetch->downloadComplete())
+        return;
+
+    if (matches)
+    {
+        emit cacheFileUpdated(_expectedHash);
+    }
+    else
+    {
+        qDebug() << "Removing corrupt download" << _inputfile.fileName() << "from the cache";
+        _inputfile.close();
+        QFile::remove(_inputfile.fileName());
+    }
+}
@@ -8,6 +8,9 @@
 
 #include "downloadextractthread.h"
 #include <QFile>
+#include <QPointer>
+
+class PrefetchThread;
 
 class LocalFileExtractThread : public DownloadExtractThread
 {
@@ -16,13 +19,26 @@ public:
     explicit LocalFileExtractThread(const QByteArray &url, const QByteArray &dst = "", const QByteArray &expectedHash = "", QObject *parent = nullptr);
     virtual ~LocalFileExtractThread();
 
+    /*
+     * The image is the cache file prefetch is still downloading to, reads wait for it to grow
+     */
+    void followPrefetch(PrefetchThread *prefetch);
+
 protected:
     virtual void _cancelExtract();
     virtual void run();
     virtual ssize_t _on_read(struct archive *a, const void **buff);
+    virtual int64_t _on_seek(struct archive *a, int64_t offset, int whence);
     virtual int _on_close(struct archive *a);
+    virtual void _writeComplete();
+    virtual void _onHashChecked(bool matches);
+    bool _isUncompressed();
+    void _writeUncompressedRun();
+    void _scanArchive();
+    void _hashInputFile();
     QFile _inputfile;
     char *_inputBuf;
+    QPointer<PrefetchThread> _prefetch;
 };
 
 #endif // LOCALFILEEXTRACTTHREAD_H
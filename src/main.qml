@@ -1600,6 +1600,9 @@ ApplicationWindow {
                 msgpopup.text = qsTr("<b>%1</b> has been written to <b>%2</b><br><br>You can now remove the SD card from the reader").arg(osbutton.text).arg(dstbutton.text)
             }
         }
+        var skipped = imageWriter.bytesSkipped()
+        if (skipped > 0 && dstbutton.text !== "DFU Mode")
+            msgpopup.text += qsTr("<br><br>%1 MB were already on the device and did not need to be rewritten").arg(Math.floor(skipped / 1048576))
         if (imageWriter.isEmbeddedMode()) {
             msgpopup.continueButton = false
             msgpopup.quitButton = true
@@ -1777,6 +1780,10 @@ ApplicationWindow {
                 entry["subitems_json"] = JSON.stringify(entry["subitems"])
                 delete entry["subitems"]
             }
+            if ("image_download_chunks" in entry) {
+                entry["image_download_chunks_json"] = JSON.stringify(entry["image_download_chunks"])
+                delete entry["image_download_chunks"]
+            }
         }
 
         return oslist_parsed
@@ -1978,6 +1985,10 @@ ApplicationWindow {
                     entry["subitems_json"] = JSON.stringify(entry["subitems"])
                     delete entry["subitems"]
                 }
+                if ("image_download_chunks" in entry) {
+                    entry["image_download_chunks_json"] = JSON.stringify(entry["image_download_chunks"])
+                    delete entry["image_download_chunks"]
+                }
                 m.append(entry)
             }
 
@@ -2077,7 +2088,7 @@ ApplicationWindow {
             console.log("FINAL: board=", board, "imageType=", imageType, "distro=", distro, "variant=", variant)
 
             // DFU parameters are now handled through setSrc - URL contains all needed info
-            imageWriter.setSrc(d.url, d.image_download_size, d.extract_size, typeof(d.extract_sha256) != "undefined" ? d.extract_sha256 : "", typeof(d.contains_multiple_files) != "undefined" ? d.contains_multiple_files : false, ospopup.categorySelected, d.name, typeof(d.init_format) != "undefined" ? d.init_format : "")
+            imageWriter.setSrc(d.url, d.image_download_size, d.extract_size, typeof(d.extract_sha256) != "undefined" ? d.extract_sha256 : "", typeof(d.contains_multiple_files) != "undefined" ? d.contains_multiple_files : false, ospopup.categorySelected, d.name, typeof(d.init_format) != "undefined" ? d.init_format : "", typeof(d.image_download_chunks_json) != "undefined" ? d.image_download_chunks_json : "")
             osbutton.text = d.name
             ospopup.close()
             osswipeview.decrementCurrentIndex()
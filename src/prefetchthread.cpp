@@ -0,0 +1,208 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "prefetchthread.h"
+#include "config.h"
+#include <QDebug>
+#include <archive.h>
+#include <cerrno>
+
+PrefetchThread::PrefetchThread(const QByteArray &url, const QByteArray &expectedHash, QObject *parent)
+    : DownloadExtractThread(url, "", expectedHash, parent)
+{
+}
+
+PrefetchThread::~PrefetchThread()
+{
+    cancelDownload();
+    wait();
+}
+
+void PrefetchThread::setMaxSpeed(qint64 bytesPerSecond)
+{
+    _maxSpeed = bytesPerSecond;
+}
+
+void PrefetchThread::setExtractEnabled(bool extract)
+{
+    _extract = extract;
+}
+
+bool PrefetchThread::isExtracting()
+{
+    return _extract && !_extractStopped;
+}
+
+void PrefetchThread::stopExtracting()
+{
+    _extractStopped = true;
+    /* Frees the queue, in case the download is waiting for room in it */
+    DownloadExtractThread::_cancelExtract();
+}
+
+QByteArray PrefetchThread::url()
+{
+    return _url;
+}
+
+qint64 PrefetchThread::bytesCached()
+{
+    return _bytesCached;
+}
+
+bool PrefetchThread::downloadComplete()
+{
+    return _downloadComplete;
+}
+
+bool PrefetchThread::hasFailed()
+{
+    return _failed;
+}
+
+QByteArray PrefetchThread::cacheFileHash()
+{
+    return _cacheFileHash;
+}
+
+QByteArray PrefetchThread::rawCacheFileHash()
+{
+    return _rawCacheFileHash;
+}
+
+QString PrefetchThread::errorString()
+{
+    std::lock_guard<std::mutex> lock(_errorMutex);
+    return _errorString.isEmpty() ? tr("Download of the image failed") : _errorString;
+}
+
+void PrefetchThread::run()
+{
+    if (!_cacheEnabled)
+    {
+        _failed = true;
+        return;
+    }
+
+    qDebug() << "Prefetching" << _url << "into" << _cachefile.fileName();
+    _throttleTimer.start();
+    DownloadExtractThread::run();
+    bool downloaded = _downloadComplete && !_cancelled;
+    /* A stopped extraction waits in _on_read() for the download to end, then gives up without reporting an error */
+    if (_extractStopped)
+        _cancelled = true;
+    waitForExtractThread();
+
+    if (!isExtracting() && downloaded)
+    {
+        _cachefile.close();
+        _finishRawCache(false);
+        qDebug() << "Download done in" << _timer.elapsed() / 1000 << "seconds, the reader checks its hash";
+    }
+    else if (!_verified)
+    {
+        _failed = true;
+        _cachefile.close();
+        _cachefile.remove();
+        _finishRawCache(false);
+        qDebug() << "Prefetch of" << _url << (_cancelled ? "cancelled" : "failed");
+    }
+}
+
+/* No device involved */
+bool PrefetchThread::_openAndPrepareDevice()
+{
+    return true;
+}
+
+size_t PrefetchThread::_writeData(const char *buf, size_t len)
+{
+    /* Stay within the bandwidth budget, rechecked in short steps so lifting the cap takes effect at once */
+    qint64 maxSpeed;
+    while ((maxSpeed = _maxSpeed) > 0 && !_cancelled)
+    {
+        qint64 due = (_bytesCached + (qint64) len) * 1000 / maxSpeed - _throttleTimer.elapsed();
+        if (due <= 0)
+            break;
+        msleep(qMin<qint64>(due, 100));
+    }
+
+    size_t ret = len;
+    if (isExtracting())
+        ret = DownloadExtractThread::_writeData(buf, len);
+    else if (!_cancelled)
+        _writeCache(buf, len);
+
+    /* The cache file is all a prefetch is good for */
+    if (!_cacheEnabled || !_cachefile.flush())
+        return 0;
+
+    _bytesCached += len;
+    return ret;
+}
+
+size_t PrefetchThread::_writeFile(const char *buf, size_t len)
+{
+    if (_cancelled)
+        return len;
+
+    _writeRawCache(buf, len);
+    _writehash.addData(buf, len);
+    return len;
+}
+
+void PrefetchThread::_writeComplete()
+{
+    QByteArray computedHash = _writehash.result().toHex();
+    if (_expectedHash != computedHash)
+    {
+        qDebug() << "Prefetched image does not match expected hash:" << computedHash;
+        return;
+    }
+
+    _cachefile.close();
+    _verified = true;
+    _cacheFileHash = computedHash;
+    emit cacheFileUpdated(computedHash);
+
+    if (_rawCacheEnabled)
+    {
+        _finishRawCache(true);
+        if (_rawCachefile.exists())
+        {
+            _rawCacheFileHash = computedHash;
+            emit rawCacheFileUpdated(computedHash);
+        }
+    }
+    qDebug() << "Prefetch done in" << _timer.elapsed() / 1000 << "seconds";
+}
+
+void PrefetchThread::_onDownloadSuccess()
+{
+    _downloadComplete = true;
+    if (isExtracting())
+        DownloadExtractThread::_onDownloadSuccess();
+}
+
+ssize_t PrefetchThread::_on_read(struct archive *a, const void **buff)
+{
+    ssize_t len = DownloadExtractThread::_on_read(a, buff);
+    if (!_extractStopped)
+        return len;
+
+    while (!_cancelled)
+        msleep(100);
+    archive_set_error(a, ECANCELED, "Extraction stopped");
+    return -1;
+}
+
+void PrefetchThread::_onDownloadError(const QString &msg)
+{
+    {
+        std::lock_guard<std::mutex> lock(_errorMutex);
+        _errorString = msg;
+    }
+    _failed = true;
+    DownloadExtractThread::_onDownloadError(msg);
+}
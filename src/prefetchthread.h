@@ -0,0 +1,84 @@
+#ifndef PREFETCHTHREAD_H
+#define PREFETCHTHREAD_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "downloadextractthread.h"
+#include <atomic>
+
+/*
+ * Downloads an image into the disk cache, at most at the given speed, nothing is written to a device.
+ *
+ * Before a device has been chosen, the image is decompressed as it arrives, only to check it
+ * against the expected hash (and to fill the decompressed image cache if enabled).
+ * A LocalFileExtractThread can follow the cache file while it is still growing, so a write
+ * started meanwhile continues from the prefetched data.
+ *
+ * With extraction disabled it only serves as elastic buffer between the network and a slower
+ * device: the download runs at network speed and the reader following it checks the hash.
+ * A write that follows a prefetch still decompressing stops that with stopExtracting(), so
+ * the image is decompressed once, by the writer.
+ */
+class PrefetchThread : public DownloadExtractThread
+{
+    Q_OBJECT
+public:
+    explicit PrefetchThread(const QByteArray &url, const QByteArray &expectedHash, QObject *parent = nullptr);
+    virtual ~PrefetchThread();
+
+    /*
+     * Bandwidth cap in bytes per second, 0 for none. May be changed while running.
+     */
+    void setMaxSpeed(qint64 bytesPerSecond);
+
+    /*
+     * Must be set before start(). If disabled, a complete download is kept unverified.
+     */
+    void setExtractEnabled(bool extract);
+    bool isExtracting();
+
+    /*
+     * Keeps downloading as elastic buffer only, the follower checks the hash instead.
+     * What was decompressed so far is dropped, including the decompressed image cache file.
+     */
+    void stopExtracting();
+
+    QByteArray url();
+
+    /*
+     * Thread safe state queries for a reader following the cache file
+     */
+    qint64 bytesCached();
+    bool downloadComplete();
+    bool hasFailed();
+    QString errorString();
+
+    /*
+     * Hash of the verified cache file and decompressed image cache file, empty if not stored.
+     * Only meaningful once the thread has finished.
+     */
+    QByteArray cacheFileHash();
+    QByteArray rawCacheFileHash();
+
+protected:
+    virtual void run();
+    virtual bool _openAndPrepareDevice();
+    virtual size_t _writeData(const char *buf, size_t len);
+    virtual size_t _writeFile(const char *buf, size_t len);
+    virtual void _writeComplete();
+    virtual void _onDownloadSuccess();
+    virtual void _onDownloadError(const QString &msg);
+    virtual ssize_t _on_read(struct archive *a, const void **buff);
+
+    std::atomic<qint64> _maxSpeed{0}, _bytesCached{0};
+    std::atomic<bool> _downloadComplete{false}, _failed{false}, _verified{false}, _extractStopped{false};
+    bool _extract{true};
+    QElapsedTimer _throttleTimer;
+    QString _errorString;
+    std::mutex _errorMutex;
+    QByteArray _cacheFileHash, _rawCacheFileHash;
+};
+
+#endif // PREFETCHTHREAD_H
@@ -4,25 +4,18 @@
 #include <filesystem>
 #include <QDir>
 #include <QCoreApplication>
+#include <QDeadlineTimer>
+#include <QThread>
 
 PriviligedProcess::PriviligedProcess(QObject* parent)
-    : _proc{parent}
+    : QObject{parent}
 {
-    QObject::connect(&_server, &QLocalServer::newConnection, [this]()
-    {
-        onNewConnection();
-    });
 }
 
 PriviligedProcess::~PriviligedProcess()
 {
-    _proc.kill();
-    if(_peer != nullptr)
-    {
-        _peer->close();
-        delete _peer;
-    }
-    _server.close();
+    // Helper keeps running, closing the channel only ends our job
+    closeCommunicationChannel();
 }
 
 void PriviligedProcess::setArguments(QStringList &args)
@@ -41,94 +34,193 @@ QProcess *PriviligedProcess::getQProcess()
     return &_proc;
 }
 
-void PriviligedProcess::start()
+bool PriviligedProcess::start()
 {
 #if defined(Q_OS_UNIX)
-    _proc.start("pkexec", _args);
+    _proc.setProgram("pkexec");
+    _proc.setArguments(_args);
 #elif defined(Q_OS_WIN)
-    _proc.start("powershell.exe", QStringList() << "Start" << _args);
+    _proc.setProgram("powershell.exe");
+    _proc.setArguments(QStringList() << "Start" << _args);
 #else
 #error "Not implemented yet!"
 #endif
+    return _proc.startDetached();
 }
 
-bool PriviligedProcess::waitForFinished(int msecs)
+bool PriviligedProcess::_connect(int msecs)
 {
-    return _proc.waitForFinished(msecs);
+    if(_peer == nullptr)
+    {
+        _peer = new QLocalSocket(this);
+        QObject::connect(_peer, &QLocalSocket::readyRead, this, [this]()
+        {
+            _readFrames();
+        });
+    }
+
+    if(_peer->state() == QLocalSocket::ConnectedState)
+    {
+        return true;
+    }
+
+    _peer->abort();
+    _frameReader = SimpbootpIpc::FrameReader{};
+    _pendingEvents.clear();
+    _hasReply = false;
+    _peer->connectToServer(_channelName);
+    return _peer->waitForConnected(msecs);
 }
 
-QProcess::ExitStatus PriviligedProcess::exitStatus()
+bool PriviligedProcess::startCommunicationChannel(QByteArray channelName)
 {
-    return _proc.exitStatus();
+    _channelName = channelName;
+    return _connect(500);
 }
 
-void PriviligedProcess::kill()
+bool PriviligedProcess::waitForCommunicationChannelReady(int msecs)
 {
-    _proc.kill();
+    QDeadlineTimer deadline{msecs};
+    while(false == _connect(500))
+    {
+        if(deadline.hasExpired())
+        {
+            qDebug() << "helper not reachable: " << _peer->errorString();
+            return false;
+        }
+        QThread::msleep(250);
+    }
+
+    // helper may already have pushed events before we looked
+    _readFrames();
+    return true;
 }
 
-bool PriviligedProcess::startCommunicationChannel(QByteArray channelName)
+void PriviligedProcess::closeCommunicationChannel()
 {
-    _channelName = channelName;
-    _server.removeServer(channelName);
-    if(false == _server.listen(channelName))
+    if(_peer != nullptr)
     {
-        qDebug() << _server.errorString();
-        return false;
+        _peer->disconnectFromServer();
+        delete _peer;
+        _peer = nullptr;
     }
-    return true;
 }
 
-bool PriviligedProcess::waitForCommunicationChannelReady()
+void PriviligedProcess::_readFrames()
 {
-    if(false == _server.hasPendingConnections())
+    if(_peer == nullptr)
+    {
+        return;
+    }
+
+    _frameReader.append(_peer->readAll());
+
+    SimpbootpIpc::MessageType type;
+    QByteArray payload;
+    while(_frameReader.takeFrame(type, payload))
     {
-        if(false == _server.waitForNewConnection(10000))
+        if(type == SimpbootpIpc::Reply)
         {
-            return false;
+            _reply = payload;
+            _hasReply = true;
+            continue;
+        }
+
+        if(type != SimpbootpIpc::Progress)
+        {
+            _queueEvent(type, payload);
         }
+        emit eventReceived(type, payload);
     }
+}
 
-    if(_peer != nullptr)
+void PriviligedProcess::_queueEvent(SimpbootpIpc::MessageType type, const QByteArray &payload)
+{
+    // only the latest link state and the latest state of each board matter to a waiter
+    if(type == SimpbootpIpc::LinkState || type == SimpbootpIpc::JobState)
     {
-        _peer->close();
-        delete _peer;
+        QByteArray board = payload.left(payload.indexOf(' '));
+        _pendingEvents.removeIf([&](const QPair<SimpbootpIpc::MessageType, QByteArray> &event)
+        {
+            return event.first == type && (type == SimpbootpIpc::LinkState || event.second.left(event.second.indexOf(' ')) == board);
+        });
     }
 
-    _peer = _server.nextPendingConnection();
-    return true;
+    if(_pendingEvents.size() >= SIMPBOOTP_IPC_MAX_PENDING_EVENTS)
+    {
+        qDebug() << "dropping unclaimed helper event of type" << static_cast<int>(_pendingEvents.first().first);
+        _pendingEvents.removeFirst();
+    }
+    _pendingEvents.append({type, payload});
+}
+
+bool PriviligedProcess::_takeEvent(SimpbootpIpc::MessageType type, QByteArray &payload)
+{
+    for(auto it = _pendingEvents.begin(); it != _pendingEvents.end(); ++it)
+    {
+        if(it->first == type)
+        {
+            payload = it->second;
+            _pendingEvents.erase(it);
+            return true;
+        }
+    }
+    return false;
 }
 
 bool PriviligedProcess::sendMessage(QByteArray msg, int msecs)
+{
+    return getValue(msg, msecs) == "ok";
+}
+
+QByteArray PriviligedProcess::getValue(QByteArray key, int msecs)
 {
     if(_peer == nullptr)
     {
         qDebug() << "no peer found: ";
-        return false;
+        return "";
     }
 
-    msg.append('\n');
+    QByteArray frame = SimpbootpIpc::encodeFrame(SimpbootpIpc::Command, key);
+    _hasReply = false;
 
-    if(msg.size() != _peer->write(msg) && _peer->waitForBytesWritten(msecs))
+    if(frame.size() != _peer->write(frame) || !_peer->waitForBytesWritten(msecs))
     {
         qDebug() << "send failed: " << _peer->errorString();
-        return false;
+        return "";
     }
 
-    QByteArray recvBuf = recvMessage();
-
-    if(recvBuf.size() != 0 && recvBuf == "ok")
+    QDeadlineTimer deadline{msecs};
+    _readFrames();
+    while(!_hasReply)
     {
-        return true;
+        if(false == _peer->waitForReadyRead(deadline.remainingTime()))
+        {
+            qDebug() << "no reply for" << key;
+            return "";
+        }
+        _readFrames();
     }
 
-    return false;
+    _hasReply = false;
+    return _reply;
 }
 
-QByteArray PriviligedProcess::getValue(QByteArray key, int msecs)
+bool PriviligedProcess::sendEvent(SimpbootpIpc::MessageType type, const QByteArray &payload)
 {
-    if(false == sendMessage(key)) return "";
-    return recvMessage(msecs);
+    if(_peer == nullptr)
+    {
+        return false;
+    }
+
+    QByteArray frame = SimpbootpIpc::encodeFrame(type, payload);
+    if(frame.size() != _peer->write(frame))
+    {
+        qDebug() << "send failed: " << _peer->errorString();
+        return false;
+    }
+    _peer->flush();
+    return true;
 }
 
 bool PriviligedProcess::checkValue(QByteArray key, QByteArray expected, int msecs)
@@ -136,22 +228,24 @@ bool PriviligedProcess::checkValue(QByteArray key, QByteArray expected, int msec
     return getValue(key,msecs) == expected;
 }
 
-QByteArray PriviligedProcess::recvMessage(int msec)
+QByteArray PriviligedProcess::waitForEvent(SimpbootpIpc::MessageType type, int msecs)
 {
+    QByteArray payload;
     if(_peer == nullptr)
     {
-        return QByteArray{0, Qt::Initialization::Uninitialized};
+        return payload;
     }
 
-    if(false == _peer->bytesAvailable() && false == _peer->waitForReadyRead(msec))
+    QDeadlineTimer deadline{msecs};
+    _readFrames();
+    while(!_takeEvent(type, payload))
     {
-        return QByteArray{0, Qt::Initialization::Uninitialized};
+        if(false == _peer->waitForReadyRead(deadline.remainingTime()))
+        {
+            break;
+        }
+        _readFrames();
     }
 
-    return _peer->readLine().trimmed();
-}
-
-void PriviligedProcess::onNewConnection()
-{
-
+    return payload;
 }
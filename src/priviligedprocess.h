@@ -1,11 +1,14 @@
 #ifndef PRIVILIGEDPROCESS_H
 #define PRIVILIGEDPROCESS_H
 
-#include <qlocalserver.h>
+#include <qlocalsocket.h>
 #include <qstringlist.h>
 #include <qprocess.h>
+#include <qlist.h>
+#include <qpair.h>
+#include "simpbootpipc.h"
 
-class PriviligedProcess: QObject
+class PriviligedProcess: public QObject
 {
     Q_OBJECT
 public:
@@ -14,25 +17,61 @@ public:
 
     void setArguments(QStringList& args);
     QProcess* getQProcess();
-    void start();
-    bool waitForFinished(int msecs = 30000);
-    QProcess::ExitStatus exitStatus();
-    void kill();
+
+    /*
+     * Launches the helper detached, it outlives this object and serves further jobs
+     */
+    bool start();
+
+    /*
+     * Connects to an already running helper. Returns false if none is listening on channelName
+     */
     bool startCommunicationChannel(QByteArray channelName);
-    bool waitForCommunicationChannelReady();
+
+    /*
+     * Keeps trying to connect until the helper started listening (authorization may take a while)
+     */
+    bool waitForCommunicationChannelReady(int msecs = 10000);
+    void closeCommunicationChannel();
+
+    /*
+     * Sends a command and waits for its reply. Returns true if the helper replied "ok"
+     */
     bool sendMessage(QByteArray msg, int msecs = 1000);
     QByteArray getValue(QByteArray key, int msecs = 1000);
+
+    /*
+     * Pushes a frame to the helper without waiting for a reply
+     */
+    bool sendEvent(SimpbootpIpc::MessageType type, const QByteArray &payload);
     bool checkValue(QByteArray key, QByteArray expected, int msecs = 1000);
-    QByteArray recvMessage(int msec = 1000);
 
-public slots:
-    void onNewConnection();
+    /*
+     * Waits until the helper pushes an event of the given type and returns its payload.
+     * Events that arrived before the call are returned first. Progress events are not queued,
+     * link and board states only keep the latest one and at most SIMPBOOTP_IPC_MAX_PENDING_EVENTS are kept.
+     */
+    QByteArray waitForEvent(SimpbootpIpc::MessageType type, int msecs = 1000);
+
+signals:
+    /*
+     * Emitted for every event pushed by the helper. type is a SimpbootpIpc::MessageType
+     */
+    void eventReceived(int type, QByteArray payload);
 
 private:
+    bool _connect(int msecs);
+    void _readFrames();
+    void _queueEvent(SimpbootpIpc::MessageType type, const QByteArray &payload);
+    bool _takeEvent(SimpbootpIpc::MessageType type, QByteArray &payload);
+
+    SimpbootpIpc::FrameReader _frameReader;
+    QList<QPair<SimpbootpIpc::MessageType, QByteArray>> _pendingEvents;
+    QByteArray _reply;
+    bool _hasReply{false};
     QStringList _args;
     QProcess _proc;
     QByteArray _channelName;
-    QLocalServer _server{this};
     QLocalSocket* _peer{nullptr};
 };
 
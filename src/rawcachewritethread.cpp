@@ -0,0 +1,283 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "rawcachewritethread.h"
+#include "config.h"
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QUrl>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+
+#ifndef Q_OS_WIN
+#include <unistd.h>
+#endif
+
+#ifdef Q_OS_LINUX
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#endif
+
+RawCacheWriteThread::RawCacheWriteThread(const QString &cacheFile, const QByteArray &dst, QObject *parent)
+    : DownloadThread(QUrl::fromLocalFile(cacheFile).toEncoded(), dst, "", false, parent),
+      _inputfile(cacheFile), _copyMethod(CopyFileRange)
+{
+    _copyBuf = (char *) qMallocAligned(IMAGEWRITER_RAW_CACHE_CHUNK_SIZE, 4096);
+}
+
+RawCacheWriteThread::~RawCacheWriteThread()
+{
+    _cancelled = true;
+    wait();
+    qFreeAligned(_copyBuf);
+}
+
+void RawCacheWriteThread::run()
+{
+    if (!_openAndPrepareDevice())
+        return;
+
+    emit preparationStatusUpdate(tr("opening cached image"));
+    _timer.start();
+
+    if (!_inputfile.open(QIODevice::ReadOnly) || !_readDigests())
+    {
+        _onDownloadError(tr("Error opening cached image"));
+        _closeFiles();
+        return;
+    }
+
+    qint64 size = _inputfile.size();
+    _lastDlTotal = size;
+
+    if (!_copyImage(size))
+    {
+        _onWriteError();
+        _closeFiles();
+        return;
+    }
+
+    _inputfile.close();
+    _writeComplete();
+}
+
+bool RawCacheWriteThread::_readDigests()
+{
+    QFile f(_inputfile.fileName()+".sha256sums");
+    if (!f.open(QIODevice::ReadOnly))
+        return false;
+
+    _digests = f.readAll().split('\n');
+    _digests.removeAll(QByteArray());
+
+    qint64 chunks = (_inputfile.size() + IMAGEWRITER_RAW_CACHE_CHUNK_SIZE - 1) / IMAGEWRITER_RAW_CACHE_CHUNK_SIZE;
+    if (_digests.size() != chunks)
+    {
+        qDebug() << "Digest list does not match decompressed image cache file";
+        return false;
+    }
+
+    return true;
+}
+
+bool RawCacheWriteThread::_copyImage(qint64 size)
+{
+#ifdef Q_OS_LINUX
+    struct stat st;
+    bool regular = ::fstat(_file.handle(), &st) == 0 && S_ISREG(st.st_mode);
+    if (regular && !_verifyEnabled)
+    {
+        /* The clone is not read back without verification, so the cache is checked before it is used */
+        for (qint64 pos = 0; pos < size; pos += IMAGEWRITER_RAW_CACHE_CHUNK_SIZE)
+        {
+            if (_cancelled || !_checkCachedRange(pos, qMin<qint64>(size - pos, IMAGEWRITER_RAW_CACHE_CHUNK_SIZE)))
+                return false;
+        }
+        _cacheChecked = true;
+    }
+    if (regular && ::ioctl(_file.handle(), FICLONE, _inputfile.handle()) == 0)
+    {
+        qDebug() << "Destination is a reflink copy of the cached image";
+        _bytesWritten = size;
+        _lastDlNow = size;
+        return _file.seek(size);
+    }
+#endif
+
+    /* As with every other write, the partition table goes last */
+    qint64 firstLen = qMin<qint64>(size, IMAGEWRITER_RAW_CACHE_CHUNK_SIZE);
+    if (!_inputfile.seek(0) || _inputfile.read(_copyBuf, firstLen) != firstLen
+            || QCryptographicHash::hash(QByteArrayView(_copyBuf, firstLen), QCryptographicHash::Sha256).toHex() != _digests.first()
+            || _writeFile(_copyBuf, firstLen) != (size_t) firstLen)
+    {
+        return false;
+    }
+    _lastDlNow = firstLen;
+
+    for (qint64 pos = firstLen; pos < size; pos += IMAGEWRITER_RAW_CACHE_CHUNK_SIZE)
+    {
+        if (_cancelled)
+            return false;
+
+        qint64 len = qMin<qint64>(size - pos, IMAGEWRITER_RAW_CACHE_CHUNK_SIZE);
+        if (!_copyRange(pos, len))
+            return false;
+
+        _bytesWritten += len;
+        _lastDlNow += len;
+    }
+
+    qDebug() << "Copied cached image in" << _timer.elapsed() / 1000 << "seconds";
+    return _file.seek(size);
+}
+
+/* Reads one chunk of the cache into _copyBuf and checks it against its digest */
+bool RawCacheWriteThread::_checkCachedRange(qint64 offset, qint64 len)
+{
+    if (!_inputfile.seek(offset) || _inputfile.read(_copyBuf, len) != len)
+        return false;
+
+    QByteArray digest = QCryptographicHash::hash(QByteArrayView(_copyBuf, len), QCryptographicHash::Sha256).toHex();
+    if (digest != _digests.at(offset / IMAGEWRITER_RAW_CACHE_CHUNK_SIZE))
+    {
+        qDebug() << "Decompressed image cache file is corrupt at offset" << offset;
+        return false;
+    }
+
+    return true;
+}
+
+/* Copies one chunk to the same offset of the destination, without the data passing through user space where possible */
+bool RawCacheWriteThread::_copyRange(qint64 offset, qint64 len)
+{
+#ifdef Q_OS_LINUX
+    /*
+     * Verification reads back the destination, without it the chunk is checked first.
+     * It stays in the page cache, so the in-kernel copy does not read it from disk a second time
+     */
+    if (_copyMethod != ReadWrite && !_verifyEnabled && !_cacheChecked && !_checkCachedRange(offset, len))
+        return false;
+
+    int in = _inputfile.handle(), out = _file.handle();
+    loff_t inPos = offset, outPos = offset;
+
+    while (len && _copyMethod != ReadWrite)
+    {
+        ssize_t n;
+
+        if (_copyMethod == CopyFileRange)
+        {
+            n = ::copy_file_range(in, &inPos, out, &outPos, len, 0);
+        }
+        else
+        {
+            /* sendfile() writes at the file position of the destination */
+            off_t sendPos = inPos;
+            n = (::lseek(out, outPos, SEEK_SET) == outPos) ? ::sendfile(out, in, &sendPos, len) : -1;
+            if (n > 0)
+            {
+                inPos = sendPos;
+                outPos += n;
+            }
+        }
+
+        if (n > 0)
+        {
+            len -= n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        /* Nothing copied yet by this method, so the next one can take over the same range */
+        if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == ENOSYS) && inPos == offset)
+        {
+            qDebug() << "Cannot use" << (_copyMethod == CopyFileRange ? "copy_file_range()" : "sendfile()")
+                     << "for the destination:" << strerror(errno);
+            _copyMethod = (_copyMethod == CopyFileRange) ? SendFile : ReadWrite;
+            continue;
+        }
+
+        qDebug() << "Error copying cached image at offset" << inPos << ":" << (n < 0 ? strerror(errno) : "unexpected end of file");
+        return false;
+    }
+
+    if (!len)
+        return true;
+#endif
+
+    /* Plain copy, the data passes by anyway so check it against the digest */
+    return _checkCachedRange(offset, len) && _file.seek(offset) && _file.write(_copyBuf, len) == len;
+}
+
+bool RawCacheWriteThread::_verify()
+{
+    _lastVerifyNow = 0;
+    _verifyTotal = _file.pos();
+    QElapsedTimer t1;
+    t1.start();
+
+#ifdef Q_OS_LINUX
+    /* Make sure we are reading from the drive and not from cache */
+    posix_fadvise(_file.handle(), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+    /* The held back first chunk is not on the device yet, it is checked last */
+    for (int i = _firstBlock ? 1 : 0; i < _digests.size() && _verifyEnabled && !_cancelled; i++)
+    {
+        if (!_verifyChunk(i))
+            return false;
+    }
+
+    if (_firstBlock && _verifyEnabled && !_cancelled)
+    {
+        /* Everything else checked out, so the partition table can go in now and be read back like the rest */
+        if (!_file.seek(0) || _file.write(_firstBlock, _firstBlockSize) != (qint64) _firstBlockSize || !_file.flush()
+#ifndef Q_OS_WIN
+                || ::fsync(_file.handle()) != 0
+#endif
+                )
+        {
+            DownloadThread::_onDownloadError(tr("Error writing first block (partition table)"));
+            return false;
+        }
+        _bytesWritten += _firstBlockSize;
+        qFreeAligned(_firstBlock);
+        _firstBlock = nullptr;
+
+#ifdef Q_OS_LINUX
+        posix_fadvise(_file.handle(), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+        if (!_verifyChunk(0))
+            return false;
+    }
+
+    qDebug() << "Verify done in" << t1.elapsed() / 1000.0 << "seconds";
+    return true;
+}
+
+bool RawCacheWriteThread::_verifyChunk(int i)
+{
+    qint64 pos = (qint64) i * IMAGEWRITER_RAW_CACHE_CHUNK_SIZE;
+    qint64 len = qMin<qint64>(_verifyTotal - pos, IMAGEWRITER_RAW_CACHE_CHUNK_SIZE);
+
+    if (!_file.seek(pos) || _file.read(_copyBuf, len) != len)
+    {
+        DownloadThread::_onDownloadError(tr("Error reading from storage.<br>"
+                                            "SD card may be broken."));
+        return false;
+    }
+
+    if (QCryptographicHash::hash(QByteArrayView(_copyBuf, len), QCryptographicHash::Sha256).toHex() != _digests.at(i))
+    {
+        qDebug() << "Verify mismatch in chunk at offset" << pos;
+        DownloadThread::_onDownloadError(tr("Verifying write failed. Contents of SD card is different from what was written to it."));
+        return false;
+    }
+    _lastVerifyNow += len;
+    return true;
+}
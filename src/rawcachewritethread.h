@@ -0,0 +1,44 @@
+#ifndef RAWCACHEWRITETHREAD_H
+#define RAWCACHEWRITETHREAD_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "downloadthread.h"
+#include <QFile>
+#include <QList>
+
+/*
+ * Writes an image from the decompressed image cache, which was verified against the
+ * expected hash when it was stored. No decompression and, on Linux, no copy through
+ * user space: reflink for file destinations, copy_file_range or sendfile for devices.
+ * Verification compares the per-chunk digests stored with the cache file. Without it
+ * the cache file itself is checked against them before it is copied.
+ */
+class RawCacheWriteThread : public DownloadThread
+{
+    Q_OBJECT
+public:
+    explicit RawCacheWriteThread(const QString &cacheFile, const QByteArray &dst, QObject *parent = nullptr);
+    virtual ~RawCacheWriteThread();
+
+protected:
+    enum CopyMethod { CopyFileRange, SendFile, ReadWrite };
+
+    virtual void run();
+    virtual bool _verify();
+    bool _verifyChunk(int i);
+    bool _readDigests();
+    bool _copyImage(qint64 size);
+    bool _copyRange(qint64 offset, qint64 len);
+    bool _checkCachedRange(qint64 offset, qint64 len);
+
+    QFile _inputfile;
+    QList<QByteArray> _digests;
+    CopyMethod _copyMethod;
+    bool _cacheChecked{false};
+    char *_copyBuf;
+};
+
+#endif // RAWCACHEWRITETHREAD_H
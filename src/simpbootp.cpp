@@ -1,18 +1,29 @@
-#include <QtConcurrent/qtconcurrentrun.h>
 #include <qlocalserver.h>
 #include <qlocalsocket.h>
 #include <qthread.h>
 #include <tftpserver.h>
 #include <simpdhcp.h>
+#include "simpbootpipc.h"
 #include <cstring>
 #include <qcoreapplication.h>
 #include <qnetworkdatagram.h>
 #include <qnetworkinterface.h>
 #include <qprocess.h>
 #include <qcommandlineparser.h>
+#include <qelapsedtimer.h>
+#include <qeventloop.h>
+#include <qsocketnotifier.h>
 #include <qtimer.h>
 #include <qudpsocket.h>
 
+#if defined(Q_OS_UNIX)
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+#if defined(Q_OS_LINUX)
+#include "linux/netlinkconfig.h"
+#endif
+
 #if defined(Q_OS_UNIX)
 #define DEFAULT_IFACE "eno1"
 #elif defined(Q_OS_WIN)
@@ -27,6 +38,8 @@
 #define DEFAULT_BOOTFILE "tiboot3.bin"
 #define DEFAULT_SERVER_NAME ""
 #define TFTP_DEFAULT_PORT (69)
+#define CARRIER_WAIT_TIMEOUT_MSEC (3000)
+#define DEFAULT_IDLE_TIMEOUT_SEC (600)
 
 char const* optTypeToStr(OpType type)
 {
@@ -293,6 +306,7 @@ enum ReturnCodes
     SEND_REPLY_FAILED,
     SEND_REPLY_TIMEOUT,
     MAINPROC_COMM_INIT_FAILED,
+    HELPER_ALREADY_RUNNING,
 };
 
 bool isDHCPProcessSuccessfull(QString targetIp)
@@ -317,25 +331,39 @@ bool isDHCPProcessSuccessfull(QString targetIp)
 
 bool setInterfaceSettings(const QString &interface, const QString ipAddr, const QString &speed, const QString &duplex)
 {
-#if defined(Q_OS_UNIX)
-    QStringList args;
-    QStringList ipArgs;
-    QProcess ipProcess;
-    QProcess process;
+#if defined(Q_OS_LINUX)
+    NetlinkConfig link{interface.toUtf8()};
+    if (!link.isValid())
+    {
+        return false;
+    }
 
-    args << "ip" << "link" << "set" << interface << "down";
-    process.start("pkexec", args);
-    process.waitForFinished();
-    args.clear();
+    QElapsedTimer timer;
+    timer.start();
 
-    args << "ethtool" <<"-s" << interface << "speed" << speed << "duplex" << duplex << "autoneg" << "off";
-    qDebug() << args;
+    if (!link.setLinkUp(false))
+    {
+        return false;
+    }
 
-    ipArgs << "ip" << "addr" << "add" << (ipAddr + "/24") << "dev" << interface;
-    qDebug() << ipArgs;
+    // Not every adapter accepts forced modes, it keeps negotiating in that case
+    if (!link.setLinkMode(speed.toInt(), duplex == "full", false))
+    {
+        qDebug() << "Forcing" << speed << duplex << "failed on" << interface;
+    }
 
-    process.start("pkexec", args);
-    process.waitForFinished();
+    if (!link.addAddress(QHostAddress{ipAddr}, 24) || !link.setLinkUp(true))
+    {
+        return false;
+    }
+
+    if (!link.waitForCarrier(CARRIER_WAIT_TIMEOUT_MSEC))
+    {
+        qDebug() << "No carrier on" << interface << "yet, board may not be powered";
+    }
+
+    qDebug() << "Interface" << interface << "configured in" << timer.elapsed() << "ms";
+    return true;
 #elif defined(Q_OS_WIN)
     QString command = QString("powershell.exe -WindowStyle Hidden \
                               -ArgumentList \"-ExecutionPolicy Bypass -Command `\"Set-NetAdapterAdvancedProperty \
@@ -351,20 +379,8 @@ bool setInterfaceSettings(const QString &interface, const QString ipAddr, const
 
     process.start("powershell.exe", QStringList() << "Start" << command);
     ipProcess.start("powershell.exe", QStringList() << "Start" << ipCommand);
-#else
-#error "Unsupported platform";
-    return;
-#endif
-
-#if defined(Q_OS_UNIX)
-    ipProcess.start("pkexec", ipArgs);
-    ipProcess.waitForFinished();
-
-    args.clear();
-    args << "ip" << "link" << "set" << interface << "up";
-    process.start("pkexec", args);
     process.waitForFinished();
-#endif
+    ipProcess.waitForFinished();
 
     // Check for errors
     if (process.exitStatus() != QProcess::NormalExit || ipProcess.exitStatus() != QProcess::NormalExit) {
@@ -375,10 +391,19 @@ bool setInterfaceSettings(const QString &interface, const QString ipAddr, const
         qDebug() << "Command error:" << process.readAllStandardError();
         return true;
     }
+#else
+    qDebug() << "Unsupported platform";
+    return false;
+#endif
 }
 
 bool changeSpeedTo1000MBit(const QString &interface)
 {
+#if defined(Q_OS_LINUX)
+    // Renegotiation completes asynchronously, carrier changes are reported as LinkState events
+    NetlinkConfig link{interface.toUtf8()};
+    return link.isValid() && link.setLinkMode(1000, true, true);
+#else
     QProcess process;
     QStringList args;
 
@@ -392,24 +417,18 @@ bool changeSpeedTo1000MBit(const QString &interface)
         return true;
 
     return false;
+#endif
 }
 
 void revertInterfaceSettings(const QString &interface, const QString &ipAddr)
 {
-#if defined(Q_OS_UNIX)
-    QStringList args;
-    QStringList ipArgs;
-    QProcess ipProcess;
-    QProcess process;
-
-    args << "ethtool" <<"-s" << interface << "autoneg" << "on";
-    qDebug() << args;
-
-    ipArgs << "ip" << "addr" << "del" << (ipAddr + "/24") << "dev" << interface;
-    qDebug() << ipArgs;
-
-    process.start("pkexec", args);
-    ipProcess.start("pkexec", ipArgs);
+#if defined(Q_OS_LINUX)
+    NetlinkConfig link{interface.toUtf8()};
+    if (link.isValid())
+    {
+        link.setLinkMode(0, true, true);
+        link.removeAddress(QHostAddress{ipAddr}, 24);
+    }
 #elif defined(Q_OS_WIN)
     QString command = QString("Start -FilePath powershell.exe -WindowStyle Hidden \
                               -ArgumentList \"-ExecutionPolicy Bypass -Command `\"Set-NetAdapterAdvancedProperty \
@@ -422,13 +441,11 @@ void revertInterfaceSettings(const QString &interface, const QString &ipAddr)
 
     process.start("powershell.exe", QStringList() << "-Command" << command);
     process.start("powershell.exe", QStringList() << "-Command" << command);
+    process.waitForFinished();
+    ipProcess.waitForFinished();
 #else
     qDebug() << "Unsupported platform";
 #endif
-
-    process.waitForFinished();
-    ipProcess.waitForFinished();
-    return;
 }
 
 void cleanSocket(int socket)
@@ -446,7 +463,7 @@ void cleanSocket(int socket)
     }
 }
 
-int dhcpServerRun(int sock, QString& offeredIp, QString& bootFile, QString& serverIp, QString& serverName)
+int dhcpServerRun(int sock, QString& offeredIp, QString& bootFile, QString& serverIp, QString& serverName, QByteArray& clientMac, bool serve = true)
 {
     // Receive a packet
     char buffer[4096];
@@ -464,7 +481,15 @@ int dhcpServerRun(int sock, QString& offeredIp, QString& bootFile, QString& serv
         qDebug() << "[simpdhcp] Packet received";
     }
 
+    if(!serve)
+    {
+        // No job running, nothing to boot the board with
+        return -NO_DATAGRAM;
+    }
+
     DhcpPacket dpacket = parseDhcpPacket(buffer, bytes_received);
+    clientMac = QByteArray((const char*)dpacket.chaddr, std::min<int>(dpacket.hlen, sizeof(dpacket.chaddr))).toHex(':');
+
     DhcpPacket reply{};
     auto reply_size = generateBootReply(dpacket, offeredIp, bootFile, serverIp, serverName, reply);
 
@@ -480,16 +505,59 @@ int dhcpServerRun(int sock, QString& offeredIp, QString& bootFile, QString& serv
     return 0;
 }
 
+bool changeSpeedTo100MBit(const QString &interface)
+{
+#if defined(Q_OS_LINUX)
+    NetlinkConfig link{interface.toUtf8()};
+    return link.isValid() && link.setLinkMode(100, true, false);
+#else
+    QProcess process;
+    process.start("pkexec", QStringList() << "ethtool" << "-s" << interface << "speed" << "100" << "duplex" << "full" << "autoneg" << "off");
+    process.waitForFinished();
+    return process.exitStatus() == QProcess::NormalExit;
+#endif
+}
+
+bool listenCommunicationChannel(QLocalServer &server)
+{
+    QLocalServer::removeServer(SIMPBOOTP_IPC_CHANNEL);
+    if(false == server.listen(SIMPBOOTP_IPC_CHANNEL))
+    {
+        qDebug() << "Listening comm channel failed!" << server.errorString();
+        return false;
+    }
+
+#if defined(Q_OS_UNIX)
+    // We run as root, only the user that authorized us may hand out jobs, and only root if nobody did
+    const char* uid = getenv("PKEXEC_UID");
+    if(uid == nullptr)
+    {
+        uid = getenv("SUDO_UID");
+    }
+    QByteArray path = QFile::encodeName(server.fullServerName());
+    if((uid != nullptr && chown(path.constData(), atoi(uid), -1) < 0) || chmod(path.constData(), 0600) < 0)
+    {
+        qDebug() << "Restricting comm channel access failed!" << strerror(errno);
+        return false;
+    }
+#endif
+    return true;
+}
+
+bool isHelperRunning()
+{
+    QLocalSocket probe;
+    probe.connectToServer(SIMPBOOTP_IPC_CHANNEL);
+    return probe.waitForConnected(500);
+}
+
 ReturnCodes doWork(
     QString& interface, QString& speed, QString& duplex,
     QString& serverIp, QString& offeredIp, QString& bootFile,
-    QString& serverName, TFTP& tftpServer
+    QString& serverName, const QString& targetDirectory, TFTP& tftpServer, int idleTimeoutSec
 )
 {
-    quint16 senderPort;
     int sock = 0;
-    struct sockaddr_in dest;
-    char packet[4096];
 
     if(false == setInterfaceSettings(interface, serverIp, speed, duplex))
     {
@@ -498,7 +566,7 @@ ReturnCodes doWork(
     }
 
     QScopeGuard guard {
-        [serverIp, interface, sock]()
+        [&serverIp, &interface, &sock]()
         {
             revertInterfaceSettings(interface, serverIp);
             cleanSocket(sock);
@@ -511,22 +579,27 @@ ReturnCodes doWork(
         return SOCKET_INIT_FAILED;
     }
 
+    // Boards reach us on the boot interface only, nothing else on the host gets to fetch files
+    if (0 > tftpServer.start(QHostAddress{serverIp}))
+    {
+        qDebug() << "[simptftp]" << "server init failed!";
+        return PORT_BIND_FAILED;
+    }
+
     sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock < 0) {
         qDebug() << "Socket creation failed";
         return SOCKET_INIT_FAILED;
     }
 
+    // DHCP socket is served from the event loop, reads must never block
 #if defined(Q_OS_WIN)
-    uint32_t timeout = 100;
+    u_long nonBlocking = 1;
+    if (ioctlsocket(sock, FIONBIO, &nonBlocking) != 0) {
 #elif defined(Q_OS_UNIX)
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 100000;
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) < 0) {
 #endif
-
-    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout)) < 0) {
-        qDebug("Set socket option recv timeout failed");
+        qDebug("Set socket non blocking mode failed");
         return SOCKET_OPT_TIMEOUT_FAILED;
     }
 
@@ -567,195 +640,260 @@ ReturnCodes doWork(
         return SOCKET_OPT_BINDTODEV_FAILED;
     }
 #endif
-    int dhcpStatus;
-    int tftpStatus;
+    float lastSentProgress{-1.0f};
+    bool jobActive{false};
+    QByteArray boardMac;
+
+    QEventLoop loop;
+    QLocalServer server;
+    QLocalSocket* client{nullptr};
+    SimpbootpIpc::FrameReader frameReader;
+    QTimer idleTimer;
+
+    // Nobody asked for a job for a while, give the interface back
+    idleTimer.setSingleShot(true);
+    idleTimer.setInterval(idleTimeoutSec * 1000);
+    idleTimer.callOnTimeout([&loop]()
+    {
+        qDebug() << "[simpbootp] idle timeout, exiting...";
+        loop.quit();
+    });
 
-    bool ipcEnabled{true};
-    bool notifyNextDHCP{false};
-    bool notifyNextFileSend{false};
-    bool programShouldClose{false};
-    bool fileSendNotificationReady{false};
-    float currentProgress{0.0f};
+    auto sendFrame = [&client](SimpbootpIpc::MessageType type, const QByteArray &payload = {}) -> bool
+    {
+        if(client == nullptr || client->state() != QLocalSocket::ConnectedState)
+        {
+            return false;
+        }
 
-    tftpServer.setProgressUpdateCallback([&currentProgress](float progress) -> void
+        QByteArray frame = SimpbootpIpc::encodeFrame(type, payload);
+        if(frame.size() == client->write(frame))
+        {
+            client->flush();
+            return true;
+        }
+
+        return false;
+    };
+
+    auto sendReply = [&sendFrame](bool ok)
+    {
+        sendFrame(SimpbootpIpc::Reply, ok ? "ok" : "nok");
+    };
+
+    auto sendJobState = [&](const QByteArray &state)
     {
-        currentProgress = progress;
+        qDebug() << "[simpbootp] board" << boardMac << state;
+        sendFrame(SimpbootpIpc::JobState, boardMac + ' ' + state);
+    };
+
+    auto stopJob = [&]()
+    {
+        if(jobActive)
+        {
+            jobActive = false;
+            tftpServer.setServing(false);
+            sendJobState("stopped");
+        }
+    };
+
+    tftpServer.setServing(false);
+
+    tftpServer.setProgressUpdateCallback([&](float progress) -> void
+    {
+        // Called for every acked block, only push when it is visible on the progress bar
+        if(progress - lastSentProgress >= 0.001f || progress >= 1.0f || progress < lastSentProgress)
+        {
+            lastSentProgress = progress;
+            sendFrame(SimpbootpIpc::Progress, SimpbootpIpc::encodeProgress(progress));
+        }
     });
 
     tftpServer.setOnReadSuccess([&](QByteArray filename)
     {
-        fileSendNotificationReady = true;
         qDebug() << "file sent: " << filename;
+        sendFrame(SimpbootpIpc::FileSent, filename);
+        if(filename == bootFile.toUtf8())
+        {
+            sendJobState("booting");
+        }
     });
 
-    auto ipcProc = QtConcurrent::run([&]()
+    tftpServer.setOnTransferError([&](QByteArray reason)
     {
-        QLocalSocket mainProc;
+        qDebug() << "transfer failed: " << reason;
+        sendFrame(SimpbootpIpc::TransferError, reason);
+        sendJobState("error");
+    });
 
-        auto sendMsg = [&mainProc](QByteArray msg, int msecs = 100) -> bool
+    QSocketNotifier dhcpNotifier{(qintptr)sock, QSocketNotifier::Read};
+    QObject::connect(&dhcpNotifier, &QSocketNotifier::activated, [&]()
+    {
+        // Drain everything that arrived, socket is non blocking
+        int dhcpStatus;
+        QByteArray mac;
+        while((dhcpStatus = dhcpServerRun(sock, offeredIp, bootFile, serverIp, serverName, mac, jobActive)) != -DHCP_RECV_TIMEOUT)
         {
-            msg.append('\n');
-            if(msg.size() == mainProc.write(msg) && mainProc.waitForBytesWritten(msecs))
+            if(dhcpStatus == 0)
             {
-                return true;
+                boardMac = mac;
+                sendFrame(SimpbootpIpc::DhcpServed, offeredIp.toUtf8());
+                sendJobState("dhcp");
             }
+        }
+    });
 
-            return false;
-        };
-
-        auto recvMsg = [&mainProc, sendMsg](int msecs = 100) -> QByteArray
+#if defined(Q_OS_LINUX)
+    NetlinkConfig linkMonitor{interface.toUtf8()};
+    QSocketNotifier linkNotifier{(qintptr)linkMonitor.monitorSocket(), QSocketNotifier::Read};
+    linkNotifier.setEnabled(linkMonitor.monitorSocket() >= 0);
+    QObject::connect(&linkNotifier, &QSocketNotifier::activated, [&]()
+    {
+        bool carrier;
+        if(linkMonitor.readLinkEvents(carrier))
         {
-            if(false == mainProc.bytesAvailable() && false == mainProc.waitForReadyRead(msecs))
-            {
-                return QByteArray{0, Qt::Initialization::Uninitialized};
-            }
+            qDebug() << "[simpbootp] link" << (carrier ? "up" : "down");
+            sendFrame(SimpbootpIpc::LinkState, carrier ? "up" : "down");
+        }
+    });
+#endif
 
-            QByteArray readBuf = mainProc.readLine().trimmed();
-            if(readBuf.size() != 0)
-            {
-                sendMsg("ok", msecs);
-            }
-            return readBuf;
-        };
+    auto handleCommand = [&](const QByteArray &command)
+    {
+        QList<QByteArray> args = command.split('\n');
 
-        mainProc.connectToServer("SimpbootpCommChannel");
-        if(false == mainProc.waitForConnected(2000))
+        if(command == "quit" || command == "shutdown")
         {
-            qDebug() << "Connection to the main proc failed!" << mainProc.errorString();
-            qDebug() << "IPC disabled";
-            ipcEnabled = false;
+            qDebug() << "[ipc] shutdown";
+            stopJob();
+            sendReply(true);
+            loop.quit();
         }
-
-        while(ipcEnabled)
+        else if(args.first() == "startJob")
         {
-            if(fileSendNotificationReady && notifyNextFileSend)
-            {
-                auto filename = tftpServer.getLastFileName();
-                qDebug() << "sending notification for file: " << filename;
-                sendMsg(filename);
-                fileSendNotificationReady = false;
-                notifyNextFileSend = false;
-            }
-            else
+            // startJob\n<interface>\n<directory with the boot files>
+            // Only the directory given when we got authorized is ever served, a job for another one needs a new helper
+            if(args.size() != 3 || args[1] != interface.toUtf8() || QDir{QString::fromUtf8(args[2])}.canonicalPath() != targetDirectory)
             {
-                fileSendNotificationReady = false;
+                qDebug() << "[ipc] cannot start job" << args;
+                sendReply(false);
+                return;
             }
-
-            if(mainProc.state() != QLocalSocket::ConnectedState)
+            if(!changeSpeedTo100MBit(interface))
             {
-                qDebug() << "[simpbootp] server closed exiting...";
-                programShouldClose = true;
-                break;
+                qDebug() << "[ipc] set interface speed to 100MB failed!";
             }
+            boardMac.clear();
+            lastSentProgress = -1.0f;
+            tftpServer.resetJobState();
+            tftpServer.setTftpBlockSize(TFTP_DEFAULT_BLOCK_SIZE);
+            tftpServer.setImageWatermark(0, 0, 0, true);
+            tftpServer.setServing(true);
+            jobActive = true;
+            sendReply(true);
+            sendJobState("waiting");
+        }
+        else if(command == "stopJob")
+        {
+            stopJob();
+            sendReply(true);
+        }
+        else if(command == "1000MB")
+        {
+            bool ok = changeSpeedTo1000MBit(interface);
+            qDebug() << "[ipc] Speed 1000MB" << (ok ? "" : "failed!");
+            sendReply(ok);
+            if(ok) sendJobState("serving");
+        }
+        else if(command == "100MB")
+        {
+            bool ok = changeSpeedTo100MBit(interface);
+            qDebug() << "[ipc] Speed 100MB" << (ok ? "" : "failed!");
+            sendReply(ok);
+        }
+        else if(command == "isSblUartReady")
+        {
+            sendReply(tftpServer.isTiboot3BinSent());
+        }
+        else if(command == "tftpBlokSize1468")
+        {
+            qDebug() << "[ipc] TFTP Blocksize 1468";
+            tftpServer.setTftpBlockSize(1468);
+            sendReply(true);
+        }
+        else if(command == "isFileTransferOk")
+        {
+            sendReply(!tftpServer.hasError());
+        }
+        else
+        {
+            qDebug() << "[ipc] unknown command" << command;
+            sendReply(false);
+        }
+    };
 
-            if(mainProc.bytesAvailable() > 0 || true == mainProc.waitForReadyRead(1000))
-            {
-                QByteArray readBuf = recvMsg();
-
-                if(readBuf == "quit")
-                {
-                    qDebug() << "[ipc] quit";
-                    programShouldClose = true;
-                    break;
-                }
-
-                if(readBuf == "1000MB")
-                {
-                    if(false == changeSpeedTo1000MBit(interface))
-                    {
-                        qDebug() << "[ipc] set interface speed to 1000MB failed!";
-                        sendMsg("nok");
-                    }
-                    else
-                    {
-                        qDebug() << "[ipc] Speed 1000MB";
-                        sendMsg("ok");
-                    }
-                    continue;
-                }
-
-                if(readBuf == "100MB")
-                {
-                    if(false == setInterfaceSettings(interface, serverIp, "100", "full"))
-                    {
-                        qDebug() << "[ipc] set interface speed to 100MB failed!";
-                        sendMsg("nok");
-                    }
-                    else
-                    {
-                        qDebug() << "[ipc] Speed 100MB";
-                        sendMsg("ok");
-                    }
-                    continue;
-                }
-
-                if(readBuf == "isSblUartReady")
-                {
-                    if(tftpServer.isTiboot3BinSent())
-                    {
-                        qDebug() << "[ipc] SblUartReady!";
-                        sendMsg("ok");
-                    }
-                    else
-                    {
-                        sendMsg("nok");
-                    }
-                    continue;
-                }
-
-                if(readBuf == "tftpBlokSize1468")
-                {
-                    qDebug() << "[ipc] TFTP Blocksize 1468";
-                    tftpServer.setTftpBlockSize(1468);
-                    sendMsg("ok");
-                    continue;
-                }
+    QObject::connect(&server, &QLocalServer::newConnection, [&]()
+    {
+        QLocalSocket* next = server.nextPendingConnection();
+        if(client != nullptr)
+        {
+            // Only one job owner at a time
+            qDebug() << "[simpbootp] already serving a client, rejecting connection";
+            next->disconnectFromServer();
+            next->deleteLater();
+            return;
+        }
 
-                if(readBuf == "notifyDHCP")
-                {
-                    notifyNextDHCP = true;
-                    continue;
-                }
+        client = next;
+        frameReader = SimpbootpIpc::FrameReader{};
+        idleTimer.stop();
+        qDebug() << "[simpbootp] client connected";
 
-                if(readBuf == "notifyFileSend")
-                {
-                    notifyNextFileSend = true;
-                    tftpServer.setError(false);
-                    continue;
-                }
+        QObject::connect(client, &QLocalSocket::readyRead, [&]()
+        {
+            frameReader.append(client->readAll());
 
-                if(readBuf == "getFileSendProgress")
+            SimpbootpIpc::MessageType type;
+            QByteArray payload;
+            while(client != nullptr && frameReader.takeFrame(type, payload))
+            {
+                if(type == SimpbootpIpc::Command)
                 {
-                    auto str = QString::asprintf("%f", currentProgress);
-                    sendMsg(str.toUtf8());
-                    continue;
+                    handleCommand(payload);
                 }
-
-                if(readBuf == "isFileTransferOk")
+                else if(type == SimpbootpIpc::Watermark)
                 {
-                    if(tftpServer.hasError())
-                    {
-                        sendMsg("nok");
-                    }
-                    else
-                    {
-                        sendMsg("ok");
-                    }
-                    continue;
+                    auto mark = SimpbootpIpc::decodeWatermark(payload);
+                    tftpServer.setImageWatermark(mark.expectedSize, mark.available, mark.holdEnd, mark.complete);
                 }
             }
-        }
+        });
+
+        QObject::connect(client, &QLocalSocket::disconnected, [&]()
+        {
+            qDebug() << "[simpbootp] client disconnected";
+            stopJob();
+            client->deleteLater();
+            client = nullptr;
+            idleTimer.start();
+        });
     });
 
-    qDebug() << "Main loop started!";
-    while(!programShouldClose)
+    if(false == listenCommunicationChannel(server))
     {
-        tftpStatus = tftpServer.run();
-        dhcpStatus = dhcpServerRun(sock, offeredIp, bootFile, serverIp, serverName);
+        return MAINPROC_COMM_INIT_FAILED;
     }
 
+    qDebug() << "Main loop started!";
+    idleTimer.start();
+    loop.exec();
+
+    dhcpNotifier.setEnabled(false);
     tftpServer.stop();
-    ipcProc.waitForFinished();
+    if(client != nullptr)
+    {
+        client->disconnectFromServer();
+    }
 
     return SUCCESS;
 }
@@ -796,14 +934,20 @@ int main(int argc, char* argv[])
         {{"t", "target-directory"},
             QCoreApplication::translate("main", "Copy all source files into <directory>."),
             QCoreApplication::translate("main", "directory")},
-        {{"sr", "single-run"},
-            QCoreApplication::translate("main", "Serve only <filename> and exit."),
-            QCoreApplication::translate("main", "filename")},
+        {{"it", "idle-timeout"},
+            QCoreApplication::translate("main", "Exit after <seconds> without a connected job owner."),
+            QCoreApplication::translate("main", "seconds")},
     });
 
     parser.addHelpOption();
     parser.process(app);
 
+    if(isHelperRunning())
+    {
+        qDebug() << "Another simpbootp instance is already serving, exiting";
+        return HELPER_ALREADY_RUNNING;
+    }
+
     QString speed { DEFAULT_SPEED };
     QString interface { DEFAULT_IFACE };
     QString duplex { DEFAULT_DUPLEX };
@@ -849,15 +993,23 @@ int main(int argc, char* argv[])
         QDir::setCurrent(targetDirectory);
     }
 
+    int idleTimeoutSec = DEFAULT_IDLE_TIMEOUT_SEC;
+    if(parser.isSet("idle-timeout"))
+    {
+        bool ok = false;
+        idleTimeoutSec = parser.value("idle-timeout").toInt(&ok);
+        if(!ok || idleTimeoutSec <= 0)
+        {
+            idleTimeoutSec = DEFAULT_IDLE_TIMEOUT_SEC;
+            qDebug() << "Idle timeout is not valid (" << parser.value("idle-timeout") << ") using default" << idleTimeoutSec;
+        }
+    }
+
+    targetDirectory = QDir{targetDirectory}.canonicalPath();
     TFTP tftpServer{port, tftpBlocksize, targetDirectory};
     tftpServer.setCommandWaitTimeout(100);
     tftpServer.setTIMode(true);
 
-    if (0 > tftpServer.start())
-    {
-        qDebug() << "[simptftp]" << "server init failed!";
-    }
-
     if(parser.isSet("interface"))
     {
         interface = parser.value("interface");
@@ -894,9 +1046,9 @@ int main(int argc, char* argv[])
     }
 
     QTimer::singleShot(0, &app,
-        [&interface, &speed, &duplex, &serverIp, &offeredIp, &bootFile, &serverName, &tftpServer]()
+        [&interface, &speed, &duplex, &serverIp, &offeredIp, &bootFile, &serverName, &targetDirectory, &tftpServer, idleTimeoutSec]()
         {
-            QCoreApplication::exit(doWork(interface, speed, duplex, serverIp, offeredIp, bootFile, serverName, tftpServer));
+            QCoreApplication::exit(doWork(interface, speed, duplex, serverIp, offeredIp, bootFile, serverName, targetDirectory, tftpServer, idleTimeoutSec));
         }
     );
 
@@ -0,0 +1,136 @@
+#ifndef SIMPBOOTPIPC_H
+#define SIMPBOOTPIPC_H
+
+/*
+ * Framed binary protocol spoken between gem-imager and the privileged
+ * simpbootp helper over the "SimpbootpCommChannel" local socket.
+ *
+ * Every frame is: quint32 length (big endian, type + payload), quint8 type, payload.
+ * The helper is the long lived server, a host connects for the duration of a job,
+ * sends Command frames and gets exactly one Reply frame back for each.
+ * The helper pushes the remaining frame types on its own whenever something happens.
+ *
+ * Job commands: "startJob\n<interface>\n<directory>", "stopJob", "shutdown"
+ */
+
+#include <QByteArray>
+#include <QDataStream>
+#include <QtEndian>
+
+#define SIMPBOOTP_IPC_CHANNEL "SimpbootpCommChannel"
+#define SIMPBOOTP_IPC_MAX_FRAME_SIZE (64 * 1024)
+/* Events nobody waited for yet that a host keeps, older ones are dropped */
+#define SIMPBOOTP_IPC_MAX_PENDING_EVENTS 64
+
+namespace SimpbootpIpc
+{
+    enum MessageType : quint8
+    {
+        Command       = 1, // payload: command name
+        Reply         = 2, // payload: "ok", "nok" or the queried value
+        Progress      = 3, // payload: float [0.0 1.0] of the file being served
+        FileSent      = 4, // payload: name of the file completely sent
+        TransferError = 5, // payload: reason
+        DhcpServed    = 6, // payload: offered ip address
+        LinkState     = 7, // payload: "up" or "down" when the boot interface carrier changes
+        JobState      = 8, // payload: "<board mac> <waiting|dhcp|booting|serving|error|stopped>"
+        Watermark     = 9, // host -> helper, no reply. payload: encodeWatermark()
+    };
+
+    inline QByteArray encodeFrame(MessageType type, const QByteArray &payload = {})
+    {
+        QByteArray frame(sizeof(quint32) + 1, Qt::Uninitialized);
+        qToBigEndian<quint32>(payload.size() + 1, frame.data());
+        frame[sizeof(quint32)] = static_cast<char>(type);
+        frame.append(payload);
+        return frame;
+    }
+
+    inline QByteArray encodeProgress(float progress)
+    {
+        QByteArray payload;
+        QDataStream stream{&payload, QIODevice::WriteOnly};
+        stream.setFloatingPointPrecision(QDataStream::SinglePrecision);
+        stream << progress;
+        return payload;
+    }
+
+    inline float decodeProgress(const QByteArray &payload)
+    {
+        float progress{0.0f};
+        QDataStream stream{payload};
+        stream.setFloatingPointPrecision(QDataStream::SinglePrecision);
+        stream >> progress;
+        return progress;
+    }
+
+    /*
+     * State of the image file the host is still writing while the helper serves it.
+     * expectedSize: final size (0 if unknown), available: bytes committed so far,
+     * holdEnd: bytes below this may still be rewritten, complete: file is final
+     */
+    struct ImageWatermark
+    {
+        qint64 expectedSize{0};
+        qint64 available{0};
+        qint64 holdEnd{0};
+        bool complete{true};
+    };
+
+    inline QByteArray encodeWatermark(const ImageWatermark &mark)
+    {
+        QByteArray payload;
+        QDataStream stream{&payload, QIODevice::WriteOnly};
+        stream << mark.expectedSize << mark.available << mark.holdEnd << mark.complete;
+        return payload;
+    }
+
+    inline ImageWatermark decodeWatermark(const QByteArray &payload)
+    {
+        ImageWatermark mark;
+        QDataStream stream{payload};
+        stream >> mark.expectedSize >> mark.available >> mark.holdEnd >> mark.complete;
+        return mark;
+    }
+
+    /*
+     * Reassembles frames from a byte stream that may deliver them in pieces
+     */
+    class FrameReader
+    {
+    public:
+        void append(const QByteArray &data)
+        {
+            _buf.append(data);
+        }
+
+        /*
+         * Returns false if no complete frame is buffered yet
+         * Oversized or empty frames mean the stream is out of sync, so the buffer is dropped
+         */
+        bool takeFrame(MessageType &type, QByteArray &payload)
+        {
+            if (_buf.size() < (qsizetype) sizeof(quint32))
+                return false;
+
+            quint32 len = qFromBigEndian<quint32>(_buf.constData());
+            if (len == 0 || len > SIMPBOOTP_IPC_MAX_FRAME_SIZE)
+            {
+                _buf.clear();
+                return false;
+            }
+            if (_buf.size() < (qsizetype) (sizeof(quint32) + len))
+                return false;
+
+            type = static_cast<MessageType>(_buf.at(sizeof(quint32)));
+            payload = _buf.mid(sizeof(quint32) + 1, len - 1);
+            _buf.remove(0, sizeof(quint32) + len);
+            return true;
+        }
+
+    private:
+        QByteArray _buf;
+    };
+}
+
+#endif // SIMPBOOTPIPC_H
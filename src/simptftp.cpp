@@ -1,102 +1,65 @@
-#include <QTimer>
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Serves a directory with the TFTP server of simpbootp, without DHCP and
+ * interface setup, so uniflash parts and manifests can be fetched locally.
+ * Meant for testing, an unprivileged port keeps it usable without root.
+ * Only listens on the loopback interface.
+ */
+
+#include <tftpserver.h>
 #include <qcommandlineparser.h>
 #include <qcoreapplication.h>
-#include <qdir.h>
-#include <tftpserver.h>
+#include <limits>
 
 int main(int argc, char* argv[])
 {
     QCoreApplication app{argc, argv};
 
     QCommandLineParser parser;
+    parser.setApplicationDescription("Standalone TFTP server for testing uniflash serving");
     parser.addOptions({
-        {{"b", "blocksize"},
-            QCoreApplication::translate("main", "TFTP block size"),
-            QCoreApplication::translate("main", "blocksize")},
-        // A boolean option with multiple names (-f, --force)
         {{"p", "port"},
             QCoreApplication::translate("main", "TFTP port."),
             QCoreApplication::translate("main", "port")},
-        // An option with a value
+        {{"b", "blocksize"},
+            QCoreApplication::translate("main", "TFTP block size"),
+            QCoreApplication::translate("main", "blocksize")},
         {{"t", "target-directory"},
-            QCoreApplication::translate("main", "Copy all source files into <directory>."),
+            QCoreApplication::translate("main", "Serve files from <directory>."),
             QCoreApplication::translate("main", "directory")},
-        {{"s", "single-run"},
-            QCoreApplication::translate("main", "Serve only <filename> and exit."),
-            QCoreApplication::translate("main", "filename")},
     });
-
     parser.addHelpOption();
     parser.process(app);
 
-    uint16_t port = TFTP_DEFAULT_PORT;
-    int32_t tftpBlocksize = TFTP_DEFAULT_BLOCK_SIZE;
-    QString targetDirectory = app.applicationDirPath();
-
-    if(parser.isSet("port"))
+    bool ok = true;
+    int port = parser.isSet("port") ? parser.value("port").toInt(&ok) : TFTP_DEFAULT_PORT;
+    if(!ok || port <= 0 || port > std::numeric_limits<uint16_t>::max())
     {
-        bool ok = false;
-        port = parser.value("port").toInt(&ok);
-        if(!ok || port > std::numeric_limits<uint16_t>::max())
-        {
-            port = TFTP_DEFAULT_PORT;
-            qDebug() << "Port is not valid (" << parser.value("port") << ") using default port" << port;
-        }
+        qCritical() << "Port is not valid:" << parser.value("port");
+        return 1;
     }
 
-    if(parser.isSet("blocksize"))
+    int blockSize = parser.isSet("blocksize") ? parser.value("blocksize").toInt(&ok) : TFTP_DEFAULT_BLOCK_SIZE;
+    if(!ok || blockSize <= 0)
     {
-        bool ok = false;
-        tftpBlocksize = parser.value("blocksize").toInt(&ok);
-        if(!ok)
-        {
-            tftpBlocksize = TFTP_DEFAULT_BLOCK_SIZE;
-            qDebug() << "Blocksize is not valid (" << parser.value("blocksize") << ") using default blocksize " << tftpBlocksize;
-        }
+        qCritical() << "Blocksize is not valid:" << parser.value("blocksize");
+        return 1;
     }
 
-    if(parser.isSet("target-directory"))
+    QString targetDirectory = parser.isSet("target-directory") ? parser.value("target-directory") : QDir::currentPath();
+    if(!QDir{targetDirectory}.exists())
     {
-        targetDirectory = parser.value("target-directory");
-        if(!QDir{targetDirectory}.exists())
-        {
-            targetDirectory = app.applicationDirPath();
-            qDebug() << "Target directory not valid (" << parser.value("target-directory")  << ") using default target directory" << targetDirectory;
-        }
+        qCritical() << "Target directory not valid:" << targetDirectory;
+        return 1;
     }
 
-    TFTP server{port, tftpBlocksize, targetDirectory};
-
-    if(parser.isSet("single-run"))
+    TFTP tftpServer{static_cast<uint16_t>(port), blockSize, targetDirectory};
+    if(tftpServer.start(QHostAddress::LocalHost) != 0)
     {
-        QString f = parser.value("single-run");
-        if(!QDir{targetDirectory}.exists())
-        {
-            qDebug() << "Single run file is not valid (" << f << ")";
-            return -1;
-        }
-        server.setSingleRunFilename(f);
+        qCritical() << "Cannot bind TFTP port" << port;
+        return 1;
     }
 
-    QTimer::singleShot(0, &app, [tftpBlocksize, port, targetDirectory, &server, &parser]()
-    {
-        if (0 > server.start())
-        {
-            qDebug() << "[simptftp]" << "server init failed!";
-            return;
-        }
-
-        while (server.run() >= 0);
-        server.stop();
-        if(parser.isSet("single-run"))
-        {
-            QCoreApplication::exit(server.isClosedSuccessfully() ? 0: 1);
-        }
-        else
-        {
-            QCoreApplication::quit();
-        }
-    });
-
     return app.exec();
 }
@@ -22,6 +22,7 @@
     SOFTWARE.
 */
 
+#include <qfileinfo.h>
 #include <qlogging.h>
 #include <QUdpSocket>
 #include <qthread.h>
@@ -35,272 +36,535 @@ TFTP::TFTP(uint16_t port, int tftp_block_size, QString target_dir)
     _tftpDataSize{_tftpBlockSize + 4},
     _path{target_dir}
 {
+    _timeoutTimer.setInterval(TFTP_ACK_TIMEOUT_MSEC / 10);
+    _timeoutTimer.callOnTimeout([this]()
+    {
+        checkTimeout();
+    });
 }
 
 TFTP::~TFTP()
 {
+    if (_scanThread != nullptr)
+    {
+        _scanThread->wait();
+        delete _scanThread;
+    }
+}
+
+void TFTP::allocateBuffers()
+{
+    // One spare byte so that request strings are always null terminated
+    _rxBuffer.resize(_tftpDataSize + 1);
+    _txBuffer.resize(_tftpDataSize);
 }
 
-int TFTP::processWrite()
+bool TFTP::isCurrentClient(const QHostAddress &addr, uint16_t port)
 {
-    int result = -1;
-    int totalSize = 0;
-    int nextBlockNum = 1;
-    while (1)
+    return addr.isEqual(_clientAddr) && port == _clientPort;
+}
+
+void TFTP::processPendingDatagrams()
+{
+    while (_socket.get() != nullptr && _socket->hasPendingDatagrams())
     {
-        if(false == _socket->waitForReadyRead(2000))
+        QHostAddress addr;
+        quint16 port;
+        _rxSize = _socket->readDatagram(_rxBuffer.data(), _tftpDataSize, &addr, &port);
+        if (_rxSize < 4)
         {
-            return -1;
+            qDebug() << TAG << "Short packet received from" << addr.toString() << ":" << port;
+            continue;
         }
+        _rxBuffer[_rxSize] = 0;
 
-        if (_socket->hasPendingDatagrams())
+        if (!_serving)
         {
-            _readSize = _socket->readDatagram((char*)_buffer, _tftpDataSize, &_clientAddr, &_clientPort);
-            qDebug() << TAG << "Received packet from" << _clientAddr.toString() << ":" << _clientPort;
-            qDebug() << TAG << "Data:" << _buffer; // Print the data in hex format
-        }
-        else
-        {
-            qDebug() << TAG << "No datagram inside received packat!!!";
-            return -1;
+            continue;
         }
 
-        if (_readSize < 0)
+        uint16_t cmd = ntohs(*(uint16_t*)(_rxBuffer.constData()));
+        if (cmd == TFTP_CMD_RRQ && _state == TransferState::Deferred && isCurrentClient(addr, port)
+            && _requestedFile == QByteArray(_rxBuffer.constData() + 2))
         {
-            qDebug(TAG, "error on receive");
-            break;
+            // Client retried the request that is held, it is answered once its part is written
+            continue;
         }
 
-        uint16_t code = ntohs(*(uint16_t*)(&_buffer[0]));
-        if ( code != TFTP_CMD_DATA )
+        if (cmd == TFTP_CMD_RRQ || cmd == TFTP_CMD_WRQ)
         {
-            qDebug() << TAG << "not data packet received: [" << code << "]";
-            qDebug() << TAG << _buffer << _readSize;
-            if ( ( code == TFTP_CMD_WRQ ) && ( nextBlockNum == 1 ) )
+            if (_state != TransferState::Idle)
             {
-                // some clients repeat request several times
-                sendAck(0);
-                continue;
+                // TI ROM Bootloader do not send last ack, a new request means it got the file
+                if (_state == TransferState::Reading && _tftpTIMode && _readSize < _tftpBlockSize)
+                {
+                    _totalSize += _readSize;
+                    finishRead();
+                }
+                else
+                {
+                    qDebug() << TAG << "New request while transfer in progress, dropping current transfer";
+                    finishTransfer();
+                }
             }
-            result = 1; // repeat
-            break;
+            _clientAddr = addr;
+            _clientPort = port;
+            qDebug() << TAG << "Received request from" << _clientAddr.toString() << ":" << _clientPort;
         }
-        uint16_t blockNum = ntohs(*(uint16_t*)(&_buffer[2]));
-        int dataSize = _readSize - 4;
-        sendAck(blockNum);
-        if ( blockNum < nextBlockNum )
+        else if (!isCurrentClient(addr, port))
         {
-            // Maybe this is dup, ignore it
-            qDebug() << TAG << "dup packet received: [" << blockNum << "], expected [" << nextBlockNum << "]";
-        }
-        else
-        {
-            nextBlockNum++;
-            totalSize += dataSize;
-            onWriteData(&_buffer[4], dataSize);
-            qDebug() << TAG << "Block size: " <<  dataSize;
-        }
-        if (_readSize < _tftpDataSize)
-        {
-            qDebug() << TAG << "file received: (" << totalSize << " bytes)";
-            result = 0;
-            break;
+            qDebug() << TAG << "Packet from unknown transfer id" << addr.toString() << ":" << port;
+            continue;
         }
+
+        handlePacket();
     }
-    return result;
 }
 
-int TFTP::processRead()
+void TFTP::handlePacket()
 {
-    int result = -ERR_NOT_DEFINED;
-    int blockNum = 1;
-    int totalSize = 0;
-    int count = 0;
-    qDebug() << "process read loop started";
+    uint16_t cmd = ntohs(*(uint16_t*)(_rxBuffer.constData()));
+    uint16_t blockNum = ntohs(*(uint16_t*)(_rxBuffer.constData() + 2));
 
-    for(;;)
+    switch (cmd)
     {
-        *(uint16_t*)(&_buffer[0]) = htons(TFTP_CMD_DATA);
-        *(uint16_t*)(&_buffer[2]) = htons(blockNum);
-
-        if(_splittedFileMode && ((totalSize + _tftpBlockSize) > _splitModeSize))
-        {
-            _splittedFileMode = false;
-            _readSize = 0;
-        }
-        else
-        {
-            _readSize = onReadData( &_buffer[4], _tftpBlockSize );
-            if (_readSize < 0)
+        case TFTP_CMD_RRQ:
+            if (parseRrq() == 0)
             {
-                qDebug(TAG, "Failed to read data from file");
-                sendError(ERR_ILLEGAL_OPERATION, "failed to read file");
-                result = -ERR_ILLEGAL_OPERATION;
-                break;
+                beginRead();
             }
-        }
-
-
-        // qDebug() << TAG <<  "Sending data to " << _clientAddr.toString().data() <<
-        //         ", blockNumber=" << blockNum << ", size=" << dataSize;
-
-        for(int r=0; r<3; r++)
-        {
-            auto sendSize = _readSize + 4;
-            auto writeSize = _socket->writeDatagram((char*)_buffer, sendSize, _clientAddr, _clientPort);
-            if(-1 == writeSize || writeSize != sendSize)
+            break;
+        case TFTP_CMD_WRQ:
+            if (parseWrq() == 0)
             {
-                qDebug() << TAG << "_splittedFileMode: " << _splittedFileMode;
-                qDebug() << TAG << "_tftpBlokSize: " << _tftpBlockSize;
-                qDebug() << TAG << "_splitModeSize: " << _splitModeSize;
-                qDebug() << TAG << "totalSize: " << totalSize;
-                qDebug() << TAG << "sendSize: " << sendSize;
-                qDebug() << TAG << "Extended block size request reject failed! Expected " << _readSize + 4 << "got " << writeSize;
-                result = -1;
-                break;
+                _state = TransferState::Writing;
+                _blockNum = 1;
+                _totalSize = 0;
+                _retries = 0;
+                _lastSend.start();
+                _timeoutTimer.start();
             }
-
-            if (waitForAck(blockNum) == 0)
+            break;
+        case TFTP_CMD_ACK:
+            if (_state == TransferState::Reading)
             {
-                result = 0;
-                break;
+                onAck(blockNum);
             }
-
-            qDebug() << TAG << "No ack/wrong ack, retrying";
-            result = -1;
-
-            // TI ROM Bootloader do not send last ack ignore it
-            if(writeSize < _tftpBlockSize && _tftpTIMode)
+            break;
+        case TFTP_CMD_DATA:
+            if (_state == TransferState::Writing)
             {
-                qDebug() << "TI Mode skipping last ack!";
-                result = 0;
-                break;
+                onData(blockNum);
             }
-        }
-        if ( result < 0 )
-        {
             break;
-        }
+        case TFTP_CMD_ERROR:
+            qDebug() << TAG << "client reported error" << blockNum << ":" << (_rxBuffer.constData() + 4);
+            failTransfer("aborted by client");
+            break;
+        default:
+            qDebug() << TAG << "unknown command " << cmd;
+    }
+}
+
+void TFTP::beginRead()
+{
+    _blockNum = 1;
+    _totalSize = 0;
+
+    if (!isReadRangeAvailable())
+    {
+        qDebug() << TAG << _requestedFile << "not written yet, holding request";
+        _state = TransferState::Deferred;
+        return;
+    }
+
+    _state = TransferState::Reading;
+    _timeoutTimer.start();
+    sendNextBlock();
+}
+
+bool TFTP::isReadRangeAvailable()
+{
+    // Zero regions are only known once the image is final and the manifest covers it
+    if (_manifestMode)
+    {
+        return false;
+    }
+
+    if (!_splittedFileMode || _imageComplete)
+    {
+        return true;
+    }
+
+    qint64 partEnd = _partOffset + _partLength;
+    return _imageSize != 0 && _curFile.isOpen() && _partOffset >= _holdEnd && partEnd <= _availableBytes;
+}
+
+void TFTP::setImageWatermark(qint64 expectedSize, qint64 available, qint64 holdEnd, bool complete)
+{
+    if (_imageComplete && !complete)
+    {
+        // A new image is being written, whatever the manifest knew is about the previous one
+        _scanGeneration++;
+        _scanSize = 0;
+        _scanFailed = false;
+        _manifestRequested = false;
+    }
+
+    _expectedImageSize = expectedSize;
+    _availableBytes = available;
+    _holdEnd = holdEnd;
+    _imageComplete = complete;
+
+    updateManifestScan();
+    serveDeferred();
+}
 
-        _progressUpdateCallback(_progress);
-        totalSize += _readSize;
+void TFTP::serveDeferred()
+{
+    if (_state != TransferState::Deferred)
+    {
+        return;
+    }
 
-        // update progress
-        if(_splittedFileMode)
+    // The held request stays parsed until its part is written, only then is it looked at again
+    bool partKnown = !_manifestMode && _imageSize != 0;
+    bool ready;
+    if (_manifestMode)
+    {
+        ready = _imageComplete && _scanThread == nullptr;
+    }
+    else if (partKnown)
+    {
+        ready = _imageComplete || (_partOffset >= _holdEnd && _partOffset + _partLength <= _availableBytes);
+    }
+    else
+    {
+        ready = _imageComplete || _expectedImageSize != 0;
+    }
+    if (!ready)
+    {
+        return;
+    }
+
+    // File may not have existed or its final size was unknown when the request came in
+    if ((_imageComplete || !partKnown || !_curFile.isOpen()) && onRead(_requestedFile.constData()) < 0)
+    {
+        sendError(ERR_FILE_NOT_FOUND, "cannot open file");
+        failTransfer("deferred file cannot be opened");
+        return;
+    }
+
+    if (isReadRangeAvailable())
+    {
+        qDebug() << TAG << _requestedFile << "written, serving held request";
+        beginRead();
+    }
+}
+
+void TFTP::updateManifestScan()
+{
+    // Only boards that use the manifest pay for it. Picked up again once the running scan is done
+    if (!_manifestRequested || _scanThread != nullptr || _scanFailed)
+    {
+        return;
+    }
+
+    QString path;
+    if (resolveServedFile("uniflash", path) < 0)
+    {
+        return;
+    }
+
+    qint64 size = _imageComplete ? QFileInfo(path).size() : _expectedImageSize;
+    if (size <= 0 || (_imageComplete && _manifest.isCurrent(path)))
+    {
+        return;
+    }
+
+    // Only what lies above the held range and below the watermark is final, the held range is scanned once it is released
+    qint64 granularity = _manifest.granularity();
+    qint64 held = qMin(_holdEnd, size);
+    qint64 low = _imageComplete ? 0 : qMin(size, (held + granularity - 1) / granularity * granularity);
+    qint64 high = _imageComplete ? size : qMin(size, _availableBytes / granularity * granularity);
+    // A finished manifest that is not current anymore is about an image that got replaced
+    if (size != _scanSize || _scanDone)
+    {
+        _manifest.begin(path, size);
+        _scanSize = size;
+        _scanLow = _scanHigh = low;
+        _scanDone = false;
+    }
+
+    QList<QPair<qint64, qint64>> ranges;
+    if (low < _scanLow)
+    {
+        ranges.append({low, _scanLow});
+    }
+    if (high > _scanHigh)
+    {
+        ranges.append({_scanHigh, high});
+    }
+
+    if (ranges.isEmpty())
+    {
+        if (_imageComplete && _scanLow == 0 && _scanHigh >= size)
         {
-            _progress = (float)((float)(_splitModeSize * _seekPartPos) + (float)totalSize) / (float)_curFile.size();
+            _scanDone = _manifest.finish();
+            if (!_scanDone)
+            {
+                _scanSize = 0;
+                updateManifestScan();
+            }
         }
-        else
+        return;
+    }
+
+    // Reading the image can take a while, DHCP, TFTP and IPC are served meanwhile
+    int generation = _scanGeneration;
+    _scanThread = QThread::create([this, ranges]()
+    {
+        bool ok = true;
+        for (auto &range: ranges)
         {
-            _progress = (float)totalSize / (float)_curFile.size();
+            ok = ok && _manifest.scanRange(range.first, range.second);
         }
+        _scanOk = ok;
+    });
+    QObject::connect(_scanThread, &QThread::finished, &_timeoutTimer, [this, generation, low, high]()
+    {
+        _scanThread->deleteLater();
+        _scanThread = nullptr;
 
-
-        if (_readSize < _tftpBlockSize)
+        if (generation == _scanGeneration)
         {
-            _lastFileName = QByteArray::fromStdString(std::filesystem::path( _curFile.fileName().toStdString()).filename().string());
-            if(_lastFileName == "uniflash")
+            if (!_scanOk)
             {
-                _lastFileName.append(std::to_string(_seekPartPos));
-                qDebug() << "_lastFileName: " << _lastFileName;
+                _scanFailed = true;
+                if (_state == TransferState::Deferred && _manifestMode)
+                {
+                    sendError(ERR_FILE_NOT_FOUND, "cannot read image");
+                    failTransfer("manifest cannot be built");
+                }
+                return;
             }
+            _scanLow = qMin(_scanLow, low);
+            _scanHigh = qMax(_scanHigh, high);
+        }
 
-            qDebug() << TAG << "Sent file " << _lastFileName << "(" << totalSize << " bytes )";
-            if(_lastFileName == "tiboot3.bin")
-            {
-                _tiboot3Sent = true;
-            }
+        updateManifestScan();
+        serveDeferred();
+    });
+    _scanThread->start();
+}
 
-            totalSize = 0;
-            result = 0;
-            break;
+void TFTP::sendNextBlock()
+{
+    *(uint16_t*)(_txBuffer.data()) = htons(TFTP_CMD_DATA);
+    *(uint16_t*)(_txBuffer.data() + 2) = htons(_blockNum);
+
+    int len = _tftpBlockSize;
+    if (_splittedFileMode)
+    {
+        len = std::min<int64_t>(_tftpBlockSize, _partLength - _totalSize);
+    }
+
+    _readSize = len > 0 ? onReadData((uint8_t*)_txBuffer.data() + 4, len) : 0;
+    if (_readSize < 0)
+    {
+        qDebug(TAG, "Failed to read data from file");
+        sendError(ERR_ILLEGAL_OPERATION, "failed to read file");
+        failTransfer("file read failed");
+        return;
+    }
+
+    _retries = 0;
+    resendLastPacket();
+}
+
+void TFTP::resendLastPacket()
+{
+    qint64 sendSize = (_state == TransferState::Reading) ? _readSize + 4 : 4;
+    if (_state == TransferState::Writing)
+    {
+        sendAck(_blockNum - 1);
+    }
+    else
+    {
+        auto writeSize = _socket->writeDatagram(_txBuffer.constData(), sendSize, _clientAddr, _clientPort);
+        if (-1 == writeSize || writeSize != sendSize)
+        {
+            qDebug() << TAG << "_splittedFileMode: " << _splittedFileMode;
+            qDebug() << TAG << "_tftpBlokSize: " << _tftpBlockSize;
+            qDebug() << TAG << "_splitModeSize: " << _splitModeSize;
+            qDebug() << TAG << "totalSize: " << _totalSize;
+            qDebug() << TAG << "Send data block failed! Expected " << sendSize << "got " << writeSize;
+            failTransfer("send failed");
+            return;
         }
-        blockNum++;
     }
-    if (result >= 0 && _onReadSuccess != nullptr) _onReadSuccess(_lastFileName);
-    return result;
+    _lastSend.start();
 }
 
-void TFTP::sendAck(uint16_t blockNum)
+void TFTP::onAck(uint16_t blockNum)
 {
-    uint8_t data[4];
+    if (blockNum != _blockNum)
+    {
+        // Duplicate of an earlier ack, the current block is still in flight
+        qDebug() << TAG << "received ack not in order: " << blockNum << "expected" << _blockNum;
+        return;
+    }
 
-    *(uint16_t*)(&data[0]) = htons(TFTP_CMD_ACK);
-    *(uint16_t*)(&data[2]) = htons(blockNum);
-    qDebug() << TAG <<  "ack to " << _clientAddr.toString().data() << ", blockNumber=" << blockNum;
+    _totalSize += _readSize;
 
-    auto sendSize = sizeof(data);
-    auto writeSize = _socket->writeDatagram((char*)data, sendSize, _clientAddr, _clientPort);
-    if(-1 == writeSize || writeSize != sendSize)
+    if (_readSize < _tftpBlockSize)
     {
-        qDebug() << TAG << "Extended block size request reject failed! Expected " << sendSize << "got " << writeSize;
+        finishRead();
+        return;
     }
+
+    updateProgress();
+
+    _blockNum++;
+    sendNextBlock();
 }
 
-void TFTP::sendError(uint16_t code, const char *message)
+void TFTP::onData(uint16_t blockNum)
 {
-    *(uint16_t *)(&_buffer[0]) = htons(TFTP_CMD_ERROR);
-    *(uint16_t *)(&_buffer[2]) = htons(code);
-    strcpy((char *)(&_buffer[4]), message);
-    auto sendSize = 4 + strlen(message) + 1;
-    auto writeSize = _socket->writeDatagram((char*)_buffer, sendSize, _clientAddr, _clientPort);
-    if(-1 == writeSize || writeSize != sendSize)
+    int dataSize = _rxSize - 4;
+
+    if (blockNum != _blockNum)
     {
-        qDebug() << TAG << "Extended block size request reject failed! Expected " << sendSize + 4 << "got " << writeSize;
+        // Maybe this is dup, ack it again so the client moves on
+        qDebug() << TAG << "dup packet received: [" << blockNum << "], expected [" << _blockNum << "]";
+        sendAck(blockNum);
+        return;
     }
 
-    if(false == _socket->waitForBytesWritten())
+    onWriteData((uint8_t*)_rxBuffer.data() + 4, dataSize);
+    _totalSize += dataSize;
+    sendAck(blockNum);
+    _blockNum++;
+    _retries = 0;
+    _lastSend.start();
+
+    if (_rxSize < _tftpDataSize)
     {
-        qDebug() << TAG << "Extended block size request reject failed!";
+        qDebug() << TAG << "file received: (" << _totalSize << " bytes)";
+        finishTransfer();
     }
 }
 
-int TFTP::waitForAck(uint16_t blockNum)
+void TFTP::updateProgress()
 {
-    uint8_t data[4];
-    qint64 readSize = 0;
+    // the manifest is bookkeeping and does not count
+    if (_progressTotal > 0)
+    {
+        _progress = (float)(_progressBase + _totalSize) / (float)_progressTotal;
+        if (_progressUpdateCallback != nullptr) _progressUpdateCallback(_progress);
+    }
+}
 
-    // qDebug() << TAG << "waiting for ack";
+void TFTP::finishRead()
+{
+    // Also reached without a last ack in TI mode, the final progress always goes out before the file is reported sent
+    updateProgress();
 
-    if(false == _socket->waitForReadyRead(2000))
+    _lastFileName = QByteArray::fromStdString(std::filesystem::path( _curFile.fileName().toStdString()).filename().string());
+    if(_lastFileName == "uniflash" || _source == &_memFile)
     {
-        return -ERR_PROC_TIMEOUT;
+        _lastFileName = _requestedFile.mid(_requestedFile.indexOf("uniflash"));
+        qDebug() << "_lastFileName: " << _lastFileName;
     }
 
-    if (_socket->hasPendingDatagrams())
+    qDebug() << TAG << "Sent file " << _lastFileName << "(" << _totalSize << " bytes )";
+    if(_lastFileName == "tiboot3.bin")
     {
-        readSize = _socket->readDatagram((char*)data, sizeof(data), &_clientAddr, &_clientPort);
-        // qDebug() << TAG << "Received packet from" << _clientAddr.toString() << ":" << _clientPort;
-        // qDebug() << TAG << "Data:" << data; // Print the data in hex format
+        _tiboot3Sent = true;
     }
-    else
+
+    finishTransfer();
+    if (_onReadSuccess != nullptr) _onReadSuccess(_lastFileName);
+}
+
+void TFTP::finishTransfer()
+{
+    _state = TransferState::Idle;
+    _splittedFileMode = false;
+    _totalSize = 0;
+    _timeoutTimer.stop();
+    onClose();
+}
+
+void TFTP::failTransfer(const char *reason)
+{
+    qDebug() << TAG << "transfer failed:" << reason;
+    _hasError = true;
+    finishTransfer();
+    if (_onTransferError != nullptr) _onTransferError(reason);
+}
+
+void TFTP::checkTimeout()
+{
+    if (_state == TransferState::Idle || _state == TransferState::Deferred || _lastSend.elapsed() < TFTP_ACK_TIMEOUT_MSEC)
     {
-        qDebug() << TAG << "No datagram inside received packat!!!";
-        return -ERR_NOT_DEFINED;
+        return;
     }
 
-    uint16_t cmd = ntohs(*(uint16_t *)(&data[0]));
-    if (readSize != sizeof(data) || (cmd != TFTP_CMD_ACK))
+    // TI ROM Bootloader do not send last ack ignore it
+    if (_state == TransferState::Reading && _readSize < _tftpBlockSize && _tftpTIMode)
     {
-        qDebug() << TAG << "received wrong ack packet: " << cmd;
-        sendError(ERR_NOT_DEFINED, "incorrect ack");
-        return -ERR_NOT_DEFINED;
+        qDebug() << "TI Mode skipping last ack!";
+        _totalSize += _readSize;
+        finishRead();
+        return;
     }
 
-    if (ntohs(*(uint16_t *)(&data[2])) != blockNum)
+    if (++_retries >= TFTP_MAX_RETRIES)
     {
-        qDebug() << TAG << "received ack not in order";
-        return 1;
+        failTransfer("peer stopped responding");
+        return;
+    }
+
+    qDebug() << TAG << "No ack/wrong ack, retrying";
+    resendLastPacket();
+}
+
+void TFTP::sendAck(uint16_t blockNum)
+{
+    uint8_t data[4];
+
+    *(uint16_t*)(&data[0]) = htons(TFTP_CMD_ACK);
+    *(uint16_t*)(&data[2]) = htons(blockNum);
+    qDebug() << TAG <<  "ack to " << _clientAddr.toString().data() << ", blockNumber=" << blockNum;
+
+    auto sendSize = sizeof(data);
+    auto writeSize = _socket->writeDatagram((char*)data, sendSize, _clientAddr, _clientPort);
+    if(-1 == writeSize || writeSize != sendSize)
+    {
+        qDebug() << TAG << "Extended block size request reject failed! Expected " << sendSize << "got " << writeSize;
+    }
+}
+
+void TFTP::sendError(uint16_t code, const char *message)
+{
+    QByteArray packet(4, Qt::Uninitialized);
+    *(uint16_t *)(packet.data()) = htons(TFTP_CMD_ERROR);
+    *(uint16_t *)(packet.data() + 2) = htons(code);
+    packet.append(message);
+    packet.append('\0');
+    auto writeSize = _socket->writeDatagram(packet, _clientAddr, _clientPort);
+    if(-1 == writeSize || writeSize != packet.size())
+    {
+        qDebug() << TAG << "Sending error packet failed! Expected " << packet.size() << "got " << writeSize;
     }
-    return 0;
 }
 
 int TFTP::parseWrq()
 {
-    uint8_t *ptr = (uint8_t*)(_buffer + 2);
-    char *filename = (char *)ptr;
-    ptr += strlen(filename) + 1;
-    char *mode = (char *)ptr;
+    char *filename = _rxBuffer.data() + 2;
+    char *ptr = filename + strlen(filename) + 1;
+    char *mode = ptr;
     ptr += strlen(mode) + 1;
     if ( onWrite(filename) < 0)
     {
@@ -308,7 +572,7 @@ int TFTP::parseWrq()
         sendError(ERR_ACCESS_VIOLATION, "cannot open file");
         return -ERR_ACCESS_VIOLATION;
     }
-    if ( (ptr - _buffer < _readSize) && !strcmp((char *)ptr, "blksize") )
+    if ( (ptr - _rxBuffer.data() < _rxSize) && !strcmp(ptr, "blksize") )
     {
         uint8_t data[] = { 0, 6, 'b', 'l', 'k', 's', 'i', 'z', 'e', 0, '5', '1', '2', 0 };
         if(-1 == _socket->writeDatagram((char*)data, sizeof(data), _clientAddr, _clientPort))
@@ -327,70 +591,38 @@ int TFTP::parseWrq()
     return 0;
 }
 
+bool TFTP::isRequestNameAllowed(const QString &name)
+{
+    // Files are only ever served from the target directory, never by path
+    return !name.isEmpty() && !QDir::isAbsolutePath(name) && !name.startsWith('\\') && !name.contains("..");
+}
+
 int TFTP::parseRrq()
 {
-    uint8_t *ptr = _buffer + 2;
-    char *filename = (char *)ptr;
-    ptr += strlen(filename) + 1;
-    char *mode = (char *)ptr;
-    ptr += strlen(mode) + 1;
-    if ( onRead(filename) < 0)
+    char *filename = _rxBuffer.data() + 2;
+    _requestedFile = filename;
+    int res = isRequestNameAllowed(QString::fromUtf8(filename)) ? onRead(filename) : -ERR_ACCESS_VIOLATION;
+    if (res == -ERR_ACCESS_VIOLATION)
+    {
+        qDebug() << TAG << "refusing request for" << filename << "outside the served directory";
+        sendError(ERR_ACCESS_VIOLATION, "access violation");
+        _hasError = true;
+        if (_onTransferError != nullptr) _onTransferError(QByteArray("access violation: ") + filename);
+        return -ERR_ACCESS_VIOLATION;
+    }
+    if (res < 0)
     {
         qDebug() << TAG << "failed to open file " << filename << "for reading";
         sendError(ERR_FILE_NOT_FOUND, "cannot open file");
         _hasError = true;
+        if (_onTransferError != nullptr) _onTransferError(QByteArray("file not found: ") + filename);
         return -ERR_FILE_NOT_FOUND;
     }
     qDebug() << TAG << "sending file: " << filename;
     return 0;
 }
 
-
-int TFTP::parseRq()
-{
-    int result = ERR_ILLEGAL_OPERATION;
-    for(;;)
-    {
-        qDebug() << TAG << _buffer << _readSize;
-        uint16_t cmd = ntohs(*(uint16_t*)(&_buffer[0])); /* parse command */
-        switch (cmd)
-        {
-            case TFTP_CMD_WRQ:
-                result = parseWrq();
-                if (result == 0)
-                {
-                    result = processWrite();
-                    onClose();
-                }
-                else
-                {
-                    result = 0; // it is ok since parsing is not network issue
-                }
-                break;
-            case TFTP_CMD_RRQ:
-                result = parseRrq();
-                if (result == 0)
-                {
-                    result = processRead();
-                    onClose();
-                }
-                else
-                {
-                    result = 0; // it is ok since parsing is not network issue
-                }
-                break;
-            default:
-                qDebug() << TAG << "unknown command " << cmd;
-        }
-        if (result <= 0)
-        {
-            break;
-        }
-    }
-    return result;
-}
-
-int TFTP::start()
+int TFTP::start(const QHostAddress &address)
 {
     if (_socket.get() != nullptr)
     {
@@ -398,22 +630,20 @@ int TFTP::start()
         return 0;
     }
     _socket.reset(new QUdpSocket);
+    allocateBuffers();
 
-    if(_buffer != nullptr)
-    {
-        delete[] _buffer;
-    }
-    _buffer = new uint8_t[_tftpDataSize];
-
-    if (false == _socket->bind(QHostAddress::AnyIPv4, _port, QUdpSocket::ReuseAddressHint))
+    if (false == _socket->bind(address, _port, QUdpSocket::ReuseAddressHint))
     {
         qDebug() << TAG << "binding error";
         return -ERR_PORT_BIND_FAILED;
     }
 
-    _socket->flush();
+    QObject::connect(_socket.get(), &QUdpSocket::readyRead, [this]()
+    {
+        processPendingDatagrams();
+    });
 
-    qDebug() << TAG <<  "Started on port " << _port
+    qDebug() << TAG <<  "Started on " << address.toString() << ":" << _port
              << ", blocksize " << _tftpBlockSize
              << ", directory " << _path.absolutePath();
     return 0;
@@ -424,29 +654,21 @@ int TFTP::run(bool waitFor)
     if(_quit)
         return 0;
 
-    if(false == _socket->waitForReadyRead(_tftpCommandWaitTimeoutMilliSec))
-    {
-        // qDebug() << "[simptftp] No packet received";
-        return -ERR_RECV_TIMEOUT;
-    }
-    else
+    int timeout = waitFor ? _tftpCommandWaitTimeoutMilliSec : 0;
+    if (_state == TransferState::Reading || _state == TransferState::Writing)
     {
-        qDebug() << "[simptftp] Packet received";
+        timeout = std::min<qint64>(timeout, std::max<qint64>(0, TFTP_ACK_TIMEOUT_MSEC - _lastSend.elapsed()));
     }
 
-    if (_socket->hasPendingDatagrams())
-    {
-        _readSize = _socket->readDatagram((char*)_buffer, _tftpDataSize, &_clientAddr, &_clientPort);
-        qDebug() << TAG << "Received packet from" << _clientAddr.toString() << ":" << _clientPort;
-        qDebug() << TAG << "Data:" << _buffer; // Print the data in hex format
-    }
-    else
+    bool received = _socket->hasPendingDatagrams() || _socket->waitForReadyRead(timeout);
+    processPendingDatagrams();
+    checkTimeout();
+
+    if (!received && _state == TransferState::Idle)
     {
-        qDebug() << TAG << "No datagram inside received packat!!!";
-        return -1;
+        return -ERR_RECV_TIMEOUT;
     }
-
-    return parseRq();
+    return 0;
 }
 
 void TFTP::stop()
@@ -454,12 +676,11 @@ void TFTP::stop()
     if (_socket.get() != nullptr)
     {
         qDebug() << TAG << "Stopped";
-        _socket.reset(nullptr);
-        if(_buffer != nullptr)
+        if (_state != TransferState::Idle)
         {
-            delete[] _buffer;
+            finishTransfer();
         }
-        _buffer = nullptr;
+        _socket.reset(nullptr);
     }
 }
 
@@ -468,6 +689,15 @@ void TFTP::setSingleRunFilename(QString filename)
     _singleRunFilename = filename;
 }
 
+void TFTP::setServing(bool serving)
+{
+    if (!serving && _state != TransferState::Idle)
+    {
+        finishTransfer();
+    }
+    _serving = serving;
+}
+
 bool TFTP::isClosedSuccessfully()
 {
     // if _quit flag set process completed successfully
@@ -490,58 +720,149 @@ int TFTP::onRead(const char *file)
     {
         _curFile.close();
     }
+    _memFile.close();
+    _source = &_curFile;
+    _manifestMode = false;
+
+    QString name{file};
+    if(name.contains("uniflash"))
+    {
+        return openUniflash(name.mid(name.indexOf("uniflash")));
+    }
 
-    _curFile.setFileName(_path.absoluteFilePath(file));
+    QString path;
+    if(resolveServedFile(name, path) < 0)
+    {
+        return -ERR_ACCESS_VIOLATION;
+    }
 
-    if(_curFile.fileName().contains("uniflash"))
+    _curFile.setFileName(path);
+    if(false == _curFile.open(QIODeviceBase::ReadOnly))
     {
-        qDebug() << "[simptftp] file mode is uniflash!";
-        // file that needs to be splitted 1Gib parts
-        QString filename{ _curFile.fileName().toUtf8() };
-        size_t offset = filename.indexOf("uniflash");
-        _curFile.setFileName(_path.absoluteFilePath("uniflash"));
+        return -ERR_FILE_NOT_FOUND;
+    }
+    _imageSize = _curFile.size();
+    _partOffset = 0;
+    _partLength = 0;
+    _progressBase = 0;
+    _progressTotal = _imageSize;
+
+    qDebug() << TAG << "current file is now: " << file;
+    return 0;
+}
 
-        if(offset != -1)
+int TFTP::resolveServedFile(const QString &name, QString &path)
+{
+    // A symlink in the served directory must not lead out of it either
+    QFileInfo info{_path.absoluteFilePath(name)};
+    path = info.absoluteFilePath();
+    if(info.exists())
+    {
+        path = info.canonicalFilePath();
+        if(!path.startsWith(_path.canonicalPath() + '/'))
         {
-            offset += strlen("uniflash");
-            _seekPartPos = std::stoi(filename.mid(offset).toStdString());
-            qDebug() << "opening: " << _curFile.fileName();
-            if(false == _curFile.open(QIODeviceBase::ReadOnly))
-            {
-                qDebug() << "file open failed: " << _curFile.errorString();
-                return -ERR_FILE_NOT_FOUND;
-            }
+            return -ERR_ACCESS_VIOLATION;
+        }
+    }
+    return 0;
+}
 
-            _splitModeSize = _curFile.size() / 10;
-            qDebug() << TAG << "current file is now: " << _curFile.fileName()
-                     << "with offset: " << _seekPartPos
-                     << "filesize: " << _curFile.size()
-                     << "partsize: " << _splitModeSize;
+int TFTP::openUniflash(const QString &name)
+{
+    qDebug() << "[simptftp] file mode is uniflash!";
+    QString path;
+    if(resolveServedFile("uniflash", path) < 0)
+    {
+        return -ERR_ACCESS_VIOLATION;
+    }
+    _curFile.setFileName(path);
+    _splittedFileMode = true;
 
-            if(_splitModeSize % 512 != 0)
-            {
-                qDebug() << "image part size not multiples of 512 this cannot write to mmc";
-                return -ERR_ILLEGAL_OPERATION;
-            }
+    qDebug() << "opening: " << _curFile.fileName();
+    if(false == _curFile.open(QIODeviceBase::ReadOnly) && _imageComplete)
+    {
+        qDebug() << "file open failed: " << _curFile.errorString();
+        return -ERR_FILE_NOT_FOUND;
+    }
 
-            qsizetype seekPos = _seekPartPos * _splitModeSize;
-            if(false == _curFile.seek(seekPos))
-            {
-                qDebug() << "set file offset failed!";
-            }
+    // While the image is still being written parts are cut from its final size
+    _imageSize = _imageComplete ? _curFile.size() : _expectedImageSize;
+
+    if(name == "uniflash.manifest" || name.startsWith("uniflash@"))
+    {
+        _manifestMode = true;
+        _manifestRequested = true;
+        if(!_imageComplete || _scanThread != nullptr || !_manifest.isCurrent(path))
+        {
+            // Held until the manifest covers the final image
+            updateManifestScan();
+            return _scanFailed ? -ERR_FILE_NOT_FOUND : 0;
+        }
+        _manifestMode = false;
 
-            _splittedFileMode = true;
+        if(name == "uniflash.manifest")
+        {
+            _curFile.close();
+            _memFile.setData(_manifest.toText());
+            _memFile.open(QIODeviceBase::ReadOnly);
+            _source = &_memFile;
+            _splittedFileMode = false;
+            _progressTotal = 0;
             return 0;
         }
-    }
 
-    if(false == _curFile.open(QIODeviceBase::ReadOnly))
-    {
-        return -ERR_FILE_NOT_FOUND;
+        bool ok;
+        qint64 offset = name.mid(strlen("uniflash@")).toLongLong(&ok, 16);
+        const UniflashManifest::Chunk *chunk = ok ? _manifest.findChunk(offset) : nullptr;
+        if(chunk == nullptr)
+        {
+            qDebug() << TAG << "no chunk in manifest for" << name;
+            return -ERR_FILE_NOT_FOUND;
+        }
+
+        _partOffset = chunk->offset;
+        _partLength = chunk->length;
+        _progressBase = chunk->dataBefore;
+        _progressTotal = _manifest.dataSize();
     }
+    else
+    {
+        bool ok;
+        _seekPartPos = name.mid(strlen("uniflash")).toInt(&ok);
+        if(!ok)
+        {
+            return -ERR_FILE_NOT_FOUND;
+        }
 
+        // file that needs to be splitted in 10 parts
+        _splitModeSize = _imageSize / 10;
+        qDebug() << TAG << "current file is now: " << _curFile.fileName()
+                 << "with offset: " << _seekPartPos
+                 << "filesize: " << _imageSize
+                 << "partsize: " << _splitModeSize;
 
-    qDebug() << TAG << "current file is now: " << file;
+        if(_imageSize == 0)
+        {
+            // Final size is only known once writing is complete
+            return 0;
+        }
+
+        if(_splitModeSize % 512 != 0)
+        {
+            qDebug() << "image part size not multiples of 512 this cannot write to mmc";
+            return -ERR_ILLEGAL_OPERATION;
+        }
+
+        _partOffset = (qint64)_seekPartPos * _splitModeSize;
+        _partLength = _splitModeSize;
+        _progressBase = _partOffset;
+        _progressTotal = _imageSize;
+    }
+
+    if(_curFile.isOpen() && false == _curFile.seek(_partOffset))
+    {
+        qDebug() << "set file offset failed!";
+    }
     return 0;
 }
 
@@ -553,7 +874,7 @@ int TFTP::onWrite(const char *file)
 
 int TFTP::onReadData(uint8_t *buffer, int len)
 {
-    return _curFile.read((char*)buffer, len);
+    return _source->read((char*)buffer, len);
 }
 
 int TFTP::onWriteData(uint8_t *buffer, int len)
@@ -564,6 +885,7 @@ int TFTP::onWriteData(uint8_t *buffer, int len)
 void TFTP::onClose()
 {
     _curFile.close();
+    _memFile.close();
     return;
 }
 
@@ -572,6 +894,11 @@ void TFTP::setOnReadSuccess(const std::function<void (QByteArray)> &newOnReadSuc
     _onReadSuccess = newOnReadSuccess;
 }
 
+void TFTP::setOnTransferError(const std::function<void (QByteArray)> &newOnTransferError)
+{
+    _onTransferError = newOnTransferError;
+}
+
 bool TFTP::hasError()
 {
     bool res = _hasError;
@@ -584,6 +911,12 @@ void TFTP::setError(bool error)
     _hasError = error;
 }
 
+void TFTP::resetJobState()
+{
+    _hasError = false;
+    _tiboot3Sent = false;
+}
+
 bool TFTP::isTiboot3BinSent()
 {
     bool res = _tiboot3Sent;
@@ -608,8 +941,14 @@ QByteArray TFTP::getLastFileName()
 
 void TFTP::setTftpBlockSize(int newTftpBlockSize)
 {
+    if (_state != TransferState::Idle)
+    {
+        qDebug() << TAG << "Block size change ignored while transfer in progress";
+        return;
+    }
     _tftpBlockSize = newTftpBlockSize;
     _tftpDataSize = _tftpBlockSize + 4;
+    allocateBuffers();
 }
 
 void TFTP::setSplitModeSize(uint32_t newSplitModeSize)
@@ -44,10 +44,19 @@ typedef int SOCKET;
 #endif
 
 #include "downloadthread.h"
+#include "uniflashmanifest.h"
+#include <qbuffer.h>
 #include <qdir.h>
+#include <qelapsedtimer.h>
+#include <qthread.h>
+#include <qtimer.h>
 #include <qudpsocket.h>
+#include <atomic>
+#include <functional>
 #define TFTP_DEFAULT_PORT (69)
 #define TFTP_DEFAULT_BLOCK_SIZE (512)
+#define TFTP_ACK_TIMEOUT_MSEC (2000)
+#define TFTP_MAX_RETRIES (3)
 
 #include <stdint.h>
 
@@ -80,21 +89,39 @@ public:
         ERR_RECV_TIMEOUT         = 12,
     };
 
+    /**
+     * Files are only served from inside target_dir: absolute names, names containing ".."
+     * and files whose canonical path lies outside of it are refused with an access violation.
+     */
     TFTP(uint16_t port = TFTP_DEFAULT_PORT, int tftp_block_size = 512, QString target_dir = ".");
     ~TFTP();
 
     /**
-     * Starts server.
+     * Starts server, listening on address only.
+     * Once started the server is driven by the socket's readyRead signal, so
+     * a running Qt event loop is all that is needed to serve requests.
      * Returns 0 if server is started successfully
      */
-    int start();
+    int start(const QHostAddress &address = QHostAddress::AnyIPv4);
 
     /**
-     * Listens for incoming requests. Can be executed in blocking and non-blocking mode
-     * @param waitFor true if blocking mode is required, false if non-blocking mode is required
+     * Waits for and handles incoming packets without an event loop.
+     * @param waitFor true to wait up to the command wait timeout for a packet,
+     *                false to only handle packets that are already pending
+     * @return negative value if nothing was received and no transfer is in progress
      */
     int run(bool waitFor = true);
 
+    /**
+     * Handles all datagrams waiting on the socket. Never blocks.
+     */
+    void processPendingDatagrams();
+
+    /**
+     * Retransmits or aborts the current transfer if the peer stopped answering.
+     */
+    void checkTimeout();
+
     /**
      * Stops server
      */
@@ -102,6 +129,23 @@ public:
 
     void setSingleRunFilename(QString filename);
 
+    /**
+     * While not serving, incoming requests are dropped but the port stays bound
+     */
+    void setServing(bool serving);
+
+    /**
+     * Lets "uniflashN" parts be served while the image is still being written.
+     * A part is served once it lies completely below available and at or above holdEnd.
+     * Requests for parts that are not ready yet are held back and only looked at again once the
+     * watermark passes their end. Retries of the held request are ignored until then.
+     * With complete set the image is served as a regular file.
+     * "uniflash.manifest" and its "uniflash@<offset>" chunks are held until the image is complete.
+     * Once the manifest was asked for, it is built on a worker thread from what lies below the watermark,
+     * so it is ready as soon as the image is complete, without reading the image again.
+     */
+    void setImageWatermark(qint64 expectedSize, qint64 available, qint64 holdEnd, bool complete);
+
     bool isClosedSuccessfully();
 
     void setCommandWaitTimeout(uint32_t timeout);
@@ -122,14 +166,20 @@ public:
 
     void setOnReadSuccess(const std::function<void (QByteArray)> &newOnReadSuccess);
 
+    void setOnTransferError(const std::function<void (QByteArray)> &newOnTransferError);
+
     bool hasError();
 
     void setError(bool error);
 
+    /**
+     * Clears the error and tiboot3.bin flags left over from the previous job
+     */
+    void resetJobState();
+
 protected:
     void sendAck(uint16_t blockNum);
     void sendError(uint16_t code, const char *message);
-    int waitForAck(uint16_t blockNum);
 
     /**
      * This method is called, when new read request is received.
@@ -174,15 +224,28 @@ protected:
     virtual void onClose();
 
 private:
+    enum class TransferState
+    {
+        Idle,
+        Reading,
+        Writing,
+        Deferred,   // read request accepted, waiting for its data to be written
+    };
+
     uint16_t _port;
     std::unique_ptr<QUdpSocket> _socket{};
     QHostAddress _clientAddr;
     uint16_t _clientPort;
-    uint8_t* _buffer{nullptr};
-    uint32_t _readSize{0};
+    QByteArray _rxBuffer;
+    QByteArray _txBuffer;
+    qint64 _rxSize{0};
+    int32_t _readSize{0};
     QFile _curFile;
+    QBuffer _memFile;
+    QIODevice *_source{&_curFile};
     QDir _path;
     bool _quit{false};
+    bool _serving{true};
     QString _singleRunFilename{""};
     int _tftpBlockSize;
     int _tftpDataSize;
@@ -198,11 +261,59 @@ private:
     QByteArray _lastFileName;
     std::function<void(float)> _progressUpdateCallback;
     std::function<void(QByteArray)> _onReadSuccess;
-
-    int processWrite();
-    int processRead();
+    std::function<void(QByteArray)> _onTransferError;
+
+    QByteArray _requestedFile;
+    // Built on _scanThread while the image is written, only touched here while no scan runs
+    UniflashManifest _manifest;
+    QThread *_scanThread{nullptr};
+    std::atomic<bool> _scanOk{false};
+    bool _scanFailed{false};
+    bool _manifestRequested{false};
+    int _scanGeneration{0};
+    // Image size the manifest was begun for, and the part of the image it covers so far
+    qint64 _scanSize{0};
+    qint64 _scanLow{0};
+    qint64 _scanHigh{0};
+    bool _scanDone{false};
+    // Range of the image served by the current uniflash request and where it lies in the overall progress
+    bool _manifestMode{false};
+    qint64 _partOffset{0};
+    qint64 _partLength{0};
+    qint64 _progressBase{0};
+    qint64 _progressTotal{0};
+    qint64 _imageSize{0};
+    qint64 _expectedImageSize{0};
+    qint64 _availableBytes{0};
+    qint64 _holdEnd{0};
+    bool _imageComplete{true};
+
+    TransferState _state{TransferState::Idle};
+    uint16_t _blockNum{0};
+    uint32_t _totalSize{0};
+    int _retries{0};
+    QElapsedTimer _lastSend;
+    QTimer _timeoutTimer;
+
+    void allocateBuffers();
+    void handlePacket();
+    void beginRead();
+    bool isReadRangeAvailable();
+    void serveDeferred();
+    void updateManifestScan();
+    void sendNextBlock();
+    void resendLastPacket();
+    void onAck(uint16_t blockNum);
+    void updateProgress();
+    void onData(uint16_t blockNum);
+    void finishRead();
+    void finishTransfer();
+    void failTransfer(const char *reason);
+    bool isCurrentClient(const QHostAddress &addr, uint16_t port);
+    int openUniflash(const QString &name);
+    int resolveServedFile(const QString &name, QString &path);
+    static bool isRequestNameAllowed(const QString &name);
     int parseWrq();
     int parseRrq();
-    int parseRq();
 };
 
@@ -0,0 +1,184 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "uniflashmanifest.h"
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <algorithm>
+#include <cstring>
+#ifndef _WIN32
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+UniflashManifest::UniflashManifest(qint64 granularity, qint64 maxChunkSize)
+    : _granularity(granularity), _maxChunkSize(maxChunkSize - maxChunkSize % granularity)
+{
+}
+
+bool UniflashManifest::_isZero(const char *buf, qint64 len)
+{
+    // Every byte equal to its successor and the first one zero
+    return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+void UniflashManifest::_addRegion(qint64 offset, qint64 length)
+{
+    if (!_chunks.isEmpty())
+    {
+        Chunk &last = _chunks.last();
+        if (last.offset + last.length == offset && last.length + length <= _maxChunkSize)
+        {
+            last.length += length;
+            _dataSize += length;
+            return;
+        }
+    }
+
+    _chunks.append({offset, length, _dataSize});
+    _dataSize += length;
+}
+
+void UniflashManifest::begin(const QString &path, qint64 expectedSize)
+{
+    clear();
+    _path = path;
+    _imageSize = expectedSize;
+    _granuleHasData.fill(false, (expectedSize + _granularity - 1) / _granularity);
+}
+
+bool UniflashManifest::scanRange(qint64 from, qint64 to)
+{
+    QFile f{_path};
+    if (!f.open(QIODevice::ReadOnly | QIODevice::Unbuffered))
+    {
+        qDebug() << "Cannot open image for manifest:" << f.errorString();
+        return false;
+    }
+
+    QByteArray buf(_granularity, Qt::Uninitialized);
+    qint64 pos = from - from % _granularity;
+    to = qMin(to, _imageSize);
+
+    while (pos < to)
+    {
+#if !defined(_WIN32) && defined(SEEK_DATA)
+        // Holes of sparse files read back as zeros, skip them without reading
+        off_t data = ::lseek(f.handle(), pos, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+        {
+            break;
+        }
+        if (data > pos)
+        {
+            pos = data - data % _granularity;
+            if (pos >= to)
+            {
+                break;
+            }
+        }
+#endif
+        if (!f.seek(pos))
+        {
+            qDebug() << "Seek failed while building manifest:" << f.errorString();
+            return false;
+        }
+
+        qint64 len = qMin<qint64>(_granularity, _imageSize - pos);
+        if (f.read(buf.data(), len) != len)
+        {
+            qDebug() << "Read failed while building manifest:" << f.errorString();
+            return false;
+        }
+
+        _granuleHasData.setBit(pos / _granularity, !_isZero(buf.constData(), len));
+        pos += len;
+    }
+
+    return true;
+}
+
+bool UniflashManifest::finish()
+{
+    QFileInfo info{_path};
+    if (info.size() != _imageSize)
+    {
+        qDebug() << "Image is" << info.size() << "bytes instead of the expected" << _imageSize << ", manifest has to be rebuilt";
+        return false;
+    }
+
+    _chunks.clear();
+    _dataSize = 0;
+    for (qint64 i = 0; i < _granuleHasData.size(); i++)
+    {
+        if (_granuleHasData.testBit(i))
+        {
+            _addRegion(i * _granularity, qMin(_granularity, _imageSize - i * _granularity));
+        }
+    }
+
+    _lastModified = info.lastModified();
+    _finished = true;
+    qDebug() << "uniflash manifest:" << _chunks.size() << "chunks," << _dataSize << "of" << _imageSize << "bytes carry data";
+    return true;
+}
+
+bool UniflashManifest::isCurrent(const QString &path) const
+{
+    QFileInfo info{path};
+    return _finished && path == _path && info.size() == _imageSize && info.lastModified() == _lastModified;
+}
+
+qint64 UniflashManifest::granularity() const
+{
+    return _granularity;
+}
+
+void UniflashManifest::clear()
+{
+    _path.clear();
+    _lastModified = QDateTime();
+    _imageSize = 0;
+    _dataSize = 0;
+    _granuleHasData.clear();
+    _finished = false;
+    _chunks.clear();
+}
+
+QByteArray UniflashManifest::toText() const
+{
+    QByteArray text;
+    text += "size " + QByteArray::number(_imageSize, 16) + "\n";
+    text += "granularity " + QByteArray::number(_granularity, 16) + "\n";
+    for (const Chunk &chunk : _chunks)
+    {
+        text += "chunk " + QByteArray::number(chunk.offset, 16) + " " + QByteArray::number(chunk.length, 16) + "\n";
+    }
+    return text;
+}
+
+const UniflashManifest::Chunk *UniflashManifest::findChunk(qint64 offset) const
+{
+    auto it = std::lower_bound(_chunks.cbegin(), _chunks.cend(), offset, [](const Chunk &chunk, qint64 value)
+    {
+        return chunk.offset < value;
+    });
+
+    if (it == _chunks.cend() || it->offset != offset)
+    {
+        return nullptr;
+    }
+    return &(*it);
+}
+
+qint64 UniflashManifest::imageSize() const
+{
+    return _imageSize;
+}
+
+qint64 UniflashManifest::dataSize() const
+{
+    return _dataSize;
+}
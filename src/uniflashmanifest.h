@@ -0,0 +1,87 @@
+#ifndef UNIFLASHMANIFEST_H
+#define UNIFLASHMANIFEST_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <QBitArray>
+#include <QByteArray>
+#include <QDateTime>
+#include <QString>
+#include <QVector>
+
+/* Typical eMMC erase group size, regions are skipped or sent in whole units of it */
+#define UNIFLASH_MANIFEST_GRANULARITY (4 * 1024 * 1024)
+/* Keeps a single TFTP transfer (and its 32 bit byte counter) well bounded */
+#define UNIFLASH_MANIFEST_MAX_CHUNK (256 * 1024 * 1024)
+
+/*
+ * List of the regions of a uniflash image that contain anything but zeros.
+ *
+ * Served as "uniflash.manifest", every data chunk is then served as "uniflash@<offset in hex>".
+ * The target erases the device and only fetches and writes the listed chunks.
+ *
+ * Text format, numbers in hex without prefix so that u-boot scripts can use them directly:
+ *   size <image size>
+ *   granularity <alignment of offsets>
+ *   chunk <offset> <length>
+ *   ...
+ */
+class UniflashManifest
+{
+public:
+    struct Chunk
+    {
+        qint64 offset;
+        qint64 length;
+        qint64 dataBefore;  // sum of the lengths of all preceding chunks
+    };
+
+    explicit UniflashManifest(qint64 granularity = UNIFLASH_MANIFEST_GRANULARITY, qint64 maxChunkSize = UNIFLASH_MANIFEST_MAX_CHUNK);
+
+    /*
+     * Built while the image is still being written: begin() sizes it for the expected image,
+     * scanRange() looks at a granularity aligned part that is final already and finish() turns
+     * what was found into chunks once every part has been scanned.
+     * scanRange() may run on another thread, nothing else may touch the manifest meanwhile.
+     */
+    void begin(const QString &path, qint64 expectedSize);
+    bool scanRange(qint64 from, qint64 to);
+    bool finish();
+    void clear();
+
+    /*
+     * Finished for the image at path and the image did not change since
+     */
+    bool isCurrent(const QString &path) const;
+    qint64 granularity() const;
+
+    QByteArray toText() const;
+
+    /*
+     * Returns the chunk starting at offset or nullptr
+     */
+    const Chunk *findChunk(qint64 offset) const;
+
+    qint64 imageSize() const;
+
+    /*
+     * Bytes the target actually has to receive
+     */
+    qint64 dataSize() const;
+
+protected:
+    static bool _isZero(const char *buf, qint64 len);
+    void _addRegion(qint64 offset, qint64 length);
+
+    qint64 _granularity, _maxChunkSize;
+    qint64 _imageSize{0}, _dataSize{0};
+    QString _path;
+    QDateTime _lastModified;
+    QBitArray _granuleHasData;
+    bool _finished{false};
+    QVector<Chunk> _chunks;
+};
+
+#endif // UNIFLASHMANIFEST_H
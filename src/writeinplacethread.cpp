@@ -1,6 +1,20 @@
 #include "writeinplacethread.h"
 #include "archive.h"
 #include "config.h"
+#include <QCryptographicHash>
+#include <QDeadlineTimer>
+#include <QFileInfo>
+#include <QLocalSocket>
+#include <QLockFile>
+#include <QMap>
+#include <QRegularExpression>
+#include <QSettings>
+#include <limits>
+
+#ifdef Q_OS_UNIX
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 WriteInPlaceThread::WriteInPlaceThread(
     const QByteArray &url,
@@ -16,26 +30,23 @@ WriteInPlaceThread::WriteInPlaceThread(
 void WriteInPlaceThread::run()
 {
     QScopedPointer<PriviligedProcess> bootpProc{};
-    auto cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    // Boot files are kept per board and only downloaded again when they change on the server
+    auto cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/bootfiles/" + _boardName;
 
-    auto startSimpBootp = [this, &bootpProc, &cacheDir]()
+    auto launchSimpBootp = [this, &bootpProc, &cacheDir]() -> bool
     {
-        bootpProc.reset(new PriviligedProcess);
-        if(false == bootpProc->startCommunicationChannel("SimpbootpCommChannel"))
-        {
-            emit error(tr("Error comm start with simpbootp server"));
-            return;
-        }
-
 #if defined(Q_OS_UNIX)
         QString simpbootpBinaryPath;
         char* appimagedir = getenv("APPIMAGE");
         if(appimagedir)
         {
-            QString bupPath = QStandardPaths::writableLocation(QStandardPaths::TempLocation) + QDir::separator() + "GemImagerRelocated";
-            // Beacause how appimage works we have to copy APPDIR to different directory for root user access
-            QProcess::execute("cp", QStringList() << "-r" << getenv("APPDIR") << bupPath);
-            simpbootpBinaryPath = bupPath + "/usr/bin/simpbootp";
+            // Beacause how appimage works we have to copy simpbootp out of the APPDIR mount for root user access
+            simpbootpBinaryPath = _relocateSimpbootp(appimagedir, getenv("APPDIR"));
+            if(simpbootpBinaryPath.isEmpty())
+            {
+                emit error(tr("Error preparing simpbootp server"));
+                return false;
+            }
             qDebug() << "binarypath: " << simpbootpBinaryPath;
         }
         else if(QFile::exists("./simpbootp"))
@@ -46,119 +57,166 @@ void WriteInPlaceThread::run()
         {
             qDebug() << "simpbootp bulunamadi";
             emit error("Simpbootp binary not found. Probably package corrupted!");
-            return;
+            return false;
         }
 
-        bootpProc->setArguments(
-            QStringList() << simpbootpBinaryPath
+        QStringList args = QStringList() << simpbootpBinaryPath
             << "--interface" << _selEthPort
-            << "--single-run" << "tiboot3.bin"
-            << "--target-directory" << cacheDir
-        );
+            << "--target-directory" << cacheDir;
+        bootpProc->setArguments(args);
 #elif defined(Q_OS_WIN)
     QString simpbootCommand = QString("powershell.exe -WindowStyle Hidden -ArgumentList \"-ExecutionPolicy Bypass \
-                            -Command `\"./simpbootp.exe --interface Ethernet  --target-directory %1 --single-run tiboot3.bin`\"\" -Verb RunAs").arg(cacheDir);
+                            -Command `\"./simpbootp.exe --interface Ethernet  --target-directory %1`\"\" -Verb RunAs").arg(cacheDir);
 
-    bootpProc->setArguments(QStringList() << simpbootCommand);
+    QStringList args = QStringList() << simpbootCommand;
+    bootpProc->setArguments(args);
 #endif
-        bootpProc->start();
-    };
-
-    if(_boardName.isEmpty())
-    {
-        emit error(tr("Uniflash not supported for this board. This error indicates corrupted json configuration!"));
-        return;
-    }
-
-    // Downlaod boot files
-    emit preparationStatusUpdate("Downloading boot files");
-
-    QString fileUrl{BOOTIMG_URL};
-    QVector<DownloadThread*> dlThreads{};
-    QByteArray tiboot3Path = (cacheDir + QDir::separator() + "tiboot3.bin").toUtf8();
-    QByteArray emmcBootPath = (cacheDir + QDir::separator() + "texas_am67_sbl_emmcboot.release.hs_fs.tiimage").toUtf8();
-    QByteArray linuxAppimagePath = (cacheDir + QDir::separator() + "linux.appimage.hs_fs").toUtf8();
-    QByteArray ubootImgPath = (cacheDir + QDir::separator() + "u-boot.img").toUtf8();
-    QByteArray imageFilePath = (cacheDir + QDir::separator() + _filename).toUtf8();
-
-    dlThreads.reserve(3);
-    dlThreads.append(new DownloadThread(fileUrl.arg(_boardName, "texas_am67_sbl_gemboot.release.hs_fs.tiimage").toUtf8(), tiboot3Path , 0, true));
-    dlThreads.append(new DownloadThread(fileUrl.arg(_boardName, "texas_am67_sbl_emmcboot.release.hs_fs.tiimage").toUtf8(), emmcBootPath, 0, true));
-    dlThreads.append(new DownloadThread(fileUrl.arg(_boardName, "linux.appimage.hs_fs").toUtf8(), linuxAppimagePath, 0, true));
-    dlThreads.append(new DownloadThread(fileUrl.arg(_boardName, "u-boot.img").toUtf8(), ubootImgPath, 0, true));
-
-    QObject::connect(dlThreads.last(), &DownloadThread::preparationStatusUpdate, this, &WriteInPlaceThread::preparationStatusUpdate);
-    QObject::connect(dlThreads.last(), &DownloadThread::updateNumProgress, this, &WriteInPlaceThread::updateNumProgress);
-
-    for(auto& thread: dlThreads)
-    {
-        thread->start();
-    }
+        if(false == bootpProc->start())
+        {
+            emit error(tr("Error starting simpbootp server"));
+            return false;
+        }
 
-    auto deleteBootFiles = QScopeGuard{[tiboot3Path, emmcBootPath, linuxAppimagePath, ubootImgPath]()
+        // Leave enough time for the user to authorize
+        if(false == bootpProc->waitForCommunicationChannelReady(SIMPBOOTP_START_TIMEOUT_MSEC))
         {
-            QFile::remove(tiboot3Path);
-            QFile::remove(emmcBootPath);
-            QFile::remove(linuxAppimagePath);
-            QFile::remove(ubootImgPath);
+            emit error(tr("Error connecting Simpbootp server"));
+            return false;
         }
+        return true;
     };
 
-    for(auto& thread: dlThreads)
+    // Helper stays alive between jobs, only launch it (and ask for authorization) if it is not running yet
+    auto startSimpBootp = [this, &bootpProc, &cacheDir, &launchSimpBootp]() -> bool
     {
-        if(false == thread->wait(10000))
+        QByteArray startJob = "startJob\n" + _selEthPort.toUtf8() + "\n" + cacheDir.toUtf8();
+
+        bootpProc.reset(new PriviligedProcess);
+        if(bootpProc->startCommunicationChannel(SIMPBOOTP_IPC_CHANNEL))
         {
-            emit error("Timeout while downloading boot files!");
-            for(auto& killthread: dlThreads)
+            if(bootpProc->sendMessage(startJob, 5000))
             {
-                killthread->terminate();
-                killthread->deleteLater();
+                return true;
             }
-            return;
+
+            // Running helper was set up for another interface or board directory, replace it
+            qDebug() << "simpbootp refused job, restarting it";
+            bootpProc->sendMessage("shutdown");
+            bootpProc->closeCommunicationChannel();
+            QThread::msleep(500);
         }
-    }
 
-    dlThreads.last()->disconnect();
+        if(false == launchSimpBootp())
+        {
+            return false;
+        }
 
-    for(auto& thread: dlThreads)
+        if(false == bootpProc->sendMessage(startJob, 5000))
+        {
+            emit error(tr("Simpbootp server refused the job"));
+            return false;
+        }
+        return true;
+    };
+
+    if(_boardName.isEmpty())
     {
-        thread->deleteLater();
+        emit error(tr("Uniflash not supported for this board. This error indicates corrupted json configuration!"));
+        return;
     }
 
-    startSimpBootp();
+    QByteArray linuxAppimagePath = (cacheDir + QDir::separator() + "linux.appimage.hs_fs").toUtf8();
+    QByteArray ubootImgPath = (cacheDir + QDir::separator() + "u-boot.img").toUtf8();
+    QByteArray imageFilePath = (cacheDir + QDir::separator() + _filename).toUtf8();
+    QDir{}.mkpath(cacheDir);
 
-    if(!QFile::exists(tiboot3Path) || !QFile::exists(linuxAppimagePath) || !QFile::exists(ubootImgPath))
+    // Whichever side fails or gets cancelled first takes the other one down
+    auto abortJob = [this](const QString &reason)
     {
-        emit error("Failed downloading boot files!");
-        return;
-    }
+        if(_imageFailed)
+        {
+            emit error(tr("Download extract failed!"));
+        }
+        else if(_cancelled && _stage < BootStage::SblUart)
+        {
+            emit error(tr("Process cancelled by user"));
+        }
+        else if(_cancelled)
+        {
+            emit error(tr("Process cancelled by user. Please power cycle the board before retrying!"));
+        }
+        else
+        {
+            emit error(reason);
+        }
+    };
 
+    // The image is by far the largest download, it runs while the board is brought up with the small boot files
     DownloadExtractThread* th{ new DownloadExtractThread(_url, imageFilePath, _expectedHash) };
-    bool isDownExtrSuccess{true};
+    bool isDownExtrFinished{false};
+    Transfer* transferInstance{nullptr};
 
-    auto cleanup = QScopeGuard{[th, &bootpProc, imageFilePath]()
+    auto cleanup = QScopeGuard{[th, &bootpProc, &transferInstance, imageFilePath]()
     {
-        if(false == bootpProc->sendMessage("quit")) qDebug() << "send quit failed!";
-        if(false == bootpProc->waitForFinished(3000))
+        if (transferInstance)
+        {
+            transferInstance->terminate();
+            transferInstance->wait(1000);
+            transferInstance->deleteLater();
+        }
+
+        // Helper keeps the interface configured for the next board
+        if (bootpProc)
         {
-            bootpProc->kill();
-            bootpProc->waitForFinished(1000);
+            if(false == bootpProc->sendMessage("stopJob")) qDebug() << "send stopJob failed!";
+            bootpProc->closeCommunicationChannel();
         }
 
         if (th)
         {
-            th->terminate();
+            th->cancelDownload();
+            th->wait(5000);
             th->deleteLater();
         }
         QFile::remove(imageFilePath);
     }};
 
+    // The helper serves parts of the image as soon as they are written, parts that may still change are held back
+    auto sendWatermark = [this, th, &bootpProc, &isDownExtrFinished, imageFilePath]()
+    {
+        if(!bootpProc)
+        {
+            return;
+        }
+
+        SimpbootpIpc::ImageWatermark mark;
+        if(isDownExtrFinished)
+        {
+            mark.expectedSize = QFileInfo(QString::fromUtf8(imageFilePath)).size();
+            mark.available = mark.expectedSize;
+            mark.holdEnd = 0;
+            mark.complete = true;
+        }
+        else
+        {
+            qint64 rewriteEnd = th->pendingRewriteEnd();
+            mark.expectedSize = _extractSize;
+            mark.available = th->bytesWritten();
+            mark.holdEnd = rewriteEnd < 0 ? std::numeric_limits<qint64>::max() : rewriteEnd;
+            mark.complete = false;
+        }
+        bootpProc->sendEvent(SimpbootpIpc::Watermark, SimpbootpIpc::encodeWatermark(mark));
+    };
+
     QEventLoop loop;
-    emit preparationStatusUpdate("Downloading image");
     QObject::connect(th, &DownloadExtractThread::updateNumProgress, this, [this](QVariant pos)
     {
-        qDebug() << "updateNumProgress()" << pos;
-        emit this->updateNumProgress(pos);
+        // Serial transfers and the image transfer to the board report their own progress
+        BootStage stage = _stage;
+        if(stage == BootStage::Helper || stage == BootStage::SblUart || stage == BootStage::WaitImage)
+        {
+            emit this->updateNumProgress(pos);
+        }
     });
 
     QObject::connect(th, &DownloadExtractThread::preparationStatusUpdate, this, [this](QString msg)
@@ -167,39 +225,73 @@ void WriteInPlaceThread::run()
         emit this->preparationStatusUpdate(msg);
     });
 
-    QObject::connect(th, &DownloadExtractThread::success, &loop, &QEventLoop::quit);
-    QObject::connect(th, &DownloadExtractThread::error, &loop, [&loop, &isDownExtrSuccess](QString err_msg)
+    QObject::connect(th, &DownloadExtractThread::success, &loop, [&isDownExtrFinished, &sendWatermark]()
     {
-        qDebug() << "Download extract failed: " << err_msg;
-        isDownExtrSuccess = false;
-        loop.quit();
+        isDownExtrFinished = true;
+        sendWatermark();
     });
 
+    // Direct, so stages blocked outside an event loop notice it too
+    QObject::connect(th, &DownloadExtractThread::error, th, [this](QString err_msg)
+    {
+        qDebug() << "Download extract failed: " << err_msg;
+        _imageFailed = true;
+    }, Qt::DirectConnection);
+
     th->setVerifyEnabled(_verifyEnabled);
     th->setUserAgent(QString("Mozilla/5.0 gem-imager/%1").arg("1.0").toUtf8());
     th->setImageCustomization(_config, _cmdline, _firstrun, _cloudinit, _cloudinitNetwork, _geminit, _initFormat, _destination);
 
+    QTimer watermarkTimer;
+    watermarkTimer.setInterval(250);
+    watermarkTimer.callOnTimeout([&isDownExtrFinished, &sendWatermark]()
+    {
+        if(!isDownExtrFinished)
+        {
+            sendWatermark();
+        }
+    });
+
     th->start();
-    loop.exec();
 
-    if(!isDownExtrSuccess)
+    _setStage(BootStage::BootFiles);
+    if(false == _updateBootFileCache(cacheDir))
     {
-        emit error(tr("Download extract failed!"));
+        abortJob(tr("Failed downloading boot files!"));
         return;
     }
 
-    emit preparationStatusUpdate("The board is awaiting to boot");
+    _setStage(BootStage::Helper);
+    if(_isAborted())
+    {
+        abortJob(QString());
+        return;
+    }
 
+    if(false == startSimpBootp())
+    {
+        return;
+    }
+
+    sendWatermark();
+    watermarkTimer.start();
+
+    _setStage(BootStage::SblUart);
     if(false == bootpProc->waitForCommunicationChannelReady())
     {
-        emit error(tr("Error connecting Simpbootp server"));
+        abortJob(tr("Error connecting Simpbootp server"));
         return;
     }
 
     if(false == bootpProc->checkValue("isSblUartReady", "ok"))
     {
-        if(false == bootpProc->sendMessage("notifyFileSend")) qDebug() << "notify set send failed!";
-        auto resp = bootpProc->recvMessage(10000);
+        // Boot rom fetches tiboot3.bin over ethernet before SBL opens the uart
+        QByteArray resp;
+        QDeadlineTimer deadline{10000};
+        while(resp.isEmpty() && !deadline.hasExpired() && !_isAborted())
+        {
+            resp = bootpProc->waitForEvent(SimpbootpIpc::FileSent, 200);
+        }
 
         if(resp != "tiboot3.bin")
         {
@@ -207,74 +299,121 @@ void WriteInPlaceThread::run()
         }
     }
 
-    Transfer* transferInstance{ new Transfer(_selSerPort, _serPortbaudRate, _filename) };
-    if(false == transferInstance->setSerialPortAndConfigure(_selSerPort, UNIFLASH_BAUD_RATE))
-    {
-        emit error(tr("Error starting communication with board"));
-        return;
-    }
+    // Second stage loaders go over the uart, u-boot then switches the link to gigabit for the image
+    const QList<QPair<BootStage, QByteArray>> serialStages = {
+        {BootStage::LinuxAppimage, linuxAppimagePath},
+        {BootStage::Uboot, ubootImgPath},
+    };
 
-    sendFileViaXModem(transferInstance, linuxAppimagePath);
-    if(false == waitForSendFileViaXModemCompleted(transferInstance))
+    for(auto &serialStage: serialStages)
     {
-        emit error(tr("Error sending file with XMODEM: ") + tr(_lastErrorString.toUtf8()));
-        return;
-    }
+        _setStage(serialStage.first);
+        if(_isAborted())
+        {
+            abortJob(QString());
+            return;
+        }
 
-    transferInstance->terminate();
-    transferInstance->wait(1000);
-    transferInstance->deleteLater();
+        transferInstance = new Transfer(_selSerPort, _serPortbaudRate, _filename);
+        if(false == transferInstance->setSerialPortAndConfigure(_selSerPort, UNIFLASH_BAUD_RATE))
+        {
+            abortJob(tr("Error starting communication with board"));
+            return;
+        }
 
-    transferInstance =  new Transfer(_selSerPort, _serPortbaudRate, _filename);
-    if(false == transferInstance->setSerialPortAndConfigure(_selSerPort, UNIFLASH_BAUD_RATE))
-    {
-        emit error(tr("Error starting communication with board"));
-        return;
-    }
+        if(serialStage.first == BootStage::Uboot)
+        {
+            bootpProc->sendMessage("1000MB");
+        }
 
-    bootpProc->sendMessage("1000MB");
+        sendFileViaXModem(transferInstance, serialStage.second);
+        if(false == waitForSendFileViaXModemCompleted(transferInstance))
+        {
+            abortJob(tr("Error sending file with XMODEM: ") + tr(_lastErrorString.toUtf8()));
+            return;
+        }
 
-    sendFileViaXModem(transferInstance, ubootImgPath);
-    if(false == waitForSendFileViaXModemCompleted(transferInstance))
-    {
-        emit error(tr("Error sending file with XMODEM: ") + tr(_lastErrorString.toUtf8()));
-        return;
+        transferInstance->terminate();
+        transferInstance->wait(1000);
+        transferInstance->deleteLater();
+        transferInstance = nullptr;
     }
 
-    transferInstance->terminate();
-    transferInstance->wait(1000);
-    transferInstance->deleteLater();
+    bool imageSendFailed{false}, imageSent{false};
+    float imageProgress{0.0f};
+    // Anything moving, the download or the transfer to the board, keeps the job alive
+    QDeadlineTimer stallDeadline{UNIFLASH_IMAGE_STALL_TIMEOUT_MSEC};
+    quint64 lastImageWork{0};
 
-    QTimer progressTimer;
-    bool imageSendFailed{false};
+    // Helper pushes progress and errors as they happen, nothing to poll
+    QObject::connect(bootpProc.data(), &PriviligedProcess::eventReceived, &loop, [this, &loop, &imageSendFailed, &imageSent, &imageProgress, &stallDeadline, &isDownExtrFinished](int type, QByteArray payload)
+    {
+        stallDeadline.setRemainingTime(UNIFLASH_IMAGE_STALL_TIMEOUT_MSEC);
 
-    progressTimer.setInterval(1000);
-    progressTimer.callOnTimeout([this, &progressTimer, &bootpProc, &loop, &imageSendFailed](){
-        auto status_str = bootpProc->getValue("isFileTransferOk");
-        if(status_str == "nok")
+        if(type == SimpbootpIpc::TransferError)
         {
+            qDebug() << "TFTP transfer error: " << payload;
             imageSendFailed = true;
             loop.quit();
         }
+        else if(type == SimpbootpIpc::Progress)
+        {
+            // First image part only goes out once it is fully written
+            if(_stage == BootStage::WaitImage)
+            {
+                _setStage(BootStage::ServeImage);
+            }
 
-        auto progress_str = bootpProc->getValue("getFileSendProgress");
-        float progress = progress_str.toFloat();
-        updateNumProgress(progress);
+            imageProgress = SimpbootpIpc::decodeProgress(payload);
+            updateNumProgress(imageProgress);
+        }
+        else if(type == SimpbootpIpc::FileSent && imageProgress >= 1.0f)
+        {
+            // Final progress of a file is always pushed before it is reported sent
+            qDebug() << "image sent, last part:" << payload;
+            imageSent = true;
+            if(isDownExtrFinished)
+            {
+                loop.quit();
+            }
+        }
+    });
 
-        if(progress >= 1.0)
+    bool imageStalled{false};
+    QTimer stageTimer;
+    stageTimer.setInterval(200);
+    stageTimer.callOnTimeout([this, th, &loop, &imageSent, &isDownExtrFinished, &stallDeadline, &lastImageWork, &imageStalled]()
+    {
+        quint64 imageWork = th->bytesWritten() + th->verifyNow();
+        if(imageWork != lastImageWork)
         {
-            loop.quit();
+            lastImageWork = imageWork;
+            stallDeadline.setRemainingTime(UNIFLASH_IMAGE_STALL_TIMEOUT_MSEC);
         }
 
-        if(_cancelled)
+        if(stallDeadline.hasExpired())
+        {
+            qDebug() << "uniflash image transfer stalled in stage" << (int) _stage.load();
+            imageStalled = true;
+            loop.quit();
+        }
+        else if(_isAborted() || (imageSent && isDownExtrFinished))
         {
             loop.quit();
         }
     });
 
-    progressTimer.start();
-    emit updateNumProgress(QVariant{0.0});
+    _setStage(BootStage::WaitImage);
+    stageTimer.start();
     loop.exec();
+    stageTimer.stop();
+    watermarkTimer.stop();
+
+    if(imageStalled)
+    {
+        emit error(tr("Board stopped fetching the image. Please power cycle the board before retrying!"));
+        return;
+    }
 
     if(imageSendFailed)
     {
@@ -282,20 +421,338 @@ void WriteInPlaceThread::run()
         return;
     }
 
-    if(_cancelled)
+    if(_isAborted())
     {
-        emit error(tr("Process cancelled by user. Please power cycle the board before retrying!"));
+        abortJob(QString());
         return;
     }
 
     emit success();
 }
 
+void WriteInPlaceThread::_setStage(BootStage stage)
+{
+    static const QMap<BootStage, QString> stageNames = {
+        {BootStage::BootFiles, "Downloading boot files"},
+        {BootStage::Helper, "Starting network boot server"},
+        {BootStage::SblUart, "The board is awaiting to boot"},
+        {BootStage::LinuxAppimage, "Sending linux appimage to board"},
+        {BootStage::Uboot, "Sending u-boot to board"},
+        {BootStage::WaitImage, "Board is waiting for the image"},
+        {BootStage::ServeImage, "Sending image to board"},
+    };
+
+    qDebug() << "uniflash stage:" << stageNames.value(stage);
+    _stage = stage;
+    emit preparationStatusUpdate(stageNames.value(stage));
+}
+
+bool WriteInPlaceThread::_isAborted()
+{
+    return _cancelled || _imageFailed;
+}
+
+bool WriteInPlaceThread::_updateBootFileCache(const QString &bootDir)
+{
+    // remote name, name the boot rom / tftp client asks for
+    static const QList<QPair<QString, QString>> bootFiles = {
+        {"texas_am67_sbl_gemboot.release.hs_fs.tiimage", "tiboot3.bin"},
+        {"texas_am67_sbl_emmcboot.release.hs_fs.tiimage", "texas_am67_sbl_emmcboot.release.hs_fs.tiimage"},
+        {"linux.appimage.hs_fs", "linux.appimage.hs_fs"},
+        {"u-boot.img", "u-boot.img"},
+    };
+
+    QDir{}.mkpath(bootDir);
+
+    QSettings settings;
+    settings.beginGroup("caching/bootfiles/" + _boardName);
+
+    QString fileUrl{BOOTIMG_URL};
+    QVector<DownloadThread*> dlThreads{};
+
+    for(auto &file: bootFiles)
+    {
+        QString localPath = bootDir + QDir::separator() + file.second;
+        QByteArray partPath = (localPath + ".part").toUtf8();
+        QFile::remove(partPath);
+
+        auto thread = new DownloadThread(fileUrl.arg(_boardName, file.first).toUtf8(), partPath, 0, true);
+        if(QFile::exists(localPath))
+        {
+            thread->setConditionalRequest(settings.value(file.second + "/etag").toByteArray(),
+                                          settings.value(file.second + "/lastModified", 0).toLongLong());
+        }
+        dlThreads.append(thread);
+    }
+
+    QObject::connect(dlThreads.at(2), &DownloadThread::preparationStatusUpdate, this, &WriteInPlaceThread::preparationStatusUpdate);
+    QObject::connect(dlThreads.at(2), &DownloadThread::updateNumProgress, this, &WriteInPlaceThread::updateNumProgress);
+
+    for(auto& thread: dlThreads)
+    {
+        thread->start();
+    }
+
+    // curl's connect and low speed timeouts bound this, no need for a fixed deadline
+    for(auto& thread: dlThreads)
+    {
+        while(false == thread->wait(200))
+        {
+            if(_isAborted())
+            {
+                thread->cancelDownload();
+            }
+        }
+    }
+
+    bool result{true};
+    for(int i = 0; i < bootFiles.size(); i++)
+    {
+        auto thread = dlThreads.at(i);
+        const QString &name = bootFiles.at(i).second;
+        QString localPath = bootDir + QDir::separator() + name;
+        QString partPath = localPath + ".part";
+
+        if(thread->successfull() && !thread->notModified())
+        {
+            QFile::remove(localPath);
+            if(!QFile::rename(partPath, localPath))
+            {
+                qDebug() << "Cannot move" << partPath << "into the boot file cache";
+                result = false;
+                continue;
+            }
+            settings.setValue(name + "/etag", thread->etag());
+            settings.setValue(name + "/lastModified", (qlonglong) thread->lastModified());
+            settings.setValue(name + "/sha256", _fileSha256(localPath));
+            qDebug() << "Boot file updated:" << name;
+            continue;
+        }
+
+        QFile::remove(partPath);
+        if(!thread->successfull())
+        {
+            qDebug() << "Downloading" << name << "failed, trying cached copy";
+        }
+
+        // Unchanged on the server or we are offline, the cached copy has to be intact
+        QByteArray expected = settings.value(name + "/sha256").toByteArray();
+        if(!QFile::exists(localPath) || expected.isEmpty() || _fileSha256(localPath) != expected)
+        {
+            qDebug() << "No usable cached copy of" << name;
+            QFile::remove(localPath);
+            settings.remove(name);
+            result = false;
+        }
+    }
+
+    dlThreads.at(2)->disconnect();
+    for(auto& thread: dlThreads)
+    {
+        thread->deleteLater();
+    }
+
+    return result && !_isAborted();
+}
+
+QByteArray WriteInPlaceThread::_fileSha256(const QString &path)
+{
+    QFile f{path};
+    QCryptographicHash hash{QCryptographicHash::Sha256};
+    if(!f.open(QIODevice::ReadOnly) || !hash.addData(&f))
+    {
+        return QByteArray();
+    }
+    return hash.result().toHex();
+}
+
+bool WriteInPlaceThread::_isPrivatePath(const QString &path, bool directory)
+{
+#ifdef Q_OS_UNIX
+    // lstat() so a symlink planted in place of the directory or a file is not followed
+    struct stat st;
+    if(::lstat(QFile::encodeName(path).constData(), &st) != 0 || st.st_uid != ::getuid())
+    {
+        return false;
+    }
+    if(directory)
+    {
+        return S_ISDIR(st.st_mode) && (st.st_mode & 077) == 0;
+    }
+    return S_ISREG(st.st_mode) && (st.st_mode & 022) == 0;
+#else
+    Q_UNUSED(directory)
+    return QFileInfo::exists(path);
+#endif
+}
+
+QString WriteInPlaceThread::_relocateSimpbootp(const QString &appImage, const QString &appDir)
+{
+    // Reuse the copy as long as the AppImage stays the same
+    QFileInfo appImageInfo{appImage};
+    QByteArray buildId = QCryptographicHash::hash(
+        appImage.toUtf8() + QByteArray::number(appImageInfo.size())
+        + QByteArray::number(appImageInfo.lastModified().toMSecsSinceEpoch()) + IMAGER_VERSION_STR,
+        QCryptographicHash::Sha1).toHex().left(16);
+
+    // root executes what is in here, so it must be a directory only this user can write to, never a shared one like /tmp
+    QString baseLocation = QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation);
+    if(baseLocation.isEmpty())
+    {
+        baseLocation = QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation);
+    }
+    QString basePath = baseLocation + "/simpbootp";
+    QDir{}.mkpath(baseLocation);
+#ifdef Q_OS_UNIX
+    ::mkdir(QFile::encodeName(basePath).constData(), 0700);
+#endif
+    if(!_isPrivatePath(basePath, true))
+    {
+        qDebug() << basePath << "is not a private directory, refusing to relocate simpbootp to it";
+        return QString();
+    }
+
+    QDir baseDir{basePath};
+    QString relocatedPath = baseDir.filePath(QString::fromLatin1(buildId));
+    QString binaryPath = relocatedPath + "/usr/bin/simpbootp";
+
+    // Held for as long as this instance runs, so other builds leave our copy alone
+    static QLockFile *buildLock = nullptr;
+    if(buildLock == nullptr)
+    {
+        buildLock = new QLockFile{relocatedPath + ".lock"};
+        buildLock->setStaleLockTime(0);
+    }
+    if(!buildLock->isLocked())
+    {
+        buildLock->tryLock(0);
+    }
+
+    // Copies of other builds are removed once nothing can be running from them: no instance of that build
+    // holds its lock, and no helper is up, it may have been started from any of them
+    QLocalSocket helperProbe;
+    helperProbe.connectToServer(SIMPBOOTP_IPC_CHANNEL);
+    if(!helperProbe.waitForConnected(500))
+    {
+        for(auto &stale: baseDir.entryList(QDir::Dirs | QDir::NoDotAndDotDot))
+        {
+            QLockFile staleLock{baseDir.filePath(stale) + ".lock"};
+            staleLock.setStaleLockTime(0);
+            if(stale != buildId && staleLock.tryLock(0))
+            {
+                QDir{baseDir.filePath(stale)}.removeRecursively();
+                staleLock.unlock();
+            }
+        }
+    }
+    helperProbe.abort();
+
+    QDir appDirRoot{appDir};
+    QString sourceBinary = appDirRoot.filePath("usr/bin/simpbootp");
+    QStringList files{sourceBinary};
+
+    // Dependency closure as the dynamic loader resolves it, only what lives inside the AppImage has to move
+    QProcess ldd;
+    QProcessEnvironment env = QProcessEnvironment::systemEnvironment();
+    env.insert("LD_LIBRARY_PATH", appDirRoot.filePath("usr/lib"));
+    ldd.setProcessEnvironment(env);
+    ldd.start("ldd", QStringList() << sourceBinary);
+    if(!ldd.waitForFinished(10000) || ldd.exitCode() != 0)
+    {
+        qDebug() << "ldd failed for" << sourceBinary << ldd.readAllStandardError();
+        return QString();
+    }
+
+    static const QRegularExpression lddLine{"=>\\s+(\\S+)\\s+\\(0x"};
+    for(auto &line: QString::fromUtf8(ldd.readAllStandardOutput()).split('\n'))
+    {
+        auto match = lddLine.match(line);
+        if(match.hasMatch() && match.captured(1).startsWith(appDirRoot.absolutePath() + "/"))
+        {
+            files.append(match.captured(1));
+        }
+    }
+
+    // A copy is only reused when it is identical to what the AppImage ships, whatever state an earlier run left behind
+    int copied = 0;
+    for(auto &file: files)
+    {
+        QString relativePath = appDirRoot.relativeFilePath(file);
+        QString target = QDir{relocatedPath}.filePath(relativePath);
+        QByteArray sourceHash = _fileSha256(file);
+        if(sourceHash.isEmpty())
+        {
+            qDebug() << "Cannot read" << file;
+            return QString();
+        }
+        if(_isPrivatePath(target, false) && _fileSha256(target) == sourceHash)
+        {
+            continue;
+        }
+
+        // Every directory on the way is created private as well
+        QStringList dirs{relocatedPath};
+        for(auto &component: QFileInfo{relativePath}.path().split('/', Qt::SkipEmptyParts))
+        {
+            if(component != ".")
+            {
+                dirs.append(dirs.last() + "/" + component);
+            }
+        }
+        for(auto &dirPath: dirs)
+        {
+#ifdef Q_OS_UNIX
+            ::mkdir(QFile::encodeName(dirPath).constData(), 0700);
+#else
+            QDir{}.mkpath(dirPath);
+#endif
+            if(!_isPrivatePath(dirPath, true))
+            {
+                qDebug() << dirPath << "is not a private directory";
+                return QString();
+            }
+        }
+
+        // APPDIR is a read only FUSE mount, hardlinks and reflinks cannot cross it so these are plain copies.
+        // Written next to the target and renamed over it, another instance may be checking the same file.
+        QString staging = target + ".tmp" + QString::number(QCoreApplication::applicationPid());
+        QFile::remove(staging);
+        if(!QFile::copy(file, staging) || _fileSha256(staging) != sourceHash)
+        {
+            qDebug() << "Copying" << file << "to" << staging << "failed";
+            QFile::remove(staging);
+            return QString();
+        }
+        QFile::setPermissions(staging, QFile::permissions(staging) & ~(QFileDevice::WriteGroup | QFileDevice::WriteOther));
+#ifdef Q_OS_UNIX
+        if(::rename(QFile::encodeName(staging).constData(), QFile::encodeName(target).constData()) != 0)
+#else
+        QFile::remove(target);
+        if(!QFile::rename(staging, target))
+#endif
+        {
+            qDebug() << "Moving" << staging << "to" << target << "failed";
+            QFile::remove(staging);
+            return QString();
+        }
+        copied++;
+    }
+
+    qDebug() << "simpbootp relocated with" << files.size() - 1 << "libraries to" << relocatedPath
+             << "," << copied << "files copied";
+    return binaryPath;
+}
+
 void WriteInPlaceThread::setSerPortbaudRate(uint32_t newSerPortbaudRate)
 {
     _serPortbaudRate = newSerPortbaudRate;
 }
 
+void WriteInPlaceThread::setExtractSize(qint64 extractSize)
+{
+    _extractSize = extractSize;
+}
+
 void WriteInPlaceThread::setPortNames(QString selectedSerialPort, QString selectedEthernetPort)
 {
     _selSerPort = selectedSerialPort;
@@ -315,6 +772,17 @@ bool WriteInPlaceThread::waitForSendFileViaXModemCompleted(Transfer* transferIns
         loop.quit();
     });
 
+    QTimer abortTimer;
+    abortTimer.setInterval(200);
+    abortTimer.callOnTimeout([this, &loop, &result]()
+    {
+        if(_isAborted())
+        {
+            result = false;
+            loop.quit();
+        }
+    });
+
     QObject::connect(transferInstance, &Transfer::transferCompleted, &loop, &QEventLoop::quit);
     QObject::connect(transferInstance, &Transfer::transferFailed, &loop, [&loop, &result](QString err)
     {
@@ -323,7 +791,9 @@ bool WriteInPlaceThread::waitForSendFileViaXModemCompleted(Transfer* transferIns
         loop.quit();
     });
     timer.start();
+    abortTimer.start();
     loop.exec();
+    abortTimer.stop();
     timer.stop();
 
     return result;
@@ -21,14 +21,61 @@ public:
     ~WriteInPlaceThread();
     void setPortNames(QString selectedSerialPort, QString selectedEthernetPort);
     void setSerPortbaudRate(uint32_t newSerPortbaudRate);
+    /*
+     * Uncompressed image size if known, lets the board request image parts before extraction finished
+     */
+    void setExtractSize(qint64 extractSize);
     void run() override;
     bool waitForSendFileViaXModemCompleted(Transfer* transferInstance, uint32_t timeout = 50000);
     void sendFileViaXModem(Transfer* transfer, const QString& filePath);
 
 private:
+    /*
+     * Uniflash job stages. The image download runs next to all of them until the board fetches the image.
+     */
+    enum class BootStage
+    {
+        BootFiles,      // boot file cache update
+        Helper,         // network boot helper start and job setup
+        SblUart,        // boot rom fetches tiboot3.bin over ethernet
+        LinuxAppimage,  // XMODEM over serial
+        Uboot,          // XMODEM over serial
+        WaitImage,      // board requests image parts, helper holds them until written
+        ServeImage      // image parts going out over TFTP
+    };
+
+    void _setStage(BootStage stage);
+
+    /*
+     * True once the user cancelled or the image download failed, every stage bails out on it
+     */
+    bool _isAborted();
+
+    /*
+     * Copies simpbootp and the libraries it loads from the AppImage to a cached location root can access.
+     * Returns the path of the relocated binary or an empty string on failure.
+     */
+    static QString _relocateSimpbootp(const QString &appImage, const QString &appDir);
+
+    /*
+     * True if path is a directory (mode 0700) or a regular file (not writable by others) owned by this user,
+     * without following symlinks
+     */
+    static bool _isPrivatePath(const QString &path, bool directory);
+
+    /*
+     * Brings the per board boot file cache up to date. Files unchanged on the server are not transferred,
+     * cached copies are used when the server cannot be reached.
+     */
+    bool _updateBootFileCache(const QString &bootDir);
+    static QByteArray _fileSha256(const QString &path);
+
     _extractServeThreadClass *_extractThread;
     QString _selSerPort, _selEthPort;
     uint32_t _serPortbaudRate{UNIFLASH_BAUD_RATE};
+    qint64 _extractSize{0};
+    std::atomic<BootStage> _stage{BootStage::BootFiles};
+    std::atomic<bool> _imageFailed{false};
     bool _isSendFileViaXModemCompleted{false};
     bool _isSendFileViaXModemCompletedSuccessfull{false};
     QByteArray _boardName;
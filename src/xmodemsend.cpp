@@ -0,0 +1,98 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Sends a file with the Transfer class used for the uniflash serial stage and
+ * reports how long it took. Pointed at a pseudo terminal it lets the serial
+ * stage be tested and tuned without a board, see tests/test_serial_transfer.py
+ */
+
+#include "dependencies/qtxmodem/transfer.h"
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QTextStream>
+#include "config.h"
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app{argc, argv};
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Send a file over XMODEM-1K / YMODEM-G and print transfer statistics");
+    parser.addOptions({
+        {{"p", "port"},
+            QCoreApplication::translate("main", "Serial port name or device path."),
+            QCoreApplication::translate("main", "port")},
+        {{"b", "baudrate"},
+            QCoreApplication::translate("main", "Baud rate."),
+            QCoreApplication::translate("main", "baudrate")},
+        {{"r", "reply-timeout"},
+            QCoreApplication::translate("main", "Milliseconds to wait for a packet reply before resending it."),
+            QCoreApplication::translate("main", "msecs")},
+        {"no-1k", QCoreApplication::translate("main", "Only send 128 byte packets.")},
+        {"no-streaming", QCoreApplication::translate("main", "Do not switch to YMODEM-G.")},
+        {"pkcs-padding", QCoreApplication::translate("main", "Pad like the uniflash serial stage does.")},
+    });
+    parser.addPositionalArgument("file", QCoreApplication::translate("main", "File to send."));
+    parser.addHelpOption();
+    parser.process(app);
+
+    if(parser.positionalArguments().size() != 1 || !parser.isSet("port"))
+    {
+        parser.showHelp(1);
+    }
+
+    QString filePath = parser.positionalArguments().first();
+    QString port = parser.value("port");
+    bool ok = true;
+    uint32_t baudrate = parser.isSet("baudrate") ? parser.value("baudrate").toUInt(&ok) : UNIFLASH_BAUD_RATE;
+    if(!ok)
+    {
+        qCritical() << "Baud rate is not valid:" << parser.value("baudrate");
+        return 1;
+    }
+
+    Transfer transfer{port, (qint32) baudrate, filePath};
+    if(!transfer.setSerialPortAndConfigure(port, baudrate))
+    {
+        qCritical() << "Serial port not found:" << port;
+        return 1;
+    }
+
+    transfer.setFilePath(filePath);
+    transfer.setUse1KPackets(!parser.isSet("no-1k"));
+    transfer.setStreamingEnabled(!parser.isSet("no-streaming"));
+    transfer.setPkcsPadding(parser.isSet("pkcs-padding"));
+    if(parser.isSet("reply-timeout"))
+    {
+        transfer.setReplyTimeout(parser.value("reply-timeout").toUInt());
+    }
+
+    QElapsedTimer elapsed;
+    int exitCode = 1;
+    QObject::connect(&transfer, &Transfer::transferCompleted, &app, [&exitCode]()
+    {
+        exitCode = 0;
+    });
+    QObject::connect(&transfer, &Transfer::transferFailed, &app, [](QString reason)
+    {
+        qCritical() << "Transfer failed:" << reason;
+    });
+    QObject::connect(&transfer, &QThread::finished, &app, &QCoreApplication::quit);
+
+    elapsed.start();
+    transfer.launch();
+    app.exec();
+    transfer.wait();
+
+    // One line of key=value pairs, easy to parse from scripts
+    double seconds = elapsed.nsecsElapsed() / 1e9;
+    qint64 bytes = QFileInfo(filePath).size();
+    QTextStream(stdout) << "result=" << (exitCode == 0 ? "ok" : "failed")
+                        << " bytes=" << bytes
+                        << " seconds=" << QString::number(seconds, 'f', 3)
+                        << " throughput=" << QString::number(bytes / seconds, 'f', 0)
+                        << " retransmissions=" << transfer.retransmissions() << Qt::endl;
+    return exitCode;
+}
@@ -23,6 +23,24 @@ def pytest_addoption(parser):
         default="",
         help="(Loop) device if you want to perform actual image write tests"
     )
+    parser.addoption(
+        "--simptftp",
+        action="store",
+        default="",
+        help="simptftp binary from the build directory, for the uniflash serving tests"
+    )
+    parser.addoption(
+        "--xmodemsend",
+        action="store",
+        default="",
+        help="xmodemsend binary from the build directory, for the serial transfer tests"
+    )
+    parser.addoption(
+        "--imageread",
+        action="store",
+        default="",
+        help="imageread binary from the build directory, for the compressed image random access tests"
+    )
 
 def parse_json_entries(j):
     global total_download_size, largest_extract_size
@@ -0,0 +1,60 @@
+import os
+import shutil
+import subprocess
+
+import pytest
+
+MIB = 1024 * 1024
+
+
+@pytest.fixture
+def imageread(request):
+    binary = request.config.getoption("--imageread") or shutil.which("imageread")
+    if not binary or not os.path.exists(binary):
+        pytest.skip("--imageread=<binary> not specified. Skipping random access tests")
+    if not shutil.which("xz"):
+        pytest.skip("xz not installed")
+    return binary
+
+
+def xz(data, block_size):
+    return subprocess.run(["xz", "-c", "-0", "--block-size={}".format(block_size)],
+                          input=data, capture_output=True, check=True).stdout
+
+
+def read(imageread, path, offset, length):
+    proc = subprocess.run([imageread, "--offset", str(offset), "--length", str(length), str(path)],
+                          capture_output=True, timeout=60)
+    assert proc.returncode == 0, proc.stderr.decode()
+    return proc.stdout
+
+
+def test_reads_middle_of_multi_block_xz(imageread, tmp_path):
+    content = os.urandom(5 * MIB + 4321)
+    path = tmp_path / "image.img.xz"
+    path.write_bytes(xz(content, MIB))
+
+    # Within the third block, across the third and fourth, and the short last one
+    for offset, length in [(2 * MIB + 100, 1000), (3 * MIB - 512, 1024), (5 * MIB, 4321)]:
+        assert read(imageread, path, offset, length) == content[offset:offset + length]
+
+
+def test_reads_concatenated_xz_streams_with_padding(imageread, tmp_path):
+    first = os.urandom(3 * MIB)
+    second = os.urandom(2 * MIB + 77)
+    path = tmp_path / "image.img.xz"
+    # Stream padding only has to be a multiple of 4 bytes
+    path.write_bytes(xz(first, MIB) + b"\0" * 8 + xz(second, 512 * 1024))
+
+    content = first + second
+    offset = 3 * MIB - 300
+    assert read(imageread, path, offset, 600 * 1024) == content[offset:offset + 600 * 1024]
+    assert read(imageread, path, 0, len(content)) == content
+
+
+def test_streamed_formats_are_not_random_access(imageread, tmp_path):
+    path = tmp_path / "image.img.gz"
+    path.write_bytes(b"\x1f\x8b\x08\x00" + os.urandom(MIB))
+
+    proc = subprocess.run([imageread, "--size", str(path)], capture_output=True, timeout=60)
+    assert proc.returncode == 2
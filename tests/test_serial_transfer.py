@@ -0,0 +1,258 @@
+import os
+import random
+import select
+import shutil
+import subprocess
+import threading
+import time
+import tty
+
+import pytest
+
+SOH = 0x01
+STX = 0x02
+EOT = 0x04
+ACK = 0x06
+NAK = 0x15
+CAN = 0x18
+
+
+def crc16(data):
+    crc = 0
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xffff
+    return crc
+
+
+class Receiver(threading.Thread):
+    """Scripted far end of the pty, behaves like the board's XMODEM/YMODEM-G receiver.
+
+    latency: seconds before every reply
+    error_rate: probability a packet arrives with a flipped byte
+    drop_rate: probability the reply to a good packet gets lost
+    late_rate: probability the reply to a good packet arrives after the sender gave up on it
+    """
+
+    def __init__(self, fd, start_char=b"C", latency=0.0, error_rate=0.0, drop_rate=0.0, late_rate=0.0, seed=1):
+        super().__init__(daemon=True)
+        self.fd = fd
+        self.start_char = start_char
+        self.latency = latency
+        self.error_rate = error_rate
+        self.drop_rate = drop_rate
+        self.late_rate = late_rate
+        self.random = random.Random(seed)
+        self.data = bytearray()
+        self.file_info = None
+        self.naks = 0
+        self.error = None
+        self.pending = bytearray()
+
+    def read(self, n, timeout=10.0):
+        deadline = time.monotonic() + timeout
+        while len(self.pending) < n:
+            remaining = deadline - time.monotonic()
+            if remaining <= 0 or not select.select([self.fd], [], [], remaining)[0]:
+                raise TimeoutError("receiver waited for {} bytes".format(n))
+            self.pending += os.read(self.fd, 65536)
+        chunk, self.pending = bytes(self.pending[:n]), self.pending[n:]
+        return chunk
+
+    def reply(self, byte):
+        if self.latency:
+            time.sleep(self.latency)
+        os.write(self.fd, bytes([byte]))
+
+    def read_packet(self, header):
+        size = 1024 if header == STX else 128
+        body = bytearray(self.read(2 + size + 2))
+        if self.random.random() < self.error_rate:
+            body[2 + self.random.randrange(size)] ^= 0xff
+        seq, inv = body[0], body[1]
+        payload = bytes(body[2:2 + size])
+        ok = seq == 255 - inv and crc16(payload) == (body[-2] << 8 | body[-1])
+        return seq, payload, ok
+
+    def run(self):
+        try:
+            self.receive()
+        except Exception as err:
+            self.error = err
+
+    def receive(self):
+        streaming = self.start_char == b"G"
+        # Repeat the start character until the sender wakes up
+        while True:
+            os.write(self.fd, self.start_char)
+            if select.select([self.fd], [], [], 0.5)[0]:
+                break
+
+        expected = 0 if streaming else 1
+        while True:
+            header = self.read(1)[0]
+            if header == EOT:
+                self.reply(ACK)
+                break
+            if header not in (SOH, STX):
+                continue
+
+            seq, payload, ok = self.read_packet(header)
+            if not ok:
+                if streaming:
+                    os.write(self.fd, bytes([CAN, CAN]))
+                    raise IOError("corrupted packet while streaming")
+                self.naks += 1
+                self.reply(NAK)
+                continue
+
+            if streaming and seq == 0 and expected == 0:
+                name, size = payload.split(b"\0")[:2]
+                self.file_info = (name.decode(), int(size))
+                expected = 1
+                os.write(self.fd, self.start_char)
+                continue
+
+            if seq == expected & 0xff:
+                self.data += payload
+                expected += 1
+            if not streaming and self.random.random() >= self.drop_rate:
+                if self.random.random() < self.late_rate:
+                    # Past the --reply-timeout of send()
+                    time.sleep(0.35)
+                self.reply(ACK)
+
+        if streaming:
+            # Closing empty batch header
+            os.write(self.fd, self.start_char)
+            header = self.read(1)[0]
+            seq, payload, ok = self.read_packet(header)
+            assert seq == 0 and payload.strip(b"\0") == b""
+            self.data = self.data[:self.file_info[1]]
+
+
+@pytest.fixture
+def xmodemsend(request):
+    binary = request.config.getoption("--xmodemsend") or shutil.which("xmodemsend")
+    if not binary or not os.path.exists(binary):
+        pytest.skip("--xmodemsend=<binary> not specified. Skipping serial transfer tests")
+    return binary
+
+
+@pytest.fixture
+def pty_pair():
+    master, slave = os.openpty()
+    # No echo or line editing before the sender configures the port
+    tty.setraw(slave)
+    yield master, os.ttyname(slave)
+    os.close(master)
+    os.close(slave)
+
+
+def send(xmodemsend, port, path, receiver, *args):
+    receiver.start()
+    proc = subprocess.run([xmodemsend, "--port", port, "--reply-timeout", "300", *args, str(path)],
+                          capture_output=True, text=True, timeout=120)
+    receiver.join(10)
+    stats = dict(field.split("=") for field in proc.stdout.split())
+    print("{}: {}".format(" ".join(args) or "default", proc.stdout.strip()))
+    return proc.returncode, stats
+
+
+def strip_pkcs_padding(data):
+    return data[:-data[-1]]
+
+
+@pytest.mark.parametrize("args", [[], ["--no-1k"]])
+def test_xmodem_transfers_file_with_pkcs_padding(xmodemsend, pty_pair, tmp_path, args):
+    master, port = pty_pair
+    content = os.urandom(300 * 1024 + 77)
+    path = tmp_path / "u-boot.img"
+    path.write_bytes(content)
+
+    receiver = Receiver(master)
+    returncode, stats = send(xmodemsend, port, path, receiver, "--pkcs-padding", "--no-streaming", *args)
+
+    assert returncode == 0 and receiver.error is None
+    assert strip_pkcs_padding(bytes(receiver.data)) == content
+    assert stats["retransmissions"] == "0"
+
+
+def test_ymodem_g_streams_file(xmodemsend, pty_pair, tmp_path):
+    master, port = pty_pair
+    content = os.urandom(512 * 1024 + 5)
+    path = tmp_path / "linux.appimage.hs_fs"
+    path.write_bytes(content)
+
+    receiver = Receiver(master, start_char=b"G")
+    returncode, stats = send(xmodemsend, port, path, receiver)
+
+    assert returncode == 0 and receiver.error is None
+    assert receiver.file_info == ("linux.appimage.hs_fs", len(content))
+    assert bytes(receiver.data) == content
+
+
+def test_xmodem_recovers_from_errors_and_drops(xmodemsend, pty_pair, tmp_path):
+    master, port = pty_pair
+    content = os.urandom(128 * 1024)
+    path = tmp_path / "u-boot.img"
+    path.write_bytes(content)
+
+    receiver = Receiver(master, latency=0.001, error_rate=0.05, drop_rate=0.02, seed=7)
+    returncode, stats = send(xmodemsend, port, path, receiver, "--pkcs-padding", "--no-streaming")
+
+    assert returncode == 0 and receiver.error is None
+    assert strip_pkcs_padding(bytes(receiver.data)) == content
+    assert int(stats["retransmissions"]) >= receiver.naks > 0
+
+
+def test_xmodem_ignores_late_replies(xmodemsend, pty_pair, tmp_path):
+    master, port = pty_pair
+    content = os.urandom(64 * 1024)
+    path = tmp_path / "u-boot.img"
+    path.write_bytes(content)
+
+    receiver = Receiver(master, late_rate=0.05, seed=3)
+    returncode, stats = send(xmodemsend, port, path, receiver, "--pkcs-padding", "--no-streaming")
+
+    assert returncode == 0 and receiver.error is None
+    assert strip_pkcs_padding(bytes(receiver.data)) == content
+    assert int(stats["retransmissions"]) > 0
+
+
+def test_ymodem_g_aborts_on_corruption(xmodemsend, pty_pair, tmp_path):
+    master, port = pty_pair
+    path = tmp_path / "u-boot.img"
+    path.write_bytes(os.urandom(256 * 1024))
+
+    receiver = Receiver(master, start_char=b"G", error_rate=1.0)
+    returncode, stats = send(xmodemsend, port, path, receiver)
+
+    assert returncode != 0
+    assert stats["result"] == "failed"
+
+
+class NakStreamingReceiver(Receiver):
+    """Streaming receiver that answers a bad packet with a NAK instead of cancelling"""
+
+    def read_packet(self, header):
+        seq, payload, ok = super().read_packet(header)
+        if not ok:
+            os.write(self.fd, bytes([NAK]))
+            raise IOError("corrupted packet while streaming")
+        return seq, payload, ok
+
+
+def test_ymodem_g_aborts_on_first_error_reply(xmodemsend, pty_pair, tmp_path):
+    master, port = pty_pair
+    path = tmp_path / "u-boot.img"
+    path.write_bytes(os.urandom(256 * 1024))
+
+    receiver = NakStreamingReceiver(master, start_char=b"G", error_rate=0.2, seed=5)
+    returncode, stats = send(xmodemsend, port, path, receiver)
+
+    assert returncode != 0
+    assert stats["result"] == "failed"
+    assert stats["retransmissions"] == "0"
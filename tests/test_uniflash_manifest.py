@@ -0,0 +1,147 @@
+import os
+import shutil
+import socket
+import struct
+import subprocess
+import time
+
+import pytest
+
+GRANULARITY = 4 * 1024 * 1024
+BLOCK_SIZE = 512
+
+
+class TftpClient:
+    """Minimal RFC 1350 read-only client, the way the target script fetches files"""
+
+    def __init__(self, port):
+        self.server = ("127.0.0.1", port)
+
+    def get(self, filename, timeout=5.0):
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.settimeout(timeout)
+        try:
+            sock.sendto(struct.pack("!H", 1) + filename.encode() + b"\0octet\0", self.server)
+            data = bytearray()
+            expected = 1
+            while True:
+                packet, addr = sock.recvfrom(BLOCK_SIZE + 4)
+                opcode, block = struct.unpack("!HH", packet[:4])
+                if opcode == 5:
+                    raise FileNotFoundError("{}: {}".format(filename, packet[4:-1].decode()))
+                assert opcode == 3
+                if block == expected & 0xffff:
+                    data += packet[4:]
+                    expected += 1
+                sock.sendto(struct.pack("!HH", 4, block), addr)
+                if len(packet) - 4 < BLOCK_SIZE:
+                    return bytes(data)
+        finally:
+            sock.close()
+
+
+def parse_manifest(text):
+    size = None
+    chunks = []
+    for line in text.decode().splitlines():
+        fields = line.split()
+        if fields[0] == "size":
+            size = int(fields[1], 16)
+        elif fields[0] == "chunk":
+            chunks.append((int(fields[1], 16), int(fields[2], 16)))
+    return size, chunks
+
+
+@pytest.fixture
+def simptftp(request):
+    binary = request.config.getoption("--simptftp") or shutil.which("simptftp")
+    if not binary or not os.path.exists(binary):
+        pytest.skip("--simptftp=<binary> not specified. Skipping uniflash serving tests")
+    return binary
+
+
+@pytest.fixture
+def server(simptftp, tmp_path):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("127.0.0.1", 0))
+    port = sock.getsockname()[1]
+    sock.close()
+
+    proc = subprocess.Popen([simptftp, "--port", str(port), "--target-directory", str(tmp_path)],
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    time.sleep(0.5)
+    yield tmp_path, TftpClient(port)
+    proc.terminate()
+    proc.wait(5)
+
+
+def write_image(path, size, regions):
+    with open(path, "wb") as f:
+        f.truncate(size)
+        for offset, data in regions:
+            f.seek(offset)
+            f.write(data)
+
+
+def test_manifest_lists_only_data_extents(server):
+    directory, client = server
+    size = 16 * GRANULARITY
+    write_image(directory / "uniflash", size, [
+        (0, os.urandom(4096)),
+        (5 * GRANULARITY + 12345, os.urandom(100)),
+        (6 * GRANULARITY - 10, os.urandom(20)),
+        (size - 512, os.urandom(512)),
+    ])
+
+    manifest_size, chunks = parse_manifest(client.get("uniflash.manifest"))
+
+    assert manifest_size == size
+    assert chunks == [
+        (0, GRANULARITY),
+        (5 * GRANULARITY, 2 * GRANULARITY),
+        (15 * GRANULARITY, GRANULARITY),
+    ]
+
+
+def test_chunks_rebuild_the_image(server):
+    directory, client = server
+    size = 12 * GRANULARITY + 8192
+    write_image(directory / "uniflash", size, [
+        (GRANULARITY, os.urandom(GRANULARITY)),
+        (7 * GRANULARITY + 1, b"\x01"),
+        (size - 100, os.urandom(100)),
+    ])
+
+    manifest_size, chunks = parse_manifest(client.get("uniflash.manifest"))
+    rebuilt = bytearray(manifest_size)
+    for offset, length in chunks:
+        assert offset % GRANULARITY == 0
+        data = client.get("uniflash@{:x}".format(offset))
+        assert len(data) == length
+        rebuilt[offset:offset + length] = data
+
+    with open(directory / "uniflash", "rb") as f:
+        assert bytes(rebuilt) == f.read()
+    assert sum(length for _, length in chunks) < size / 2
+
+
+def test_unknown_chunk_is_rejected(server):
+    directory, client = server
+    write_image(directory / "uniflash", 4 * GRANULARITY, [(GRANULARITY, b"data")])
+
+    client.get("uniflash.manifest")
+    with pytest.raises(FileNotFoundError):
+        client.get("uniflash@{:x}".format(2 * GRANULARITY))
+
+
+def test_requests_outside_the_directory_are_refused(server):
+    directory, client = server
+    outside = directory.parent / (directory.name + "-outside")
+    outside.write_bytes(b"secret")
+    (directory / "link").symlink_to(outside)
+    (directory / "served").write_bytes(b"public")
+
+    assert client.get("served") == b"public"
+    for name in ("../" + outside.name, str(outside), "link", "./../" + directory.name + "/served"):
+        with pytest.raises(FileNotFoundError, match="access violation"):
+            client.get(name)